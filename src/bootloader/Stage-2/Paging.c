@@ -12,6 +12,22 @@ void initialisePages(uint64_t totalMemory)
 {
     printf("Setting Up Identity Paging...  ");
 
+    // 4MiB pages, the tables are only filled in when a page gets split
+    if(x86_get_cpuid_features() & CPUID_FEATURE_PSE)
+    {
+        x86_enable_pse();
+
+        for(uint32_t indexPD = 0; indexPD < 1024; indexPD++)
+        {
+            pageDirectory[indexPD] = (indexPD * LARGE_PAGE_SIZE) | PAGE_LARGE | PAGE_RW | PAGE_PRESENT;
+        }
+
+        x86_set_page_directory(pageDirectory);
+
+        printf("ok (4MiB pages)\n");
+        return;
+    }
+
     // maximum memory in 32-bit space
     for(uint32_t page_index = 0; page_index < (((uint64_t)UINT32_MAX + 1) / PAGE_SIZE); page_index += 1)
     {
@@ -40,6 +56,23 @@ void initialisePages(uint64_t totalMemory)
     printf("ok\n");
 }
 
+// returns the table of the directory entry, a large page is split into its slot of the table array
+static uint32_t* getPageTable(uint32_t indexPD)
+{
+    uint32_t* pageTable = (uint32_t*)((char*)pageTableArray + (PAGE_SIZE * indexPD));
+
+    uint32_t entry = pageDirectory[indexPD];
+    if((entry & PAGE_LARGE) == 0) return pageTable;
+
+    for(uint32_t indexPT = 0; indexPT < 1024; indexPT++)
+    {
+        pageTable[indexPT] = ((entry & 0xFFC00000) + indexPT * PAGE_SIZE) | (entry & 0xFFF & ~PAGE_LARGE);
+    }
+    pageDirectory[indexPD] = ((uint32_t)pageTable) | (entry & 0xFFF & ~PAGE_LARGE);
+
+    return pageTable;
+}
+
 // maps page at virtual address to page at physical address
 void mapVirtualAddress(uint32_t vaddress, uint32_t paddress, uint32_t flags)
 {
@@ -50,7 +83,7 @@ void mapVirtualAddress(uint32_t vaddress, uint32_t paddress, uint32_t flags)
     uint32_t indexPD = (vaddress) >> 22;
     uint32_t indexPT = (vaddress >> 12) & 0x03FF;
 
-    uint32_t* pageTable = (uint32_t*)((char*)pageTableArray + (PAGE_SIZE * indexPD));
+    uint32_t* pageTable = getPageTable(indexPD);
 
     // set PD entry to PT physical address
     // PT physical address must be 4KiB aligned
@@ -79,7 +112,7 @@ void mapVirtualPages(uint32_t vaddress, uint32_t paddress, uint32_t pages, uint3
         uint32_t indexPD = (pageVirtualAddress) >> 22;
         uint32_t indexPT = (pageVirtualAddress >> 12) & 0x03FF;
 
-        uint32_t* pageTable = (uint32_t*)((char*)pageTableArray + (PAGE_SIZE * indexPD));
+        uint32_t* pageTable = getPageTable(indexPD);
 
         // set PD entry to PT physical address
         // PT physical address must be 4KiB aligned
@@ -4,6 +4,12 @@
 
 #define PAGE_RW         0x02
 #define PAGE_PRESENT    0x01
+// directory entry maps a 4MiB page
+#define PAGE_LARGE      0x80
+
+#define LARGE_PAGE_SIZE 0x400000
+
+#define CPUID_FEATURE_PSE 0x08
 
 // identity maps vaddr to phyaddr
 void initialisePages(uint64_t totalMemory);
@@ -321,6 +321,28 @@ x86_get_cr0_register:
     mov eax, cr0
     ret
 
+; uint32_t _cdecl x86_get_cpuid_features();
+global x86_get_cpuid_features
+x86_get_cpuid_features:
+    [bits 32]
+    push ebx
+
+    mov eax, 1
+    cpuid
+    mov eax, edx
+
+    pop ebx
+    ret
+
+; void _cdecl x86_enable_pse();
+global x86_enable_pse
+x86_enable_pse:
+    [bits 32]
+    mov eax, cr4
+    or eax, 0x10
+    mov cr4, eax
+    ret
+
 ; uint32_t _cdecl x86_flushTLB();
 global x86_flushTLB
 x86_flushTLB:
@@ -40,4 +40,9 @@ bool _cdecl x86_read_disk_ext(uint8_t drive_no, DataAddressPacket* dap);
 void _cdecl x86_set_page_directory(void* page_directory_ptr);
 uint32_t _cdecl x86_get_cr0_register();
 
+// edx of cpuid leaf 1
+uint32_t _cdecl x86_get_cpuid_features();
+// allows 4MiB pages in the page directory
+void _cdecl x86_enable_pse();
+
 uint32_t _cdecl x86_flushTLB();
@@ -37,3 +37,9 @@ i686_load_tss:
     mov eax, [esp + 4]
     ltr ax
     ret
+
+global i686_load_local_segment
+i686_load_local_segment:
+    mov eax, [esp + 4]
+    mov gs, ax
+    ret
@@ -105,8 +105,11 @@ GDT_ENTRY gdt_entries[] =
 
 GDT_DESC gdt_desc = { sizeof(gdt_entries) - 1, gdt_entries };
 
+_Static_assert(sizeof(gdt_entries) == sizeof(((i686_gdt_t*)0)->entries), "per-CPU GDT size mismatch");
+
 _import void _asmcall i686_load_gdt(GDT_DESC* gdt_desc, u16 code_segment, u16 data_segment);
 _import void _asmcall i686_load_tss(u16 tss_segment);
+_import void _asmcall i686_load_local_segment(u16 local_segment);
 
 void i686_init_gdt()
 {
@@ -126,3 +129,29 @@ void x86_gdt_add_tss(tss_entry_t* tss, u32 gdt_entry_id)
     );
     i686_load_tss(gdt_entry_id << 3);
 }
+
+void i686_load_cpu_gdt(i686_gdt_t* gdt, tss_entry_t* tss, void* cpu_local)
+{
+    GDT_ENTRY* entries = (GDT_ENTRY*)gdt->entries;
+    for(u32 i = 0; i < i686_GDT_ENTRY_COUNT; i++) entries[i] = gdt_entries[i];
+
+    entries[i686_GDT_TSS_SEGMENT >> 3] = GDT_ENTRY(
+        ((u32)tss),
+        (sizeof(tss_entry_t) - 1),
+        GDT_PRESENT_ENTRY | GDT_PRIVILEGE_RING0 | GDT_32BIT_TSS,
+        0
+    );
+    entries[i686_GDT_LOCAL_SEGMENT >> 3] = GDT_ENTRY(
+        ((u32)cpu_local),
+        0xFFFF,
+        GDT_PRESENT_ENTRY | GDT_PRIVILEGE_RING0 | GDT_DATA_SEGMENT | GDT_ALLOW_DATA_WRITE,
+        GDT_32BIT_SEGMENT | GDT_GRANULARITY_4K
+    );
+
+    gdt->limit = sizeof(gdt->entries) - 1;
+    gdt->base = (u32)entries;
+
+    i686_load_gdt((GDT_DESC*)&gdt->limit, i686_GDT_CODE_SEGMENT, i686_GDT_DATA_SEGMENT);
+    i686_load_tss(i686_GDT_TSS_SEGMENT);
+    i686_load_local_segment(i686_GDT_LOCAL_SEGMENT);
+}
@@ -22,8 +22,23 @@ How GDT's and segmentation work:
 
 #define i686_GDT_CODE_SEGMENT 0x08
 #define i686_GDT_DATA_SEGMENT 0x10
+#define i686_GDT_TSS_SEGMENT  0x18
+// data segment based at the data of the CPU, loaded into gs
+#define i686_GDT_LOCAL_SEGMENT 0x20
+
+#define i686_GDT_ENTRY_COUNT 7
+
+// each CPU has its own copy of the GDT, for its TSS and its local segment
+typedef struct i686_gdt_t
+{
+    u64 entries[i686_GDT_ENTRY_COUNT];
+    u16 limit;
+    u32 base;
+} _packed i686_gdt_t;
 
 void i686_init_gdt();
+// copies the GDT into gdt and loads it on the calling CPU, with tss and gs based at cpu_local
+void i686_load_cpu_gdt(i686_gdt_t* gdt, tss_entry_t* tss, void* cpu_local);
 
 void x86_gdt_add_tss(tss_entry_t* tss, u32 gdt_entry_id);
 
@@ -37,7 +37,7 @@ isr_common:
     mov ds, ax
     mov es, ax
     mov fs, ax
-    mov gs, ax
+    ; gs stays, it points at the data of this CPU
 
     push esp
     call _default_isr_handler
@@ -47,7 +47,6 @@ isr_common:
     mov ds, ax
     mov es, ax
     mov fs, ax
-    mov gs, ax
 
     popa
     add esp, 8          ; remove error code and vector id
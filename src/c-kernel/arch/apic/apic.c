@@ -0,0 +1,80 @@
+#include "apic.h"
+
+#include "../x86.h"
+#include <resources/timer.h>
+
+ptr_t g_apic_base = 0;
+
+static inline u32 apic_read(u32 reg) {
+    return *(volatile u32*)(g_apic_base + reg);
+}
+static inline void apic_write(u32 reg, u32 value) {
+    *(volatile u32*)(g_apic_base + reg) = value;
+}
+
+// busy waits on the system timer, interrupts must be enabled
+static void apic_wait_ms(u32 ms) {
+    time_ns_t end = timer_time_since_init_ns() + TIME_MS_TO_NS(ms);
+    while(timer_time_since_init_ns() < end);
+}
+
+bool apic_initialize() {
+    u32 features = x86_get_cpuid_features();
+    if((features & X86_CPUID_FEATURE_APIC) == 0) return false;
+
+    g_apic_base = APIC_DEFAULT_BASE;
+    // the firmware may have moved it
+    if(features & X86_CPUID_FEATURE_MSR) g_apic_base = (ptr_t)(x86_rdmsr(APIC_BASE_MSR) & 0xFFFFF000);
+
+    return true;
+}
+bool apic_is_present() { return g_apic_base != 0; }
+ptr_t apic_get_base() { return g_apic_base; }
+
+void apic_enable() {
+    // accept all interrupts
+    apic_write(APIC_REG_TPR, 0);
+    apic_write(APIC_REG_SPURIOUS, APIC_SPURIOUS_ENABLE | APIC_SPURIOUS_VECTOR);
+}
+u8 apic_get_id() {
+    return apic_read(APIC_REG_ID) >> 24;
+}
+void apic_eoi() {
+    apic_write(APIC_REG_EOI, 0);
+}
+
+static void apic_send_ipi(u32 command) {
+    apic_write(APIC_REG_ICR_HIGH, 0);
+    apic_write(APIC_REG_ICR_LOW, command);
+
+    while(apic_read(APIC_REG_ICR_LOW) & APIC_ICR_PENDING);
+}
+void apic_send_init_all() {
+    apic_send_ipi(APIC_ICR_ALL_BUT_SELF | APIC_ICR_ASSERT | APIC_ICR_INIT);
+    apic_wait_ms(10);
+}
+void apic_send_startup_all(u8 vector_page) {
+    apic_send_ipi(APIC_ICR_ALL_BUT_SELF | APIC_ICR_ASSERT | APIC_ICR_STARTUP | vector_page);
+    // 200us are enough, the system timer only counts milliseconds
+    apic_wait_ms(1);
+}
+
+u32 apic_calibrate_timer(u32 ms) {
+    apic_write(APIC_REG_TIMER_DIVIDE, APIC_TIMER_DIVIDE_16);
+    apic_write(APIC_REG_LVT_TIMER, APIC_TIMER_MASKED | APIC_TIMER_VECTOR);
+
+    // start on a timer edge, so the whole window is measured
+    apic_wait_ms(1);
+    apic_write(APIC_REG_TIMER_INITIAL, 0xFFFFFFFF);
+    apic_wait_ms(ms);
+
+    u32 elapsed = 0xFFFFFFFF - apic_read(APIC_REG_TIMER_CURRENT);
+    apic_write(APIC_REG_TIMER_INITIAL, 0);
+
+    return elapsed / ms;
+}
+void apic_start_timer(u32 ticks, u8 vector) {
+    apic_write(APIC_REG_TIMER_DIVIDE, APIC_TIMER_DIVIDE_16);
+    apic_write(APIC_REG_LVT_TIMER, APIC_TIMER_PERIODIC | vector);
+    apic_write(APIC_REG_TIMER_INITIAL, ticks);
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <includes.h>
+
+// local APIC, one per CPU at the same physical address
+
+#define APIC_DEFAULT_BASE 0xFEE00000
+#define APIC_BASE_MSR     0x1B
+
+// registers, as offsets from the base
+#define APIC_REG_ID            0x020
+#define APIC_REG_TPR           0x080
+#define APIC_REG_EOI           0x0B0
+#define APIC_REG_SPURIOUS      0x0F0
+#define APIC_REG_ICR_LOW       0x300
+#define APIC_REG_ICR_HIGH      0x310
+#define APIC_REG_LVT_TIMER     0x320
+#define APIC_REG_TIMER_INITIAL 0x380
+#define APIC_REG_TIMER_CURRENT 0x390
+#define APIC_REG_TIMER_DIVIDE  0x3E0
+
+#define APIC_SPURIOUS_ENABLE 0x100
+
+// interrupt command bits
+#define APIC_ICR_INIT          0x00000500
+#define APIC_ICR_STARTUP       0x00000600
+#define APIC_ICR_PENDING       0x00001000
+#define APIC_ICR_ASSERT        0x00004000
+#define APIC_ICR_ALL_BUT_SELF  0x000C0000
+
+#define APIC_TIMER_PERIODIC 0x20000
+#define APIC_TIMER_MASKED   0x10000
+// divide the bus clock by 16
+#define APIC_TIMER_DIVIDE_16 0x3
+
+#define APIC_TIMER_VECTOR    0x40
+#define APIC_SPURIOUS_VECTOR 0xFF
+
+// finds the local APIC of the boot CPU, returns false if there is none
+bool apic_initialize();
+bool apic_is_present();
+ptr_t apic_get_base();
+
+// enables the local APIC of the calling CPU
+void apic_enable();
+u8   apic_get_id();
+void apic_eoi();
+
+// INIT and STARTUP IPIs to every other CPU, vector_page is the 4KiB page the APs start at
+void apic_send_init_all();
+void apic_send_startup_all(u8 vector_page);
+
+// returns the timer ticks in one millisecond, measured against the system timer over ms milliseconds
+u32  apic_calibrate_timer(u32 ms);
+// periodic timer interrupt on vector every ticks
+void apic_start_timer(u32 ticks, u8 vector);
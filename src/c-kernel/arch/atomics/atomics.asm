@@ -1 +1,112 @@
-; implementing atomics
\ No newline at end of file
+
+; implementing atomics
+
+[bits 32]
+
+; u32 atomic_inc(u32* ptr);
+global atomic_inc
+atomic_inc:
+    mov edx, [esp + 4]
+    mov eax, 1
+    lock xadd [edx], eax
+    inc eax
+    ret
+
+; u32 atomic_dec(u32* ptr);
+global atomic_dec
+atomic_dec:
+    mov edx, [esp + 4]
+    mov eax, -1
+    lock xadd [edx], eax
+    dec eax
+    ret
+
+; u32 atomic_add(u32* ptr, u32 val);
+global atomic_add
+atomic_add:
+    mov edx, [esp + 4]
+    mov eax, [esp + 8]
+    mov ecx, eax
+    lock xadd [edx], eax
+    add eax, ecx
+    ret
+
+; u32 atomic_sub(u32* ptr, u32 val);
+global atomic_sub
+atomic_sub:
+    mov edx, [esp + 4]
+    mov eax, [esp + 8]
+    neg eax
+    mov ecx, eax
+    lock xadd [edx], eax
+    add eax, ecx
+    ret
+
+; u32 atomic_xchg(u32* ptr, u32 val);
+global atomic_xchg
+atomic_xchg:
+    mov edx, [esp + 4]
+    mov eax, [esp + 8]
+    ; xchg with memory is always locked
+    xchg [edx], eax
+    ret
+
+; u32 atomic_cmpxchg(u32* ptr, u32 expected, u32 desired);
+global atomic_cmpxchg
+atomic_cmpxchg:
+    mov edx, [esp + 4]
+    mov eax, [esp + 8]
+    mov ecx, [esp + 12]
+    ; eax is the old value either way
+    lock cmpxchg [edx], ecx
+    ret
+
+; u32 atomic_fetch_add(u32* ptr, u32 val);
+global atomic_fetch_add
+atomic_fetch_add:
+    mov edx, [esp + 4]
+    mov eax, [esp + 8]
+    lock xadd [edx], eax
+    ret
+
+; u32 atomic_fetch_or(u32* ptr, u32 val);
+global atomic_fetch_or
+atomic_fetch_or:
+    push ebx
+    mov edx, [esp + 8]
+    mov eax, [edx]
+.retry:
+    mov ebx, eax
+    or ebx, [esp + 12]
+    ; reloads eax if another CPU got in between
+    lock cmpxchg [edx], ebx
+    jnz .retry
+    pop ebx
+    ret
+
+; u32 atomic_fetch_and(u32* ptr, u32 val);
+global atomic_fetch_and
+atomic_fetch_and:
+    push ebx
+    mov edx, [esp + 8]
+    mov eax, [edx]
+.retry:
+    mov ebx, eax
+    and ebx, [esp + 12]
+    lock cmpxchg [edx], ebx
+    jnz .retry
+    pop ebx
+    ret
+
+; void atomic_fence();
+global atomic_fence
+atomic_fence:
+    ; a locked op on the stack, mfence needs SSE2
+    lock or dword [esp], 0
+    ret
+
+; void atomic_pause();
+global atomic_pause
+atomic_pause:
+    pause
+    ret
@@ -0,0 +1,61 @@
+#include "atomics.h"
+
+#include <arch/x86.h>
+
+void spinlock_acquire(spinlock_t* lock) {
+    u32 ticket = atomic_fetch_add((u32*)&lock->next, 1);
+
+    if(lock->serving != ticket) {
+        // wait on a plain read, so the cache line isn't bounced between the waiting CPUs
+        while(lock->serving != ticket) atomic_pause();
+        lock->contended++;
+    }
+    lock->acquired++;
+}
+bool spinlock_try_acquire(spinlock_t* lock) {
+    // only takes the next ticket if it would be served right away
+    u32 serving = lock->serving;
+    if(atomic_cmpxchg((u32*)&lock->next, serving, serving + 1) != serving) return false;
+
+    lock->acquired++;
+    return true;
+}
+void spinlock_release(spinlock_t* lock) {
+    // locked, so no store from inside the lock moves past it
+    atomic_inc((u32*)&lock->serving);
+}
+
+u32 spinlock_acquire_irqsave(spinlock_t* lock) {
+    u32 eflags = x86_disable_intr_save();
+    spinlock_acquire(lock);
+    return eflags;
+}
+void spinlock_release_irqrestore(spinlock_t* lock, u32 eflags) {
+    spinlock_release(lock);
+    x86_restore_intr_saved(eflags);
+}
+
+u32 seqlock_read_begin(const seqlock_t* lock) {
+    u32 sequence;
+    while((sequence = lock->sequence) & 1) atomic_pause();
+
+    atomic_read_fence();
+    return sequence;
+}
+bool seqlock_read_retry(const seqlock_t* lock, u32 sequence) {
+    atomic_read_fence();
+    return lock->sequence != sequence;
+}
+
+void seqlock_write_begin(seqlock_t* lock) {
+    spinlock_acquire(&lock->lock);
+
+    lock->sequence++;
+    atomic_write_fence();
+}
+void seqlock_write_end(seqlock_t* lock) {
+    atomic_write_fence();
+    lock->sequence++;
+
+    spinlock_release(&lock->lock);
+}
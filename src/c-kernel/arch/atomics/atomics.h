@@ -3,6 +3,7 @@
 #include <includes.h>
 
 // atomic operations for 32-bit integers
+// every read-modify-write below is locked, and a full barrier on x86
 
 // atomically increments the value pointed to by ptr and returns the new value
 u32 atomic_inc(u32* ptr);
@@ -12,6 +13,73 @@ u32 atomic_dec(u32* ptr);
 u32 atomic_add(u32* ptr, u32 val);
 // atomically subtracts val from the value pointed to by ptr and returns the new value
 u32 atomic_sub(u32* ptr, u32 val);
+// atomically stores val to the value pointed to by ptr and returns the old value
+u32 atomic_xchg(u32* ptr, u32 val);
 
+// atomically stores desired if the value pointed to by ptr is expected, returns the old value either way
+u32 atomic_cmpxchg(u32* ptr, u32 expected, u32 desired);
+// atomically adds val to the value pointed to by ptr and returns the old value
+u32 atomic_fetch_add(u32* ptr, u32 val);
+// atomically ors val into the value pointed to by ptr and returns the old value
+u32 atomic_fetch_or(u32* ptr, u32 val);
+// atomically ands val into the value pointed to by ptr and returns the old value
+u32 atomic_fetch_and(u32* ptr, u32 val);
 
+// hint for the CPU that this is a spin-wait loop
+void atomic_pause();
 
+// memory fences
+// x86 keeps loads in order with loads and stores with stores, only a store followed by a load can pass,
+// so the read and write fences only have to stop the compiler
+#define atomic_read_fence()  __asm__ volatile("" ::: "memory")
+#define atomic_write_fence() __asm__ volatile("" ::: "memory")
+// orders everything, including stores before loads
+void atomic_fence();
+
+// spinlocks
+// only protects against other CPUs, use the irqsave variants if an interrupt handler takes the same lock
+// fair, the CPUs get the lock in the order they asked for it
+
+typedef struct spinlock_t {
+    volatile u32 next;
+    volatile u32 serving;
+
+    // statistics, only written by the holder
+    u32 acquired;
+    // acquisitions that had to wait for another CPU
+    u32 contended;
+} spinlock_t;
+
+#define SPINLOCK_INIT ((spinlock_t){ .next = 0, .serving = 0, .acquired = 0, .contended = 0 })
+
+void spinlock_acquire(spinlock_t* lock);
+bool spinlock_try_acquire(spinlock_t* lock);
+void spinlock_release(spinlock_t* lock);
+
+// also disables interrupts on this CPU, returns the eflags to restore them with
+u32  spinlock_acquire_irqsave(spinlock_t* lock);
+void spinlock_release_irqrestore(spinlock_t* lock, u32 eflags);
+
+// seqlocks
+// for read-mostly data, readers never block the writer, and retry if it ran during their read
+// writers are serialized by the spinlock, readers must not follow pointers that a writer may free
+//
+// u32 seq;
+// do {
+//     seq = seqlock_read_begin(&lock);
+//     ... copy the data ...
+// } while(seqlock_read_retry(&lock, seq));
+
+typedef struct seqlock_t {
+    // odd while a write is in progress
+    volatile u32 sequence;
+    spinlock_t lock;
+} seqlock_t;
+
+#define SEQLOCK_INIT ((seqlock_t){ .sequence = 0, .lock = SPINLOCK_INIT })
+
+u32  seqlock_read_begin(const seqlock_t* lock);
+bool seqlock_read_retry(const seqlock_t* lock, u32 sequence);
+
+void seqlock_write_begin(seqlock_t* lock);
+void seqlock_write_end(seqlock_t* lock);
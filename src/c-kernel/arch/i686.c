@@ -1,8 +1,7 @@
 #include "i686.h"
 
 #include <pools.h>
-
-tss_entry_t g_tss;
+#include <arch/smp/smp.h>
 
 void initialize_i686()
 {
@@ -22,15 +21,12 @@ void initialize_i686()
 	init_irq();
 	//printf("ok\n");
 
-	g_tss = (tss_entry_t){0};
-	g_tss.ss0 = i686_GDT_DATA_SEGMENT;
+	// the boot CPU gets its own GDT and TSS like the APs,
 	// set the kernel interrupt stack pointer to the end of the interrupt stack (the stack grows downwards)
-	g_tss.esp0 = (u32)(__idle_thread_intr_stack_end - 4);
-	// no IO permission bitmap in user land
-	g_tss.iomap_base = sizeof(tss_entry_t);
-	x86_gdt_add_tss(&g_tss, 3);
+	smp_setup_cpu(smp_get_cpu(0), __idle_thread_intr_stack_end - 4);
 }
 
-tss_entry_t* get_global_tss() { return &g_tss; }
-u16 get_global_tss_selector() { return 3 << 3; }
+// the TSS of the calling CPU
+tss_entry_t* get_global_tss() { return &smp_this_cpu()->tss; }
+u16 get_global_tss_selector() { return i686_GDT_TSS_SEGMENT; }
 
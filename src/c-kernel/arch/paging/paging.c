@@ -37,31 +37,54 @@ x86_mmu_map_t x86_from_handoff(PagingInfo* pagingInfo) {
     return map;
 }
 
+// whether the range at vaddress can be mapped as one 4MiB page
+static bool x86_fits_large_page(x86_mmu_map_t* map, u32 vaddress, u32 paddress, u32 pages) {
+    if((x86_get_cr4_register() & X86_CR4_PSE) == 0) return false;
+    if(((vaddress | paddress) & (X86_LARGE_PAGE_SIZE - 1)) != 0 || pages < X86_PAGETABLE_SIZE) return false;
+
+    // a table already in place is reused, it belongs to whoever allocated it
+    u32 entry = map->directory[vaddress >> 22];
+    return (entry & X86_PAGE_PRESENT) == 0 || (entry & X86_PAGE_LARGE) != 0;
+}
+// fills table with the 4KiB pages of the large page at pd_index
+static void x86_split_large_page(x86_mmu_map_t* map, u32* table, u32 pd_index) {
+    u32 entry = map->directory[pd_index];
+    u32 base = entry & 0xFFC00000;
+    // PAT moves from bit 12 to bit 7, where the large page bit was
+    u32 flags = (entry & 0xFFF & ~X86_PAGE_LARGE) | ((entry & X86_PAGE_LARGE_PAT) ? X86_PAGE_PAT : 0);
+
+    for(u32 pt_index = 0; pt_index < X86_PAGETABLE_SIZE; pt_index++) {
+        table[pt_index] = (base + pt_index * X86_PAGE_SIZE) | flags;
+    }
+    // same translation as before, no flush needed
+    map->directory[pd_index] = ((u32)table) | (entry & 0xFFF & ~(X86_PAGE_LARGE | X86_PAGE_PAT)) | X86_PAGE_PRESENT;
+}
+
 // returns the number of pages that need to be allocated to map the given range
-usize x86_map_pages_get_page_count(x86_mmu_map_t* map, u32 vaddress, u32 pages) {
+usize x86_map_pages_get_page_count(x86_mmu_map_t* map, u32 vaddress, u32 paddress, u32 pages) {
     // align adresses to 4KiB
     vaddress &= 0xFFFFF000;
+    paddress &= 0xFFFFF000;
 
-    u32  table_alloc_count = 0;
-    u32  table_alloc_idx = 0;
-    u32* tables = nullptr;
-
-    u32 lastPD_idx = invalid_u32;
+    u32 table_alloc_count = 0;
 
-    for(u32 page_index = 0; page_index < pages; page_index += 1) {
+    for(u32 page_index = 0; page_index < pages;) {
         u32 pageVirtualAddress = vaddress + page_index * X86_PAGE_SIZE;
+        u32 pagePhysicalAddress = paddress + page_index * X86_PAGE_SIZE;
 
         u32 indexPD = (pageVirtualAddress) >> 22;
         u32 indexPT = (pageVirtualAddress >> 12) & 0x03FF;
 
-        // if page table is not present - then schedule to allocate one!
-        if(map->directory[indexPD] & X86_PAGE_PRESENT) continue;
+        // pages left in this directory entry
+        u32 count = X86_PAGETABLE_SIZE - indexPT;
+        if(count > pages - page_index) count = pages - page_index;
+        page_index += count;
 
-        // if the page directory index is different from the last one, then we need to allocate a new page table
-        if(indexPD != lastPD_idx) {
-            lastPD_idx = indexPD;
-            table_alloc_count++;
-        }
+        if(x86_fits_large_page(map, pageVirtualAddress, pagePhysicalAddress, count)) continue;
+
+        // a missing table is allocated, a large page is split into one
+        u32 entry = map->directory[indexPD];
+        if((entry & X86_PAGE_PRESENT) == 0 || (entry & X86_PAGE_LARGE) != 0) table_alloc_count++;
     }
     return table_alloc_count;
 }
@@ -76,20 +99,35 @@ err_t x86_map_pages(x86_mmu_map_t* map, u32 vaddress, u32 paddress, u32 pages, u
 
     tables = (u32*) alloc_pages;
 
-    usize req_page_count = x86_map_pages_get_page_count(map, vaddress, pages);
+    usize req_page_count = x86_map_pages_get_page_count(map, vaddress, paddress, pages);
     if(req_page_count > alloc_page_count) return ENOMEM;
 
-    for(u32 page_index = 0; page_index < pages; page_index += 1) {
+    for(u32 page_index = 0; page_index < pages;) {
         u32 pageVirtualAddress = vaddress + page_index * X86_PAGE_SIZE;
         u32 pagePhysicalAddress = paddress + page_index * X86_PAGE_SIZE;
 
         u32 indexPD = (pageVirtualAddress) >> 22;
         u32 indexPT = (pageVirtualAddress >> 12) & 0x03FF;
 
+        u32 count = X86_PAGETABLE_SIZE - indexPT;
+        if(count > pages - page_index) count = pages - page_index;
+        page_index += count;
+
+        // a whole aligned 4MiB goes into the directory entry, no table needed
+        if(x86_fits_large_page(map, pageVirtualAddress, pagePhysicalAddress, count)) {
+            map->directory[indexPD] = pagePhysicalAddress | (flags & 0xFFF) | X86_PAGE_LARGE | X86_PAGE_PRESENT;
+            continue;
+        }
+
         // if page table is not present - then allocate one!
-        if((map->directory[indexPD] & X86_PAGE_PRESENT) == 0) {
+        // a large page is split so the rest of it stays mapped
+        u32 entry = map->directory[indexPD];
+        if((entry & X86_PAGE_PRESENT) == 0 || (entry & X86_PAGE_LARGE) != 0) {
             if(table_alloc_idx >= alloc_page_count) return ENOMEM;
-            initialize_pagetable(map, tables + (table_alloc_idx * X86_PAGETABLE_SIZE), indexPD);
+
+            u32* table = tables + (table_alloc_idx * X86_PAGETABLE_SIZE);
+            if(entry & X86_PAGE_PRESENT) x86_split_large_page(map, table, indexPD);
+            else initialize_pagetable(map, table, indexPD);
             table_alloc_idx++;
         }
 
@@ -98,10 +136,12 @@ err_t x86_map_pages(x86_mmu_map_t* map, u32 vaddress, u32 paddress, u32 pages, u
         // set PD entry to PT physical address
         // PT physical address must be 4KiB aligned
         // mark as present
-        map->directory[indexPD] = ((u32)pageTable) | ((X86_PD_FLAGS(map, indexPD) | flags) & 0xFFF) | X86_PAGE_PRESENT;
+        map->directory[indexPD] = ((u32)pageTable) | ((X86_PD_FLAGS(map, indexPD) | flags) & 0xFFF & ~X86_PAGE_LARGE) | X86_PAGE_PRESENT;
 
-        // set PT entry to page address
-        pageTable[indexPT] = pagePhysicalAddress | (flags & 0xFFF) | X86_PAGE_PRESENT;
+        // set PT entries to page addresses
+        for(u32 i = 0; i < count; i++) {
+            pageTable[indexPT + i] = (pagePhysicalAddress + i * X86_PAGE_SIZE) | (flags & 0xFFF) | X86_PAGE_PRESENT;
+        }
     }
 
     return ESUCCESS;
@@ -117,6 +157,16 @@ err_t x86_set_flags_pages(x86_mmu_map_t* map, u32 vaddress, u32 pages, u32 flags
         u32 indexPD = (pageVirtualAddress) >> 22;
         u32 indexPT = (pageVirtualAddress >> 12) & 0x03FF;
 
+        u32 entry = map->directory[indexPD];
+        if(entry & X86_PAGE_LARGE) {
+            // splitting needs a table, part of a large page has to be remapped with x86_map_pages
+            if(indexPT != 0 || pages - page_index < X86_PAGETABLE_SIZE) return ENOMEM;
+
+            map->directory[indexPD] = (entry & 0xFFFFF000) | (flags & 0xFFF) | X86_PAGE_LARGE | X86_PAGE_PRESENT;
+            page_index += X86_PAGETABLE_SIZE - 1;
+            continue;
+        }
+
         ptr_t* pageTable = X86_PD_TABLE(map, indexPD);
         if(pageTable == nullptr || X86_PD_FLAGS(map, indexPD) & X86_PAGE_PRESENT == 0) return ENOPAGE;
 
@@ -127,7 +177,7 @@ err_t x86_set_flags_pages(x86_mmu_map_t* map, u32 vaddress, u32 pages, u32 flags
         pageTable[indexPT] = pageTableEntryAddr | (flags & 0xFFF) | 0x01;
 
         // set PD flags
-        map->directory[indexPD] = ((u32)pageTable) | ((X86_PD_FLAGS(map, indexPD) | flags) & 0xFFF) | X86_PAGE_PRESENT;
+        map->directory[indexPD] = ((u32)pageTable) | ((X86_PD_FLAGS(map, indexPD) | flags) & 0xFFF & ~X86_PAGE_LARGE) | X86_PAGE_PRESENT;
     }
 
     return ESUCCESS;
@@ -144,6 +194,10 @@ u32 x86_get_map(x86_mmu_map_t* map, ptr_t vaddress)
     ptr_t indexPD = (vaddrPage) >> 22;
     ptr_t indexPT = (vaddrPage >> 12) & 0x03FF;
 
+    if(map->directory[indexPD] & X86_PAGE_LARGE) {
+        return (map->directory[indexPD] & 0xFFC00000) + (vaddr & (X86_LARGE_PAGE_SIZE - 1));
+    }
+
     // get PT
     ptr_t* pageTable = X86_PD_TABLE(map, indexPD);
     if(pageTable == nullptr || X86_PD_FLAGS(map, indexPD) & X86_PAGE_PRESENT == 0) return ENOPAGE;
@@ -162,6 +216,10 @@ u32 x86_get_flags(x86_mmu_map_t* map, ptr_t vaddress)
     u32 indexPD = (vaddress) >> 22;
     u32 indexPT = (vaddress >> 12) & 0x03FF;
 
+    if(map->directory[indexPD] & X86_PAGE_LARGE) {
+        return X86_PD_FLAGS(map, indexPD) & ~X86_PAGE_LARGE;
+    }
+
     // get PT
     ptr_t* pageTable = X86_PD_TABLE(map, indexPD);
     if(pageTable == nullptr || X86_PD_FLAGS(map, indexPD) & X86_PAGE_PRESENT == 0) return ENOPAGE;
@@ -190,6 +248,10 @@ ptr_t x86_get_phys_addr(const x86_mmu_map_t* map, ptr_t vaddress) {
     ptr_t indexPD = (vaddress) >> 22;
     ptr_t indexPT = (vaddress >> 12) & 0x03FF;
 
+    if(map->directory[indexPD] & X86_PAGE_LARGE) {
+        return (map->directory[indexPD] & 0xFFC00000) + (vaddress & (X86_LARGE_PAGE_SIZE - 1)) + offset;
+    }
+
     // get PT
     ptr_t* pageTable = X86_PD_TABLE(map, indexPD);
     if(pageTable == nullptr || X86_PD_FLAGS(map, indexPD) & X86_PAGE_PRESENT == 0) return ENOPAGE;
@@ -212,13 +274,17 @@ void log_mmu_map(x86_mmu_map_t* map) {
     for(u32 pd_index = 0; pd_index < X86_PAGETABLE_SIZE; pd_index++) {
         if((X86_PD_FLAGS(map, pd_index) & X86_PAGE_PRESENT) == 0) continue;
         u32* pageTable = X86_PD_TABLE(map, pd_index);
+        bool large = (map->directory[pd_index] & X86_PAGE_LARGE) != 0;
         for(u32 pt_index = 0; pt_index < X86_PAGETABLE_SIZE; pt_index++) {
-            if((pageTable[pt_index] & X86_PAGE_PRESENT) == 0) continue;
+            // a large page is walked as if it had a table of contiguous pages
+            u32 entry = large ? ((map->directory[pd_index] & 0xFFC00000) + pt_index * X86_PAGE_SIZE) | (X86_PD_FLAGS(map, pd_index) & ~X86_PAGE_LARGE)
+                              : pageTable[pt_index];
+            if((entry & X86_PAGE_PRESENT) == 0) continue;
 
             u32 pageVirtualAddress = (pd_index << 22) | (pt_index << 12);
-            u32 pagePhysicalAddress = pageTable[pt_index] & 0xFFFFF000;
+            u32 pagePhysicalAddress = entry & 0xFFFFF000;
             // ignore the accessed and dirty flags when comparing flags
-            u32 flags = (pageTable[pt_index] & 0xFFF) & ~(X86_PAGE_TABLE_ENTRY_ACCESSED | X86_PAGE_TABLE_ENTRY_DIRTY);
+            u32 flags = (entry & 0xFFF) & ~(X86_PAGE_TABLE_ENTRY_ACCESSED | X86_PAGE_TABLE_ENTRY_DIRTY);
 
             if((pend != pagePhysicalAddress) || (vend != pageVirtualAddress) || (flags != pflags)) {
                 if(pend != 0xFFFFFFFF) {
@@ -11,6 +11,15 @@
 #define X86_PAGE_DISABLE_CACHING 0x10
 #define X86_PAGE_WRITETHROUGH 0x08
 
+// directory entry maps a 4MiB page, needs CR4.PSE
+#define X86_PAGE_LARGE     0x80
+// PAT bit of a table entry, and its place in a large page
+#define X86_PAGE_PAT       0x80
+#define X86_PAGE_LARGE_PAT 0x1000
+
+#define X86_LARGE_PAGE_SIZE 0x400000
+#define X86_CR4_PSE 0x10
+
 #define X86_PAGE_TABLE_ENTRY_DIRTY    ((ptr_t)0x40)
 #define X86_PAGE_TABLE_ENTRY_ACCESSED ((ptr_t)0x20)
 
@@ -24,8 +33,9 @@ x86_mmu_map_t x86_copy_pagetable(void* page, x86_mmu_map_t* src);
 x86_mmu_map_t x86_from_handoff(PagingInfo* pagingInfo);
 
 // returns the number of pages that need to be allocated to map the given range
-usize x86_map_pages_get_page_count(x86_mmu_map_t* map, u32 vaddress, u32 pages);
-// maps n pages at vaddress to n pages at paddress
+// aligned 4MiB runs are mapped as large pages and need no table
+usize x86_map_pages_get_page_count(x86_mmu_map_t* map, u32 vaddress, u32 paddress, u32 pages);
+// maps n pages at vaddress to n pages at paddress, splitting large pages that are partly remapped
 err_t x86_map_pages(x86_mmu_map_t* map, u32 vaddress, u32 paddress, u32 pages, u32 flags, void* alloc_pages, usize alloc_page_count);
 // sets flags of multiple pages
 err_t x86_set_flags_pages(x86_mmu_map_t* map, u32 vaddress, u32 pages, u32 flags);
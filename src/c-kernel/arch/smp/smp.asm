@@ -0,0 +1,85 @@
+; AP startup and per-CPU data
+
+%define SMP_TRAMPOLINE_BASE 0x8000
+%define SMP_MAX_CPUS        8
+
+%define i686_GDT_CODE_SEGMENT 0x08
+%define i686_GDT_DATA_SEGMENT 0x10
+%define i686_GDT_SIZE         (7 * 8)
+
+; address of a trampoline label once it's copied to SMP_TRAMPOLINE_BASE
+%define TRAMPOLINE(label) (SMP_TRAMPOLINE_BASE + (label - smp_trampoline_start))
+
+extern gdt_entries
+extern g_smp_boot_cr3
+extern g_smp_boot_cr4
+extern g_smp_boot_count
+extern g_smp_boot_stacks
+extern smp_ap_entry
+
+; x86_cpu_t* smp_this_cpu();
+global smp_this_cpu
+smp_this_cpu:
+    [bits 32]
+    mov eax, [gs:0]
+    ret
+
+; the APs start here in real mode, with cs = SMP_TRAMPOLINE_BASE >> 4
+; this is copied below 1MiB, so only the far jump out of it may use kernel addresses
+global smp_trampoline_start
+global smp_trampoline_end
+smp_trampoline_start:
+    [bits 16]
+    cli
+    cld
+
+    xor ax, ax
+    mov ds, ax
+    o32 lgdt [TRAMPOLINE(smp_trampoline_gdt_desc)]
+
+    mov eax, cr0
+    or eax, 1
+    mov cr0, eax
+
+    jmp dword i686_GDT_CODE_SEGMENT:smp_ap_protected_entry
+
+align 4
+smp_trampoline_gdt_desc:
+    dw i686_GDT_SIZE - 1
+    dd gdt_entries
+smp_trampoline_end:
+
+; the kernel is identity mapped, so this runs before and after paging is on
+smp_ap_protected_entry:
+    [bits 32]
+    mov ax, i686_GDT_DATA_SEGMENT
+    mov ds, ax
+    mov es, ax
+    mov fs, ax
+    mov gs, ax
+    mov ss, ax
+
+    ; same paging as the boot CPU
+    mov eax, [g_smp_boot_cr4]
+    mov cr4, eax
+    mov eax, [g_smp_boot_cr3]
+    mov cr3, eax
+    mov eax, cr0
+    or eax, 0x80000000
+    mov cr0, eax
+
+    ; the boot CPU is 0
+    mov eax, 1
+    lock xadd [g_smp_boot_count], eax
+    inc eax
+    cmp eax, SMP_MAX_CPUS
+    jae .park
+
+    mov esp, [g_smp_boot_stacks + eax * 4]
+    push eax
+    call smp_ap_entry
+
+.park:
+    cli
+    hlt
+    jmp .park
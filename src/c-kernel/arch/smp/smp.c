@@ -0,0 +1,135 @@
+#include "smp.h"
+
+#include <pools.h>
+#include <arch/i686.h>
+#include <arch/apic/apic.h>
+#include <arch/atomics/atomics.h>
+#include <resources/timer.h>
+#include <utils/cstdlib.h>
+#include <utils/logger.h>
+
+x86_cpu_t g_smp_cpus[SMP_MAX_CPUS];
+u32 g_smp_cpu_count = 1;
+
+// read by the trampoline
+u32 g_smp_boot_cr3;
+u32 g_smp_boot_cr4;
+u32 g_smp_boot_count;
+void* g_smp_boot_stacks[SMP_MAX_CPUS];
+
+u32 g_smp_timer_ticks;
+volatile smp_entry_t g_smp_entry = nullptr;
+ISRHandler g_smp_tick_handler = nullptr;
+
+_import u8 smp_trampoline_start[];
+_import u8 smp_trampoline_end[];
+
+u32 smp_cpu_index() { return smp_this_cpu()->index; }
+x86_cpu_t* smp_get_cpu(u32 index) { return &g_smp_cpus[index]; }
+u32 smp_cpu_count() { return g_smp_cpu_count; }
+
+void* smp_get_intr_stack_top(u32 index) { return __cpu_intr_stacks_start + (index + 1) * SMP_CPU_STACK_SIZE - 4; }
+void* smp_get_exec_stack_top(u32 index) { return __cpu_exec_stacks_start + (index + 1) * SMP_CPU_STACK_SIZE - 4; }
+
+void smp_setup_cpu(x86_cpu_t* cpu, void* intr_stack_top) {
+    cpu->self = cpu;
+
+    cpu->tss = (tss_entry_t){0};
+    cpu->tss.ss0 = i686_GDT_DATA_SEGMENT;
+    cpu->tss.esp0 = (u32)intr_stack_top;
+    // no IO permission bitmap in user land
+    cpu->tss.iomap_base = sizeof(tss_entry_t);
+
+    i686_load_cpu_gdt(&cpu->gdt, &cpu->tss, cpu);
+}
+
+static void smp_wait_ms(u32 ms) {
+    time_ns_t deadline = timer_time_since_init_ns() + TIME_MS_TO_NS(ms);
+    while(timer_time_since_init_ns() < deadline) atomic_pause();
+}
+
+static void smp_timer_interrupt(registers_t* registers) {
+    // the tick handler may switch threads, so the EOI can't wait for it
+    apic_eoi();
+    if(g_smp_tick_handler) g_smp_tick_handler(registers);
+}
+static void smp_spurious_interrupt(registers_t* registers) {
+    // no EOI for spurious interrupts
+}
+
+// called by the trampoline on the boot stack of the AP, with interrupts disabled
+_export void _asmcall smp_ap_entry(u32 index) {
+    x86_cpu_t* cpu = &g_smp_cpus[index];
+    cpu->index = index;
+
+    smp_setup_cpu(cpu, g_smp_boot_stacks[index]);
+    i686_load_idt_current();
+
+    apic_enable();
+    cpu->apic_id = apic_get_id();
+    cpu->online = true;
+
+    while(!cpu->released) atomic_pause();
+
+    apic_start_timer(g_smp_timer_ticks, APIC_TIMER_VECTOR);
+    g_smp_entry(index);
+
+    for(;;) __asm__("hlt");
+}
+
+u32 smp_start_aps() {
+    g_smp_cpus[0].apic_id = 0;
+    g_smp_cpus[0].online = true;
+
+    if(!apic_initialize()) {
+        log_warn("no local APIC, running on the boot CPU only\n");
+        return g_smp_cpu_count;
+    }
+
+    apic_enable();
+    g_smp_cpus[0].apic_id = apic_get_id();
+
+    g_smp_timer_ticks = apic_calibrate_timer(10);
+    if(g_smp_timer_ticks == 0) {
+        log_warn("local APIC timer is not running, running on the boot CPU only\n");
+        return g_smp_cpu_count;
+    }
+
+    i686_set_isr(APIC_TIMER_VECTOR, smp_timer_interrupt);
+    i686_set_isr(APIC_SPURIOUS_VECTOR, smp_spurious_interrupt);
+
+    // the APs take the same paging as this CPU, so they can jump straight into the kernel
+    memcpy((void*)SMP_TRAMPOLINE_BASE, smp_trampoline_start, PTR_DIFF_I32(smp_trampoline_end, smp_trampoline_start));
+    g_smp_boot_cr3 = x86_get_cr3_register();
+    g_smp_boot_cr4 = x86_get_cr4_register();
+    g_smp_boot_count = 0;
+    for(u32 i = 0; i < SMP_MAX_CPUS; i++) g_smp_boot_stacks[i] = smp_get_intr_stack_top(i);
+
+    apic_send_init_all();
+    apic_send_startup_all(SMP_TRAMPOLINE_BASE >> 12);
+    apic_send_startup_all(SMP_TRAMPOLINE_BASE >> 12);
+
+    smp_wait_ms(SMP_AP_TIMEOUT_MS);
+
+    // APs that show up after this get an index past the end and park
+    u32 ap_count = atomic_xchg(&g_smp_boot_count, SMP_MAX_CPUS);
+    if(ap_count > SMP_MAX_CPUS - 1) ap_count = SMP_MAX_CPUS - 1;
+    g_smp_cpu_count = 1 + ap_count;
+
+    time_ns_t deadline = timer_time_since_init_ns() + TIME_MS_TO_NS(SMP_AP_TIMEOUT_MS);
+    for(u32 i = 1; i < g_smp_cpu_count; i++) {
+        while(!g_smp_cpus[i].online && timer_time_since_init_ns() < deadline) atomic_pause();
+        if(!g_smp_cpus[i].online) log_warn("CPU {u} did not come online\n", i);
+    }
+
+    return g_smp_cpu_count;
+}
+
+void smp_release_ap(u32 index, smp_entry_t entry, ISRHandler tick_handler) {
+    g_smp_tick_handler = tick_handler;
+    g_smp_entry = entry;
+
+    // the AP reads the entry as soon as it sees the flag
+    atomic_fence();
+    g_smp_cpus[index].released = true;
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <includes.h>
+#include <arch/GDT/GDT.h>
+#include <arch/ISR/ISR.h>
+
+// must match cpu_count and cpu_stack_size in linker.ld
+#define SMP_MAX_CPUS       8
+#define SMP_CPU_STACK_SIZE 0x2000
+
+// the APs start in real mode at this page, it has to be below 1MiB
+#define SMP_TRAMPOLINE_BASE 0x8000
+
+// how long the APs get to report in
+#define SMP_AP_TIMEOUT_MS 20
+
+typedef struct x86_cpu_t {
+    // read through gs, must stay first
+    struct x86_cpu_t* self;
+    u32 index;
+    u8  apic_id;
+    volatile bool online;
+    // set by smp_release_ap, the CPU stays parked until then
+    volatile bool released;
+
+    tss_entry_t tss;
+    i686_gdt_t  gdt;
+} x86_cpu_t;
+
+typedef void (*smp_entry_t)(u32 cpu_index);
+
+// the CPU executing this, only valid after smp_setup_cpu ran on it
+_import x86_cpu_t* _asmcall smp_this_cpu();
+u32 smp_cpu_index();
+x86_cpu_t* smp_get_cpu(u32 index);
+u32 smp_cpu_count();
+
+// top of the stacks reserved for the idle thread of a CPU
+void* smp_get_intr_stack_top(u32 index);
+void* smp_get_exec_stack_top(u32 index);
+
+// loads the GDT and TSS of cpu on the calling CPU
+void smp_setup_cpu(x86_cpu_t* cpu, void* intr_stack_top);
+
+// wakes up the other CPUs and parks them, returns the number of CPUs online
+u32 smp_start_aps();
+// lets the parked CPU index call entry, tick_handler is called on its local timer every millisecond
+// CPUs that are never released, e.g. ones that came online too late, stay parked
+void smp_release_ap(u32 index, smp_entry_t entry, ISRHandler tick_handler);
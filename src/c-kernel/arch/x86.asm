@@ -82,6 +82,34 @@ x86_get_cr3_register:
     mov eax, cr3
     ret
 
+; u32 _cdecl x86_get_cr4_register();
+global x86_get_cr4_register
+x86_get_cr4_register:
+    [bits 32]
+    mov eax, cr4
+    ret
+
+; u32 _cdecl x86_get_cpuid_features();
+global x86_get_cpuid_features
+x86_get_cpuid_features:
+    [bits 32]
+    push ebx
+
+    mov eax, 1
+    cpuid
+    mov eax, edx
+
+    pop ebx
+    ret
+
+; u64 _cdecl x86_rdmsr(u32 msr);
+global x86_rdmsr
+x86_rdmsr:
+    [bits 32]
+    mov ecx, [esp + 4]
+    rdmsr
+    ret
+
 ; u32 _cdecl x86_flushTLB();
 global x86_flushTLB
 x86_flushTLB:
@@ -20,9 +20,20 @@ _import u32 _asmcall x86_flushTLB();
 void _cdecl x86_set_page_directory(void* page_directory_ptr);
 u32 _cdecl x86_get_cr0_register();
 u32 _cdecl x86_get_cr3_register();
+u32 _cdecl x86_get_cr4_register();
 
 _import u32 _asmcall x86_flushCache();
 
+// cpu features
+
+#define X86_CPUID_FEATURE_PSE  (1 << 3)
+#define X86_CPUID_FEATURE_MSR  (1 << 5)
+#define X86_CPUID_FEATURE_APIC (1 << 9)
+
+// edx of cpuid leaf 1
+u32 _cdecl x86_get_cpuid_features();
+u64 _cdecl x86_rdmsr(u32 msr);
+
 // interrupts and exceptions
 _import void _asmcall x86_Panic();
 _import void _asmcall x86_enable_interrupts();
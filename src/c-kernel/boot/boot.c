@@ -9,6 +9,7 @@
 #include <resources/timer.h>
 #include <arch/i686.h>
 #include <arch/IRQ/PIC.h>
+#include <arch/smp/smp.h>
 #include <utils/heap.h>
 #include <utils/heap.h>
 #include <arch/paging/paging.h>
@@ -70,6 +71,10 @@ _export void start(KernelInfo kernelInfo)
 	// initialize timer for multitasking preemption
 	initialize_timer();
 	log_info("PIT timer... ok\n");
+
+	// wake up the other CPUs, they wait until the scheduler lets them in
+	u32 cpu_count = smp_start_aps();
+	log_info("SMP... ok, {u} CPUs\n", cpu_count);
 	
 	// setup multitasking
 	initialize_multitasking(&idle_ptable, kalloca);
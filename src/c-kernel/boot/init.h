@@ -21,3 +21,5 @@ void initialize_multitasking(x86_mmu_map_t* handoff_ptable, heap_allocator_t* ka
 
 void timer_setup_callback(u32 frequency_hz, x86_interrupt_handler_t callback);
 void kmt_spawn_idle_thread(thread_entry_point_t entry, x86_mmu_map_t ptable);
+// gives every CPU an idle thread and lets the APs into the scheduler
+void kmt_release_cpus();
@@ -41,6 +41,12 @@ _import u8 __syscore_thread_intr_stack_end[];
 _import u8 __syscore_thread_exec_stack_start[];
 _import u8 __syscore_thread_exec_stack_end[];
 
+_import u8 __cpu_intr_stacks_start[];
+_import u8 __cpu_intr_stacks_end[];
+
+_import u8 __cpu_exec_stacks_start[];
+_import u8 __cpu_exec_stacks_end[];
+
 // page tables
 _import u8 __ptable_template_start[];
 _import u8 __ptable_template_end[];
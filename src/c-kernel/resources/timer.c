@@ -3,12 +3,15 @@
 
 #include <arch/IRQ/IRQ.h>
 #include <arch/IRQ/PIC.h>
+#include <arch/atomics/atomics.h>
 
 //#define PIT_FREQUENCY_HZ 1193182
 #define PIT_FREQUENCY_HZ 1000
 #define PIT_BASE_CLOCK_HZ 1193182
 
 struct {
+    // read on every CPU, written by the timer interrupt on the boot CPU
+    seqlock_t seqlock;
     u64 ticks_since_init;
     u32 frequency_hz;
     u32 callback_acuumulator;
@@ -17,7 +20,9 @@ struct {
 } g_timer_ctx;
 
 void _timer_interrupt(registers_t* registers) {
+    seqlock_write_begin(&g_timer_ctx.seqlock);
 	g_timer_ctx.ticks_since_init++;
+    seqlock_write_end(&g_timer_ctx.seqlock);
 
     if(!g_timer_ctx.callback) return;
 
@@ -33,6 +38,8 @@ void initialize_timer() {
 	
 	u16 divider = (u16)((u32)PIT_BASE_CLOCK_HZ / PIT_FREQUENCY_HZ) & ~(u16)(0x1);
 	
+	g_timer_ctx.seqlock = SEQLOCK_INIT;
+
 	x86_outb(0x43, 0b00110110);
     x86_outb(0x40, (u8)divider);
     x86_outb(0x40, (u8)(divider >> 8));
@@ -47,14 +54,30 @@ void initialize_timer() {
 }
 
 time_ns_t timer_time_since_init_ns() {
-    u64 ticks = g_timer_ctx.ticks_since_init;
-    u64 ticks_quotient = ticks / g_timer_ctx.frequency_hz;
-    u64 ticks_remainder = ticks % g_timer_ctx.frequency_hz;
+    // the 64-bit tick count takes two loads, retry if the timer ticked in between
+    u64 ticks;
+    u32 frequency_hz;
+    u32 sequence;
+    do {
+        sequence = seqlock_read_begin(&g_timer_ctx.seqlock);
+        ticks = g_timer_ctx.ticks_since_init;
+        frequency_hz = g_timer_ctx.frequency_hz;
+    } while(seqlock_read_retry(&g_timer_ctx.seqlock, sequence));
+
+    u64 ticks_quotient = ticks / frequency_hz;
+    u64 ticks_remainder = ticks % frequency_hz;
 
     // avoids overflow by calculating the remainder first, then dividing by the frequency
-    return (ticks_quotient * (1000 * 1000 * 1000)) + ((ticks_remainder * (1000 * 1000 * 1000)) / g_timer_ctx.frequency_hz);
+    return (ticks_quotient * (1000 * 1000 * 1000)) + ((ticks_remainder * (1000 * 1000 * 1000)) / frequency_hz);
 }
 void timer_setup_callback(u32 frequency_hz, x86_interrupt_handler_t callback) {
+    // the timer interrupt writes too, it would deadlock on the seqlock if it interrupted this
+    u32 eflags = x86_disable_intr_save();
+    seqlock_write_begin(&g_timer_ctx.seqlock);
+
     g_timer_ctx.callback_frequency_hz = frequency_hz;
     g_timer_ctx.callback = callback;
+
+    seqlock_write_end(&g_timer_ctx.seqlock);
+    x86_restore_intr_saved(eflags);
 }
@@ -5,6 +5,8 @@
 #include <panic/panic.h>
 
 #include <pools.h>
+#include <arch/smp/smp.h>
+#include <arch/apic/apic.h>
 
 struct {
     heap_allocator_t* allocator;
@@ -418,6 +420,10 @@ err_t initialize_buddy_allocator(heap_allocator_t* heap_allocator, KernelInfo* k
     err = ba_mark_pages(0xB8000 >> 12, 1, PNODE_ON_RAM | PNODE_USED, false, false);
     if(err != ESUCCESS) return err;
 
+    // the APs are started from here
+    err = ba_mark_pages(SMP_TRAMPOLINE_BASE >> 12, 1, PNODE_ON_RAM | PNODE_USED, false, false);
+    if(err != ESUCCESS) return err;
+
     return ESUCCESS;
 }
 
@@ -523,7 +529,7 @@ x86_mmu_map_t make_template_page_table() {
         u32 paddress = curr_node->address * X86_PAGE_SIZE;
 
         // map the pages in the template page table to the physical address of the node
-        usize req_pages = x86_map_pages_get_page_count(&ptable, paddress, size);
+        usize req_pages = x86_map_pages_get_page_count(&ptable, paddress, paddress, size);
         if((page_idx + req_pages) > page_count) {
             kpanic(PANIC_OBJ_POOL_FULL, "not enough pages in the template page table to map all used pages in the buddy allocator");
         }
@@ -537,6 +543,20 @@ x86_mmu_map_t make_template_page_table() {
         curr_node = ba_get_next_leaf(curr_node);
     }
 
+    // every CPU acknowledges its timer through the local APIC, whichever thread it's running
+    if(apic_is_present()) {
+        ptr_t apic_base = apic_get_base();
+        usize req_pages = x86_map_pages_get_page_count(&ptable, apic_base, apic_base, 1);
+        if((page_idx + req_pages) > page_count) {
+            kpanic(PANIC_OBJ_POOL_FULL, "not enough pages in the template page table to map the local APIC");
+        }
+        err_t err = x86_map_pages(&ptable, apic_base, apic_base, 1, X86_PAGE_PRESENT | X86_PAGE_RW | X86_PAGE_DISABLE_CACHING, &pages[page_idx], req_pages);
+        if(err != ESUCCESS) {
+            kpanic(PANIC_UNEXPECTED_FAILURE, "failed to map the local APIC in the template page table. error code: {x}", err);
+        }
+        page_idx += req_pages;
+    }
+
     return ptable;
 }
 
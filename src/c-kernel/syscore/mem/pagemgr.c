@@ -141,7 +141,7 @@ err_t pmgr_alloc_pages(page_mgr_ctx_t* ctx, ptr_t vaddress, usize page_cnt, u32
     // TODO: this code leaks memory if mapping fails, we should free the allocated pages
     // also leaks if remapping the same virtual address with different physical pages
     void* mapping_pages = nullptr;
-    usize req_page_cnt = x86_map_pages_get_page_count(&ctx->ptable, vaddress, page_cnt);
+    usize req_page_cnt = x86_map_pages_get_page_count(&ctx->ptable, vaddress, (ptr_t)pages->memory, page_cnt);
     // need to allocate pages for page tables
     if(req_page_cnt) {
         page_alloc_info_t* mapping_pages_info = allocate_pages(ctx, req_page_cnt);
@@ -165,7 +165,7 @@ err_t pmgr_alloc_unmapped_pages(page_mgr_ctx_t* ctx, ptr_t vaddress, usize page_
 
     // map the allocated pages to the virtual address
     void* mapping_pages = nullptr;
-    usize req_page_cnt = x86_map_pages_get_page_count(&ctx->ptable, vaddress, page_cnt);
+    usize req_page_cnt = x86_map_pages_get_page_count(&ctx->ptable, vaddress, (ptr_t)pages->memory, page_cnt);
     // need to allocate pages for page tables
     if(req_page_cnt) {
         page_alloc_info_t* mapping_pages_info = allocate_pages(ctx, req_page_cnt);
@@ -3,6 +3,8 @@
 
 #include <pools.h>
 #include <arch/i686.h>
+#include <arch/smp/smp.h>
+#include <arch/atomics/atomics.h>
 #include <utils/cstdlib.h>
 
 #include <resources/timer.h>
@@ -23,33 +25,43 @@
 #define KMT_MUTEX_FREE 0x0
 #define KMT_MUTEX_USED 0x1
 
+// mutex lock word, the owner in the low bits
+#define KMT_MUTEX_OWNER_MASK 0xFFFF
+#define KMT_MUTEX_UNLOCKED   ((u32)invalid_u16)
+// threads are parked on the mutex, the owner has to unlock it through the scheduler
+#define KMT_MUTEX_WAITERS    0x10000
+// how long a thread spins on a mutex whose owner is running on another CPU, before it parks
+#define KMT_MUTEX_SPIN_LIMIT 1000
+
 #define KMT_PREEMPTION_ENABLED  0x1
+// only in the flags kmt_disable_preemption returns, interrupts were enabled before
+#define KMT_INTERRUPTS_ENABLED  0x2
+
+#define X86_EFLAGS_IF 0x200
 
 #define KMT_TIME_SLICE_US 20
 #define KMT_AGE_TICKS 4
 
-typedef struct kmt_queue_node_t {
-    thread_uid_t thread_id;
-    struct kmt_queue_node_t* next;
-} kmt_queue_node_t;
+#define KMT_CPU_IDLE_HEAP_SIZE 0x400
 
+// threads are linked through their tcb, a queue never allocates
 typedef struct kmt_queue_t {
-    kmt_queue_node_t* head;
-    kmt_queue_node_t* tail;
+    thread_uid_t head;
+    thread_uid_t tail;
 } kmt_queue_t;
 
 typedef struct kmt_mutex_impl_t {
     u16          flags;
-    thread_uid_t owner;
-    kmt_queue_node_t* waiting_queue_head;
-    kmt_queue_node_t* waiting_queue_tail;
+    // owner and KMT_MUTEX_WAITERS, only changed atomically
+    volatile u32 lock;
+    // linked through thread_info_t.wait_next, highest priority first
+    kmt_queue_t  waiting;
 } kmt_mutex_impl_t;
 
 typedef struct kmt_rwlock_impl_t {
     u16          flags;
     thread_uid_t owner;
-    kmt_queue_node_t* waiting_queue_head;
-    kmt_queue_node_t* waiting_queue_tail;
+    kmt_queue_t  waiting;
 } kmt_rwlock_impl_t;
 
 typedef struct kmt_sleep_request_t {
@@ -57,6 +69,22 @@ typedef struct kmt_sleep_request_t {
     time_ms_t wakeup_time;
 } kmt_sleep_request_t;
 
+// scheduler state of one CPU
+typedef struct kmt_cpu_t {
+    thread_uid_t current_thread;
+    // runs when nothing else is ready, it's never queued
+    thread_uid_t idle_thread;
+    u32 flags;
+
+    // queues, a thread is made ready on the CPU it last ran on
+    u32 tick;
+    u32 ready_priority_bitmap;
+    kmt_queue_t ready_queues[31];
+
+    // the context the CPU entered the scheduler from, it's never switched back into
+    tcb_t boot_tcb;
+} kmt_cpu_t;
+
 bool kmt_is_initialized_value = false;
 struct {
     // heaps
@@ -72,13 +100,12 @@ struct {
     usize alloc_mutex_count;
 
     // current state
-    thread_uid_t current_thread;
     thread_uid_t idle_thread;
-    u32 flags;
-    
-    // queues
-    u32 ready_priority_bitmap;
-    kmt_queue_t ready_queues[31];
+
+    // one big lock for the scheduler state shared between CPUs, taken by STOP_PREEMPTING
+    spinlock_t lock;
+    kmt_cpu_t cpus[SMP_MAX_CPUS];
+    usize cpu_count;
 
     // min heap for sleeping threads, sorted by wakeup_time
     kmt_sleep_request_t sleep_heap[MAX_KERNEL_THREADS];
@@ -90,41 +117,151 @@ _import tcb_t* _asmcall kmt_switch_task(tcb_t* current_thread, tcb_t* next_threa
 // this function is used to setup a valid call frame for a new thread
 _import void _asmcall _kmt_setup_cf();
 
+u8 g_kmt_cpu_idle_heaps[SMP_MAX_CPUS][KMT_CPU_IDLE_HEAP_SIZE];
+
 // helper functions
 //void x86_intr_dtor(u32* eflags) { x86_restore_intr_saved(*eflags); }
-u32 kmt_disable_preemption() { u32 flags = g_kmt_ctx.flags; g_kmt_ctx.flags &= ~KMT_PREEMPTION_ENABLED; return flags; }
+static inline kmt_cpu_t* kmt_this_cpu() { return &g_kmt_ctx.cpus[smp_cpu_index()]; }
+// expects no PREEMPTION, otherwise the thread may move to another CPU
+static inline thread_uid_t kmt_current_thread() { return kmt_this_cpu()->current_thread; }
+
+// interrupts stay disabled until the flags are restored, so the CPU can't switch threads while it holds the lock
+// only the outermost call takes the lock
+u32 kmt_disable_preemption() {
+    u32 eflags = x86_disable_intr_save();
+
+    kmt_cpu_t* cpu = kmt_this_cpu();
+    u32 flags = cpu->flags;
+    if(flags & KMT_PREEMPTION_ENABLED) {
+        cpu->flags &= ~KMT_PREEMPTION_ENABLED;
+        spinlock_acquire(&g_kmt_ctx.lock);
+    }
+
+    if(eflags & X86_EFLAGS_IF) flags |= KMT_INTERRUPTS_ENABLED;
+    return flags;
+}
 void kmt_restore_flags(u32* flags) { 
-    g_kmt_ctx.flags = *flags; 
+    // the thread may have been switched in on another CPU since, the lock is released by whichever runs it now
+    if(*flags & KMT_PREEMPTION_ENABLED) {
+        spinlock_release(&g_kmt_ctx.lock);
+        kmt_this_cpu()->flags |= KMT_PREEMPTION_ENABLED;
+    }
+    if(*flags & KMT_INTERRUPTS_ENABLED) x86_enable_interrupts();
 }
 
 // code to push to the queue, expects no PREEMPTION, and caller should ensure thread_id is valid
 void kmt_queue_push(kmt_queue_t* queue, thread_uid_t thread_id) {
-    kmt_queue_node_t* node = malloc(g_kmt_ctx.kalloca, sizeof(kmt_queue_node_t));
-    *node = (kmt_queue_node_t){ .thread_id = thread_id, .next = nullptr };
-    if(queue->tail) {
-        queue->tail->next = node;
-        queue->tail = node;
+    g_kmt_ctx.tcb_pool[thread_id].ready_next = KMT_INVALID_KTHREAD_UID;
+    if(queue->tail != KMT_INVALID_KTHREAD_UID) {
+        g_kmt_ctx.tcb_pool[queue->tail].ready_next = thread_id;
+        queue->tail = thread_id;
     } else {
-        queue->head = node;
-        queue->tail = node;
+        queue->head = thread_id;
+        queue->tail = thread_id;
     }
 }
-// code to push to the queue, expects no PREEMPTION, and caller should ensure thread_id is valid
+// code to pop from the queue, expects no PREEMPTION
 thread_uid_t kmt_queue_pop(kmt_queue_t* queue) {
-    if(!queue->head) return KMT_INVALID_KTHREAD_UID;
+    thread_uid_t thread_id = queue->head;
+    if(thread_id == KMT_INVALID_KTHREAD_UID) return KMT_INVALID_KTHREAD_UID;
 
-    kmt_queue_node_t* node = queue->head;
-    thread_uid_t thread_id = node->thread_id;
-    queue->head = node->next;
+    queue->head = g_kmt_ctx.tcb_pool[thread_id].ready_next;
+    if(queue->head == KMT_INVALID_KTHREAD_UID) queue->tail = KMT_INVALID_KTHREAD_UID;
 
-    if(!queue->head) queue->tail = nullptr;
-    
-    free(g_kmt_ctx.kalloca, node);
     return thread_id;
 }
 // check if the queue is empty, expects no PREEMPTION
 bool kmt_queue_is_empty(const kmt_queue_t* queue) {
-    return queue->head == nullptr;
+    return queue->head == KMT_INVALID_KTHREAD_UID;
+}
+
+// same as the ready queue, but linked through thread_info_t.wait_next
+void kmt_wait_queue_push(kmt_queue_t* queue, thread_uid_t thread_id) {
+    g_kmt_ctx.threads[thread_id].wait_next = KMT_INVALID_KTHREAD_UID;
+    if(queue->tail != KMT_INVALID_KTHREAD_UID) {
+        g_kmt_ctx.threads[queue->tail].wait_next = thread_id;
+        queue->tail = thread_id;
+    } else {
+        queue->head = thread_id;
+        queue->tail = thread_id;
+    }
+}
+// inserts the thread behind the waiting threads of the same or higher priority
+void kmt_wait_queue_insert(kmt_queue_t* queue, thread_uid_t thread_id) {
+    u8 priority = g_kmt_ctx.tcb_pool[thread_id].base_priority;
+
+    thread_uid_t prev = KMT_INVALID_KTHREAD_UID;
+    thread_uid_t next = queue->head;
+    while(next != KMT_INVALID_KTHREAD_UID && g_kmt_ctx.tcb_pool[next].base_priority >= priority) {
+        prev = next;
+        next = g_kmt_ctx.threads[next].wait_next;
+    }
+
+    g_kmt_ctx.threads[thread_id].wait_next = next;
+    if(prev != KMT_INVALID_KTHREAD_UID) g_kmt_ctx.threads[prev].wait_next = thread_id;
+    else queue->head = thread_id;
+    if(next == KMT_INVALID_KTHREAD_UID) queue->tail = thread_id;
+}
+thread_uid_t kmt_wait_queue_pop(kmt_queue_t* queue) {
+    thread_uid_t thread_id = queue->head;
+    if(thread_id == KMT_INVALID_KTHREAD_UID) return KMT_INVALID_KTHREAD_UID;
+
+    queue->head = g_kmt_ctx.threads[thread_id].wait_next;
+    if(queue->head == KMT_INVALID_KTHREAD_UID) queue->tail = KMT_INVALID_KTHREAD_UID;
+
+    return thread_id;
+}
+
+// priority of a ready thread of cpu once aged, priority 0 threads never age
+u32 kmt_effective_priority(const kmt_cpu_t* cpu, u32 priority, thread_uid_t thread_id) {
+    if(priority == 0) return 0;
+
+    u32 effective = priority + (cpu->tick - g_kmt_ctx.tcb_pool[thread_id].ready_tick) / KMT_AGE_TICKS;
+    return effective > 30 ? 30 : effective;
+}
+
+// pops the thread cpu would run next, expects no PREEMPTION and a non empty bitmap
+thread_uid_t kmt_pop_ready_thread(kmt_cpu_t* cpu) {
+    // each queue is FIFO, so its head waited the longest and has aged the most,
+    // only the heads are compared and the cost doesn't grow with the number of ready threads
+    u32 max_priority = 31 - __builtin_clz(cpu->ready_priority_bitmap);
+    u32 max_effective = kmt_effective_priority(cpu, max_priority, cpu->ready_queues[max_priority].head);
+
+    u32 ready_bitmap = cpu->ready_priority_bitmap & ~(1 << max_priority);
+    while(ready_bitmap > 1 && max_effective < 30) {
+        u32 priority = 31 - __builtin_clz(ready_bitmap);
+        ready_bitmap &= ~(1 << priority);
+
+        // on a tie the thread already at that priority goes first, as if the aged one was queued behind it
+        u32 effective = kmt_effective_priority(cpu, priority, cpu->ready_queues[priority].head);
+        if(effective > max_effective) {
+            max_priority = priority;
+            max_effective = effective;
+        }
+    }
+
+    thread_uid_t thread_id = kmt_queue_pop(&cpu->ready_queues[max_priority]);
+    if(kmt_queue_is_empty(&cpu->ready_queues[max_priority])) {
+        cpu->ready_priority_bitmap &= ~(1 << max_priority);
+    }
+    // the thread keeps the priority it aged to until it's rescheduled
+    g_kmt_ctx.tcb_pool[thread_id].priority = max_effective;
+
+    return thread_id;
+}
+
+// the next thread for cpu, from its own queues first, then stolen from the other CPUs
+// returns the idle thread of cpu if nothing is ready, expects no PREEMPTION
+thread_uid_t kmt_next_thread(kmt_cpu_t* cpu) {
+    if(cpu->ready_priority_bitmap != 0) return kmt_pop_ready_thread(cpu);
+
+    usize index = cpu - g_kmt_ctx.cpus;
+    for(usize i = 1; i < g_kmt_ctx.cpu_count; i++) {
+        kmt_cpu_t* victim = &g_kmt_ctx.cpus[(index + i) % g_kmt_ctx.cpu_count];
+        if(victim->ready_priority_bitmap != 0) return kmt_pop_ready_thread(victim);
+    }
+
+    return cpu->idle_thread;
 }
 
 // schedule a thread to run, and set the current thread to the specified status
@@ -132,32 +269,32 @@ bool kmt_queue_is_empty(const kmt_queue_t* queue) {
 void kmt_schedule(u8 new_status) {
     STOP_PREEMPTING();
 
+    kmt_cpu_t* cpu = kmt_this_cpu();
+    thread_uid_t current_thread_id = cpu->current_thread;
+
     // retire the current thread if it's not already terminated
-    if(g_kmt_ctx.tcb_pool[g_kmt_ctx.current_thread].status != THREAD_STATUS_TERMINATED) {
-        g_kmt_ctx.tcb_pool[g_kmt_ctx.current_thread].status = THREAD_STATUS_IDLE;
+    if(g_kmt_ctx.tcb_pool[current_thread_id].status != THREAD_STATUS_TERMINATED) {
+        g_kmt_ctx.tcb_pool[current_thread_id].status = THREAD_STATUS_IDLE;
         // if the thread is not the idle thread, we put it back to the ready queue
         if(new_status == THREAD_STATUS_READY) {
-            // reset the age and priority of the thread, and put it back to the ready queue
-            g_kmt_ctx.tcb_pool[g_kmt_ctx.current_thread].age = 0;
-            g_kmt_ctx.tcb_pool[g_kmt_ctx.current_thread].priority = g_kmt_ctx.tcb_pool[g_kmt_ctx.current_thread].base_priority;
+            // reset the priority of the thread, and put it back to the ready queue
+            g_kmt_ctx.tcb_pool[current_thread_id].priority = g_kmt_ctx.tcb_pool[current_thread_id].base_priority;
 
-            kpanic_on_err(kmt_wakeup_thread(g_kmt_ctx.current_thread), "Failed to wakeup thread to reschedule");
+            if(current_thread_id == cpu->idle_thread) {
+                g_kmt_ctx.tcb_pool[current_thread_id].status = THREAD_STATUS_READY;
+            } else {
+                kpanic_on_err(kmt_wakeup_thread(current_thread_id), "Failed to wakeup thread to reschedule");
+            }
         } else {
-            g_kmt_ctx.tcb_pool[g_kmt_ctx.current_thread].status = new_status;
+            g_kmt_ctx.tcb_pool[current_thread_id].status = new_status;
         }
     }
 
-    // get the next thread from the ready queue
-    kpanic_if(g_kmt_ctx.ready_priority_bitmap == 0, PANIC_UNEXPECTED_FAILURE, "bitmap is zero!");
-
-    u32 max_priority = 31 - __builtin_clz(g_kmt_ctx.ready_priority_bitmap);
-    thread_uid_t next_thread_id = kmt_queue_pop(&g_kmt_ctx.ready_queues[max_priority]);
-    if(kmt_queue_is_empty(&g_kmt_ctx.ready_queues[max_priority])) {
-        g_kmt_ctx.ready_priority_bitmap &= ~(1 << max_priority);
-    }
+    // get the next thread from the ready queues
+    thread_uid_t next_thread_id = kmt_next_thread(cpu);
+    kpanic_if(next_thread_id == KMT_INVALID_KTHREAD_UID, PANIC_UNEXPECTED_FAILURE, "no thread to run!");
 
-    u32 current_thread_id = g_kmt_ctx.current_thread;
-    g_kmt_ctx.current_thread = next_thread_id;
+    cpu->current_thread = next_thread_id;
     if(g_kmt_ctx.tcb_pool[next_thread_id].status != THREAD_STATUS_READY) {
         kpanic(
             PANIC_UNEXPECTED_FAILURE, 
@@ -167,6 +304,9 @@ void kmt_schedule(u8 new_status) {
         return;
     }
     g_kmt_ctx.tcb_pool[next_thread_id].status = THREAD_STATUS_RUNNING;
+    g_kmt_ctx.tcb_pool[next_thread_id].cpu = cpu - g_kmt_ctx.cpus;
+
+    if(next_thread_id == current_thread_id) return;
 
     /*
     if(g_kmt_ctx.tcb_pool[current_thread_id].status == THREAD_STATUS_IDLE_RPC_CALLEE) {
@@ -180,8 +320,10 @@ void kmt_schedule(u8 new_status) {
 
 // this function is the entry point for all threads, it will call the thread's actual entry point and handle thread termination
 void _asmcall kmt_thread_start(thread_entry_point_t entry_point) {
-    // enable preemption
-    g_kmt_ctx.flags |= KMT_PREEMPTION_ENABLED;
+    // the thread is switched into with the lock held and interrupts disabled
+    kmt_this_cpu()->flags |= KMT_PREEMPTION_ENABLED;
+    spinlock_release(&g_kmt_ctx.lock);
+    x86_enable_interrupts();
     
     entry_point();
 
@@ -226,7 +368,12 @@ void kmt_pop_sleep_heap() {
     }
 }
 void kmt_preemptive_intr_handler(registers_t* registers) {
-    if(!(g_kmt_ctx.flags & KMT_PREEMPTION_ENABLED)) return;
+    if(!(kmt_this_cpu()->flags & KMT_PREEMPTION_ENABLED)) return;
+
+    STOP_PREEMPTING();
+
+    // ready threads age against this, see kmt_effective_priority
+    kmt_this_cpu()->tick++;
 
     // update all the threads which are sleeping
     time_ms_t current_time = div_floor(timer_time_since_init_ns(), 1000 * 1000);
@@ -238,38 +385,6 @@ void kmt_preemptive_intr_handler(registers_t* registers) {
         kpanic_on_err(kmt_wakeup_thread(thread_id), "Failed to wakeup thread from sleep heap");
     }
 
-    // age all the threads in the ready queue, except the no priority threads (priority 0), and promote them if they have aged enough
-    u32 ready_bitmap = g_kmt_ctx.ready_priority_bitmap;
-    while(ready_bitmap > 1) {
-        u32 priority = 31 - __builtin_clz(ready_bitmap);
-        kmt_queue_node_t* prev_node = nullptr;
-        kmt_queue_node_t* node = g_kmt_ctx.ready_queues[priority].head;
-        while(node) {
-            g_kmt_ctx.tcb_pool[node->thread_id].age++;
-
-            if(g_kmt_ctx.tcb_pool[node->thread_id].age >= KMT_AGE_TICKS) {
-                // if the thread has aged enough, we will promote it to the next priority level
-                g_kmt_ctx.tcb_pool[node->thread_id].age = 0;
-                g_kmt_ctx.tcb_pool[node->thread_id].priority++;
-                if(g_kmt_ctx.tcb_pool[node->thread_id].priority >= 31) g_kmt_ctx.tcb_pool[node->thread_id].priority = 30;
-                // remove from the current queue and add it to the next priority queue
-                if(prev_node) {
-                    prev_node->next = node->next;
-                } else {
-                    g_kmt_ctx.ready_queues[priority].head = node->next;
-                }
-                g_kmt_ctx.tcb_pool[node->thread_id].status = THREAD_STATUS_IDLE;
-                kpanic_on_err(kmt_wakeup_thread(node->thread_id), "Failed to raise thread priority from ready queue");
-                // we just removed the current node from the list
-                node = prev_node;
-            }
-
-            prev_node = node;
-            node = node->next;
-        }
-        ready_bitmap &= ~(1 << priority);
-    }
-
     kmt_schedule(THREAD_STATUS_READY);
 }
 
@@ -286,8 +401,10 @@ void initialize_multitasking(x86_mmu_map_t* handoff_ptable, heap_allocator_t* ka
     // the boot thread is not a real thread, it will never be switched into, so we don't need to worry about its heap
     g_kmt_ctx.threads[0].heap = nullptr;
     //g_kmt_ctx.threads[0].palloca_ctx = nullptr;
-    g_kmt_ctx.threads[0].rpc_head = nullptr;
-    g_kmt_ctx.threads[0].rpc_tail = nullptr;
+    g_kmt_ctx.threads[0].wait_next = KMT_INVALID_KTHREAD_UID;
+    g_kmt_ctx.threads[0].rpc_head = KMT_INVALID_KTHREAD_UID;
+    g_kmt_ctx.threads[0].rpc_tail = KMT_INVALID_KTHREAD_UID;
+    g_kmt_ctx.threads[0].rpc_next = KMT_INVALID_KTHREAD_UID;
 
     g_kmt_ctx.tcb_pool[0] = (tcb_t){
         // the boot thread stack is already set up by the bootloader
@@ -296,23 +413,32 @@ void initialize_multitasking(x86_mmu_map_t* handoff_ptable, heap_allocator_t* ka
         .esp0 = __idle_thread_intr_stack_end - 4,
         .cr3 = x86_get_ctx_map(handoff_ptable),
         .status = THREAD_STATUS_RUNNING,
+        .cpu = 0,
+        .ready_next = KMT_INVALID_KTHREAD_UID,
     };
-    g_kmt_ctx.current_thread = 0;
 
-    // setup the ready queues
-    g_kmt_ctx.ready_priority_bitmap = 0;
-    for(usize i = 0; i < 31; i++) {
-        g_kmt_ctx.ready_queues[i].head = nullptr;
-        g_kmt_ctx.ready_queues[i].tail = nullptr;
+    // setup the CPUs and their ready queues, only the boot CPU runs until kmt_release_cpus
+    g_kmt_ctx.lock = SPINLOCK_INIT;
+    g_kmt_ctx.cpu_count = 1;
+    for(usize cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        g_kmt_ctx.cpus[cpu].current_thread = cpu == 0 ? 0 : KMT_INVALID_KTHREAD_UID;
+        g_kmt_ctx.cpus[cpu].idle_thread = KMT_INVALID_KTHREAD_UID;
+        g_kmt_ctx.cpus[cpu].flags = 0;
+        g_kmt_ctx.cpus[cpu].tick = 0;
+        g_kmt_ctx.cpus[cpu].ready_priority_bitmap = 0;
+        for(usize i = 0; i < 31; i++) {
+            g_kmt_ctx.cpus[cpu].ready_queues[i].head = KMT_INVALID_KTHREAD_UID;
+            g_kmt_ctx.cpus[cpu].ready_queues[i].tail = KMT_INVALID_KTHREAD_UID;
+        }
     }
 
     // initialize the mutex pool
     g_kmt_ctx.alloc_mutex_count = 0;
     for(usize i = 0; i < KMT_MAX_MUTEXES; i++) {
         g_kmt_ctx.mutex_pool[i].flags = KMT_MUTEX_FREE;
-        g_kmt_ctx.mutex_pool[i].owner = invalid_u16;
-        g_kmt_ctx.mutex_pool[i].waiting_queue_head = nullptr;
-        g_kmt_ctx.mutex_pool[i].waiting_queue_tail = nullptr;
+        g_kmt_ctx.mutex_pool[i].lock = KMT_MUTEX_UNLOCKED;
+        g_kmt_ctx.mutex_pool[i].waiting.head = KMT_INVALID_KTHREAD_UID;
+        g_kmt_ctx.mutex_pool[i].waiting.tail = KMT_INVALID_KTHREAD_UID;
     }
 
     // setup sleeping thread tracking
@@ -350,8 +476,10 @@ thread_uid_t kmt_create_thread(const thread_desc_t *desc) {
     memcpy(g_kmt_ctx.threads[new_thread_id].name, desc->name, strlen(desc->name) + 1);
     g_kmt_ctx.threads[new_thread_id].pmgr_ctx = desc->pmgr_ctx;
     g_kmt_ctx.threads[new_thread_id].heap = initialize_heap(g_kmt_ctx.kalloca, desc->heap_base, desc->heap_size);
-    g_kmt_ctx.threads[new_thread_id].rpc_head = nullptr;
-    g_kmt_ctx.threads[new_thread_id].rpc_tail = nullptr;
+    g_kmt_ctx.threads[new_thread_id].wait_next = KMT_INVALID_KTHREAD_UID;
+    g_kmt_ctx.threads[new_thread_id].rpc_head = KMT_INVALID_KTHREAD_UID;
+    g_kmt_ctx.threads[new_thread_id].rpc_tail = KMT_INVALID_KTHREAD_UID;
+    g_kmt_ctx.threads[new_thread_id].rpc_next = KMT_INVALID_KTHREAD_UID;
     if(IS_ERR_PTR(g_kmt_ctx.threads[new_thread_id].heap)) {
         return 0x8000 | ERR_CAST(g_kmt_ctx.threads[new_thread_id].heap);
     }
@@ -399,6 +527,7 @@ thread_uid_t kmt_create_thread(const thread_desc_t *desc) {
         .status = THREAD_STATUS_IDLE,
         .priority = desc->priority,
         .base_priority = desc->priority,
+        .ready_next = KMT_INVALID_KTHREAD_UID,
     };
 
     return new_thread_id;
@@ -424,11 +553,65 @@ void kmt_spawn_idle_thread(thread_entry_point_t entry, x86_mmu_map_t ptable) {
     // wakeup the idle thread
     kmt_wakeup_thread(g_kmt_ctx.idle_thread);
     // enable preemption
-    g_kmt_ctx.flags |= KMT_PREEMPTION_ENABLED;
+    kmt_this_cpu()->flags |= KMT_PREEMPTION_ENABLED;
     // finally, we can kill the thread
     kmt_kill_current_thread();
 }
 
+// the idle thread of each CPU
+void kmt_cpu_idle_entry() {
+    for(;;) __asm__("hlt");
+}
+// each AP enters the scheduler here once released, it never returns
+void kmt_enter_cpu(u32 index) {
+    x86_disable_interrupts();
+    spinlock_acquire(&g_kmt_ctx.lock);
+
+    kmt_cpu_t* cpu = &g_kmt_ctx.cpus[index];
+    cpu->current_thread = cpu->idle_thread;
+    g_kmt_ctx.tcb_pool[cpu->idle_thread].status = THREAD_STATUS_RUNNING;
+
+    // the idle thread starts in kmt_thread_start, which releases the lock
+    kmt_switch_task(&cpu->boot_tcb, &g_kmt_ctx.tcb_pool[cpu->idle_thread], get_global_tss());
+}
+void kmt_release_cpus() {
+    {
+        STOP_PREEMPTING();
+
+        g_kmt_ctx.cpu_count = smp_cpu_count();
+        for(usize i = 0; i < g_kmt_ctx.cpu_count; i++) {
+            if(!smp_get_cpu(i)->online) continue;
+
+            char name[] = "kcpu0";
+            name[4] = '0' + i;
+
+            thread_uid_t idle_thread = kmt_create_thread(&(thread_desc_t){
+                .name = name,
+                .pmgr_ctx = construct_page_mgr_ctx(g_kmt_ctx.kalloca, g_kmt_ctx.threads[0].pmgr_ctx.ptable),
+                .stack_top = smp_get_exec_stack_top(i),
+                .interrupt_stack_top = smp_get_intr_stack_top(i),
+                .entry = kmt_cpu_idle_entry,
+                .heap_base = g_kmt_cpu_idle_heaps[i],
+                .heap_size = KMT_CPU_IDLE_HEAP_SIZE,
+                .priority = 0,
+                .policy = KMT_POLICY_ROUND_ROBIN,
+            });
+            kpanic_if(KMT_IS_INVALID_UID(idle_thread), KMT_GET_ERR_UID(idle_thread), "Failed to create CPU idle thread");
+
+            // never queued, the CPU falls back to it
+            g_kmt_ctx.tcb_pool[idle_thread].status = THREAD_STATUS_READY;
+            g_kmt_ctx.tcb_pool[idle_thread].cpu = i;
+            g_kmt_ctx.cpus[i].idle_thread = idle_thread;
+        }
+    }
+
+    // only CPUs with an idle thread to enter, late ones stay parked
+    for(usize i = 1; i < g_kmt_ctx.cpu_count; i++) {
+        if(KMT_IS_INVALID_UID(g_kmt_ctx.cpus[i].idle_thread)) continue;
+        smp_release_ap(i, kmt_enter_cpu, kmt_preemptive_intr_handler);
+    }
+}
+
 err_t kmt_wakeup_thread(thread_uid_t thread_id) {
     STOP_PREEMPTING();
 
@@ -442,10 +625,12 @@ err_t kmt_wakeup_thread(thread_uid_t thread_id) {
 
     // TODO: deal with waking up a sleeping thread
 
-    // add the thread to the correct ready queue
+    // add the thread to the correct ready queue of the CPU it last ran on, its cache is still warm there
+    kmt_cpu_t* cpu = &g_kmt_ctx.cpus[g_kmt_ctx.tcb_pool[thread_id].cpu];
     u8 priority = g_kmt_ctx.tcb_pool[thread_id].priority;
-    kmt_queue_push(&g_kmt_ctx.ready_queues[priority], thread_id);
-    g_kmt_ctx.ready_priority_bitmap |= (1 << priority);
+    g_kmt_ctx.tcb_pool[thread_id].ready_tick = cpu->tick;
+    kmt_queue_push(&cpu->ready_queues[priority], thread_id);
+    cpu->ready_priority_bitmap |= (1 << priority);
 
     // mark the thread as ready
     g_kmt_ctx.tcb_pool[thread_id].status = THREAD_STATUS_READY;
@@ -469,7 +654,7 @@ void kmt_sleep_until(time_ms_t wakeup_time_ms) {
     if(timer_time_since_init_ns() >= TIME_MS_TO_NS(wakeup_time_ms)) return;
 
     usize idx = g_kmt_ctx.sleep_heap_size;
-    g_kmt_ctx.sleep_heap[idx].thread_id = g_kmt_ctx.current_thread;
+    g_kmt_ctx.sleep_heap[idx].thread_id = kmt_current_thread();
     g_kmt_ctx.sleep_heap[idx].wakeup_time = wakeup_time_ms;
     g_kmt_ctx.sleep_heap_size++;
 
@@ -494,7 +679,7 @@ void kmt_sleep_for(time_ms_t sleep_duration_ms) {
 }
 void kmt_kill_current_thread() {
     STOP_PREEMPTING();
-    g_kmt_ctx.tcb_pool[g_kmt_ctx.current_thread].status = THREAD_STATUS_TERMINATED;
+    g_kmt_ctx.tcb_pool[kmt_current_thread()].status = THREAD_STATUS_TERMINATED;
     kmt_schedule(false);
 }
 // mutexes
@@ -516,85 +701,104 @@ thread_mutex_t kmt_create_mutex() {
     }
 
     g_kmt_ctx.mutex_pool[mutex_id].flags = KMT_MUTEX_USED;
-    g_kmt_ctx.mutex_pool[mutex_id].owner = invalid_u16;
-    g_kmt_ctx.mutex_pool[mutex_id].waiting_queue_head = nullptr;
-    g_kmt_ctx.mutex_pool[mutex_id].waiting_queue_tail = nullptr;
+    g_kmt_ctx.mutex_pool[mutex_id].lock = KMT_MUTEX_UNLOCKED;
+    g_kmt_ctx.mutex_pool[mutex_id].waiting.head = KMT_INVALID_KTHREAD_UID;
+    g_kmt_ctx.mutex_pool[mutex_id].waiting.tail = KMT_INVALID_KTHREAD_UID;
 
     return mutex_id;
 }
+// the uncontended lock and unlock are a single CAS, the scheduler is only involved once threads have to park
 err_t kmt_lock_mutex(thread_mutex_t mutex) {
-    STOP_PREEMPTING();
-
     kmt_mutex_impl_t* mutex_impl = &g_kmt_ctx.mutex_pool[mutex];
     if(mutex_impl->flags == KMT_MUTEX_FREE) return EUSEFREED;
-    if(mutex_impl->owner == g_kmt_ctx.current_thread) return ESUCCESS;
-    if(mutex_impl->owner == invalid_u16) {
-        mutex_impl->owner = g_kmt_ctx.current_thread;
-        return ESUCCESS;
-    }
-    // add the current thread to the mutex's waiting queue
-    kmt_queue_node_t* new_queue_node = (kmt_queue_node_t*)malloc(g_kmt_ctx.kalloca, sizeof(kmt_queue_node_t));
-    new_queue_node->thread_id = g_kmt_ctx.current_thread;
-    new_queue_node->next = nullptr;
-    if(mutex_impl->waiting_queue_tail) {
-        mutex_impl->waiting_queue_tail->next = new_queue_node;
-        mutex_impl->waiting_queue_tail = new_queue_node;
-    } else {
-        mutex_impl->waiting_queue_head = new_queue_node;
-        mutex_impl->waiting_queue_tail = new_queue_node;
+
+    thread_uid_t current_thread_id = kmt_get_current_thread();
+    u32 word = atomic_cmpxchg((u32*)&mutex_impl->lock, KMT_MUTEX_UNLOCKED, current_thread_id);
+    if(word == KMT_MUTEX_UNLOCKED) return ESUCCESS;
+    if((word & KMT_MUTEX_OWNER_MASK) == current_thread_id) return ESUCCESS;
+
+    // the owner is likely to unlock soon while it's running on another CPU, parking would cost more
+    for(u32 spins = 0; spins < KMT_MUTEX_SPIN_LIMIT && g_kmt_ctx.cpu_count > 1; spins++) {
+        word = mutex_impl->lock;
+        if(word == KMT_MUTEX_UNLOCKED) {
+            word = atomic_cmpxchg((u32*)&mutex_impl->lock, KMT_MUTEX_UNLOCKED, current_thread_id);
+            if(word == KMT_MUTEX_UNLOCKED) return ESUCCESS;
+        }
+        if(word & KMT_MUTEX_WAITERS) break;
+        if(g_kmt_ctx.tcb_pool[word & KMT_MUTEX_OWNER_MASK].status != THREAD_STATUS_RUNNING) break;
+
+        atomic_pause();
     }
 
-    while(mutex_impl->owner != g_kmt_ctx.current_thread) {
+    STOP_PREEMPTING();
+
+    // flag the waiters, so the owner unlocks through kmt_unlock_mutex's slow path and hands the mutex over
+    word = mutex_impl->lock;
+    while(true) {
+        u32 next_word = word | KMT_MUTEX_WAITERS;
+        if(word == KMT_MUTEX_UNLOCKED) next_word = current_thread_id;
+
+        u32 old_word = atomic_cmpxchg((u32*)&mutex_impl->lock, word, next_word);
+        if(old_word == word) break;
+        word = old_word;
+    }
+    if(word == KMT_MUTEX_UNLOCKED) return ESUCCESS;
+
+    // park until the mutex is handed to this thread
+    kmt_wait_queue_insert(&mutex_impl->waiting, current_thread_id);
+    while((mutex_impl->lock & KMT_MUTEX_OWNER_MASK) != current_thread_id) {
         kmt_schedule(THREAD_STATUS_IDLE_MUTEX);
     }
     return ESUCCESS;
 }
 err_t kmt_unlock_mutex(thread_mutex_t mutex) {
-    STOP_PREEMPTING();
-
     kmt_mutex_impl_t* mutex_impl = &g_kmt_ctx.mutex_pool[mutex];
     if(mutex_impl->flags == KMT_MUTEX_FREE) return EUSEFREED;
-    if(mutex_impl->owner != g_kmt_ctx.current_thread) return ENOTOWNED;
-    if(mutex_impl->waiting_queue_head) {
-        // wake up the next thread in the waiting queue,
-        // which is not terminated
-        kmt_queue_node_t* next_thread_node = nullptr;
-        do {
-            next_thread_node = mutex_impl->waiting_queue_head;
-            mutex_impl->waiting_queue_head = next_thread_node->next;
-            if(mutex_impl->waiting_queue_head == nullptr) {
-                mutex_impl->waiting_queue_tail = nullptr;
-            }
-        } while(g_kmt_ctx.tcb_pool[next_thread_node->thread_id].status != THREAD_STATUS_TERMINATED);
 
-        mutex_impl->owner = next_thread_node->thread_id;
+    thread_uid_t current_thread_id = kmt_get_current_thread();
+    u32 word = atomic_cmpxchg((u32*)&mutex_impl->lock, current_thread_id, KMT_MUTEX_UNLOCKED);
+    if(word == current_thread_id) return ESUCCESS;
+    if((word & KMT_MUTEX_OWNER_MASK) != current_thread_id) return ENOTOWNED;
+
+    STOP_PREEMPTING();
+
+    // hand the mutex to the next thread in the waiting queue,
+    // which is not terminated, the mutex is never unlocked in between so no other thread can barge in
+    thread_uid_t next_thread_id = kmt_wait_queue_pop(&mutex_impl->waiting);
+    while(next_thread_id != KMT_INVALID_KTHREAD_UID && g_kmt_ctx.tcb_pool[next_thread_id].status == THREAD_STATUS_TERMINATED) {
+        next_thread_id = kmt_wait_queue_pop(&mutex_impl->waiting);
+    }
+
+    word = KMT_MUTEX_UNLOCKED;
+    if(next_thread_id != KMT_INVALID_KTHREAD_UID) {
+        word = next_thread_id;
+        if(!kmt_queue_is_empty(&mutex_impl->waiting)) word |= KMT_MUTEX_WAITERS;
+    }
+    // lockers only add the waiters flag, and they do it holding the scheduler lock
+    atomic_xchg((u32*)&mutex_impl->lock, word);
+
+    if(next_thread_id != KMT_INVALID_KTHREAD_UID) {
         // downgrade the thread's status to idle, and wake it up
-        g_kmt_ctx.tcb_pool[next_thread_node->thread_id].status = THREAD_STATUS_IDLE;
-        kpanic_on_err(kmt_wakeup_thread(next_thread_node->thread_id), "Failed to wakeup thread from mutex waiting queue");
-        free(g_kmt_ctx.kalloca, next_thread_node);
-    } else {
-        mutex_impl->owner = invalid_u16;
+        g_kmt_ctx.tcb_pool[next_thread_id].status = THREAD_STATUS_IDLE;
+        kpanic_on_err(kmt_wakeup_thread(next_thread_id), "Failed to wakeup thread from mutex waiting queue");
     }
     return ESUCCESS;
 }
 
 bool kmt_is_mutex_owned(thread_mutex_t mutex) {
-    STOP_PREEMPTING();
-
     kmt_mutex_impl_t* mutex_impl = &g_kmt_ctx.mutex_pool[mutex];
     if(mutex_impl->flags == KMT_MUTEX_FREE) return false;
-    return mutex_impl->owner == g_kmt_ctx.current_thread;
+    return (mutex_impl->lock & KMT_MUTEX_OWNER_MASK) == kmt_get_current_thread();
 }
 
 err_t kmt_free_mutex(thread_mutex_t mutex) {
     STOP_PREEMPTING();
 
     if(g_kmt_ctx.mutex_pool[mutex].flags == KMT_MUTEX_FREE) return EINVAL;
-    if(g_kmt_ctx.mutex_pool[mutex].owner != invalid_u16) return EINUSE;
+    if(g_kmt_ctx.mutex_pool[mutex].lock != KMT_MUTEX_UNLOCKED) return EINUSE;
 
     kmt_mutex_impl_t* mutex_impl = &g_kmt_ctx.mutex_pool[mutex];
     mutex_impl->flags = KMT_MUTEX_FREE;
-    mutex_impl->owner = invalid_u16;
 
     return ESUCCESS;
 }
@@ -609,7 +813,7 @@ err_t kmt_free_rwlock(thread_rwlock_t rwlock);
 // RPC
 heap_allocator_t* kmt_get_rpc_heap() {
     STOP_PREEMPTING();
-    void* heap = g_kmt_ctx.threads[g_kmt_ctx.current_thread].rpc_shared_heap;
+    void* heap = g_kmt_ctx.threads[kmt_current_thread()].rpc_shared_heap;
     return heap;
 }
 
@@ -623,10 +827,10 @@ err_t kmt_rpc_call(thread_uid_t callee, u32 function, void* request, usize reque
     if(response_size > 0 && IS_ERR_PTR(response)) return EINVPTR;
     if(IS_ERR_PTR(return_code)) return EINVPTR;
 
-    // add the RPC request to the callee's RPC queue
-    kmt_rpc_queue_node_t* new_rpc_node = (kmt_rpc_queue_node_t*)malloc(g_kmt_ctx.kalloca, sizeof(kmt_rpc_queue_node_t));
-    new_rpc_node->rpc_desc = (thread_rpc_desc_t){
-        .caller = g_kmt_ctx.current_thread,
+    // add the RPC request to the callee's RPC queue, the caller blocks so its own slot holds the request
+    thread_uid_t caller = kmt_current_thread();
+    g_kmt_ctx.threads[caller].rpc_request = (thread_rpc_desc_t){
+        .caller = caller,
         .callee = callee,
         .function = function,
         .request = request,
@@ -634,13 +838,13 @@ err_t kmt_rpc_call(thread_uid_t callee, u32 function, void* request, usize reque
         .response = response,
         .response_size = response_size,
     };
-    new_rpc_node->next = nullptr;
-    if(g_kmt_ctx.threads[callee].rpc_tail) {
-        g_kmt_ctx.threads[callee].rpc_tail->next = new_rpc_node;
-        g_kmt_ctx.threads[callee].rpc_tail = new_rpc_node;
+    g_kmt_ctx.threads[caller].rpc_next = KMT_INVALID_KTHREAD_UID;
+    if(g_kmt_ctx.threads[callee].rpc_tail != KMT_INVALID_KTHREAD_UID) {
+        g_kmt_ctx.threads[g_kmt_ctx.threads[callee].rpc_tail].rpc_next = caller;
+        g_kmt_ctx.threads[callee].rpc_tail = caller;
     } else {
-        g_kmt_ctx.threads[callee].rpc_head = new_rpc_node;
-        g_kmt_ctx.threads[callee].rpc_tail = new_rpc_node;
+        g_kmt_ctx.threads[callee].rpc_head = caller;
+        g_kmt_ctx.threads[callee].rpc_tail = caller;
         // the callee's RPC queue is empty, we will wake it up if it's idle
         if(g_kmt_ctx.tcb_pool[callee].status == THREAD_STATUS_IDLE_RPC_CALLEE) {
             g_kmt_ctx.tcb_pool[callee].status = THREAD_STATUS_IDLE;
@@ -655,33 +859,32 @@ err_t kmt_rpc_call(thread_uid_t callee, u32 function, void* request, usize reque
     }
 
     // wait for the callee to process the RPC request
-    g_kmt_ctx.threads[g_kmt_ctx.current_thread].rpc_return = EPENDING;
-    while(g_kmt_ctx.threads[g_kmt_ctx.current_thread].rpc_return == EPENDING) {
+    g_kmt_ctx.threads[caller].rpc_return = EPENDING;
+    while(g_kmt_ctx.threads[caller].rpc_return == EPENDING) {
         kmt_schedule(THREAD_STATUS_IDLE_RPC_CALLER);
     }
-    *return_code = g_kmt_ctx.threads[g_kmt_ctx.current_thread].rpc_return;
+    *return_code = g_kmt_ctx.threads[caller].rpc_return;
     return ESUCCESS;
 }
 thread_rpc_desc_t kmt_rpc_listen() {
     STOP_PREEMPTING();
 
-    kmt_rpc_queue_node_t* rpc_node = g_kmt_ctx.threads[g_kmt_ctx.current_thread].rpc_head;
-    if(!rpc_node) {
+    thread_info_t* info = &g_kmt_ctx.threads[kmt_current_thread()];
+    thread_uid_t caller = info->rpc_head;
+    if(caller == KMT_INVALID_KTHREAD_UID) {
         // no RPC requests, we will just sleep until we get one
         kmt_schedule(THREAD_STATUS_IDLE_RPC_CALLEE);
-        rpc_node = g_kmt_ctx.threads[g_kmt_ctx.current_thread].rpc_head;
-        kpanic_if(IS_ERR_PTR(rpc_node), PANIC_UNEXPECTED_FAILURE, "RPC queue is empty after waking up from idle RPC");
+        caller = info->rpc_head;
+        kpanic_if(caller == KMT_INVALID_KTHREAD_UID, PANIC_UNEXPECTED_FAILURE, "RPC queue is empty after waking up from idle RPC");
     }
 
     // remove the RPC request from the queue
-    g_kmt_ctx.threads[g_kmt_ctx.current_thread].rpc_head = rpc_node->next;
-    if(!g_kmt_ctx.threads[g_kmt_ctx.current_thread].rpc_head) {
-        g_kmt_ctx.threads[g_kmt_ctx.current_thread].rpc_tail = nullptr;
+    info->rpc_head = g_kmt_ctx.threads[caller].rpc_next;
+    if(info->rpc_head == KMT_INVALID_KTHREAD_UID) {
+        info->rpc_tail = KMT_INVALID_KTHREAD_UID;
     }
 
-    thread_rpc_desc_t rpc_desc = rpc_node->rpc_desc;
-    free(g_kmt_ctx.kalloca, rpc_node);
-    return rpc_desc;
+    return g_kmt_ctx.threads[caller].rpc_request;
 }
 err_t kmt_rpc_return(const thread_rpc_desc_t* desc, err_t return_code) {
     STOP_PREEMPTING();
@@ -689,7 +892,7 @@ err_t kmt_rpc_return(const thread_rpc_desc_t* desc, err_t return_code) {
     // validate the RPC descriptor
     if(IS_ERR_PTR(desc)) return EINVPTR;
     if(desc->caller >= g_kmt_ctx.thread_count) return EOUTOFRANGE;
-    if(desc->callee != g_kmt_ctx.current_thread) return EINVAL;
+    if(desc->callee != kmt_current_thread()) return EINVAL;
     if(desc->request_size > 0 && IS_ERR_PTR(desc->request)) return EINVPTR;
     if(desc->response_size > 0 && IS_ERR_PTR(desc->response)) return EINVPTR;
     if(return_code == EPENDING) return EINVAL;
@@ -708,7 +911,13 @@ err_t kmt_rpc_return(const thread_rpc_desc_t* desc, err_t return_code) {
 }
 
 // thread info
-thread_uid_t kmt_get_current_thread() { return g_kmt_ctx.current_thread; }
+thread_uid_t kmt_get_current_thread() {
+    // the thread can't move to another CPU between reading the index and the current thread
+    u32 eflags = x86_disable_intr_save();
+    thread_uid_t thread_id = kmt_this_cpu()->current_thread;
+    x86_restore_intr_saved(eflags);
+    return thread_id;
+}
 thread_uid_t kmt_get_thread(const char *name) {
     if(strlen(name) >= sizeof(g_kmt_ctx.threads[0].name)) return 0x8000 | ESTRTOOBIG;
     for(thread_uid_t i = 0; i < g_kmt_ctx.thread_count; i++) {
@@ -724,7 +933,7 @@ const char *kmt_get_thread_name(thread_uid_t thread_id)
     return g_kmt_ctx.threads[thread_id].name;
 }
 heap_allocator_t* kmt_get_heap() {
-    thread_uid_t thread_id = g_kmt_ctx.current_thread;
+    thread_uid_t thread_id = kmt_get_current_thread();
     if(thread_id >= g_kmt_ctx.thread_count) return ERR_PTR(heap_allocator_t, EOUTOFRANGE);
     return g_kmt_ctx.threads[thread_id].heap;
 }
@@ -746,7 +955,7 @@ err_t kmt_override_thread_priority(thread_uid_t thread_id, u8 priority) {
 
 // get physical address of a virtual address in the current thread's page table
 ptr_t kmt_get_phys_addr(ptr_t vaddress) {
-    thread_uid_t thread_id = g_kmt_ctx.current_thread;
+    thread_uid_t thread_id = kmt_get_current_thread();
     if(thread_id >= g_kmt_ctx.thread_count) return EOUTOFRANGE;
     return x86_get_phys_addr(&g_kmt_ctx.threads[thread_id].pmgr_ctx.ptable, vaddress);
 }
@@ -10,8 +10,6 @@
 
 typedef void(*thread_entry_point_t)();
 
-typedef struct kmt_queue_node_t kmt_queue_node_t;
-
 typedef struct thread_desc_t {
     char* name;
     page_mgr_ctx_t pmgr_ctx;
@@ -29,17 +27,17 @@ typedef struct tcb_t {
     void* esp;
     void* esp0;
     u32  cr3;
-    u32  age;
+    // scheduler tick the thread was made ready at, its age is counted from there
+    u32  ready_tick;
     u8 status;
     u8 priority;
     u8 base_priority;
+    // the CPU the thread last ran on, it's made ready there
+    u8 cpu;
+    // next thread in the same ready queue
+    thread_uid_t ready_next;
 } _packed tcb_t;
 
-typedef struct kmt_rpc_queue_node_t {
-    thread_rpc_desc_t rpc_desc;
-    struct kmt_rpc_queue_node_t* next;
-} kmt_rpc_queue_node_t;
-
 typedef struct thread_info_t {
     // thread info
     char name[16];
@@ -48,14 +46,19 @@ typedef struct thread_info_t {
     heap_allocator_t* heap;
     page_mgr_ctx_t    pmgr_ctx;
 
-    // RPC
-    kmt_rpc_queue_node_t* rpc_head;
-    kmt_rpc_queue_node_t* rpc_tail;
+    // next thread waiting on the same mutex
+    thread_uid_t wait_next;
+
+    // RPC, callers queue up by their own request
+    thread_uid_t rpc_head;
+    thread_uid_t rpc_tail;
+    thread_uid_t rpc_next;
+    thread_rpc_desc_t rpc_request;
     err_t rpc_return;
     heap_allocator_t* rpc_shared_heap;
 
     // rwlock
-    kmt_queue_node_t* owned_rwlocks;
+    thread_rwlock_t owned_rwlocks;
 } thread_info_t;
 
 #define STOP_PREEMPTING() u32 _kmt_flags __attribute__((cleanup(kmt_restore_flags))) = kmt_disable_preemption();
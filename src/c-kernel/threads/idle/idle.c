@@ -1,6 +1,7 @@
 #include "idle.h"
 
 #include <utils/heap.h>
+#include <boot/init.h>
 
 #include <pools.h>
 #include <utils/logger.h>
@@ -13,6 +14,7 @@ idle_thread_init_t g_idle_thread_init;
 
 void idle_thread_entry() {
     log_info("idle thread started successfully\n");
+    kmt_release_cpus();
     log_info("handoff to syscore thread\n");
     // create the syscore thread, which will be used to manage the memory
     kpanic_on_err(syscore_start_thread(g_idle_thread_init.page_table), "Failed to start syscore thread");
@@ -3,7 +3,10 @@
 #include "../x86.h"
 #include <io/io.h>
 
-IRQHandler irq_handlers[16];
+// PCI devices can share a line, every handler checks its own device
+#define IRQ_MAX_SHARED 4
+
+IRQHandler irq_handlers[16][IRQ_MAX_SHARED];
 
 void _no_stack_trace _default_irq_handler(Registers* registers)
 {
@@ -12,9 +15,12 @@ void _no_stack_trace _default_irq_handler(Registers* registers)
     u16 pic_isr = PIC_get_isr();
     u16 pic_irr = PIC_get_irr();
 
-    if(irq_handlers[irq] != nullptr)
+    if(irq_handlers[irq][0] != nullptr)
     {
-        irq_handlers[irq](registers);
+        for(int i = 0; i < IRQ_MAX_SHARED && irq_handlers[irq][i] != nullptr; i++)
+        {
+            irq_handlers[irq][i](registers);
+        }
     }
     else
     {
@@ -38,8 +44,19 @@ void init_irq()
 
 void IRQ_registerHandler(u8 irq, IRQHandler handler)
 {
-    if(irq < 16)
+    if(irq >= 16) return;
+
+    for(int i = 0; i < IRQ_MAX_SHARED; i++)
     {
-        irq_handlers[irq] = handler;
+        // already registered
+        if(irq_handlers[irq][i] == handler) return;
+
+        if(irq_handlers[irq][i] == nullptr)
+        {
+            irq_handlers[irq][i] = handler;
+            return;
+        }
     }
+
+    log_warn("Too many handlers for IRQ #%d\n", irq);
 }
@@ -4,8 +4,8 @@
 
 #define MASTER_PIC_COMMAND 0x20
 #define MASTER_PIC_DATA 0x21
-#define SLAVE_PIC_COMMAND 0x20
-#define SLAVE_PIC_DATA 0x21
+#define SLAVE_PIC_COMMAND 0xA0
+#define SLAVE_PIC_DATA 0xA1
 
 #define PIC_EOI_VAL 0x20
 
@@ -111,6 +111,9 @@ void PIC_irq_unmask(u8 irq_line)
     {
         port = SLAVE_PIC_DATA;
         irq_line -= 8;
+
+        // slave lines are only delivered through the cascade line
+        x86_outb(MASTER_PIC_DATA, x86_inb(MASTER_PIC_DATA) & ~(1 << 2));
     }
 
     u8 mask = x86_inb(port);
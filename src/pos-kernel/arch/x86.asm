@@ -57,6 +57,25 @@ x86_flushTLB:
 
     ret
 
+; u32 _cdecl x86_getCR4();
+global x86_getCR4
+x86_getCR4:
+    [bits 32]
+
+    mov eax, cr4
+
+    ret
+
+; void _cdecl x86_invlpg(u32 address);
+global x86_invlpg
+x86_invlpg:
+    [bits 32]
+
+    mov eax, [esp + 4]
+    invlpg [eax]
+
+    ret
+
 ; _import u32 _asmcall x86_flushCache();
 global x86_flushCache
 x86_flushCache:
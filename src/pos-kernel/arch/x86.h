@@ -14,6 +14,9 @@ _import u32 _asmcall x86_inl(u16 port);
 
 // returns cr3 value
 _import u32 _asmcall x86_flushTLB();
+// drops the TLB entry of the page at address
+_import void _asmcall x86_invlpg(u32 address);
+_import u32 _asmcall x86_getCR4();
 
 _import u32 _asmcall x86_flushCache();
 
@@ -1,5 +1,7 @@
 #include "blkio.hpp"
 
+#include <std/memory/object_cache.hpp>
+
 namespace blkio
 {
     struct request_link
@@ -10,6 +12,8 @@ namespace blkio
     
     static request_link* head;
     static request_link* tail;
+
+    static std::object_cache<request_link> request_cache;
     
     void init()
     {
@@ -19,7 +23,7 @@ namespace blkio
 
     void submit_request(request_t &request)
     {
-        request_link* link = new request_link();;
+        request_link* link = request_cache.alloc();
         link->req = request;
         
         if(tail == nullptr)
@@ -43,6 +47,11 @@ namespace blkio
         request_link* first = head;
         if(first == nullptr) return request_t{.type = REQ_INVALID};
         head = head->next;
-        return first->req;
+        if(head == nullptr) tail = nullptr;
+
+        request_t req = first->req;
+        request_cache.free(first);
+
+        return req;
     }
 }
@@ -0,0 +1,108 @@
+#include "dma.hpp"
+
+#include <c/math.h>
+#include <io/io.h>
+#include <std/basic.hpp>
+
+#include "memory.hpp"
+#include "paging.hpp"
+
+#define DMA_ZONE_GRANULES (DMA_ZONE_PAGES * PAGE_SIZE / DMA_GRANULE)
+
+namespace cpu::dma
+{
+    namespace
+    {
+        static u8* zone_base = nullptr;
+        static ptr_t zone_phys = 0;
+
+        // a bit per granule, and the summary std::Bitmap keeps after it
+        alignas(4) static u8 zone_bits[DMA_ZONE_GRANULES / 8 + DMA_ZONE_GRANULES / 256];
+        static std::Bitmap zone_status;
+    }
+
+    bool initialize()
+    {
+        zone_base = (u8*)alloc_low_pages(DMA_ZONE_PAGES, DMA_ZONE_LIMIT);
+        if(zone_base == nullptr)
+        {
+            log_error("[DMA] no contiguous memory below 0x%x for the zone\n", DMA_ZONE_LIMIT);
+            return false;
+        }
+
+        // the zone is physically contiguous, one translation covers it
+        zone_phys = getPhysicalLocation(zone_base);
+        zone_status = std::Bitmap(zone_bits, DMA_ZONE_GRANULES, false);
+
+        return true;
+    }
+
+    dma_buffer alloc(size_t size, size_t align, size_t boundary)
+    {
+        dma_buffer buffer = { nullptr, 0, 0 };
+
+        if(zone_base == nullptr || size == 0) return buffer;
+        if(boundary != 0 && size > boundary)
+        {
+            log_warn("[DMA] 0x%x bytes can't fit within a 0x%x boundary\n", size, boundary);
+            return buffer;
+        }
+
+        align = align < DMA_GRANULE ? DMA_GRANULE : RoundUpTo2Power(align);
+        size_t count = DivRoundUp(size, DMA_GRANULE);
+
+        size_t granule = zone_status.next_false(0);
+        while(granule < DMA_ZONE_GRANULES)
+        {
+            // alignment and boundaries are of the physical address
+            ptr_t phys = (zone_phys + granule * DMA_GRANULE + align - 1) & ~(align - 1);
+            granule = (phys - zone_phys) / DMA_GRANULE;
+
+            // start over at the boundary that would be crossed
+            if(boundary != 0 && phys / boundary != (phys + size - 1) / boundary)
+            {
+                granule = ((phys / boundary + 1) * boundary - zone_phys) / DMA_GRANULE;
+                continue;
+            }
+
+            if(granule + count > DMA_ZONE_GRANULES) break;
+
+            // the free run from here is long enough
+            size_t end = zone_status.next_true(granule);
+            if(end >= granule + count)
+            {
+                zone_status.setBits(granule, count, true);
+
+                buffer.virt = zone_base + granule * DMA_GRANULE;
+                buffer.phys = phys;
+                buffer.size = size;
+
+                return buffer;
+            }
+
+            granule = zone_status.next_false(end);
+        }
+
+        log_warn("[DMA] zone out of space for 0x%x bytes\n", size);
+        return buffer;
+    }
+
+    void free(const dma_buffer& buffer)
+    {
+        if(buffer.virt == nullptr) return;
+
+        u8* virt = (u8*)buffer.virt;
+        if(virt < zone_base || virt >= zone_base + DMA_ZONE_PAGES * PAGE_SIZE)
+        {
+            log_warn("[DMA] freeing a buffer outside of the zone\n");
+            return;
+        }
+
+        zone_status.setBits((virt - zone_base) / DMA_GRANULE, DivRoundUp(buffer.size, DMA_GRANULE), false);
+    }
+
+    ptr_t physical(const void* virt)
+    {
+        return zone_phys + ((const u8*)virt - zone_base);
+    }
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <includes.h>
+
+// the zone must be reachable by ISA and 32 bit PCI bus masters alike
+#define DMA_ZONE_LIMIT 0x1000000 // 16 MiB
+#define DMA_ZONE_PAGES 0x100 // 1 MiB
+// smallest allocation, and the smallest alignment
+#define DMA_GRANULE 0x10
+
+namespace cpu::dma
+{
+    // memory a device can address, phys is what goes into its registers and descriptors
+    struct dma_buffer
+    {
+        void* virt;
+        ptr_t phys;
+        size_t size;
+    };
+
+    // reserves the physically contiguous zone, called once at boot
+    bool initialize();
+
+    // size bytes at a physical multiple of align that don't cross a multiple of boundary,
+    // boundary is a power of 2 or 0 for none. virt is nullptr if the zone is out of space
+    dma_buffer alloc(size_t size, size_t align = DMA_GRANULE, size_t boundary = 0);
+    void free(const dma_buffer& buffer);
+
+    // physical address of memory inside the zone
+    ptr_t physical(const void* virt);
+}
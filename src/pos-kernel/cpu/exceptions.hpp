@@ -12,6 +12,14 @@ namespace cpu
 {
     inline void halt() { __asm__("hlt"); }
 
+    // cycles since reset
+    inline u64 read_tsc()
+    {
+        u32 low, high;
+        __asm__ volatile("rdtsc" : "=a"(low), "=d"(high));
+        return ((u64)high << 32) | low;
+    }
+
     void initialize_exceptions();
 }
 
@@ -6,6 +6,7 @@
 #include <arch/x86.h>
 
 extern u8 __page_allocator_start[];
+extern u8 __page_allocator_end[];
 
 #define MMAP_TYPE_USED_CRITICAL     0
 #define MMAP_TYPE_FREE              1
@@ -17,6 +18,18 @@ extern u8 __page_allocator_start[];
 #define ACPI_ATTRIB_IGNORE          0x01
 #define ACPI_ATTRIB_NON_VOLATILE    0x02
 
+// PCI devices are usually mapped above this
+#define ADDRESS_SPACE_LIMIT         0xC0000000
+#define ADDRESS_SPACE_ALIGN         0x400000
+
+// free page runs the index can hold, the rest is only in the bitmap until it is rebuilt
+#define PAGE_EXTENT_COUNT           1024
+// slots of each boundary table, twice the extents so probes stay short
+#define PAGE_EXTENT_SLOT_BITS       11
+#define PAGE_EXTENT_SLOTS           (1 << PAGE_EXTENT_SLOT_BITS)
+// class n holds the extents of [2^n, 2^(n+1)) pages
+#define PAGE_EXTENT_CLASSES         32
+
 namespace cpu
 {
     namespace
@@ -27,6 +40,10 @@ namespace cpu
         static uint64_t page_count;
         static uint64_t kernel_end;
 
+        // next free address of the space above RAM
+        static uint64_t address_space_cursor = 0;
+        static uint64_t address_space_limit = ADDRESS_SPACE_LIMIT;
+
         typedef struct
         {
             u32 sectionBegin;
@@ -52,6 +69,277 @@ namespace cpu
 
         e820_MemoryMap memoryMap;
 
+        // a run of free pages, found by its first and last page and listed by its size class
+        struct page_extent
+        {
+            u32 start;
+            u32 count;
+
+            page_extent* next;
+            page_extent* prev;
+        };
+
+        struct extent_slot
+        {
+            u32 page;
+            page_extent* extent;
+        };
+
+        static page_extent extent_pool[PAGE_EXTENT_COUNT];
+        static page_extent* unused_extents = nullptr;
+
+        static page_extent* extent_classes[PAGE_EXTENT_CLASSES];
+        static u32 extent_classes_used = 0;
+
+        // open addressing on the first and on the last page of every extent
+        static extent_slot extent_starts[PAGE_EXTENT_SLOTS];
+        static extent_slot extent_ends[PAGE_EXTENT_SLOTS];
+
+        // some free pages did not get an extent, only the bitmap knows them
+        static bool extents_lost = false;
+
+        // next fit, single pages come from here until it runs out
+        static page_extent* extent_cursor = nullptr;
+
+        u32 slot_hash(u32 page)
+        {
+            return (page * 2654435761u) >> (32 - PAGE_EXTENT_SLOT_BITS);
+        }
+
+        page_extent* slot_find(extent_slot* table, u32 page)
+        {
+            for(u32 i = slot_hash(page); table[i].extent != nullptr; i = (i + 1) & (PAGE_EXTENT_SLOTS - 1))
+            {
+                if(table[i].page == page) return table[i].extent;
+            }
+
+            return nullptr;
+        }
+        void slot_insert(extent_slot* table, u32 page, page_extent* extent)
+        {
+            u32 i = slot_hash(page);
+            while(table[i].extent != nullptr) i = (i + 1) & (PAGE_EXTENT_SLOTS - 1);
+
+            table[i].page = page;
+            table[i].extent = extent;
+        }
+        void slot_erase(extent_slot* table, u32 page)
+        {
+            u32 i = slot_hash(page);
+            while(table[i].page != page || table[i].extent == nullptr) i = (i + 1) & (PAGE_EXTENT_SLOTS - 1);
+
+            // move later entries of the probe back into the hole
+            for(u32 j = (i + 1) & (PAGE_EXTENT_SLOTS - 1); table[j].extent != nullptr; j = (j + 1) & (PAGE_EXTENT_SLOTS - 1))
+            {
+                u32 home = slot_hash(table[j].page);
+
+                // the entry is reachable without passing the hole
+                if(i <= j ? (i < home && home <= j) : (i < home || home <= j)) continue;
+
+                table[i] = table[j];
+                i = j;
+            }
+
+            table[i].extent = nullptr;
+        }
+
+        u32 extent_class(u32 count)
+        {
+            return 31 - __builtin_clz(count);
+        }
+
+        void extent_link(page_extent* extent)
+        {
+            u32 index = extent_class(extent->count);
+
+            extent->prev = nullptr;
+            extent->next = extent_classes[index];
+            if(extent->next != nullptr) extent->next->prev = extent;
+
+            extent_classes[index] = extent;
+            extent_classes_used |= 1u << index;
+
+            slot_insert(extent_starts, extent->start, extent);
+            slot_insert(extent_ends, extent->start + extent->count - 1, extent);
+        }
+        void extent_unlink(page_extent* extent)
+        {
+            u32 index = extent_class(extent->count);
+
+            if(extent->prev != nullptr) extent->prev->next = extent->next;
+            else extent_classes[index] = extent->next;
+            if(extent->next != nullptr) extent->next->prev = extent->prev;
+
+            if(extent_classes[index] == nullptr) extent_classes_used &= ~(1u << index);
+
+            slot_erase(extent_starts, extent->start);
+            slot_erase(extent_ends, extent->start + extent->count - 1);
+        }
+
+        void extent_new(u32 start, u32 count)
+        {
+            page_extent* extent = unused_extents;
+            if(extent == nullptr)
+            {
+                extents_lost = true;
+                return;
+            }
+
+            unused_extents = extent->next;
+
+            extent->start = start;
+            extent->count = count;
+            extent_link(extent);
+        }
+        void extent_recycle(page_extent* extent)
+        {
+            if(extent_cursor == extent) extent_cursor = nullptr;
+
+            extent->next = unused_extents;
+            unused_extents = extent;
+        }
+
+        // add pages that were just cleared in the bitmap, merging with the extents around them
+        void extent_add(u32 start, u32 count)
+        {
+            page_extent* before = start > 0 ? slot_find(extent_ends, start - 1) : nullptr;
+            page_extent* after = slot_find(extent_starts, start + count);
+
+            if(after != nullptr)
+            {
+                extent_unlink(after);
+                count += after->count;
+                extent_recycle(after);
+            }
+
+            if(before == nullptr)
+            {
+                extent_new(start, count);
+                return;
+            }
+
+            extent_unlink(before);
+            before->count += count;
+            extent_link(before);
+        }
+
+        // remove [start, start + count) from extent, keeping what is left on either side
+        void extent_take(page_extent* extent, u32 start, u32 count)
+        {
+            u32 end = start + count;
+            u32 extent_end = extent->start + extent->count;
+
+            extent_unlink(extent);
+
+            if(start > extent->start)
+            {
+                extent->count = start - extent->start;
+                extent_link(extent);
+
+                if(end < extent_end) extent_new(end, extent_end - end);
+            }
+            else if(end < extent_end)
+            {
+                extent->start = end;
+                extent->count = extent_end - end;
+                extent_link(extent);
+            }
+            else extent_recycle(extent);
+        }
+
+        // an extent of at least count pages, any of a larger class fits
+        page_extent* extent_find(u32 count)
+        {
+            u32 index = extent_class(count);
+
+            u32 larger = index + 1 < PAGE_EXTENT_CLASSES ? extent_classes_used & ~((2u << index) - 1) : 0;
+            if(larger != 0) return extent_classes[__builtin_ctz(larger)];
+
+            for(page_extent* extent = extent_classes[index]; extent != nullptr; extent = extent->next)
+            {
+                if(extent->count >= count) return extent;
+            }
+
+            return nullptr;
+        }
+
+        // an extent holding count pages starting at a multiple of align, page is the highest such start
+        page_extent* extent_find_aligned(u32 align, u32 count, u32& page)
+        {
+            u32 classes = extent_classes_used & ~((1u << extent_class(count)) - 1);
+
+            while(classes != 0)
+            {
+                u32 index = __builtin_ctz(classes);
+                classes &= classes - 1;
+
+                for(page_extent* extent = extent_classes[index]; extent != nullptr; extent = extent->next)
+                {
+                    if(extent->count < count) continue;
+
+                    page = (extent->start + extent->count - count) / align * align;
+                    if(page >= extent->start && page != 0) return extent;
+                }
+            }
+
+            return nullptr;
+        }
+
+        // drop every extent and index the free runs of the bitmap again
+        void build_extents()
+        {
+            for(size_t i = 0; i < PAGE_EXTENT_CLASSES; i++) extent_classes[i] = nullptr;
+            extent_classes_used = 0;
+
+            for(size_t i = 0; i < PAGE_EXTENT_SLOTS; i++)
+            {
+                extent_starts[i].extent = nullptr;
+                extent_ends[i].extent = nullptr;
+            }
+
+            unused_extents = nullptr;
+            for(size_t i = PAGE_EXTENT_COUNT; i > 0; i--) extent_recycle(&extent_pool[i - 1]);
+
+            extent_cursor = nullptr;
+            extents_lost = false;
+
+            // runs are separated by used pages, so none of them merge
+            size_t page = page_status.next_false(0);
+            while(page < page_status.size() && !extents_lost)
+            {
+                size_t end = page_status.next_true(page);
+                extent_new(page, end - page);
+
+                page = page_status.next_false(end);
+            }
+        }
+
+        // claims count free pages at page, page - 1 must be in use
+        bool take_pages(u32 page, u32 count)
+        {
+            page_extent* extent = slot_find(extent_starts, page);
+            if(extent != nullptr && extent->count >= count)
+            {
+                extent_take(extent, page, count);
+                page_status.setBits(page, count, true);
+
+                return true;
+            }
+
+            // the index is exact unless pages were lost
+            if(!extents_lost) return false;
+
+            for(u32 i = 0; i < count; i++)
+            {
+                if(page_status.get(page + i)) return false;
+            }
+
+            page_status.setBits(page, count, true);
+            build_extents();
+
+            return true;
+        }
+
         void mem_mark_free(u32 begin, u32 size)
         {
             u32 page_begin = DivRoundUp(begin, PAGE_SIZE);
@@ -89,7 +377,13 @@ namespace cpu
         // then reserve all kernel related pages
         // then reserve all bitmap related pages
         // then reserve first page
-        page_status = std::Bitmap(__page_allocator_start, DivRoundDown(UINT32_MAX, PAGE_SIZE), true);
+        size_t bitcount = DivRoundDown(UINT32_MAX, PAGE_SIZE);
+        if(std::Bitmap::storage_size(bitcount) > (size_t)(__page_allocator_end - __page_allocator_start))
+        {
+            log_error("[memory] page allocator section is too small for the page bitmap\n");
+        }
+
+        page_status = std::Bitmap(__page_allocator_start, bitcount, true);
 
         page_count = DivRoundDown(lastAddress, PAGE_SIZE);
 
@@ -119,6 +413,9 @@ namespace cpu
         // mark stack as reserved
         mem_mark_reserved(0, ptr_cast(&lastAddress) + 4096);
 
+        // index the free runs, everything is allocated through it from here on
+        build_extents();
+
         // copy all contents of kernelInfo
         kernel_info.e820_mmap = alloc_cp((void*)kernel_info.e820_mmap, sizeof(u32) + memoryMap.entryCount * sizeof(e820_MemoryMapEntry));
         kernel_info.kernelMap = alloc_cp((void*)kernel_info.kernelMap, sizeof(u32) + kernelMap.entryCount * sizeof(KernelMapEntry));
@@ -128,16 +425,27 @@ namespace cpu
 
     void* alloc_page()
     {
-        u32 freePage = page_status.find_false();
-
-        // no memory available
-        if(freePage == std::Bitmap::npos)
+        page_extent* extent = extent_cursor;
+        if(extent == nullptr)
         {
-            allocator_status |= ALLOC_NO_FREE_SPACE;
+            if(extent_classes_used == 0 && extents_lost) build_extents();
 
-            return nullptr;
+            // no memory available
+            if(extent_classes_used == 0)
+            {
+                allocator_status |= ALLOC_NO_FREE_SPACE;
+
+                return nullptr;
+            }
+
+            // the smallest extent, large ones are kept for contiguous requests
+            extent = extent_classes[__builtin_ctz(extent_classes_used)];
+            extent_cursor = extent;
         }
 
+        u32 freePage = extent->start;
+        extent_take(extent, freePage, 1);
+
         page_status.set(freePage, true);
 
         return reinterpret_cast<void*>(freePage * PAGE_SIZE);
@@ -166,19 +474,43 @@ namespace cpu
     }
     void *alloc_pages(size_t count)
     {
-        size_t freePage = page_status.find_false_bits(count, true);
+        if(count == 0)
+        {
+            allocator_status |= ALLOC_REQ_IMPOSSIBLE;
+            return nullptr;
+        }
+
+        page_extent* extent = extent_find(count);
+        if(extent == nullptr && extents_lost)
+        {
+            build_extents();
+            extent = extent_find(count);
+        }
 
         // no memory available
-        if(freePage == std::Bitmap::npos)
+        if(extent == nullptr)
         {
+            // pages the index could not hold
+            if(extents_lost)
+            {
+                size_t freePage = page_status.find_false_bits(count);
+                if(freePage != std::Bitmap::npos)
+                {
+                    page_status.setBits(freePage, count, true);
+                    build_extents();
+
+                    return reinterpret_cast<void*>(freePage * PAGE_SIZE);
+                }
+            }
+
             if(page_status.find_false() == std::Bitmap::npos) allocator_status |= ALLOC_NO_FREE_SPACE;
             else allocator_status |= ALLOC_REQ_SIZE_NAVAIL;
 
             return nullptr;
         }
 
-        // release cached value
-        page_status.find_false();
+        u32 freePage = extent->start;
+        extent_take(extent, freePage, count);
 
         page_status.setBits(freePage, count, true);
 
@@ -188,41 +520,29 @@ namespace cpu
     {
         u32 loc = reinterpret_cast<u32>(pointer) / PAGE_SIZE;
 
-        for(size_t i = prev_count; i < req_count; i++)
-        {
-            // if allocated, then this array can't be extended
-            if(page_status.get(i + loc))
-            {
-                void* newLoc = alloc_pages(req_count);
+        // the pages right after are free
+        if(req_count <= prev_count || take_pages(loc + prev_count, req_count - prev_count)) return pointer;
 
-                std::memcpy(pointer, newLoc, prev_count * PAGE_SIZE);
-                free_pages(pointer, prev_count);
-                
-                return newLoc;
-            }
-        }
+        void* newLoc = alloc_pages(req_count);
+        if(newLoc == nullptr) return nullptr;
 
-        // if here then, memory can be extended
-        page_status.setBits(loc, req_count, true);
-        return pointer;
+        std::memcpy(pointer, newLoc, prev_count * PAGE_SIZE);
+        free_pages(pointer, prev_count);
+
+        return newLoc;
     }
 
     void *alloc_extend(void *pointer, size_t prev_count, size_t req_count)
     {
         u32 loc = reinterpret_cast<u32>(pointer) / PAGE_SIZE;
 
-        for(size_t i = prev_count; i < req_count; i++)
+        // if allocated, then this array can't be extended
+        if(req_count > prev_count && !take_pages(loc + prev_count, req_count - prev_count))
         {
-            // if allocated, then this array can't be extended
-            if(page_status.get(i + loc))
-            {
-                allocator_status |= ALLOC_REQ_IMPOSSIBLE;
-                return nullptr; // can't extend, return nullptr
-            }
+            allocator_status |= ALLOC_REQ_IMPOSSIBLE;
+            return nullptr; // can't extend, return nullptr
         }
 
-        // if here then, memory can be extended
-        page_status.setBits(loc, req_count, true);
         return pointer;
     }
 
@@ -240,29 +560,97 @@ namespace cpu
 
     void* alloc_io_pages(size_t align, size_t count)
     {
-        // start seaching before last entry
-        // most likely it is 4G limit
-        for(size_t pageAddr = memoryMap.entries[memoryMap.entryCount - 1].baseAddress - align; pageAddr > 0; pageAddr -= align)
+        // align is in pages
+        if(align == 0) align = 1;
+        if(count == 0) return nullptr;
+
+        u32 page = 0;
+        page_extent* extent = extent_find_aligned(align, count, page);
+        if(extent == nullptr && extents_lost)
+        {
+            build_extents();
+            extent = extent_find_aligned(align, count, page);
+        }
+
+        if(extent == nullptr)
         {
-            bool found = true;
-            for(size_t i = 0; i < count; i++)
+            // did not find the memory with the alignment requirement
+            allocator_status |= ALLOC_REQ_SIZE_NAVAIL;
+            return nullptr;
+        }
+
+        extent_take(extent, page, count);
+        page_status.setBits(page, count, true);
+
+        return reinterpret_cast<void*>(page * PAGE_SIZE);
+    }
+
+    void* alloc_low_pages(size_t count, ptr_t limit)
+    {
+        // the bitmap is searched from the bottom, the extents are not ordered
+        size_t page = count == 0 ? std::Bitmap::npos : page_status.find_false_bits(count);
+
+        if(page == std::Bitmap::npos || (uint64_t)(page + count) * PAGE_SIZE > limit)
+        {
+            allocator_status |= ALLOC_REQ_SIZE_NAVAIL;
+            return nullptr;
+        }
+
+        // a run found in the bitmap starts after a used page
+        take_pages(page, count);
+
+        return reinterpret_cast<void*>(page * PAGE_SIZE);
+    }
+
+    void* reserve_address_space(size_t count)
+    {
+        // start above the last region backed by memory
+        if(address_space_cursor == 0)
+        {
+            uint64_t ramEnd = 0;
+            for(size_t i = 0; i < memoryMap.entryCount; i++)
             {
-                // if it is used up, then skip this alignement
-                if(page_status.get(pageAddr + i))
-                {
-                    found = false;
-                    break;
-                }
+                e820_MemoryMapEntry& entry = memoryMap.entries[i];
+                if(entry.regionType != MMAP_TYPE_FREE && entry.regionType != MMAP_TYPE_ACPI_RECLAIMABLE &&
+                    entry.regionType != MMAP_TYPE_ACPI_NVS) continue;
+
+                if(entry.baseAddress + entry.regionSize > ramEnd) ramEnd = entry.baseAddress + entry.regionSize;
             }
-            if(found)
+
+            address_space_cursor = DivRoundUp(ramEnd, ADDRESS_SPACE_ALIGN) * ADDRESS_SPACE_ALIGN;
+        }
+
+        uint64_t begin = address_space_cursor;
+        uint64_t end = begin + (uint64_t)count * PAGE_SIZE;
+
+        if(end > address_space_limit)
+        {
+            allocator_status |= ALLOC_REQ_SIZE_NAVAIL;
+            return nullptr;
+        }
+
+        // must not hide anything the firmware reported
+        for(size_t i = 0; i < memoryMap.entryCount; i++)
+        {
+            e820_MemoryMapEntry& entry = memoryMap.entries[i];
+
+            if(entry.baseAddress < end && entry.baseAddress + entry.regionSize > begin)
             {
-                page_status.setBits(pageAddr, count, true);
-                return reinterpret_cast<void*>(pageAddr * PAGE_SIZE);
+                allocator_status |= ALLOC_REQ_IMPOSSIBLE;
+                return nullptr;
             }
         }
 
-        // did not find the memory with the alignment requirement
-        return nullptr;
+        address_space_cursor = end;
+
+        return reinterpret_cast<void*>((u32)begin);
+    }
+
+    void limit_address_space(uint64_t limit)
+    {
+        // windows are handed out in whole ADDRESS_SPACE_ALIGN units
+        limit = limit / ADDRESS_SPACE_ALIGN * ADDRESS_SPACE_ALIGN;
+        if(limit < address_space_limit) address_space_limit = limit;
     }
 
     void free_page(void* mem)
@@ -281,8 +669,15 @@ namespace cpu
 
         loc /= PAGE_SIZE;
 
+        if(!page_status.get(loc))
+        {
+            log_warn("Attempting to free a page that is not allocated\n");
+            return;
+        }
+
         // free page
         page_status.set(loc, false);
+        extent_add(loc, 1);
     }
     void free_pages(void* mem, size_t count)
     {
@@ -293,7 +688,7 @@ namespace cpu
         // do not free
         // throw an exception once it is set up
         // also thow an exception if mem is nullptr
-        if(loc & 0xFFF > 0 || mem == nullptr)
+        if((loc & 0xFFF) != 0 || mem == nullptr)
         {
             log_error("Attempting to free a page that is not page-aligned or a nullptr");
             x86_raise(0);
@@ -301,7 +696,15 @@ namespace cpu
 
         loc /= PAGE_SIZE;
 
+        if(count == 0) return;
+        if(!page_status.get(loc) || !page_status.get(loc + count - 1))
+        {
+            log_warn("Attempting to free pages that are not allocated\n");
+            return;
+        }
+
         // free pages
         page_status.setBits(loc, count, false);
+        extent_add(loc, count);
     }
 }
\ No newline at end of file
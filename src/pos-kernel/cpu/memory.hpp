@@ -24,9 +24,18 @@ namespace cpu
     // allocate a new location and copy data there
     void* alloc_cp(const void* data, size_t size);
 
-    // allocate I/O memory pages
+    // allocate count contiguous I/O memory pages, aligned to align pages
     void* alloc_io_pages(size_t align, size_t count);
 
+    // allocate the lowest count contiguous pages, if they end below limit
+    void* alloc_low_pages(size_t count, ptr_t limit);
+
+    // reserve count pages of address space that no RAM or firmware region is identity mapped at,
+    // pages allocated elsewhere can be mapped there contiguously
+    void* reserve_address_space(size_t count);
+    // keep reserve_address_space below limit, e.g. the lowest MMIO address
+    void limit_address_space(uint64_t limit);
+
     void free_page(void* mem);
     void free_pages(void* mem, size_t count);
 
@@ -1,68 +1,148 @@
 #include "paging.hpp"
 
 #include <arch/x86.h>
+#include <io/io.h>
+#include <std/std.hpp>
+
+#include "memory.hpp"
+#include "exceptions.hpp"
 
 namespace cpu
 {
     PagingInfo g_pagingInfo;
 
+    // CR4.PSE was set by the bootloader
+    static bool large_pages = false;
+    // tables are taken from the page allocator instead of the table array
+    static bool tables_released = false;
+
     void initializePaging(const PagingInfo& pagingInfo)
     {
         g_pagingInfo = pagingInfo;
+        large_pages = (x86_getCR4() & CR4_PSE) != 0;
     }
 
-    // maps page at virtual address to page at physical address
-    void mapVirtualAddress(u32 vaddress, u32 paddress, u32 flags)
+    static u32* get_array_table(u32 indexPD)
     {
-        // align adresses to 4KiB
-        vaddress &= 0xFFFFF000;
-        paddress &= 0xFFFFF000;
+        return (u32*)((char*)g_pagingInfo.pageTableArray + (PAGE_SIZE * indexPD));
+    }
+
+    void releasePageTables()
+    {
+        if(tables_released) return;
+        tables_released = true;
+
+        size_t released = 0;
+        for(u32 indexPD = 0; indexPD < PAGE_SIZE / sizeof(u32); indexPD++)
+        {
+            if((g_pagingInfo.pageDirectory[indexPD] & PAGE_LARGE) == 0) continue;
+
+            free_page(get_array_table(indexPD));
+            released++;
+        }
+
+        log_info("[paging] released %u unused page tables\n", released);
+    }
+
+    // returns the table of a directory entry, a large page is split into a table mapping the same pages
+    static u32* get_page_table(u32 indexPD)
+    {
+        u32 entry = g_pagingInfo.pageDirectory[indexPD];
+        if((entry & PAGE_PRESENT) && (entry & PAGE_LARGE) == 0) return (u32*)(entry & 0xFFFFF000);
+
+        u32* pageTable = tables_released ? (u32*)alloc_page() : get_array_table(indexPD);
+        if(pageTable == nullptr)
+        {
+            log_error("[paging] no memory left for a page table\n");
+            x86_raise(NO_HEAP_MEMORY);
+        }
+
+        if(entry & PAGE_PRESENT)
+        {
+            // the PAT bit of a large page moves from bit 12 to bit 7, where the size bit was
+            u32 flags = (entry & 0xFFF & ~PAGE_LARGE) | ((entry & 0x1000) ? 0x80 : 0);
+            for(u32 indexPT = 0; indexPT < LARGE_PAGE_PAGES; indexPT++)
+            {
+                pageTable[indexPT] = ((entry & 0xFFC00000) + indexPT * PAGE_SIZE) | flags;
+            }
+
+            entry &= 0xFFF & ~PAGE_LARGE;
+        }
+        else
+        {
+            std::memset(pageTable, 0, PAGE_SIZE);
+            entry = 0;
+        }
+
+        // same translations as before, nothing to invalidate
+        g_pagingInfo.pageDirectory[indexPD] = (u32)pageTable | entry;
+
+        return pageTable;
+    }
 
+    // whether the run at vaddress can be mapped as one large page
+    static bool fits_large_page(u32 vaddress, u32 paddress, u32 pages)
+    {
+        if(!large_pages || pages < LARGE_PAGE_PAGES || ((vaddress | paddress) & (LARGE_PAGE_SIZE - 1)) != 0) return false;
+
+        // a split page keeps its table
+        u32 entry = g_pagingInfo.pageDirectory[vaddress >> 22];
+        return (entry & PAGE_PRESENT) == 0 || (entry & PAGE_LARGE) != 0;
+    }
+
+    // maps a page without invalidating it
+    static void write_mapping(u32 vaddress, u32 paddress, u32 flags)
+    {
         u32 indexPD = (vaddress) >> 22;
         u32 indexPT = (vaddress >> 12) & 0x03FF;
 
-        u32* pageTable = (u32*)((char*)g_pagingInfo.pageTableArray + (PAGE_SIZE * indexPD));
+        u32* pageTable = get_page_table(indexPD);
 
-        // set PD entry to PT physical address
+        // the PD entry only changes if it lacks the access this page needs
         // PT physical address must be 4KiB aligned
-        // mark as present
-        g_pagingInfo.pageDirectory[indexPD] = ((u32)pageTable) | (flags & 0xFFF) | 0x01;
+        u32 entry = g_pagingInfo.pageDirectory[indexPD];
+        u32 access = (flags & (PAGE_RW | PAGE_USER)) | PAGE_PRESENT;
+
+        if((entry & access) != access) g_pagingInfo.pageDirectory[indexPD] = entry | access;
 
         // set PT entry to page address
         pageTable[indexPT] = paddress | (flags & 0xFFF) | 0x01;
+    }
+
+    // sets the flags of a page without invalidating it
+    static void write_flags(u32 vaddress, u32 flags)
+    {
+        u32 indexPD = (vaddress) >> 22;
+        u32 indexPT = (vaddress >> 12) & 0x03FF;
+
+        u32* pageTable = get_page_table(indexPD);
+
+        // get address stored in page table
+        u32 pageTableEntryAddr = pageTable[indexPT] & ~(0xFFF);
 
-        // flush TLB to load the new mapping
-        x86_flushTLB();
+        // set PT Entry flags
+        pageTable[indexPT] = pageTableEntryAddr | (flags & 0xFFF);
     }
 
-    // maps n pages at vaddress to n pages at paddress
-    void mapVirtualPages(u32 vaddress, u32 paddress, u32 pages, u32 flags)
+    // maps page at virtual address to page at physical address
+    void mapVirtualAddress(u32 vaddress, u32 paddress, u32 flags)
     {
         // align adresses to 4KiB
         vaddress &= 0xFFFFF000;
         paddress &= 0xFFFFF000;
 
-        for(u32 page_index = 0; page_index < pages; page_index += 1)
-        {
-            u32 pageVirtualAddress = vaddress + page_index * PAGE_SIZE;
-            u32 pagePhysicalAddress = paddress + page_index * PAGE_SIZE;
-
-            u32 indexPD = (pageVirtualAddress) >> 22;
-            u32 indexPT = (pageVirtualAddress >> 12) & 0x03FF;
-
-            u32* pageTable = (u32*)((char*)g_pagingInfo.pageTableArray + (PAGE_SIZE * indexPD));
+        write_mapping(vaddress, paddress, flags);
 
-            // set PD entry to PT physical address
-            // PT physical address must be 4KiB aligned
-            // mark as present
-            g_pagingInfo.pageDirectory[indexPD] = ((u32)pageTable) | (flags & 0xFFF) | 0x01;
-
-            // set PT entry to page address
-            pageTable[indexPT] = pagePhysicalAddress | (flags & 0xFFF) | 0x01;
-        }
+        // drop the old mapping of this page only
+        x86_invlpg(vaddress);
+    }
 
-        // flush TLB to load the new mapping
-        x86_flushTLB();
+    // maps n pages at vaddress to n pages at paddress
+    void mapVirtualPages(u32 vaddress, u32 paddress, u32 pages, u32 flags)
+    {
+        page_batch batch;
+        batch.map_pages(vaddress, paddress, pages, flags);
+        batch.commit();
     }
 
     // convert a pointer to it's physical location
@@ -76,7 +156,10 @@ namespace cpu
         ptr_t indexPD = (vaddrPage) >> 22;
         ptr_t indexPT = (vaddrPage >> 12) & 0x03FF;
 
-        ptr_t* pageTable = (ptr_t*)((char*)g_pagingInfo.pageTableArray + (PAGE_SIZE * indexPD));
+        ptr_t entry = g_pagingInfo.pageDirectory[indexPD];
+        if(entry & PAGE_LARGE) return (entry & 0xFFC00000) + (vaddr & (LARGE_PAGE_SIZE - 1));
+
+        ptr_t* pageTable = (ptr_t*)(entry & 0xFFFFF000);
 
         // get PT entry
         ptr_t paddrPage = pageTable[indexPT] & 0xFFFFF000;
@@ -90,19 +173,10 @@ namespace cpu
         // align adresses to 4KiB
         vaddress &= 0xFFFFF000;
 
-        u32 indexPD = (vaddress) >> 22;
-        u32 indexPT = (vaddress >> 12) & 0x03FF;
+        write_flags(vaddress, flags);
 
-        u32* pageTable = (u32*)((char*)g_pagingInfo.pageTableArray + (PAGE_SIZE * indexPD));
-
-        // get address stored in page table
-        u32 pageTableEntryAddr = pageTable[indexPT] & ~(0xFFF);
-
-        // set PT Entry flags
-        pageTable[indexPT] = pageTableEntryAddr | (flags & 0xFFF);
-
-        // flush TLB to load the new mapping
-        x86_flushTLB();
+        // drop the old flags of this page only
+        x86_invlpg(vaddress);
     }
 
     // gets flags of page
@@ -114,34 +188,138 @@ namespace cpu
         u32 indexPD = (vaddress) >> 22;
         u32 indexPT = (vaddress >> 12) & 0x03FF;
 
-        u32* pageTable = (u32*)((char*)g_pagingInfo.pageTableArray + (PAGE_SIZE * indexPD));
+        u32 entry = g_pagingInfo.pageDirectory[indexPD];
+        if(entry & PAGE_LARGE) return entry & 0xFFF & ~PAGE_LARGE;
+
+        u32* pageTable = (u32*)(entry & 0xFFFFF000);
 
         return pageTable[indexPT] & (0xFFF);
     }
 
     // sets flags of pages
     void setFlagsPages(u32 vaddress, u32 flags, size_t count)
+    {
+        page_batch batch;
+        batch.set_flags_pages(vaddress, flags, count);
+        batch.commit();
+    }
+
+    void page_batch::touch(u32 vaddress, u32 pages)
+    {
+        if(pages == 0 || flush_all) return;
+
+        page_count += pages;
+        if(page_count > PAGE_BATCH_INVLPG)
+        {
+            flush_all = true;
+            return;
+        }
+
+        // extend the last run if this continues it
+        if(range_count != 0)
+        {
+            range& last = ranges[range_count - 1];
+            if(last.vaddress + last.pages * PAGE_SIZE == vaddress)
+            {
+                last.pages += pages;
+                return;
+            }
+        }
+
+        if(range_count == PAGE_BATCH_RANGES)
+        {
+            flush_all = true;
+            return;
+        }
+
+        ranges[range_count].vaddress = vaddress;
+        ranges[range_count].pages = pages;
+        range_count++;
+    }
+
+    void page_batch::map(u32 vaddress, u32 paddress, u32 flags)
+    {
+        map_pages(vaddress, paddress, 1, flags);
+    }
+    void page_batch::map_pages(u32 vaddress, u32 paddress, u32 pages, u32 flags)
+    {
+        // align adresses to 4KiB
+        vaddress &= 0xFFFFF000;
+        paddress &= 0xFFFFF000;
+
+        for(u32 page_index = 0; page_index < pages;)
+        {
+            u32 pageVirtualAddress = vaddress + page_index * PAGE_SIZE;
+            u32 pagePhysicalAddress = paddress + page_index * PAGE_SIZE;
+
+            if(fits_large_page(pageVirtualAddress, pagePhysicalAddress, pages - page_index))
+            {
+                u32& entry = g_pagingInfo.pageDirectory[pageVirtualAddress >> 22];
+
+                // a single TLB entry held the old large page, if any
+                touch(pageVirtualAddress, 1);
+                entry = pagePhysicalAddress | (flags & 0xFFF) | PAGE_LARGE | 0x01;
+
+                page_index += LARGE_PAGE_PAGES;
+                continue;
+            }
+
+            write_mapping(pageVirtualAddress, pagePhysicalAddress, flags);
+            touch(pageVirtualAddress, 1);
+
+            page_index++;
+        }
+    }
+
+    void page_batch::set_flags(u32 vaddress, u32 flags)
+    {
+        vaddress &= 0xFFFFF000;
+
+        write_flags(vaddress, flags);
+        touch(vaddress, 1);
+    }
+    void page_batch::set_flags_pages(u32 vaddress, u32 flags, size_t count)
     {
         // align adresses to 4KiB
         vaddress &= 0xFFFFF000;
 
-        for(u32 page_index = 0; page_index < count; page_index += 1)
+        for(u32 page_index = 0; page_index < count;)
         {
             u32 pageVirtualAddress = vaddress + page_index * PAGE_SIZE;
+            u32& entry = g_pagingInfo.pageDirectory[pageVirtualAddress >> 22];
 
-            u32 indexPD = (pageVirtualAddress) >> 22;
-            u32 indexPT = (pageVirtualAddress >> 12) & 0x03FF;
+            // a large page covered as a whole keeps its size
+            if((entry & PAGE_LARGE) && (pageVirtualAddress & (LARGE_PAGE_SIZE - 1)) == 0 && count - page_index >= LARGE_PAGE_PAGES)
+            {
+                entry = (entry & 0xFFFFF000) | (flags & 0xFFF) | PAGE_LARGE | 0x01;
+                touch(pageVirtualAddress, 1);
 
-            u32* pageTable = (u32*)((char*)g_pagingInfo.pageTableArray + (PAGE_SIZE * indexPD));
+                page_index += LARGE_PAGE_PAGES;
+                continue;
+            }
 
-            // get address stored in page table
-            u32 pageTableEntryAddr = pageTable[indexPT] & ~(0xFFF);
+            // pages set together are always present
+            write_flags(pageVirtualAddress, flags | 0x01);
+            touch(pageVirtualAddress, 1);
 
-            // set PT flags
-            pageTable[indexPT] = pageTableEntryAddr | (flags & 0xFFF) | 0x01;
+            page_index++;
+        }
+    }
+
+    void page_batch::commit()
+    {
+        // flush TLB to load the new mappings
+        if(flush_all) x86_flushTLB();
+        else
+        {
+            for(size_t i = 0; i < range_count; i++)
+            {
+                for(u32 page = 0; page < ranges[i].pages; page++) x86_invlpg(ranges[i].vaddress + page * PAGE_SIZE);
+            }
         }
 
-        // flush TLB to load the new mapping
-        x86_flushTLB();
+        range_count = 0;
+        page_count = 0;
+        flush_all = false;
     }
-}
\ No newline at end of file
+}
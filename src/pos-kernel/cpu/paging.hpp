@@ -3,6 +3,16 @@
 #include <includes.h>
 #include "boot.hpp"
 
+// pages a batch invalidates one by one, past that reloading CR3 is cheaper
+#define PAGE_BATCH_INVLPG 64
+// separate runs of pages a batch remembers
+#define PAGE_BATCH_RANGES 8
+
+// pages mapped by one directory entry with PSE
+#define LARGE_PAGE_SIZE 0x400000
+#define LARGE_PAGE_PAGES (LARGE_PAGE_SIZE / PAGE_SIZE)
+#define CR4_PSE 0x10
+
 namespace cpu
 {
     enum PageFlags : u32
@@ -13,9 +23,15 @@ namespace cpu
 
         PAGE_DISABLE_CACHING = 0x10,
         PAGE_WRITETHROUGH = 0x08,
+
+        // directory entries only, the entry maps a 4MiB page
+        PAGE_LARGE = 0x80,
     };
 
     void initializePaging(const PagingInfo& pagingInfo);
+    // gives the table array slots of directory entries still mapping large pages to the page allocator,
+    // tables for later splits come from it too
+    void releasePageTables();
 
     // maps page at virtual address to page at physical address
     void mapVirtualAddress(u32 vaddress, u32 paddress, u32 flags);
@@ -33,4 +49,37 @@ namespace cpu
 
     // sets flags of multiple pages
     void setFlagsPages(u32 vaddress, u32 flags, size_t count);
+
+    // page table edits that are made right away but only invalidated by commit,
+    // with invlpg for a few pages and a single TLB flush for many
+    // aligned 4MiB runs are kept in large pages, a large page partly edited is split first
+    class page_batch
+    {
+        private:
+            struct range
+            {
+                u32 vaddress;
+                u32 pages;
+            };
+
+            range ranges[PAGE_BATCH_RANGES];
+            size_t range_count;
+            size_t page_count;
+            bool flush_all;
+
+            void touch(u32 vaddress, u32 pages);
+
+        public:
+            page_batch() : range_count(0), page_count(0), flush_all(false) { ; }
+            ~page_batch() { commit(); }
+
+            void map(u32 vaddress, u32 paddress, u32 flags);
+            void map_pages(u32 vaddress, u32 paddress, u32 pages, u32 flags);
+
+            void set_flags(u32 vaddress, u32 flags);
+            void set_flags_pages(u32 vaddress, u32 flags, size_t count);
+
+            // invalidates every page edited so far
+            void commit();
+    };
 }
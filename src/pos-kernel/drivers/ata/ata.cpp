@@ -0,0 +1,583 @@
+#include "ata.hpp"
+
+#include <io/io.h>
+#include <hw/pit/PIT.h>
+#include <arch/x86.h>
+#include <arch/IRQ/IRQ.h>
+#include <arch/IRQ/PIC.h>
+#include <cpu/paging.hpp>
+#include <cpu/memory.hpp>
+#include <cpu/dma.hpp>
+#include <cpu/exceptions.hpp>
+
+#define ATA_PCI_BAR0      0x10
+#define ATA_PCI_BAR4      0x20
+#define ATA_PCI_IRQ_LINE  0x3C
+
+// programming interface
+#define ATA_PROGIF_PRIMARY_NATIVE   (1 << 0)
+#define ATA_PROGIF_SECONDARY_NATIVE (1 << 2)
+#define ATA_PROGIF_BUS_MASTER       (1 << 7)
+
+// legacy compatibility mode resources
+#define ATA_PRIMARY_IO     0x1F0
+#define ATA_PRIMARY_CTRL   0x3F6
+#define ATA_PRIMARY_IRQ    14
+#define ATA_SECONDARY_IO   0x170
+#define ATA_SECONDARY_CTRL 0x376
+#define ATA_SECONDARY_IRQ  15
+
+// task file registers
+#define ATA_REG_DATA      0x0
+#define ATA_REG_ERROR     0x1
+#define ATA_REG_COUNT     0x2
+#define ATA_REG_LBA0      0x3
+#define ATA_REG_LBA1      0x4
+#define ATA_REG_LBA2      0x5
+#define ATA_REG_DRIVE     0x6
+#define ATA_REG_STATUS    0x7
+#define ATA_REG_COMMAND   0x7
+
+#define ATA_STS_ERROR     (1 << 0)
+#define ATA_STS_DRQ       (1 << 3)
+#define ATA_STS_FAULT     (1 << 5)
+#define ATA_STS_BUSY      (1 << 7)
+
+#define ATA_DRIVE_LBA     (1 << 6)
+#define ATA_DRIVE_SLAVE   (1 << 4)
+// obsolete bits, always set
+#define ATA_DRIVE_ALWAYS  0xA0
+
+// device control
+#define ATA_CTRL_NIEN     (1 << 1)
+
+#define ATA_CMD_IDENTIFY      0xEC
+#define ATA_CMD_READ_DMA      0xC8
+#define ATA_CMD_READ_DMA_EXT  0x25
+#define ATA_CMD_WRITE_DMA     0xCA
+#define ATA_CMD_WRITE_DMA_EXT 0x35
+
+// bus master registers
+#define ATA_BM_COMMAND    0x0
+#define ATA_BM_STATUS     0x2
+#define ATA_BM_PRDT       0x4
+
+#define ATA_BM_CMD_START  (1 << 0)
+// the controller writes to memory
+#define ATA_BM_CMD_READ   (1 << 3)
+
+#define ATA_BM_STS_ACTIVE (1 << 0)
+#define ATA_BM_STS_ERROR  (1 << 1)
+#define ATA_BM_STS_IRQ    (1 << 2)
+
+#define ATA_PRD_EOT       0x8000
+#define ATA_PRD_BOUNDARY  0x10000
+#define ATA_PRD_COUNT     (PAGE_SIZE / sizeof(prd_entry))
+
+// 128KiB per command, also the most a 28-bit command can move
+#define ATA_MAX_SECTORS   256
+#define ATA_LBA28_LIMIT   0x10000000
+
+#define ATA_TRANSFER_TIMEOUT 1000
+#define ATA_MAX_CHANNELS     8
+
+namespace drivers::ata
+{
+    // channels that have an IRQ handler registered
+    static ata_channel* irqChannels[ATA_MAX_CHANNELS];
+    static size_t irqChannelCount = 0;
+
+    void _no_stack_trace ata_irq_handler(Registers* registers)
+    {
+        // both channels might share a line in native mode
+        for(size_t i = 0; i < irqChannelCount; i++)
+        {
+            irqChannels[i]->handleIRQ();
+        }
+    }
+
+    bool ata_channel::init()
+    {
+        // the table itself must not cross a 64KiB boundary either
+        cpu::dma::dma_buffer table = cpu::dma::alloc(ATA_PRD_COUNT * sizeof(prd_entry), sizeof(u32), ATA_PRD_BOUNDARY);
+        if(table.virt == nullptr) return false;
+
+        prdt = (prd_entry*)table.virt;
+        prdtPhys = table.phys;
+        complete = false;
+
+        // stop any DMA the firmware left running, clear the status
+        x86_outb(bmBase + ATA_BM_COMMAND, 0);
+        x86_outb(bmBase + ATA_BM_STATUS, x86_inb(bmBase + ATA_BM_STATUS));
+
+        // route completion interrupts to our handler
+        if(irqLine < 16 && irqChannelCount < ATA_MAX_CHANNELS)
+        {
+            // native mode channels may share a line, it only needs the handler once
+            bool registered = false;
+            for(size_t i = 0; i < irqChannelCount; i++)
+            {
+                if(irqChannels[i]->irqLine == irqLine) registered = true;
+            }
+
+            irqChannels[irqChannelCount] = this;
+            irqChannelCount++;
+
+            if(!registered)
+            {
+                IRQ_registerHandler(irqLine, ata_irq_handler);
+                PIC_irq_unmask(irqLine);
+            }
+
+            x86_outb(ctrlBase, 0);
+        }
+        else
+        {
+            log_warn("[ATA] No usable IRQ line (%u), falling back to polling\n", irqLine);
+            irqLine = 0xFF;
+
+            x86_outb(ctrlBase, ATA_CTRL_NIEN);
+        }
+
+        return true;
+    }
+
+    bool ata_channel::handleIRQ()
+    {
+        u8 bmStatus = x86_inb(bmBase + ATA_BM_STATUS);
+
+        // not raised by this channel
+        if((bmStatus & ATA_BM_STS_IRQ) == 0) return false;
+
+        // reading the status register acknowledges the device
+        status = x86_inb(ioBase + ATA_REG_STATUS);
+
+        // acknowledge the interrupt and error bits (R/WC)
+        x86_outb(bmBase + ATA_BM_STATUS, bmStatus);
+
+        this->bmStatus = bmStatus;
+        complete = true;
+
+        return true;
+    }
+
+    void ata_channel::delay()
+    {
+        for(size_t i = 0; i < 4; i++) x86_inb(ctrlBase);
+    }
+    bool ata_channel::waitNotBusy(u32 timeout)
+    {
+        PIT_setTimeout(timeout);
+        while((x86_inb(ctrlBase) & ATA_STS_BUSY) && !PIT_hasTimedOut());
+        PIT_cancelTimeout();
+
+        return (x86_inb(ctrlBase) & ATA_STS_BUSY) == 0;
+    }
+
+    bool ata_channel::mapBuffer(void* buffer, size_t size)
+    {
+        // the controller moves words
+        if(ptr_cast(buffer) & 0x1) return false;
+
+        size_t count = 0;
+        ptr_t address = ptr_cast(buffer);
+
+        for(size_t offset = 0; offset < size;)
+        {
+            ptr_t vaddr = address + offset;
+            ptr_t paddr = cpu::getPhysicalLocation(reinterpret_cast<void*>(vaddr & 0xFFFFF000)) + (vaddr & 0xFFF);
+
+            // up to the end of the page, or the transfer
+            u32 length = PAGE_SIZE - (vaddr & 0xFFF);
+            if(length > size - offset) length = size - offset;
+
+            // grow the last region if the page continues it
+            prd_entry* last = count > 0 ? &prdt[count - 1] : nullptr;
+            u32 lastSize = (last != nullptr && last->size == 0) ? ATA_PRD_BOUNDARY : (last != nullptr ? last->size : 0);
+
+            if(last != nullptr && last->address + lastSize == paddr &&
+                (last->address & ~(ATA_PRD_BOUNDARY - 1)) == ((paddr + length - 1) & ~(ATA_PRD_BOUNDARY - 1)))
+            {
+                last->size = (u16)(lastSize + length);
+            }
+            else
+            {
+                if(count >= ATA_PRD_COUNT) return false;
+
+                prdt[count].address = paddr;
+                prdt[count].size = (u16)length;
+                prdt[count].flags = 0;
+                count++;
+            }
+
+            offset += length;
+        }
+
+        if(count == 0) return false;
+
+        prdt[count - 1].flags = ATA_PRD_EOT;
+
+        return true;
+    }
+
+    bool ata_drive::identify()
+    {
+        ata_channel& ch = *channel;
+
+        x86_outb(ch.ioBase + ATA_REG_DRIVE, ATA_DRIVE_ALWAYS | (slave ? ATA_DRIVE_SLAVE : 0));
+        ch.delay();
+
+        x86_outb(ch.ioBase + ATA_REG_COUNT, 0);
+        x86_outb(ch.ioBase + ATA_REG_LBA0, 0);
+        x86_outb(ch.ioBase + ATA_REG_LBA1, 0);
+        x86_outb(ch.ioBase + ATA_REG_LBA2, 0);
+
+        x86_outb(ch.ioBase + ATA_REG_COMMAND, ATA_CMD_IDENTIFY);
+        ch.delay();
+
+        // no drive, or a floating bus
+        u8 status = x86_inb(ch.ioBase + ATA_REG_STATUS);
+        if(status == 0 || status == 0xFF) return false;
+
+        if(!ch.waitNotBusy(ATA_TRANSFER_TIMEOUT)) return false;
+
+        // ATAPI and SATA devices abort IDENTIFY with a signature
+        if(x86_inb(ch.ioBase + ATA_REG_LBA1) != 0 || x86_inb(ch.ioBase + ATA_REG_LBA2) != 0) return false;
+
+        PIT_setTimeout(ATA_TRANSFER_TIMEOUT);
+        while(((status = x86_inb(ch.ioBase + ATA_REG_STATUS)) & (ATA_STS_DRQ | ATA_STS_ERROR)) == 0 && !PIT_hasTimedOut());
+        PIT_cancelTimeout();
+
+        if((status & ATA_STS_DRQ) == 0) return false;
+
+        u16 data[256];
+        for(size_t i = 0; i < 256; i++) data[i] = x86_inw(ch.ioBase + ATA_REG_DATA);
+
+        // bus master DMA
+        if((data[49] & (1 << 8)) == 0)
+        {
+            log_warn("[ATA] Drive does not support DMA\n");
+            return false;
+        }
+
+        lba48 = data[83] & (1 << 10);
+        if(lba48) sectorCount = (u64)data[100] | ((u64)data[101] << 16) | ((u64)data[102] << 32) | ((u64)data[103] << 48);
+        else sectorCount = (u32)data[60] | ((u32)data[61] << 16);
+
+        // the model string is stored in big endian words
+        for(size_t i = 0; i < 20; i++)
+        {
+            model[i * 2] = data[27 + i] >> 8;
+            model[i * 2 + 1] = data[27 + i] & 0xFF;
+        }
+        model[40] = 0;
+
+        for(size_t i = 40; i > 0 && (model[i - 1] == ' ' || model[i - 1] == 0); i--) model[i - 1] = 0;
+
+        return sectorCount != 0;
+    }
+
+    bool ata_drive::inRange(u64 lba, u64 count) const
+    {
+        return lba < sectorCount && count <= sectorCount - lba;
+    }
+
+    bool ata_drive::transfer(u64 lba, u32 count, void* buffer, bool write)
+    {
+        ata_channel& ch = *channel;
+
+        if(count == 0 || count > ATA_MAX_SECTORS) return false;
+        if(!inRange(lba, count)) return false;
+        if(!lba48 && lba + count > ATA_LBA28_LIMIT) return false;
+
+        if(!ch.mapBuffer(buffer, count * ATA_SECTOR_SIZE))
+        {
+            log_warn("[ATA] Buffer can't be used for DMA\n");
+            return false;
+        }
+
+        if(!ch.waitNotBusy(ATA_TRANSFER_TIMEOUT)) return false;
+
+        // setup the bus master
+        x86_outl(ch.bmBase + ATA_BM_PRDT, ch.prdtPhys);
+        x86_outb(ch.bmBase + ATA_BM_COMMAND, write ? 0 : ATA_BM_CMD_READ);
+        x86_outb(ch.bmBase + ATA_BM_STATUS, ATA_BM_STS_IRQ | ATA_BM_STS_ERROR);
+
+        ch.complete = false;
+
+        if(lba48)
+        {
+            x86_outb(ch.ioBase + ATA_REG_DRIVE, ATA_DRIVE_ALWAYS | ATA_DRIVE_LBA | (slave ? ATA_DRIVE_SLAVE : 0));
+            ch.delay();
+
+            // high bytes first, a count of 0 means 65536
+            x86_outb(ch.ioBase + ATA_REG_COUNT, (count >> 8) & 0xFF);
+            x86_outb(ch.ioBase + ATA_REG_LBA0, (lba >> 24) & 0xFF);
+            x86_outb(ch.ioBase + ATA_REG_LBA1, (lba >> 32) & 0xFF);
+            x86_outb(ch.ioBase + ATA_REG_LBA2, (lba >> 40) & 0xFF);
+
+            x86_outb(ch.ioBase + ATA_REG_COUNT, count & 0xFF);
+            x86_outb(ch.ioBase + ATA_REG_LBA0, lba & 0xFF);
+            x86_outb(ch.ioBase + ATA_REG_LBA1, (lba >> 8) & 0xFF);
+            x86_outb(ch.ioBase + ATA_REG_LBA2, (lba >> 16) & 0xFF);
+
+            x86_outb(ch.ioBase + ATA_REG_COMMAND, write ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_READ_DMA_EXT);
+        }
+        else
+        {
+            x86_outb(ch.ioBase + ATA_REG_DRIVE, ATA_DRIVE_ALWAYS | ATA_DRIVE_LBA | (slave ? ATA_DRIVE_SLAVE : 0) | ((lba >> 24) & 0xF));
+            ch.delay();
+
+            // a count of 0 means 256
+            x86_outb(ch.ioBase + ATA_REG_COUNT, count & 0xFF);
+            x86_outb(ch.ioBase + ATA_REG_LBA0, lba & 0xFF);
+            x86_outb(ch.ioBase + ATA_REG_LBA1, (lba >> 8) & 0xFF);
+            x86_outb(ch.ioBase + ATA_REG_LBA2, (lba >> 16) & 0xFF);
+
+            x86_outb(ch.ioBase + ATA_REG_COMMAND, write ? ATA_CMD_WRITE_DMA : ATA_CMD_READ_DMA);
+        }
+
+        // start the DMA engine
+        x86_outb(ch.bmBase + ATA_BM_COMMAND, (write ? 0 : ATA_BM_CMD_READ) | ATA_BM_CMD_START);
+
+        PIT_setTimeout(ATA_TRANSFER_TIMEOUT);
+
+        // sleep until the drive interrupts us or the command times out
+        while(!ch.complete && !PIT_hasTimedOut())
+        {
+            // without an IRQ line the status has to be polled
+            if(ch.irqLine >= 16) ch.handleIRQ();
+            else cpu::halt();
+        }
+
+        PIT_cancelTimeout();
+
+        // stop the DMA engine
+        x86_outb(ch.bmBase + ATA_BM_COMMAND, write ? 0 : ATA_BM_CMD_READ);
+
+        if(!ch.complete)
+        {
+            log_warn("[ATA] Command timed out, lba %u count %u\n", (u32)lba, count);
+            return false;
+        }
+
+        if((ch.bmStatus & ATA_BM_STS_ERROR) || (ch.status & (ATA_STS_ERROR | ATA_STS_FAULT)))
+        {
+            log_warn("[ATA] Command failed, status %x error %x bus master %x\n", ch.status, x86_inb(ch.ioBase + ATA_REG_ERROR), ch.bmStatus);
+            return false;
+        }
+
+        return true;
+    }
+
+    bool ata_drive::read_sectors(u64 lba, size_t count, void* buffer)
+    {
+        // nothing is sent to the drive for requests past its end
+        if(!inRange(lba, count))
+        {
+            log_warn("[ATA] Read of %u sectors at %u is past the end of the drive\n", (u32)count, (u32)lba);
+            return false;
+        }
+
+        u8* dst = (u8*)buffer;
+
+        while(count > 0)
+        {
+            u32 chunk = count < ATA_MAX_SECTORS ? count : ATA_MAX_SECTORS;
+
+            if(!transfer(lba, chunk, dst, false)) return false;
+
+            lba += chunk;
+            count -= chunk;
+            dst += chunk * ATA_SECTOR_SIZE;
+        }
+
+        return true;
+    }
+    bool ata_drive::write_sectors(u64 lba, size_t count, const void* buffer)
+    {
+        // nothing is sent to the drive for requests past its end
+        if(!inRange(lba, count))
+        {
+            log_warn("[ATA] Write of %u sectors at %u is past the end of the drive\n", (u32)count, (u32)lba);
+            return false;
+        }
+
+        u8* src = (u8*)buffer;
+
+        while(count > 0)
+        {
+            u32 chunk = count < ATA_MAX_SECTORS ? count : ATA_MAX_SECTORS;
+
+            if(!transfer(lba, chunk, src, true)) return false;
+
+            lba += chunk;
+            count -= chunk;
+            src += chunk * ATA_SECTOR_SIZE;
+        }
+
+        return true;
+    }
+
+    struct ata_kdriver
+    {
+        std::vector<ata_channel*> channels;
+        std::vector<ata_drive*> drives;
+    };
+
+    const char* ata_kdriver_error_desc(u32 error)
+    {
+        const char* error_array[] = {
+            "No Failiure",
+            "Event parsing failed[this driver does not handle the given event]",
+            "Critical Failiure",
+            "Failed to initialize IDE controller detected on pci bus"
+        };
+
+        if(error >= sizeof(error_array)/sizeof(char*)) return nullptr;
+
+        return error_array[error];
+    }
+
+    i32 ata_node_read(vfs::node_t* node, size_t offset, void* buffer, size_t len)
+    {
+        ata_drive* drive = reinterpret_cast<ata_drive*>(node->data);
+
+        if(offset % ATA_SECTOR_SIZE != 0 || len % ATA_SECTOR_SIZE != 0)
+        {
+            log_warn("[ATA] unaligned read of %u bytes at %u\n", len, offset);
+            return EINVARG;
+        }
+
+        if(!drive->read_sectors(offset / ATA_SECTOR_SIZE, len / ATA_SECTOR_SIZE, buffer)) return EINVOP;
+
+        return OP_SUCCESS;
+    }
+    i32 ata_node_write(vfs::node_t* node, size_t offset, const void* buffer, size_t len)
+    {
+        ata_drive* drive = reinterpret_cast<ata_drive*>(node->data);
+
+        if(offset % ATA_SECTOR_SIZE != 0 || len % ATA_SECTOR_SIZE != 0)
+        {
+            log_warn("[ATA] unaligned write of %u bytes at %u\n", len, offset);
+            return EINVARG;
+        }
+
+        if(!drive->write_sectors(offset / ATA_SECTOR_SIZE, len / ATA_SECTOR_SIZE, buffer)) return EINVOP;
+
+        return OP_SUCCESS;
+    }
+
+    u32 ata_kdriver_init(kernel_driver* driver)
+    {
+        driver->data = new ata_kdriver();
+
+        return DRIVER_SUCCESS;
+    }
+    u32 ata_kdriver_process_event(kernel_driver* driver, vfs::event_t event)
+    {
+        if(event.flags != vfs::EVENT_DEVICE_ADD) return DRIVER_PARSE_FAIL;
+        if(event.trigger_node == nullptr) return DRIVER_PARSE_FAIL;
+
+        vfs::node_t* dnode = event.trigger_node;
+        ata_kdriver& self = *reinterpret_cast<ata_kdriver*>(driver->data);
+
+        bus::pci::device* pci_device = reinterpret_cast<bus::pci::device*>(dnode->data);
+
+        // check if this is a bus mastering IDE controller
+        if(pci_device->classCode != 0x01 || pci_device->subClass != 0x01) return DRIVER_PARSE_FAIL;
+        if((pci_device->progIF & ATA_PROGIF_BUS_MASTER) == 0) return DRIVER_PARSE_FAIL;
+
+        u32 bar4 = pci_device->config_read<u32>(ATA_PCI_BAR4);
+        if((bar4 & 0x1) == 0) return 0x3;
+
+        // enable IO decoding and bus mastering
+        pci_device->config_write<u16>(0x4, pci_device->config_read<u16>(0x4) | 0b101);
+
+        u16 bmBase = bar4 & 0xFFFC;
+        u8 nativeIRQ = pci_device->config_read<u8>(ATA_PCI_IRQ_LINE);
+
+        for(u8 i = 0; i < 2; i++)
+        {
+            ata_channel* channel = new ata_channel();
+            channel->bmBase = bmBase + i * 8;
+
+            u8 nativeBit = i == 0 ? ATA_PROGIF_PRIMARY_NATIVE : ATA_PROGIF_SECONDARY_NATIVE;
+
+            if(pci_device->progIF & nativeBit)
+            {
+                // the control block BAR points 2 bytes before the register
+                channel->ioBase = pci_device->config_read<u32>(ATA_PCI_BAR0 + i * 8) & 0xFFFC;
+                channel->ctrlBase = (pci_device->config_read<u32>(ATA_PCI_BAR0 + i * 8 + 4) & 0xFFFC) + 2;
+                channel->irqLine = nativeIRQ;
+            }
+            else
+            {
+                channel->ioBase = i == 0 ? ATA_PRIMARY_IO : ATA_SECONDARY_IO;
+                channel->ctrlBase = i == 0 ? ATA_PRIMARY_CTRL : ATA_SECONDARY_CTRL;
+                channel->irqLine = i == 0 ? ATA_PRIMARY_IRQ : ATA_SECONDARY_IRQ;
+            }
+
+            if(!channel->init())
+            {
+                log_warn("[ATA] Failed to allocate PRD table\n");
+                delete channel;
+                continue;
+            }
+
+            self.channels.push_back(channel);
+
+            for(u8 j = 0; j < 2; j++)
+            {
+                ata_drive* drive = new ata_drive();
+                drive->channel = channel;
+                drive->slave = j == 1;
+
+                if(!drive->identify())
+                {
+                    delete drive;
+                    continue;
+                }
+
+                log_info("[ATA] %s: %u MiB%s\n", drive->model, (u32)(drive->sectorCount / 2048), drive->lba48 ? ", LBA48" : "");
+
+                std::string name = "ata" + std::utos(self.drives.size());
+                vfs::node_t node = vfs::make_node(name.take(), false);
+
+                node.flags |= vfs::NODE_BLOCK;
+                node.data = drive;
+                node.size = ATA_SECTOR_SIZE;
+                node.read = ata_node_read;
+                node.write = ata_node_write;
+                node.driver_uid = driver->uid;
+
+                vfs::add_bnode(driver->gvfs, "/dev/", node);
+
+                self.drives.push_back(drive);
+            }
+        }
+
+        return DRIVER_SUCCESS;
+    }
+
+    kernel_driver get_ata_driver(vfs::vfs_t* gvfs)
+    {
+        return kernel_driver{
+            // driver name and desciption
+            .name = "dvr_ata",
+            .desc = "IDE/ATA Bus Master DMA Driver",
+
+            // the filesystem
+            .gvfs = gvfs,
+            .data = nullptr,
+
+            // some driver functions
+            .get_error_desc = ata_kdriver_error_desc,
+            .init = ata_kdriver_init,
+            .process_event = ata_kdriver_process_event,
+
+            // the class of the driver
+            .uid_class = UID_CLASS_PCI
+        };
+    }
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <includes.h>
+#include "../driver_defs.hpp"
+
+#include <std/std.hpp>
+#include <std/ds.hpp>
+#include <hw/pci/pci.hpp>
+
+#define ATA_SECTOR_SIZE 512
+
+namespace drivers::ata
+{
+    // physical region descriptor, a region must not cross a 64KiB boundary
+    struct prd_entry
+    {
+        u32 address;
+        // 0 means 64KiB
+        u16 size;
+        u16 flags;
+    }_packed;
+
+    // one of the two IDE channels of a controller
+    struct ata_channel
+    {
+        u16 ioBase;
+        // alternate status / device control
+        u16 ctrlBase;
+        // bus master registers of this channel
+        u16 bmBase;
+        u8  irqLine;
+
+        prd_entry* prdt;
+        ptr_t prdtPhys;
+
+        // set by the IRQ handler once the command is done
+        volatile bool complete;
+        volatile u8 bmStatus;
+        volatile u8 status;
+
+        bool init();
+
+        // returns true if the interrupt was raised by this channel
+        bool handleIRQ();
+
+        // waits 400ns for the status to be valid
+        void delay();
+        bool waitNotBusy(u32 timeout);
+
+        // builds the PRD table, returns false if the buffer can't be DMA'd to
+        bool mapBuffer(void* buffer, size_t size);
+    };
+
+    struct ata_drive
+    {
+        ata_channel* channel;
+        bool slave;
+
+        bool lba48;
+        u64 sectorCount;
+        char model[41];
+
+        bool identify();
+        // lba to lba + count - 1 exist on the drive
+        bool inRange(u64 lba, u64 count) const;
+
+        // a single DMA command of up to ATA_MAX_SECTORS
+        bool transfer(u64 lba, u32 count, void* buffer, bool write);
+
+        bool read_sectors(u64 lba, size_t count, void* buffer);
+        bool write_sectors(u64 lba, size_t count, const void* buffer);
+    };
+
+    kernel_driver get_ata_driver(vfs::vfs_t* gvfs);
+}
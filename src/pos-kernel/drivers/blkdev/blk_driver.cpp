@@ -52,7 +52,7 @@ namespace drivers::blk
             .process_event = kdriver_process_event,
 
             // the class of the driver
-            .uid_class = UID_CLASS_USBCTRL
+            .uid_class = UID_CLASS_PCI
         };
     }
 }
@@ -1,15 +1,21 @@
 #include "drivers.hpp"
 
+#include "usb/hci/ehci.hpp"
 #include "usb/hci/uhci.hpp"
+#include "usb/devices/mass_storage.hpp"
+#include "ata/ata.hpp"
 
-#define KDRIVER_COUNT 1
+#define KDRIVER_COUNT 4
 
 namespace drivers
 {
     typedef kernel_driver(*driver_init_function)(vfs::vfs_t*);
     
     static driver_init_function kdrivers_init_functions[KDRIVER_COUNT] = {
-        usb::get_uhci_driver
+        usb::get_ehci_driver,
+        usb::get_uhci_driver,
+        usb::get_msd_driver,
+        ata::get_ata_driver
     };
 
     static kernel_driver kdrivers[KDRIVER_COUNT];
@@ -52,7 +52,26 @@ namespace drivers::usb
         u16 size;
     }_packed;
 
+    struct device_desc
+    {
+        u8  length;
+        u8  descType;
+        u16 bcdUSB;
+        u8  deviceClass;
+        u8  subClass;
+        u8  protocolCode;
+        u8  maxPacketSize;
+        u16 vendorID;
+        u16 productID;
+        u16 bcdDevice;
+        u8  iManufacture;
+        u8  iProduct;
+        u8  iSerialNumber;
+        u8  configCount;
+    }_packed;
+
     struct usb_controller;
+    struct device_stats;
 
     struct usb_device
     {
@@ -66,9 +85,15 @@ namespace drivers::usb
         u16 productID;
         u16 bcdDevice;
         u8  configCount;
+        // string descriptors not fetched yet, 0 once they are
+        u8  iManufacture;
+        u8  iProduct;
+        u8  iSerialNumber;
         std::string manufactureName;
         std::string productName;
         std::string serialNumber;
+        // transfer counters, nullptr while enumerating
+        device_stats* stats;
     };
 
     struct usb_controller
@@ -81,7 +106,14 @@ namespace drivers::usb
         bool (*controlIn)(void* instance_data, const usb_device& device, request_packet rpacket, void* buffer, u16 size);
         bool (*controlOut)(void* instance_data, const usb_device& device, request_packet rpacket, u16 size);
 
-        bool (*bulkIn)(void* instance_data, const usb_device& device, u8 endpoint, u16 maxPacketSize, void* buffer, u16 size);
-        bool (*bulkOut)(void* instance_data, const usb_device& device, u8 endpoint, u16 maxPacketSize, void* buffer, u16 size);
+        bool (*bulkIn)(void* instance_data, const usb_device& device, u8 endpoint, u16 maxPacketSize, void* buffer, u32 size);
+        bool (*bulkOut)(void* instance_data, const usb_device& device, u8 endpoint, u16 maxPacketSize, void* buffer, u32 size);
+
+        // queue a bulk transfer without waiting for it, returns nullptr on failure
+        void* (*bulkQueue)(void* instance_data, const usb_device& device, u8 endpoint, u16 maxPacketSize, void* buffer, u32 size, u8 packetType);
+        // wait for a queued bulk transfer, every queued transfer must be waited for
+        bool (*bulkWait)(void* instance_data, const usb_device& device, void* transfer);
+        // largest bulk transfer the controller can have queued at once
+        u32 (*maxBulkTransfer)(void* instance_data, u16 maxPacketSize);
     };
 }
@@ -1,6 +1,7 @@
 #include "mass_storage.hpp"
 
 #include <io/io.h>
+#include <hw/pit/PIT.h>
 #include <std/std.hpp>
 #include <std/ds.hpp>
 
@@ -19,12 +20,12 @@
 
 #define CBW_SIGNATURE 0x43425355
 #define CSW_SIGNATURE 0x53425355
-/*
+
+// transfer size of a single READ command, unless the controller can't queue that much
+#define MSD_DEFAULT_TRANSFER_SIZE 0x20000
+
 namespace drivers::usb
 {
-    //using namespace bus;
-    //using usb_device;
-
     struct CommandBlockWrapper
     {
         u32 signature;     // USBC in hexadecimal, acting as magic number
@@ -118,7 +119,7 @@ namespace drivers::usb
         u8 specific[3];
     } _packed;
 
-    CommandBlockWrapper SCSIprepareCommandBlock(u8 command, int length, uint64_t lba = 0, int sectors = 0)
+    CommandBlockWrapper SCSIprepareCommandBlock(u8 command, u32 length, uint64_t lba = 0, u32 sectors = 0)
     {
         CommandBlockWrapper cmd;
         std::memset(&cmd, 0, sizeof(CommandBlockWrapper));
@@ -218,7 +219,7 @@ namespace drivers::usb
 
         return cmd;
     }
-    bool SCSIRequest(const msd_device& device, CommandBlockWrapper* request, u8* dataPointer, int dataLength)
+    bool SCSIRequest(const msd_device& device, CommandBlockWrapper* request, u8* dataPointer, u32 dataLength)
     {
         // Send request to device
         if(!device.sendBulkOut(request, sizeof(CommandBlockWrapper)))
@@ -226,7 +227,7 @@ namespace drivers::usb
             log_error("[USB Mass Storage Driver] Error Sending command %b to bulk out endpoint\n", request->command[0]);
             
             // Clear HALT for the OUT-Endpoint
-            if(!usb::clear_feature(device.target, USB_REP_ENDPOINT, 0, device.bulkOut->endpointAddress & 0xF))
+            if(!usb::clear_feature(device.dnode, USB_REP_ENDPOINT, 0, device.bulkOut->endpointAddress))
             {
                 log_error("[USB Mass Storage Driver] Clear feature (HALT) Failed for Bulk-Out!\n");
                 return false;
@@ -240,10 +241,10 @@ namespace drivers::usb
             {
                 if(!device.sendBulkIn(dataPointer, dataLength))
                 {
-                    log_error("[USB Mass Storage Driver] Error receiving data after command %b from bulk endpoint, len=%d\n", request->command[0], dataLength);
+                    log_error("[USB Mass Storage Driver] Error receiving data after command %b from bulk endpoint, len=%u\n", request->command[0], dataLength);
                     
                     // Clear HALT feature for the IN-Endpoint
-                    if(!usb::clear_feature(device.target, USB_REP_ENDPOINT, 0, device.bulkIn->endpointAddress & 0xF))
+                    if(!usb::clear_feature(device.dnode, USB_REP_ENDPOINT, 0, device.bulkIn->endpointAddress))
                     {
                         log_error("[USB Mass Storage Driver] Clear feature (HALT) Failed for Bulk-In!\n");
                         return false;
@@ -253,10 +254,10 @@ namespace drivers::usb
             else
             {
                 if(!device.sendBulkOut(dataPointer, dataLength)) {
-                    log_error("[USB Mass Storage Driver] Error sending data after command %b to bulk endpoint, len=%d\n", request->command[0], dataLength);
+                    log_error("[USB Mass Storage Driver] Error sending data after command %b to bulk endpoint, len=%u\n", request->command[0], dataLength);
                     
                     // Clear HALT feature for the OUT-Endpoint
-                    if(!usb::clear_feature(device.target, USB_REP_ENDPOINT, 0, device.bulkOut->endpointAddress & 0xF))
+                    if(!usb::clear_feature(device.dnode, USB_REP_ENDPOINT, 0, device.bulkOut->endpointAddress))
                     {
                         log_error("[USB Mass Storage Driver] Clear feature (HALT) Failed for Bulk-Out!\n");
                         return false;
@@ -273,7 +274,7 @@ namespace drivers::usb
             log_error("[USB Mass Storage Driver] Error reading Command Status Wrapper from bulk in endpoint\n");
 
             // Clear HALT feature for the IN-Endpoint
-            if(!usb::clear_feature(device.target, USB_REP_ENDPOINT, 0, device.bulkIn->endpointAddress & 0xF))
+            if(!usb::clear_feature(device.dnode, USB_REP_ENDPOINT, 0, device.bulkIn->endpointAddress))
             {
                 log_error("[USB Mass Storage Driver] Clear feature (HALT) Failed for Bulk-In!\n");
                 return false;
@@ -314,18 +315,21 @@ namespace drivers::usb
 
     bool msd_device::sendBulkOut(void* buffer, size_t size) const
     {
-        return usb::bulk_out(this->target, this->bulkOut, buffer, size);
+        return usb::bulk_out(this->dnode, this->bulkOut, buffer, size);
     }
     bool msd_device::sendBulkIn(void* buffer, size_t size) const
     {
-        return usb::bulk_in(this->target, this->bulkIn, buffer, size);
+        return usb::bulk_in(this->dnode, this->bulkIn, buffer, size);
     }
 
-    bool msd_device::detect(const usb_device &device)
+    bool msd_device::detect(vfs::node_t* dnode)
     {
         // TODO: identify the configuration that supports Bulk only transport
-        usb::config_desc config0 = usb::get_config(device, 0);
-        return config0.interfaces[0].classCode == 0x08 && config0.interfaces[0].subClass == 0x06;
+        usb::config_desc config0 = usb::get_config(dnode, 0);
+        bool status = config0.interfaceCount > 0 && config0.interfaces[0].classCode == 0x08 && config0.interfaces[0].subClass == 0x06;
+        usb::free_config(config0);
+
+        return status;
     }
 
     bool msd_device::reset() const
@@ -338,7 +342,7 @@ namespace drivers::usb
         reqPacket.index = interface->interfaceID;
         reqPacket.size = 0;
 
-        return usb::control_packet_out(this->target, reqPacket);
+        return usb::control_packet_out(this->dnode, reqPacket);
     }
     bool msd_device::fullReset() const
     {
@@ -350,14 +354,14 @@ namespace drivers::usb
         }
 
         // Then the Clear feature for the IN-Endpoint
-        if(!usb::clear_feature(this->target, USB_REP_ENDPOINT, 0, this->bulkIn->endpointAddress & 0xF))
+        if(!usb::clear_feature(this->dnode, USB_REP_ENDPOINT, 0, this->bulkIn->endpointAddress))
         {
             log_error("[USB Mass Storage Driver] Clear feature (HALT) Failed for Bulk-In!\n");
             return false;
         }
 
         // Then the Clear feature for the OUT-Endpoint
-        if(!usb::clear_feature(this->target, USB_REP_ENDPOINT, 0, this->bulkOut->endpointAddress & 0xF))
+        if(!usb::clear_feature(this->dnode, USB_REP_ENDPOINT, 0, this->bulkOut->endpointAddress))
         {
             log_error("[USB Mass Storage Driver] Clear feature (HALT) Failed for Bulk-Out!\n");
             return false;
@@ -366,16 +370,25 @@ namespace drivers::usb
         return true;
     }
 
-    bool msd_device::init(const usb_device& device)
+    bool msd_device::init(vfs::node_t* dnode)
     {
-        // TODO: identify the configuration that supports Bulk only transport
-        usb::config_desc config0 = usb::get_config(device, 0);
-        bool status = usb::set_config(device, config0);
+        this->dnode = dnode;
+        this->bulkIn = nullptr;
+        this->bulkOut = nullptr;
+        this->logicalUnitCount = 0;
+        this->blockCount = 0;
+        this->blockSize = 0;
+        this->use16Base = false;
 
-        this->interface = &config0.interfaces[0];
+        // TODO: identify the configuration that supports Bulk only transport
+        this->config = usb::get_config(dnode, 0);
+        if(!usb::set_config(dnode, this->config))
+        {
+            log_warn("[USB Mass Storage Driver] set config failed\n");
+            return false;
+        }
 
-        // copy 
-        this->target = device;
+        this->interface = &this->config.interfaces[0];
 
         // bulk reset packet
         usb::request_packet reqPacket;
@@ -385,17 +398,26 @@ namespace drivers::usb
         reqPacket.index = this->interface->interfaceID;
         reqPacket.size = 1;
 
-        if(!usb::control_packet_in(this->target, reqPacket, &this->logicalUnitCount))
+        if(!usb::control_packet_in(this->dnode, reqPacket, &this->logicalUnitCount))
         {
-            log_warn("[USB Mass Storage Driver] get LUN Count Failed");
+            log_warn("[USB Mass Storage Driver] get LUN Count Failed\n");
         }
 
         for(size_t i = 0; i < this->interface->endpointCount; i++)
         {
+            // can't carry any data
+            if(this->interface->endpoints[i].maxPacketSize == 0) continue;
+
             if(this->interface->endpoints[i].endpointAddress & 0x80) this->bulkIn = &this->interface->endpoints[i];
             else this->bulkOut = &this->interface->endpoints[i];
         }
 
+        if(this->bulkIn == nullptr || this->bulkOut == nullptr)
+        {
+            log_warn("[USB Mass Storage Driver] missing bulk endpoints\n");
+            return false;
+        }
+
         ///////////////
         // Test Unit Ready
         ///////////////
@@ -453,21 +475,30 @@ namespace drivers::usb
                 Capacity16Block readCapacityRet16;
                 if(SCSIRequest(*this, &readCapacity16CMD, (u8*)&readCapacityRet16, sizeof(Capacity16Block))) {
                     readCapacityRet16.logicalBlockAddress = __builtin_bswap64(readCapacityRet16.logicalBlockAddress);
-                    readCapacityRet16.blockLength = __builtin_bswap64(readCapacityRet16.blockLength);
+                    readCapacityRet16.blockLength = __builtin_bswap32(readCapacityRet16.blockLength);
 
-                    this->blockCount = readCapacityRet16.logicalBlockAddress - 1;
+                    // the device reports the last LBA
+                    this->blockCount = readCapacityRet16.logicalBlockAddress + 1;
                     this->blockSize = readCapacityRet16.blockLength;
                     this->use16Base = true;
                 }
             }
             else
             {
-                this->blockCount = readCapacityRet.logicalBlockAddress - 1;
+                this->blockCount = (uint64_t)readCapacityRet.logicalBlockAddress + 1;
                 this->blockSize = readCapacityRet.blockLength;
             }
         }
 
+        if(this->blockSize == 0)
+        {
+            log_warn("[USB Mass Storage Driver] Read capacity failed\n");
+            return false;
+        }
+
         this->size = this->blockCount * this->blockSize;
+        set_max_transfer_size(MSD_DEFAULT_TRANSFER_SIZE);
+
         return true;
     }
 
@@ -475,31 +506,183 @@ namespace drivers::usb
     {
         return blockSize;
     }
-    bool msd_device::read_sectors(u32 lba, size_t count, void* buffer)
+    void msd_device::set_max_transfer_size(u32 size)
     {
-        CommandBlockWrapper sendBuf = SCSIprepareCommandBlock(use16Base ? SCSI_READ_16 : SCSI_READ_10, blockSize, lba, count);
-        if(SCSIRequest(*this, &sendBuf, (u8*)buffer, blockSize)) return true;
+        // the data stage has to fit in the controller at once
+        u32 limit = usb::max_bulk_transfer(dnode, bulkIn);
+        if(size > limit) size = limit;
 
-        log_error("[USB Mass Storage Driver] Error writing sector %x", lba);
-        return false;
+        // whole blocks, and at least one
+        size -= size % blockSize;
+        if(size == 0) size = blockSize;
+
+        maxTransferSize = size;
+    }
+    bool msd_device::read_sectors(u64 lba, size_t count, void* buffer)
+    {
+        // the whole request is split into as few commands as possible
+        size_t maxBlocks = maxTransferSize / blockSize;
+
+        u8* dst = (u8*)buffer;
+        u8 readCommand = use16Base ? SCSI_READ_16 : SCSI_READ_10;
+
+        // the CBW of the next command is queued while the
+        // current one is still finishing, the device NAKs it till then
+        CommandBlockWrapper commands[2];
+        CommandStatusWrapper status;
+
+        size_t blocks = count < maxBlocks ? count : maxBlocks;
+        commands[0] = SCSIprepareCommandBlock(readCommand, blocks * blockSize, lba, blocks);
+        commands[0].tag = 0;
+
+        void* commandTransfer = usb::bulk_queue(dnode, bulkOut, &commands[0], sizeof(CommandBlockWrapper));
+
+        for(u32 i = 0; count > 0; i++)
+        {
+            CommandBlockWrapper& command = commands[i & 1];
+            u32 length = blocks * blockSize;
+
+            std::memset(&status, 0, sizeof(CommandStatusWrapper));
+
+            void* dataTransfer = usb::bulk_queue(dnode, bulkIn, dst, length);
+            void* statusTransfer = usb::bulk_queue(dnode, bulkIn, &status, sizeof(CommandStatusWrapper));
+
+            u64 commandLBA = lba;
+            lba += blocks;
+            count -= blocks;
+            dst += length;
+
+            size_t nextBlocks = count < maxBlocks ? count : maxBlocks;
+            void* nextTransfer = nullptr;
+
+            if(count > 0)
+            {
+                CommandBlockWrapper& next = commands[(i + 1) & 1];
+                next = SCSIprepareCommandBlock(readCommand, nextBlocks * blockSize, lba, nextBlocks);
+                next.tag = i + 1;
+
+                nextTransfer = usb::bulk_queue(dnode, bulkOut, &next, sizeof(CommandBlockWrapper));
+            }
+
+            // every queued transfer has to be waited for
+            bool success = usb::bulk_wait(dnode, commandTransfer);
+            success &= usb::bulk_wait(dnode, dataTransfer);
+            success &= usb::bulk_wait(dnode, statusTransfer);
+
+            success = success && status.signature == CSW_SIGNATURE && status.tag == command.tag && status.status == 0;
+
+            if(!success)
+            {
+                log_error("[USB Mass Storage Driver] Error reading sectors %x-%x, status = %d\n", (u32)commandLBA, (u32)(commandLBA + blocks - 1), status.status);
+
+                // the device might be holding the next command, start over
+                usb::bulk_wait(dnode, nextTransfer);
+                fullReset();
+
+                return false;
+            }
+
+            commandTransfer = nextTransfer;
+            blocks = nextBlocks;
+        }
+
+        return true;
     }
 
-    namespace msd
+    const char* msd_kdriver_error_desc(u32 error)
+    {
+        const char* error_array[] = {
+            "No Failiure",
+            "Event parsing failed[this driver does not handle the given event]",
+            "Critical Failiure",
+        };
+
+        if(error >= sizeof(error_array)/sizeof(char*)) return nullptr;
+
+        return error_array[error];
+    }
+
+    struct msd_kdriver
+    {
+        std::vector<msd_device*> devices;
+    };
+
+    i32 msd_node_read(vfs::node_t* node, size_t offset, void* buffer, size_t len)
     {
-        bool read_sectors_wrapper(void* instance, u32 lba, size_t count, void* buffer)
+        msd_device* device = reinterpret_cast<msd_device*>(node->data);
+
+        if(offset % device->blockSize != 0 || len % device->blockSize != 0)
         {
-            return reinterpret_cast<msd_device*>(instance)->read_sectors(lba, count, buffer);
+            log_warn("[USB Mass Storage Driver] unaligned read of %u bytes at %u\n", len, offset);
+            return EINVARG;
         }
+
+        // the buffer holds whatever was there before on failure
+        if(!device->read_sectors(offset / device->blockSize, len / device->blockSize, buffer)) return EINVOP;
+
+        return OP_SUCCESS;
     }
-    disk_driver msd_device::as_disk_driver()
+
+    u32 msd_kdriver_init(kernel_driver* driver)
     {
-        disk_driver driver;
+        driver->data = new msd_kdriver();
+
+        return DRIVER_SUCCESS;
+    }
+    u32 msd_kdriver_process_event(kernel_driver* driver, vfs::event_t event)
+    {
+        if(event.flags != vfs::EVENT_DEVICE_ADD) return DRIVER_PARSE_FAIL;
+        if(event.trigger_node == nullptr) return DRIVER_PARSE_FAIL;
+
+        vfs::node_t* dnode = event.trigger_node;
+        msd_kdriver& self = *reinterpret_cast<msd_kdriver*>(driver->data);
+
+        if((dnode->flags & vfs::NODE_TYPE_MASK) != vfs::NODE_DEVICE) return DRIVER_PARSE_FAIL;
+        if(!msd_device::detect(dnode)) return DRIVER_PARSE_FAIL;
 
-        driver.driver_instance = (void*)this;
-        driver.block_byte_size = this->blockSize;
-        driver.read_blocks_fptr = msd::read_sectors_wrapper;
+        msd_device* device = new msd_device();
+        if(!device->init(dnode))
+        {
+            log_warn("[USB Mass Storage Driver] Failed to initialize %s\n", dnode->name);
+            delete device;
+            return DRIVER_PARSE_FAIL;
+        }
+
+        std::string name = "msd" + std::utos(self.devices.size());
+        vfs::node_t node = vfs::make_node(name.take(), false);
+
+        node.flags |= vfs::NODE_BLOCK;
+        node.data = device;
+        node.size = device->blockSize;
+        node.read = msd_node_read;
+        node.write = vfs::ignore_write;
+        node.driver_uid = driver->uid;
+
+        vfs::add_bnode(driver->gvfs, "/dev/", node);
 
-        return driver;
+        self.devices.push_back(device);
+
+        return DRIVER_SUCCESS;
+    }
+
+    kernel_driver get_msd_driver(vfs::vfs_t* gvfs)
+    {
+        return kernel_driver{
+            // driver name and desciption
+            .name = "dvr_usb_msd",
+            .desc = "USB Mass Storage Driver(Bulk Only)",
+
+            // the filesystem
+            .gvfs = gvfs,
+            .data = nullptr,
+
+            // some driver functions
+            .get_error_desc = msd_kdriver_error_desc,
+            .init = msd_kdriver_init,
+            .process_event = msd_kdriver_process_event,
+
+            // the class of the driver
+            .uid_class = UID_CLASS_USB
+        };
     }
 }
-*/
\ No newline at end of file
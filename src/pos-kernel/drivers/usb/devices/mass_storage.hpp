@@ -4,13 +4,16 @@
 
 #include "../defs.hpp"
 #include "../usb.hpp"
+#include "../../driver_defs.hpp"
 
 namespace drivers::usb
 {
     struct msd_device
     {
-        usb_device target;
+        // the usb device node
+        vfs::node_t* dnode;
 
+        config_desc config;
         interface_desc* interface;
         endpoint_desc* bulkIn;
         endpoint_desc* bulkOut;
@@ -22,6 +25,9 @@ namespace drivers::usb
         uint64_t size;
         bool use16Base;
 
+        // largest transfer issued by a single READ command
+        u32 maxTransferSize;
+
         char vendorSCSI[9];
         char productSCSI[17];
         char revisionSCSI[5];
@@ -29,17 +35,20 @@ namespace drivers::usb
         bool sendBulkOut(void* buffer, size_t size) const;
         bool sendBulkIn(void* buffer, size_t size) const;
 
-        static bool detect(const usb_device& device);
+        static bool detect(vfs::node_t* dnode);
 
-        bool init(const usb_device& device);
+        bool init(vfs::node_t* dnode);
 
         bool reset() const;
         bool fullReset() const;
 
         u32 get_sector_size();
-        bool read_sectors(u32 lba, size_t count, void* buffer);
-
-        //disk_driver as_disk_driver();
+        // capped by what the controller can queue on the bulk in endpoint
+        void set_max_transfer_size(u32 size);
+        // reads in transfers of up to maxTransferSize
+        bool read_sectors(u64 lba, size_t count, void* buffer);
     };
+
+    kernel_driver get_msd_driver(vfs::vfs_t* gvfs);
 }
 
@@ -0,0 +1,269 @@
+#include "enumeration.hpp"
+#include "stats.hpp"
+
+#include <io/io.h>
+#include <hw/pit/PIT.h>
+#include <std/std.hpp>
+#include <std/memory/object_cache.hpp>
+
+#define PORT_RESTART_TRIES 10
+#define SET_ADDRESS_RECOVERY 2
+
+namespace drivers::usb
+{
+    static std::object_cache<usb_device> device_cache;
+
+    static void port_timer(void* data);
+    static void fail_port(root_port* port);
+
+    static void schedule(root_port* port, u32 time)
+    {
+        if(PIT_addTimer(time, port_timer, port)) return;
+
+        log_warn("[USB] Out of timers, port %x is not enumerated\n", port->port);
+        fail_port(port);
+    }
+
+    static usb_controller* hub_controller(root_hub& hub)
+    {
+        return reinterpret_cast<usb_controller*>(hub.controllerNode->data);
+    }
+
+    static void claim_address(root_port* port);
+
+    // hands the default address to the next port waiting in reset
+    static void release_address(root_hub& hub)
+    {
+        hub.addressOwner = nullptr;
+
+        for(size_t i = 0; i < hub.portCount; i++)
+        {
+            if(hub.ports[i].state != PORT_WAIT) continue;
+
+            claim_address(&hub.ports[i]);
+            return;
+        }
+    }
+    static void fail_port(root_port* port)
+    {
+        root_hub& hub = *port->hub;
+
+        port->state = PORT_IDLE;
+
+        // the device might still answer on address 0
+        hub.port_disable(hub.instance_data, port->port);
+
+        if(hub.addressOwner == port) release_address(hub);
+    }
+
+    static void claim_address(root_port* port)
+    {
+        root_hub& hub = *port->hub;
+
+        hub.addressOwner = port;
+
+        hub.port_reset(hub.instance_data, port->port, false);
+
+        port->state = PORT_RECOVERY;
+        port->tries = 0;
+        schedule(port, USB_TRSTRCY);
+    }
+
+    // the device answers on address 0, give it its own
+    static void address_device(root_port* port, bool lowSpeed)
+    {
+        root_hub& hub = *port->hub;
+        usb_controller* controller = hub_controller(hub);
+
+        usb_device& device = port->device;
+        device.isLowSpeedDevice = lowSpeed;
+        device.portAddress = port->port;
+        device.address = 0;
+        device.stats = nullptr;
+        // every device accepts 8 byte packets on endpoint 0
+        device.maxPacketSize = 8;
+
+        device_desc deviceDesc;
+
+        // the first 8 bytes hold the real max packet size
+        request_packet rpacket;
+        rpacket.requestType = USB_DEVICE_TO_HOST | USB_REQ_STRD | USB_REP_DEVICE;
+        rpacket.request = REQ_GET_DESC;
+        rpacket.value = (USB_DESC_DEVICE << 8) | 0;
+        rpacket.index = 0;
+        rpacket.size = 8;
+
+        if(!controller->controlIn(controller->instance_data, device, rpacket, &deviceDesc, 8))
+        {
+            log_warn("[USB][DeviceSetup] Failed to get USB descriptor.\n");
+            fail_port(port);
+            return;
+        }
+
+        device.maxPacketSize = deviceDesc.maxPacketSize;
+
+        rpacket.requestType = USB_HOST_TO_DEVICE | USB_REQ_STRD | USB_REP_DEVICE;
+        rpacket.request = REQ_SET_ADDR;
+        rpacket.value = hub.addressCount;
+        rpacket.index = 0;
+        rpacket.size = 0;
+
+        if(!controller->controlOut(controller->instance_data, device, rpacket, 0))
+        {
+            log_warn("[USB][DeviceSetup] Failed to set USB address.\n");
+            fail_port(port);
+            return;
+        }
+
+        device.address = hub.addressCount; hub.addressCount++;
+
+        // address 0 is free again
+        release_address(hub);
+
+        port->state = PORT_ADDRESSED;
+        schedule(port, SET_ADDRESS_RECOVERY);
+    }
+
+    static void add_device(root_port* port)
+    {
+        root_hub& hub = *port->hub;
+        usb_controller* controller = hub_controller(hub);
+
+        usb_device& device = port->device;
+        device_desc deviceDesc;
+
+        request_packet rpacket;
+        rpacket.requestType = USB_DEVICE_TO_HOST | USB_REQ_STRD | USB_REP_DEVICE;
+        rpacket.request = REQ_GET_DESC;
+        rpacket.value = (USB_DESC_DEVICE << 8) | 0;
+        rpacket.index = 0;
+        rpacket.size = sizeof(device_desc);
+
+        if(!controller->controlIn(controller->instance_data, device, rpacket, &deviceDesc, sizeof(device_desc)))
+        {
+            log_warn("[USB][DeviceSetup] Failed to get USB descriptor.\n");
+            fail_port(port);
+            return;
+        }
+
+        device.bcdDevice = deviceDesc.bcdDevice;
+        device.configCount = deviceDesc.configCount;
+        device.productID = deviceDesc.productID;
+        device.protocolCode = deviceDesc.protocolCode;
+        device.subClass = deviceDesc.subClass;
+        device.vendorID = deviceDesc.vendorID;
+
+        // strings are fetched on first access
+        device.iManufacture = deviceDesc.iManufacture;
+        device.iProduct = deviceDesc.iProduct;
+        device.iSerialNumber = deviceDesc.iSerialNumber;
+
+        std::string ctrl_path = "/dev/" + std::string(hub.controllerNode->name);
+
+        usb_device* dev = device_cache.alloc(device);
+        std::string dev_name = "usb" + std::utos(hub.deviceCount);
+
+        // exists before any driver sees the device
+        add_stats_node(hub.gvfs, ctrl_path.c_str(), dev_name.c_str(), dev);
+
+        vfs::node_t node = vfs::make_node(dev_name.take(), false);
+
+        node.flags |= vfs::NODE_DEVICE;
+        node.data = dev;
+        node.size = device.maxPacketSize;
+        node.write = vfs::ignore_write;
+        node.read = vfs::ignore_read;
+        node.driver_uid = UID_CLASS_USB;
+
+        vfs::add_dnode(hub.gvfs, ctrl_path.c_str(), node);
+
+        hub.deviceCount++;
+
+        port->state = PORT_DONE;
+    }
+
+    static void port_timer(void* data)
+    {
+        root_port* port = reinterpret_cast<root_port*>(data);
+        root_hub& hub = *port->hub;
+
+        switch (port->state)
+        {
+        case PORT_RESET:
+            // keep signaling reset till address 0 is free
+            port->state = PORT_WAIT;
+            if(hub.addressOwner == nullptr) claim_address(port);
+            break;
+        case PORT_RECOVERY:
+        {
+            u8 status = hub.port_enable(hub.instance_data, port->port);
+
+            if(status & USB_PORT_ENABLED)
+            {
+                address_device(port, status & USB_PORT_LOW_SPEED);
+                break;
+            }
+
+            port->tries++;
+            if((status & USB_PORT_RETRY) && port->tries < PORT_RESTART_TRIES)
+            {
+                schedule(port, USB_TRSTRCY);
+                break;
+            }
+
+            fail_port(port);
+            break;
+        }
+        case PORT_ADDRESSED:
+            add_device(port);
+            break;
+        default:
+            break;
+        }
+    }
+
+    void init_root_hub(root_hub& hub, vfs::vfs_t* gvfs, vfs::node_t* controllerNode)
+    {
+        hub.gvfs = gvfs;
+        hub.controllerNode = controllerNode;
+
+        hub.deviceCount = 0;
+        // address of 0 is reserved.
+        hub.addressCount = 1;
+
+        hub.portCount = 0;
+        hub.addressOwner = nullptr;
+    }
+
+    void enumerate_port(root_hub& hub, u16 port)
+    {
+        if(hub.portCount >= USB_MAX_ROOT_PORTS)
+        {
+            log_warn("[USB] Too many root hub ports\n");
+            return;
+        }
+
+        root_port& rport = hub.ports[hub.portCount];
+        hub.portCount++;
+
+        rport.hub = &hub;
+        rport.port = port;
+        rport.tries = 0;
+
+        hub.port_reset(hub.instance_data, port, true);
+
+        rport.state = PORT_RESET;
+        schedule(&rport, hub.resetTime);
+    }
+
+    bool hub_resetting(const root_hub& hub)
+    {
+        for(size_t i = 0; i < hub.portCount; i++)
+        {
+            u8 state = hub.ports[i].state;
+            if(state == PORT_RESET || state == PORT_WAIT || state == PORT_RECOVERY) return true;
+        }
+
+        return false;
+    }
+}
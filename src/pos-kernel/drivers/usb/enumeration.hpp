@@ -0,0 +1,81 @@
+#pragma once
+
+#include <includes.h>
+#include "defs.hpp"
+
+// returned by root_hub::port_enable
+#define USB_PORT_ENABLED   (1 << 0)
+#define USB_PORT_LOW_SPEED (1 << 1)
+// not enabled yet, try again after the recovery time
+#define USB_PORT_RETRY     (1 << 2)
+// disconnected or handed to another controller
+#define USB_PORT_GONE      (1 << 3)
+
+#define USB_MAX_ROOT_PORTS 16
+
+namespace drivers::usb
+{
+    enum port_state : u8
+    {
+        PORT_IDLE,
+        // reset is signaled
+        PORT_RESET,
+        // held in reset till the default address is free
+        PORT_WAIT,
+        // reset released, waiting for the port to enable
+        PORT_RECOVERY,
+        // set address recovery
+        PORT_ADDRESSED,
+        PORT_DONE
+    };
+
+    struct root_hub;
+
+    struct root_port
+    {
+        root_hub* hub;
+        u16 port;
+        u8 state;
+        u8 tries;
+        usb_device device;
+    };
+
+    // the ports of a controller are enumerated in parallel by timer callbacks,
+    // only one device at a time may answer on the default address
+    struct root_hub
+    {
+        void* instance_data;
+
+        // start or stop reset signaling
+        void (*port_reset)(void* instance_data, u16 port, bool reset);
+        // returns USB_PORT_* flags of a port that left reset
+        u8 (*port_enable)(void* instance_data, u16 port);
+        // silences a device that failed to enumerate
+        void (*port_disable)(void* instance_data, u16 port);
+
+        // ms reset is signaled for
+        u16 resetTime;
+
+        vfs::vfs_t* gvfs;
+        // data is the usb_controller devices are added with
+        vfs::node_t* controllerNode;
+
+        u32 deviceCount;
+        u8  addressCount;
+
+        root_port ports[USB_MAX_ROOT_PORTS];
+        u8 portCount;
+
+        // port currently using address 0
+        root_port* addressOwner;
+    };
+
+    void init_root_hub(root_hub& hub, vfs::vfs_t* gvfs, vfs::node_t* controllerNode);
+
+    // starts resetting the port, the device is added to the
+    // controller node once it is addressed
+    void enumerate_port(root_hub& hub, u16 port);
+
+    // true while ports are in reset, port routing is not settled till then
+    bool hub_resetting(const root_hub& hub);
+}
@@ -0,0 +1,1319 @@
+#include "ehci.hpp"
+
+#include <c/math.h>
+#include <io/io.h>
+#include <hw/pit/PIT.h>
+#include <arch/x86.h>
+#include <arch/IRQ/IRQ.h>
+#include <arch/IRQ/PIC.h>
+#include <std/std.hpp>
+#include <std/memory/object_cache.hpp>
+#include <cpu/paging.hpp>
+#include <cpu/memory.hpp>
+#include <cpu/dma.hpp>
+#include <cpu/exceptions.hpp>
+
+#define EHCI_PCI_BAR0     0x10
+#define EHCI_PCI_IRQ_LINE 0x3C
+
+// capability registers
+#define EHCI_CAPLENGTH 0x00
+#define EHCI_HCSPARAMS 0x04
+#define EHCI_HCCPARAMS 0x08
+
+// operational registers
+#define EHCI_USBCMD       0x00
+#define EHCI_USBSTS       0x04
+#define EHCI_USBINTR      0x08
+#define EHCI_FRINDEX      0x0C
+#define EHCI_CTRLDSSEGMENT 0x10
+#define EHCI_ASYNCLISTADDR 0x18
+#define EHCI_CONFIGFLAG   0x40
+#define EHCI_PORTSC       0x44
+
+#define EHCI_CMD_RUN      (1 << 0)
+#define EHCI_CMD_HCRESET  (1 << 1)
+#define EHCI_CMD_ASYNC    (1 << 5)
+#define EHCI_CMD_IAAD     (1 << 6)
+// interrupt every micro-frame
+#define EHCI_CMD_ITC_1    (1 << 16)
+
+#define EHCI_STS_USBINT   (1 << 0)
+#define EHCI_STS_ERROR    (1 << 1)
+#define EHCI_STS_IAA      (1 << 5)
+#define EHCI_STS_HALTED   (1 << 12)
+
+#define EHCI_PORT_CONNECT        (1 << 0)
+#define EHCI_PORT_CONNECT_CHANGE (1 << 1)
+#define EHCI_PORT_ENABLE         (1 << 2)
+#define EHCI_PORT_ENABLE_CHANGE  (1 << 3)
+#define EHCI_PORT_OC_CHANGE      (1 << 5)
+#define EHCI_PORT_RESET          (1 << 8)
+#define EHCI_PORT_LINE_STATUS    (3 << 10)
+#define EHCI_PORT_LINE_K         (1 << 10)
+#define EHCI_PORT_POWER          (1 << 12)
+#define EHCI_PORT_OWNER          (1 << 13)
+// write 1 to clear
+#define EHCI_PORT_RWC (EHCI_PORT_CONNECT_CHANGE | EHCI_PORT_ENABLE_CHANGE | EHCI_PORT_OC_CHANGE)
+
+#define EHCI_LEGSUP_ID       0x01
+#define EHCI_LEGSUP_BIOS_OWN (1 << 16)
+#define EHCI_LEGSUP_OS_OWN   (1 << 24)
+
+#define EHCI_TERMINATE 0b001
+#define EHCI_LINK_QH   0b010
+
+#define EHCI_QTD_ACTIVE  (1 << 7)
+#define EHCI_QTD_HALTED  (1 << 6)
+#define EHCI_QTD_BUFFER_ERROR (1 << 5)
+#define EHCI_QTD_BABBLE  (1 << 4)
+#define EHCI_QTD_XACT_ERROR (1 << 3)
+#define EHCI_QTD_PID_OUT   (0 << 8)
+#define EHCI_QTD_PID_IN    (1 << 8)
+#define EHCI_QTD_PID_SETUP (2 << 8)
+#define EHCI_QTD_PID_MASK  (3 << 8)
+#define EHCI_QTD_CERR    (3 << 10)
+#define EHCI_QTD_IOC     (1 << 15)
+#define EHCI_QTD_TOGGLE  (1u << 31)
+#define EHCI_QTD_BYTES(token) (((token) >> 16) & 0x7FFF)
+
+// five 4 KiB buffer pages per qTD
+#define EHCI_QTD_MAX_SIZE 0x5000
+
+#define EHCI_QH_HIGH_SPEED (2 << 12)
+#define EHCI_QH_DTC        (1 << 14)
+#define EHCI_QH_HEAD       (1 << 15)
+#define EHCI_QH_MULT_1     (1u << 30)
+
+#define EHCI_TRANSFER_TIMEOUT 1000
+#define EHCI_PORT_RESET_TIME  50
+#define EHCI_MAX_CONTROLLERS  4
+
+// 64 KiB: async head, then transfer QHs and qTDs
+#define EHCI_POOL_PAGES    16
+#define EHCI_POOL_QH_COUNT 64
+
+namespace drivers::usb
+{
+    using namespace bus;
+
+    // controllers that have an IRQ handler registered
+    static ehci_controller* irqControllers[EHCI_MAX_CONTROLLERS];
+    static size_t irqControllerCount = 0;
+
+    void _no_stack_trace ehci_irq_handler(Registers* registers)
+    {
+        // IRQ lines are shared with the companion controllers,
+        // every controller checks its own status register
+        for(size_t i = 0; i < irqControllerCount; i++)
+        {
+            irqControllers[i]->handleIRQ();
+        }
+    }
+
+    static void ehci_port_reset(void* instance_data, u16 port, bool reset)
+    {
+        reinterpret_cast<ehci_controller*>(instance_data)->portReset(port, reset);
+    }
+    static u8 ehci_port_enable(void* instance_data, u16 port)
+    {
+        return reinterpret_cast<ehci_controller*>(instance_data)->portEnable(port);
+    }
+    static void ehci_port_disable(void* instance_data, u16 port)
+    {
+        reinterpret_cast<ehci_controller*>(instance_data)->portDisable(port);
+    }
+
+    bool ehci_pool::init(size_t pages)
+    {
+        // carve aligns offsets into the pool, so the pool itself is page aligned
+        cpu::dma::dma_buffer memory = cpu::dma::alloc(pages * PAGE_SIZE, PAGE_SIZE);
+        if(memory.virt == nullptr) return false;
+
+        base = (u8*)memory.virt;
+        basePhys = memory.phys;
+        poolSize = pages * PAGE_SIZE;
+        poolHead = 0;
+
+        freeQTDs = nullptr;
+        freeQTDCount = 0;
+        totalQTDCount = 0;
+        freeQHs = nullptr;
+
+        std::memset(base, 0, poolSize);
+
+        return true;
+    }
+    void* ehci_pool::carve(size_t size, size_t align)
+    {
+        // align is a power of 2
+        poolHead = (poolHead + align - 1) & ~(align - 1);
+        if(poolHead + size > poolSize) return nullptr;
+
+        void* ptr = base + poolHead;
+        poolHead += size;
+
+        return ptr;
+    }
+    void ehci_pool::build(size_t qhCount)
+    {
+        ehci_queue_head* qhs = (ehci_queue_head*)carve(qhCount * sizeof(ehci_queue_head), 32);
+        for(size_t i = 0; qhs != nullptr && i < qhCount; i++) free_qh(&qhs[i]);
+
+        poolHead = (poolHead + sizeof(ehci_qtd) - 1) & ~(sizeof(ehci_qtd) - 1);
+
+        // everything that is left are qTDs
+        ehci_qtd* qtds = (ehci_qtd*)(base + poolHead);
+        size_t qtdCount = (poolSize - poolHead) / sizeof(ehci_qtd);
+        poolHead = poolSize;
+
+        // push in reverse, so chains come out in address order
+        for(size_t i = qtdCount; i > 0; i--)
+        {
+            qtds[i - 1].next = freeQTDs;
+            freeQTDs = &qtds[i - 1];
+        }
+        freeQTDCount = qtdCount;
+        totalQTDCount = qtdCount;
+    }
+
+    ehci_qtd_chain ehci_pool::alloc_qtds(size_t count)
+    {
+        ehci_qtd_chain chain = { nullptr, nullptr, 0 };
+        if(count == 0 || count > freeQTDCount) return chain;
+
+        chain.head = freeQTDs;
+        chain.count = count;
+
+        ehci_qtd* qtd = freeQTDs;
+        for(size_t i = 0; i < count; i++)
+        {
+            ehci_qtd* next = qtd->next;
+
+            qtd->token = 0;
+            qtd->altNextQTD = EHCI_TERMINATE;
+            qtd->nextQTD = (i == count - 1) ? EHCI_TERMINATE : physical(next);
+
+            for(size_t j = 0; j < 5; j++)
+            {
+                qtd->buffer[j] = 0;
+                qtd->bufferHi[j] = 0;
+            }
+
+            chain.tail = qtd;
+            qtd = next;
+        }
+
+        freeQTDs = qtd;
+        freeQTDCount -= count;
+        chain.tail->next = nullptr;
+
+        return chain;
+    }
+    void ehci_pool::free_qtds(ehci_qtd_chain& chain)
+    {
+        if(chain.head == nullptr) return;
+
+        chain.tail->next = freeQTDs;
+        freeQTDs = chain.head;
+        freeQTDCount += chain.count;
+
+        chain = { nullptr, nullptr, 0 };
+    }
+
+    ehci_queue_head* ehci_pool::alloc_qh()
+    {
+        ehci_queue_head* qh = freeQHs;
+        if(qh == nullptr) return nullptr;
+
+        freeQHs = qh->next;
+
+        std::memset(qh, 0, sizeof(ehci_queue_head));
+        qh->horizontalLink = EHCI_TERMINATE;
+        qh->nextQTD = EHCI_TERMINATE;
+        qh->altNextQTD = EHCI_TERMINATE;
+
+        return qh;
+    }
+    void ehci_pool::free_qh(ehci_queue_head* qh)
+    {
+        qh->next = freeQHs;
+        freeQHs = qh;
+    }
+
+    // bytes a qTD starting at address can carry, all but
+    // the last qTD end on a packet boundary
+    static u32 qtdLength(ptr_t address, u32 remaining, u16 maxPacketSize)
+    {
+        u32 length = EHCI_QTD_MAX_SIZE - (address & 0xFFF);
+        if(remaining <= length) return remaining;
+
+        return length - (length % maxPacketSize);
+    }
+    static size_t qtdCount(void* buffer, u32 size, u16 maxPacketSize)
+    {
+        size_t count = 0;
+
+        for(u32 offset = 0; offset < size; count++)
+        {
+            offset += qtdLength(ptr_cast(buffer) + offset, size - offset, maxPacketSize);
+        }
+
+        return count;
+    }
+
+    ehci_controller::ehci_controller(pci::device* device) : ehciController(device), capRegs(nullptr), opRegs(nullptr), portCount(0),
+                                                            asyncHead(nullptr), irqLine(0xFF), endpointCount(0) { }
+
+    u32 ehci_controller::readReg(u32 reg)
+    {
+        return *reinterpret_cast<volatile u32*>(opRegs + reg);
+    }
+    void ehci_controller::writeReg(u32 reg, u32 value)
+    {
+        *reinterpret_cast<volatile u32*>(opRegs + reg) = value;
+    }
+
+    void ehci_controller::takeOwnership()
+    {
+        u32 hccparams = *reinterpret_cast<volatile u32*>(capRegs + EHCI_HCCPARAMS);
+
+        // extended capabilities live in PCI config space
+        u8 eecp = (hccparams >> 8) & 0xFF;
+
+        while(eecp >= 0x40)
+        {
+            u32 capability = ehciController->config_read<u32>(eecp);
+
+            if((capability & 0xFF) == EHCI_LEGSUP_ID)
+            {
+                ehciController->config_write<u32>(eecp, capability | EHCI_LEGSUP_OS_OWN);
+
+                PIT_setTimeout(1000);
+                while((ehciController->config_read<u32>(eecp) & EHCI_LEGSUP_BIOS_OWN) && !PIT_hasTimedOut());
+                PIT_cancelTimeout();
+
+                if(ehciController->config_read<u32>(eecp) & EHCI_LEGSUP_BIOS_OWN)
+                {
+                    log_warn("[EHCI] BIOS did not release the controller\n");
+                }
+
+                // disable legacy SMIs
+                ehciController->config_write<u32>(eecp + 4, 0);
+                return;
+            }
+
+            eecp = (capability >> 8) & 0xFF;
+        }
+    }
+
+    // initialize the controller
+    bool ehci_controller::Init()
+    {
+        u32 bar = ehciController->config_read<u32>(EHCI_PCI_BAR0);
+
+        // EHCI registers are always memory mapped
+        if(bar & 0x1) return false;
+        // above 4GiB
+        if((bar & 0x6) == 0x4 && ehciController->config_read<u32>(EHCI_PCI_BAR0 + 4) != 0) return false;
+
+        // enable memory decoding and bus mastering
+        ehciController->config_write<u16>(0x4, ehciController->config_read<u16>(0x4) | 0b110);
+
+        // the firmware assigned BAR is identity mapped, just don't cache it
+        capRegs = reinterpret_cast<volatile u8*>(bar & ~0xF);
+        cpu::setFlagsPages(ptr_cast(capRegs), cpu::PAGE_PRESENT | cpu::PAGE_RW | cpu::PAGE_DISABLE_CACHING, 1);
+
+        opRegs = capRegs + capRegs[EHCI_CAPLENGTH];
+
+        takeOwnership();
+
+        // stop the controller
+        writeReg(EHCI_USBCMD, readReg(EHCI_USBCMD) & ~EHCI_CMD_RUN);
+
+        PIT_setTimeout(20);
+        while((readReg(EHCI_USBSTS) & EHCI_STS_HALTED) == 0 && !PIT_hasTimedOut());
+        PIT_cancelTimeout();
+
+        if((readReg(EHCI_USBSTS) & EHCI_STS_HALTED) == 0) return false;
+
+        // reset
+        writeReg(EHCI_USBCMD, EHCI_CMD_HCRESET);
+
+        PIT_setTimeout(50);
+        while((readReg(EHCI_USBCMD) & EHCI_CMD_HCRESET) && !PIT_hasTimedOut());
+        PIT_cancelTimeout();
+
+        if(readReg(EHCI_USBCMD) & EHCI_CMD_HCRESET) return false;
+
+        portCount = *reinterpret_cast<volatile u32*>(capRegs + EHCI_HCSPARAMS) & 0xF;
+
+        return true;
+    }
+    // setup the controller
+    void ehci_controller::Setup(vfs::vfs_t* gvfs, vfs::node_t* controller_node)
+    {
+        // disable all interrupts till the schedule is ready
+        writeReg(EHCI_USBINTR, 0);
+
+        // all DMA structures of this controller live in one pool
+        if(!descriptorPool.init(EHCI_POOL_PAGES))
+        {
+            log_error("[EHCI] Failed to allocate descriptor pool\n");
+            return;
+        }
+
+        // the reclamation head of the asynchronous schedule never has work
+        asyncHead = (ehci_queue_head*)descriptorPool.carve(sizeof(ehci_queue_head), 32);
+
+        // the rest is used by transfers
+        descriptorPool.build(EHCI_POOL_QH_COUNT);
+
+        asyncHead->horizontalLink = descriptorPool.physical(asyncHead) | EHCI_LINK_QH;
+        asyncHead->endpointChars = EHCI_QH_HEAD | EHCI_QH_HIGH_SPEED;
+        asyncHead->endpointCaps = EHCI_QH_MULT_1;
+        asyncHead->nextQTD = EHCI_TERMINATE;
+        asyncHead->altNextQTD = EHCI_TERMINATE;
+        asyncHead->token = EHCI_QTD_HALTED;
+        asyncHead->next = asyncHead;
+
+        // No periodic schedule, this driver does not implement interrupt or isochronous transfers
+
+        // descriptors are below 4GiB
+        if(*reinterpret_cast<volatile u32*>(capRegs + EHCI_HCCPARAMS) & 0x1) writeReg(EHCI_CTRLDSSEGMENT, 0);
+
+        writeReg(EHCI_ASYNCLISTADDR, descriptorPool.physical(asyncHead));
+
+        // clear status register
+        writeReg(EHCI_USBSTS, 0x3F);
+
+        // route completion and error interrupts to our handler
+        irqLine = ehciController->config_read<u8>(EHCI_PCI_IRQ_LINE);
+        if(irqLine < 16 && irqControllerCount < EHCI_MAX_CONTROLLERS)
+        {
+            irqControllers[irqControllerCount] = this;
+            irqControllerCount++;
+
+            IRQ_registerHandler(irqLine, ehci_irq_handler);
+            PIC_irq_unmask(irqLine);
+
+            writeReg(EHCI_USBINTR, EHCI_STS_USBINT | EHCI_STS_ERROR);
+        }
+        else
+        {
+            log_warn("[EHCI] No usable IRQ line (%u), falling back to polling\n", irqLine);
+            irqLine = 0xFF;
+        }
+
+        writeReg(EHCI_USBCMD, EHCI_CMD_ITC_1 | EHCI_CMD_ASYNC | EHCI_CMD_RUN);
+
+        PIT_setTimeout(20);
+        while((readReg(EHCI_USBSTS) & EHCI_STS_HALTED) && !PIT_hasTimedOut());
+        PIT_cancelTimeout();
+
+        // route all ports to this controller, the companion
+        // controllers only get the ports we release
+        writeReg(EHCI_CONFIGFLAG, 1);
+        PIT_sleep(5);
+
+        init_root_hub(rootHub, gvfs, controller_node);
+        rootHub.instance_data = this;
+        rootHub.port_reset = ehci_port_reset;
+        rootHub.port_enable = ehci_port_enable;
+        rootHub.port_disable = ehci_port_disable;
+        rootHub.resetTime = EHCI_PORT_RESET_TIME;
+
+        bool portPowerControl = *reinterpret_cast<volatile u32*>(capRegs + EHCI_HCSPARAMS) & (1 << 4);
+
+        // ports are reset together, devices are added from timer callbacks
+        for(u8 port = 0; port < portCount; port++)
+        {
+            u32 reg = EHCI_PORTSC + port * 4;
+
+            if(portPowerControl && (readReg(reg) & EHCI_PORT_POWER) == 0)
+            {
+                writeReg(reg, (readReg(reg) & ~EHCI_PORT_RWC) | EHCI_PORT_POWER);
+            }
+        }
+        if(portPowerControl) PIT_sleep(20);
+
+        for(u8 port = 0; port < portCount; port++)
+        {
+            u32 portsc = readReg(EHCI_PORTSC + port * 4);
+
+            // no devices connected
+            if((portsc & EHCI_PORT_CONNECT) == 0) continue;
+
+            // low speed device
+            if((portsc & EHCI_PORT_LINE_STATUS) == EHCI_PORT_LINE_K)
+            {
+                releasePort(port);
+                continue;
+            }
+
+            enumerate_port(rootHub, port);
+        }
+    }
+
+    void ehci_controller::releasePort(u8 port)
+    {
+        u32 reg = EHCI_PORTSC + port * 4;
+
+        writeReg(reg, (readReg(reg) & ~EHCI_PORT_RWC) | EHCI_PORT_OWNER);
+    }
+    // returns if a high speed device is connected to the port, and resets the device
+    bool ehci_controller::resetPort(u8 port)
+    {
+        u32 reg = EHCI_PORTSC + port * 4;
+        u32 portsc = readReg(reg);
+
+        // no devices connected
+        if((portsc & EHCI_PORT_CONNECT) == 0) return false;
+
+        // low speed device
+        if((portsc & EHCI_PORT_LINE_STATUS) == EHCI_PORT_LINE_K)
+        {
+            releasePort(port);
+            return false;
+        }
+
+        // the enable bit has to be written as 0 while resetting
+        writeReg(reg, (portsc & ~(EHCI_PORT_RWC | EHCI_PORT_ENABLE)) | EHCI_PORT_RESET);
+        PIT_sleep(EHCI_PORT_RESET_TIME);
+        writeReg(reg, readReg(reg) & ~(EHCI_PORT_RWC | EHCI_PORT_RESET));
+
+        // the controller finishes the reset within 2 ms
+        PIT_setTimeout(10);
+        while((readReg(reg) & EHCI_PORT_RESET) && !PIT_hasTimedOut());
+        PIT_cancelTimeout();
+
+        portsc = readReg(reg);
+
+        // only high speed devices get enabled, the rest are full speed
+        if((portsc & EHCI_PORT_ENABLE) == 0)
+        {
+            releasePort(port);
+            return false;
+        }
+
+        // clear the change bits
+        writeReg(reg, portsc);
+        PIT_sleep(USB_TRSTRCY);
+
+        return true;
+    }
+    bool ehci_controller::resetDevice(usb_device& device)
+    {
+        return resetPort(device.portAddress);
+    }
+
+    void ehci_controller::portReset(u16 port, bool reset)
+    {
+        u32 reg = EHCI_PORTSC + port * 4;
+
+        if(reset)
+        {
+            // the enable bit has to be written as 0 while resetting
+            writeReg(reg, (readReg(reg) & ~(EHCI_PORT_RWC | EHCI_PORT_ENABLE)) | EHCI_PORT_RESET);
+            return;
+        }
+
+        writeReg(reg, readReg(reg) & ~(EHCI_PORT_RWC | EHCI_PORT_RESET));
+
+        // the controller finishes the reset within 2 ms
+        PIT_setTimeout(10);
+        while((readReg(reg) & EHCI_PORT_RESET) && !PIT_hasTimedOut());
+        PIT_cancelTimeout();
+    }
+    u8 ehci_controller::portEnable(u16 port)
+    {
+        u32 reg = EHCI_PORTSC + port * 4;
+        u32 portsc = readReg(reg);
+
+        // no devices connected
+        if((portsc & EHCI_PORT_CONNECT) == 0) return USB_PORT_GONE;
+
+        // only high speed devices get enabled, the rest are full speed
+        if((portsc & EHCI_PORT_ENABLE) == 0)
+        {
+            releasePort(port);
+            return USB_PORT_GONE;
+        }
+
+        // clear the change bits
+        writeReg(reg, portsc);
+
+        return USB_PORT_ENABLED;
+    }
+    void ehci_controller::portDisable(u16 port)
+    {
+        u32 reg = EHCI_PORTSC + port * 4;
+        u32 portsc = readReg(reg);
+
+        // belongs to the companion controller
+        if(portsc & EHCI_PORT_OWNER) return;
+
+        writeReg(reg, portsc & ~(EHCI_PORT_RWC | EHCI_PORT_ENABLE));
+    }
+    bool ehci_controller::portsResetting()
+    {
+        return hub_resetting(rootHub);
+    }
+
+    void ehci_controller::linkQH(ehci_queue_head* qh)
+    {
+        qh->horizontalLink = asyncHead->horizontalLink;
+        qh->next = asyncHead->next;
+
+        __asm__ volatile("" ::: "memory");
+
+        asyncHead->horizontalLink = descriptorPool.physical(qh) | EHCI_LINK_QH;
+        asyncHead->next = qh;
+    }
+    void ehci_controller::unlinkQH(ehci_queue_head* qh)
+    {
+        ehci_queue_head* prev = asyncHead;
+        while(prev->next != qh)
+        {
+            // not linked
+            if(prev->next == asyncHead) return;
+            prev = prev->next;
+        }
+
+        prev->horizontalLink = qh->horizontalLink;
+        prev->next = qh->next;
+
+        // ring the doorbell, the controller answers once it dropped cached QHs
+        writeReg(EHCI_USBSTS, EHCI_STS_IAA);
+        writeReg(EHCI_USBCMD, readReg(EHCI_USBCMD) | EHCI_CMD_IAAD);
+
+        PIT_setTimeout(10);
+        while((readReg(EHCI_USBSTS) & EHCI_STS_IAA) == 0 && !PIT_hasTimedOut());
+        PIT_cancelTimeout();
+
+        writeReg(EHCI_USBSTS, EHCI_STS_IAA);
+    }
+
+    ehci_endpoint* ehci_controller::getEndpoint(u8 address, u8 endpoint, u8 packetType, u16 maxPacketSize)
+    {
+        for(size_t i = 0; i < endpointCount; i++)
+        {
+            ehci_endpoint& ep = endpoints[i];
+            if(ep.address == address && ep.endpoint == endpoint && ep.packetType == packetType) return &ep;
+        }
+
+        if(endpointCount >= EHCI_MAX_ENDPOINTS)
+        {
+            log_warn("[EHCI] Too many endpoints\n");
+            return nullptr;
+        }
+
+        if(maxPacketSize == 0)
+        {
+            log_warn("[EHCI] Endpoint %u of device %u has max packet size 0\n", endpoint, address);
+            return nullptr;
+        }
+
+        ehci_qtd_chain dummy = descriptorPool.alloc_qtds(1);
+        ehci_queue_head* qh = descriptorPool.alloc_qh();
+
+        if(dummy.head == nullptr || qh == nullptr)
+        {
+            log_warn("[EHCI] Out of transfer descriptors\n");
+
+            descriptorPool.free_qtds(dummy);
+            if(qh != nullptr) descriptorPool.free_qh(qh);
+            return nullptr;
+        }
+
+        ehci_endpoint& ep = endpoints[endpointCount];
+        endpointCount++;
+
+        ep.address = address;
+        ep.endpoint = endpoint;
+        ep.packetType = packetType;
+        ep.control = packetType == PACKET_SETUP;
+
+        ep.qh = qh;
+        ep.dummy = dummy.head;
+        ep.pendingHead = nullptr;
+        ep.pendingTail = nullptr;
+
+        // control endpoints take the toggle from the qTDs, the
+        // others keep it in the QH across transfers
+        qh->endpointChars = address | (endpoint << 8) | EHCI_QH_HIGH_SPEED | (ep.control ? EHCI_QH_DTC : 0) | (maxPacketSize << 16);
+        qh->endpointCaps = EHCI_QH_MULT_1;
+
+        // the queue waits on the inactive dummy
+        qh->nextQTD = descriptorPool.physical(ep.dummy);
+
+        x86_DisableInterrupts();
+        linkQH(qh);
+        x86_EnableInterrupts();
+
+        return &ep;
+    }
+    void ehci_controller::resetToggles(u8 address, u8 endpointAddress, bool allEndpoints)
+    {
+        u8 packetType = (endpointAddress & 0x80) ? PACKET_IN : PACKET_OUT;
+
+        for(size_t i = 0; i < endpointCount; i++)
+        {
+            ehci_endpoint& ep = endpoints[i];
+            if(ep.address != address || ep.control) continue;
+            if(!allEndpoints && (ep.endpoint != (endpointAddress & 0xF) || ep.packetType != packetType)) continue;
+
+            // the controller only writes the overlay of queues with work
+            if(ep.pendingHead == nullptr) ep.qh->token &= ~EHCI_QTD_TOGGLE;
+        }
+    }
+
+    static std::object_cache<ehci_transfer> transfer_cache;
+
+    // the chain starts in the endpoint's dummy qTD, the
+    // last new qTD becomes the dummy the queue waits on afterwards
+    ehci_transfer* ehci_controller::allocTransfer(ehci_endpoint* endpoint, size_t qtdCount)
+    {
+        ehci_qtd_chain qtds = descriptorPool.alloc_qtds(qtdCount);
+
+        if(qtds.head == nullptr)
+        {
+            log_warn("[EHCI] Out of transfer descriptors\n");
+            return nullptr;
+        }
+
+        ehci_transfer* transfer = transfer_cache.alloc();
+        if(transfer == nullptr)
+        {
+            descriptorPool.free_qtds(qtds);
+            return nullptr;
+        }
+
+        transfer->endpoint = endpoint;
+        transfer->size = 0;
+        transfer->status = 0;
+        transfer->complete = false;
+        transfer->next = nullptr;
+
+        ehci_qtd* newDummy = qtds.tail;
+        transfer->dummy = newDummy;
+
+        ehci_qtd_chain& chain = transfer->chain;
+        chain.head = endpoint->dummy;
+        chain.tail = endpoint->dummy;
+        chain.count = qtdCount;
+
+        chain.head->nextQTD = descriptorPool.physical(qtds.head);
+        chain.head->next = nullptr;
+
+        if(qtdCount > 1)
+        {
+            chain.head->next = qtds.head;
+
+            chain.tail = qtds.head;
+            while(chain.tail->next != newDummy) chain.tail = chain.tail->next;
+            chain.tail->next = nullptr;
+        }
+
+        // a short packet skips the rest of the chain
+        for(ehci_qtd* qtd = chain.head; qtd != nullptr; qtd = qtd->next)
+        {
+            qtd->altNextQTD = descriptorPool.physical(newDummy);
+        }
+
+        newDummy->token = 0;
+        newDummy->nextQTD = EHCI_TERMINATE;
+        newDummy->altNextQTD = EHCI_TERMINATE;
+        newDummy->next = nullptr;
+
+        return transfer;
+    }
+    void ehci_controller::fillQTD(ehci_qtd* qtd, u8 packetType, bool toggle, void* buffer, u32 length)
+    {
+        u32 pid = EHCI_QTD_PID_OUT;
+        if(packetType == PACKET_IN) pid = EHCI_QTD_PID_IN;
+        if(packetType == PACKET_SETUP) pid = EHCI_QTD_PID_SETUP;
+
+        // stays inactive till the chain is submitted
+        qtd->token = (toggle ? EHCI_QTD_TOGGLE : 0) | (length << 16) | EHCI_QTD_CERR | pid;
+
+        ptr_t address = ptr_cast(buffer);
+
+        // pages of the buffer need not be physically contiguous
+        for(size_t i = 0; i < 5; i++)
+        {
+            ptr_t page = (address & 0xFFFFF000) + i * PAGE_SIZE;
+
+            qtd->bufferHi[i] = 0;
+
+            if(length == 0 || page >= address + length)
+            {
+                qtd->buffer[i] = 0;
+                continue;
+            }
+
+            if(i == 0) qtd->buffer[i] = cpu::getPhysicalLocation(reinterpret_cast<void*>(address));
+            else qtd->buffer[i] = cpu::getPhysicalLocation(reinterpret_cast<void*>(page));
+        }
+    }
+    void ehci_controller::submitTransfer(ehci_transfer* transfer)
+    {
+        ehci_endpoint* endpoint = transfer->endpoint;
+        ehci_qtd_chain& chain = transfer->chain;
+
+        chain.tail->token |= EHCI_QTD_IOC;
+
+        for(ehci_qtd* qtd = chain.head->next; qtd != nullptr; qtd = qtd->next) qtd->token |= EHCI_QTD_ACTIVE;
+
+        x86_DisableInterrupts();
+
+        // a halted queue restarts at the endpoint's dummy, which stays the head of
+        // this chain till now, so the IRQ can't skip over it
+        endpoint->dummy = transfer->dummy;
+
+        if(endpoint->pendingTail != nullptr) endpoint->pendingTail->next = transfer;
+        else endpoint->pendingHead = transfer;
+        endpoint->pendingTail = transfer;
+
+        // activating the old dummy hands the whole chain to the controller
+        __asm__ volatile("" ::: "memory");
+        chain.head->token |= EHCI_QTD_ACTIVE;
+
+        x86_EnableInterrupts();
+    }
+
+    // called with interrupts disabled
+    void ehci_controller::retireEndpoint(ehci_endpoint* endpoint)
+    {
+        while(endpoint->pendingHead != nullptr)
+        {
+            ehci_transfer* transfer = endpoint->pendingHead;
+
+            bool active = false;
+            bool halted = false;
+
+            for(ehci_qtd* qtd = transfer->chain.head; qtd != nullptr; qtd = qtd->next)
+            {
+                u32 token = qtd->token;
+
+                if(token & EHCI_QTD_ACTIVE)
+                {
+                    active = true;
+                    break;
+                }
+                if(token & EHCI_QTD_HALTED)
+                {
+                    halted = true;
+                    break;
+                }
+
+                // short packet, the controller went on at the alternate qTD
+                if((token & EHCI_QTD_PID_MASK) == EHCI_QTD_PID_IN && EHCI_QTD_BYTES(token) != 0)
+                {
+                    // control transfers still run their status stage
+                    if(endpoint->control) active = (transfer->chain.tail->token & EHCI_QTD_ACTIVE) != 0;
+                    break;
+                }
+            }
+
+            if(active) return;
+
+            if(halted)
+            {
+                // the endpoint stalled or stopped answering, nothing
+                // queued behind will run
+                for(ehci_transfer* t = transfer; t != nullptr; t = t->next)
+                {
+                    for(ehci_qtd* qtd = t->chain.head; qtd != nullptr; qtd = qtd->next) qtd->token &= ~EHCI_QTD_ACTIVE;
+
+                    t->status = 1;
+                    t->complete = true;
+                }
+
+                endpoint->pendingHead = nullptr;
+                endpoint->pendingTail = nullptr;
+
+                // the controller leaves a halted QH alone, restart it at the dummy
+                endpoint->qh->nextQTD = descriptorPool.physical(endpoint->dummy);
+                endpoint->qh->altNextQTD = EHCI_TERMINATE;
+                endpoint->qh->token &= EHCI_QTD_TOGGLE;
+
+                return;
+            }
+
+            endpoint->pendingHead = transfer->next;
+            if(endpoint->pendingHead == nullptr) endpoint->pendingTail = nullptr;
+
+            transfer->status = 0;
+            transfer->complete = true;
+        }
+    }
+    void ehci_controller::cancelEndpoint(ehci_endpoint* endpoint)
+    {
+        unlinkQH(endpoint->qh);
+
+        x86_DisableInterrupts();
+
+        retireEndpoint(endpoint);
+
+        for(ehci_transfer* t = endpoint->pendingHead; t != nullptr; t = t->next)
+        {
+            for(ehci_qtd* qtd = t->chain.head; qtd != nullptr; qtd = qtd->next) qtd->token &= ~EHCI_QTD_ACTIVE;
+
+            t->status = 3;
+            t->complete = true;
+        }
+
+        endpoint->pendingHead = nullptr;
+        endpoint->pendingTail = nullptr;
+
+        endpoint->qh->nextQTD = descriptorPool.physical(endpoint->dummy);
+        endpoint->qh->altNextQTD = EHCI_TERMINATE;
+        endpoint->qh->token &= EHCI_QTD_TOGGLE;
+
+        linkQH(endpoint->qh);
+
+        x86_EnableInterrupts();
+    }
+
+    // packet level counters of a chain that is done, the
+    // controller retries NAKs on its own without reporting them
+    static void recordChainStats(endpoint_stats* stats, ehci_qtd* qtd, bool timedOut)
+    {
+        if(stats == nullptr) return;
+
+        if(timedOut) stats->timeouts++;
+
+        for(; qtd != nullptr; qtd = qtd->next)
+        {
+            u32 token = qtd->token;
+
+            if(token & EHCI_QTD_XACT_ERROR) stats->timeouts++;
+            else if((token & EHCI_QTD_HALTED) && (token & (EHCI_QTD_BUFFER_ERROR | EHCI_QTD_BABBLE)) == 0) stats->stalls++;
+
+            // counts down once per bus error
+            stats->retries += 3 - ((token >> 10) & 0x3);
+        }
+    }
+
+    u8 ehci_controller::waitTransfer(ehci_transfer* transfer, endpoint_stats* stats)
+    {
+        ehci_endpoint* endpoint = transfer->endpoint;
+
+        PIT_setTimeout(EHCI_TRANSFER_TIMEOUT);
+
+        // sleep until the controller interrupts us or the transfer times out
+        while(!transfer->complete && !PIT_hasTimedOut())
+        {
+            // without an IRQ line the queue has to be polled
+            if(irqLine >= 16)
+            {
+                x86_DisableInterrupts();
+                retireEndpoint(endpoint);
+                x86_EnableInterrupts();
+            }
+            else cpu::halt();
+        }
+
+        PIT_cancelTimeout();
+
+        if(!transfer->complete) cancelEndpoint(endpoint);
+
+        u8 status = transfer->status;
+
+        recordChainStats(stats, transfer->chain.head, status == 3);
+
+        descriptorPool.free_qtds(transfer->chain);
+        transfer_cache.free(transfer);
+
+        return status;
+    }
+
+    bool ehci_controller::handleIRQ()
+    {
+        u32 status = readReg(EHCI_USBSTS);
+
+        // not raised by this controller
+        if((status & (EHCI_STS_USBINT | EHCI_STS_ERROR)) == 0) return false;
+
+        // acknowledge the interrupt (R/WC)
+        writeReg(EHCI_USBSTS, status & (EHCI_STS_USBINT | EHCI_STS_ERROR));
+
+        for(size_t i = 0; i < endpointCount; i++)
+        {
+            if(endpoints[i].pendingHead != nullptr) retireEndpoint(&endpoints[i]);
+        }
+
+        return true;
+    }
+
+    bool ehci_controller::controlTransfer(const usb_device& device, request_packet rpacket, void* buffer, u16 size, bool in)
+    {
+        ehci_endpoint* endpoint = getEndpoint(device.address, CTRL_ENDPOINT, PACKET_SETUP, device.maxPacketSize);
+        if(endpoint == nullptr) return false;
+
+        size_t dataCount = qtdCount(buffer, size, device.maxPacketSize);
+
+        ehci_transfer* transfer = allocTransfer(endpoint, dataCount + 2);
+        if(transfer == nullptr) return false;
+
+        transfer->size = size;
+
+        // the first qTD describes the control packet
+        ehci_qtd* qtd = transfer->chain.head;
+        std::memcpy(&rpacket, qtd->data, sizeof(request_packet));
+        fillQTD(qtd, PACKET_SETUP, false, qtd->data, sizeof(request_packet));
+
+        ehci_qtd* status = transfer->chain.tail;
+
+        // data stage starts with DATA1
+        bool toggle = true;
+        u32 offset = 0;
+
+        for(qtd = qtd->next; qtd != status; qtd = qtd->next)
+        {
+            u32 length = qtdLength(ptr_cast(buffer) + offset, size - offset, device.maxPacketSize);
+
+            fillQTD(qtd, in ? PACKET_IN : PACKET_OUT, toggle, (u8*)buffer + offset, length);
+            // a short packet ends the data stage
+            qtd->altNextQTD = descriptorPool.physical(status);
+
+            if(DivRoundUp(length, device.maxPacketSize) & 1) toggle = !toggle;
+            offset += length;
+        }
+
+        // status stage, DATA1 in the other direction
+        fillQTD(status, (in && size != 0) ? PACKET_OUT : PACKET_IN, true, nullptr, 0);
+
+        submitTransfer(transfer);
+
+        u8 result = waitTransfer(transfer, get_endpoint_stats(device, CTRL_ENDPOINT, in));
+
+        if(result != 0)
+        {
+            const char* name = in ? "ControlIn" : "ControlOut";
+
+            switch (result)
+            {
+            case 0x3:
+                log_warn("[EHCI][%s] USB device timed out. Info: \n", name);
+                break;
+            case 0x1:
+                log_warn("[EHCI][%s] ERROR USB device. Info: \n", name);
+                break;
+            default:
+                break;
+            }
+            log_warn("\tPort: %x\n", device.portAddress);
+            log_warn("\tAddress: %x\n", device.address);
+            log_warn("\tRequest: %x\n", rpacket.request);
+            log_warn("\tRequest Type: %x\n", rpacket.requestType);
+            log_warn("\tValue: %x\n", rpacket.value);
+            log_warn("\tIndex: %x\n", rpacket.index);
+            log_warn("\tMax Packet Size: %x\n", device.maxPacketSize);
+            log_warn("\tRequested Length: %x\n", size);
+        }
+
+        return result == 0;
+    }
+
+    bool ehci_controller::controlIn(const usb_device& device, request_packet rpacket, void* buffer, u16 size)
+    {
+        return controlTransfer(device, rpacket, buffer, size, true);
+    }
+    bool ehci_controller::controlOut(const usb_device& device, request_packet rpacket, u16 size)
+    {
+        bool status = controlTransfer(device, rpacket, nullptr, 0, false);
+        if(!status) return false;
+
+        if(rpacket.request == USB_SET_CONFIG && (rpacket.requestType & 0b11) == USB_REP_DEVICE)
+        {
+            resetToggles(device.address, 0, true);
+        }
+        // ENDPOINT_HALT
+        if(rpacket.request == USB_CLEAR_FEATURE && (rpacket.requestType & 0b11) == USB_REP_ENDPOINT && rpacket.value == 0)
+        {
+            resetToggles(device.address, rpacket.index, false);
+        }
+
+        return true;
+    }
+
+    u32 ehci_controller::maxBulkTransfer(u16 maxPacketSize)
+    {
+        // half the pool, the rest is left to the other endpoints,
+        // qtdLength never cuts a qTD shorter than 16KiB less a packet
+        return (descriptorPool.total_qtds() / 2) * (EHCI_QTD_MAX_SIZE - PAGE_SIZE - maxPacketSize);
+    }
+
+    ehci_transfer* ehci_controller::bulkQueue(const usb_device& device, u8 endpoint, u16 maxPacketSize, void* buffer, u32 size, u8 packetType)
+    {
+        ehci_endpoint* ep = getEndpoint(device.address, endpoint, packetType, maxPacketSize);
+        if(ep == nullptr) return nullptr;
+
+        // up to 20 KiB per qTD
+        size_t count = qtdCount(buffer, size, maxPacketSize);
+        if(count == 0) count = 1;
+
+        ehci_transfer* transfer = allocTransfer(ep, count);
+        if(transfer == nullptr) return nullptr;
+
+        transfer->size = size;
+
+        u32 offset = 0;
+        for(ehci_qtd* qtd = transfer->chain.head; qtd != nullptr; qtd = qtd->next)
+        {
+            u32 length = qtdLength(ptr_cast(buffer) + offset, size - offset, maxPacketSize);
+
+            // the QH keeps the toggle
+            fillQTD(qtd, packetType, false, (u8*)buffer + offset, length);
+
+            offset += length;
+        }
+
+        submitTransfer(transfer);
+
+        return transfer;
+    }
+    bool ehci_controller::bulkWait(const usb_device& device, ehci_transfer* transfer)
+    {
+        ehci_endpoint* endpoint = transfer->endpoint;
+        u32 size = transfer->size;
+
+        u8 status = waitTransfer(transfer, get_endpoint_stats(device, endpoint->endpoint, endpoint->packetType == PACKET_IN));
+
+        if(status != 0)
+        {
+            const char* name = endpoint->packetType == PACKET_IN ? "BulkIn" : "BulkOut";
+
+            switch (status)
+            {
+            case 0x3:
+                log_warn("[EHCI][%s] USB device timed out. Info: \n", name);
+                break;
+            case 0x1:
+                log_warn("[EHCI][%s] ERROR USB device. Info: \n", name);
+                break;
+            default:
+                break;
+            }
+            log_warn("\tPort: %x\n", device.portAddress);
+            log_warn("\tAddress: %x\n", device.address);
+            log_warn("\tEndpoint: %x\n", endpoint->endpoint);
+            log_warn("\tSent Length: %x\n", size);
+        }
+
+        return status == 0;
+    }
+
+    bool ehci_controller::bulkIn(const usb_device& device, u8 endpoint, u16 maxPacketSize, void* buffer, u32 size)
+    {
+        ehci_transfer* transfer = bulkQueue(device, endpoint, maxPacketSize, buffer, size, PACKET_IN);
+        if(transfer == nullptr) return false;
+
+        return bulkWait(device, transfer);
+    }
+    bool ehci_controller::bulkOut(const usb_device& device, u8 endpoint, u16 maxPacketSize, void* buffer, u32 size)
+    {
+        ehci_transfer* transfer = bulkQueue(device, endpoint, maxPacketSize, buffer, size, PACKET_OUT);
+        if(transfer == nullptr) return false;
+
+        return bulkWait(device, transfer);
+    }
+
+    namespace ehci
+    {
+        bool reset_device(void* instance_data, usb_device& device)
+        {
+            return reinterpret_cast<ehci_controller*>(instance_data)->resetDevice(device);
+        }
+
+        bool controlIn(void* instance_data, const usb_device& device, request_packet rpacket, void* buffer, u16 size)
+        {
+            return reinterpret_cast<ehci_controller*>(instance_data)->controlIn(device, rpacket, buffer, size);
+        }
+        bool controlOut(void* instance_data, const usb_device& device, request_packet rpacket, u16 size)
+        {
+            return reinterpret_cast<ehci_controller*>(instance_data)->controlOut(device, rpacket, size);
+        }
+
+        bool bulkIn(void* instance_data, const usb_device& device, u8 endpoint, u16 maxPacketSize, void* buffer, u32 size)
+        {
+            return reinterpret_cast<ehci_controller*>(instance_data)->bulkIn(device, endpoint, maxPacketSize, buffer, size);
+        }
+        bool bulkOut(void* instance_data, const usb_device& device, u8 endpoint, u16 maxPacketSize, void* buffer, u32 size)
+        {
+            return reinterpret_cast<ehci_controller*>(instance_data)->bulkOut(device, endpoint, maxPacketSize, buffer, size);
+        }
+
+        void* bulkQueue(void* instance_data, const usb_device& device, u8 endpoint, u16 maxPacketSize, void* buffer, u32 size, u8 packetType)
+        {
+            return reinterpret_cast<ehci_controller*>(instance_data)->bulkQueue(device, endpoint, maxPacketSize, buffer, size, packetType);
+        }
+        bool bulkWait(void* instance_data, const usb_device& device, void* transfer)
+        {
+            return reinterpret_cast<ehci_controller*>(instance_data)->bulkWait(device, reinterpret_cast<ehci_transfer*>(transfer));
+        }
+        u32 maxBulkTransfer(void* instance_data, u16 maxPacketSize)
+        {
+            return reinterpret_cast<ehci_controller*>(instance_data)->maxBulkTransfer(maxPacketSize);
+        }
+    }
+
+    usb_controller ehci_controller::as_generic_controller()
+    {
+        usb_controller controller;
+        controller.instance_data = (void*)this;
+
+        controller.reset_device = ehci::reset_device;
+        controller.controlIn = ehci::controlIn;
+        controller.controlOut = ehci::controlOut;
+        controller.bulkIn = ehci::bulkIn;
+        controller.bulkOut = ehci::bulkOut;
+        controller.bulkQueue = ehci::bulkQueue;
+        controller.bulkWait = ehci::bulkWait;
+        controller.maxBulkTransfer = ehci::maxBulkTransfer;
+
+        return controller;
+    }
+
+    struct ehci_kdriver
+    {
+        vfs::node_t* pci_node;
+        std::vector<vfs::node_t*> pci_devices;
+        std::vector<ehci_controller*> controllers;
+    };
+
+    const char* ehci_kdriver_error_desc(u32 error)
+    {
+        const char* error_array[] = {
+            "No Failiure",
+            "Event parsing failed[this driver does not handle the given event]",
+            "Critical Failiure",
+            "Failed to initialize ehci controller detected on pci bus"
+        };
+
+        if(error >= sizeof(error_array)/sizeof(char*)) return nullptr;
+
+        return error_array[error];
+    }
+
+    static bool is_ehci_controller(bus::pci::device* pci_device)
+    {
+        return pci_device->classCode == 0x0C && pci_device->subClass == 0x03 && pci_device->progIF == 0x20;
+    }
+
+    static bool setup_ehci_controller(kernel_driver* driver, vfs::node_t* dnode)
+    {
+        ehci_kdriver& self = *reinterpret_cast<ehci_kdriver*>(driver->data);
+        bus::pci::device* pci_device = reinterpret_cast<bus::pci::device*>(dnode->data);
+
+        self.pci_devices.push_back(dnode);
+
+        ehci_controller* controller = new usb::ehci_controller(pci_device);
+        if(!controller->Init())
+        {
+            delete controller;
+            return false;
+        }
+
+        // make a new node for the ehci controller
+        std::string name = "ehci" + std::utos(self.controllers.size());
+        vfs::node_t node = vfs::make_node(name.copy().take(), true);
+
+        // set the controller
+        node.data = new usb_controller(controller->as_generic_controller());
+
+        vfs::add_vnode(driver->gvfs, "/dev/", node);
+
+        name = "/dev/" + name;
+        vfs::node_t* ctrl_node = vfs::get_node(driver->gvfs, name.c_str());
+
+        // setup the controller and detect new devices
+        controller->Setup(driver->gvfs, ctrl_node);
+
+        self.controllers.push_back(controller);
+
+        return true;
+    }
+
+    u32 ehci_kdriver_init(kernel_driver* driver)
+    {
+        ehci_kdriver ehci_driver;
+        ehci_driver.pci_node = vfs::get_node(driver->gvfs, "/hw/pci");
+
+        if(IS_ERR_PTR(ehci_driver.pci_node)) return DRIVER_EXEC_FAIL;
+
+        driver->data = new ehci_kdriver(ehci_driver);
+
+        // EHCI controllers are set up before the events of their companion
+        // controllers are processed, so those only see the ports released to them
+        for(vfs::node_t* dnode = ehci_driver.pci_node->children_head; dnode != nullptr; dnode = dnode->next)
+        {
+            bus::pci::device* pci_device = reinterpret_cast<bus::pci::device*>(dnode->data);
+            if(!is_ehci_controller(pci_device)) continue;
+
+            if(!setup_ehci_controller(driver, dnode)) log_warn("[EHCI] Failed to initialize controller %s\n", dnode->name);
+        }
+
+        ehci_kdriver& self = *reinterpret_cast<ehci_kdriver*>(driver->data);
+
+        // the ports of all controllers reset together, wait till
+        // every full and low speed device has been released
+        bool resetting = true;
+        while(resetting)
+        {
+            PIT_runTimers();
+
+            resetting = false;
+            for(size_t i = 0; i < self.controllers.size(); i++) resetting |= self.controllers[i]->portsResetting();
+        }
+
+        return DRIVER_SUCCESS;
+    }
+    u32 ehci_kdriver_process_event(kernel_driver* driver, vfs::event_t event)
+    {
+        if(event.flags != vfs::EVENT_DEVICE_ADD) return DRIVER_PARSE_FAIL;
+        if(event.trigger_node == nullptr) return DRIVER_PARSE_FAIL;
+
+        vfs::node_t* dnode = event.trigger_node;
+        ehci_kdriver& self = *reinterpret_cast<ehci_kdriver*>(driver->data);
+
+        // not a pci device
+        if(dnode->parent != self.pci_node) return DRIVER_PARSE_FAIL;
+        bus::pci::device* pci_device = reinterpret_cast<bus::pci::device*>(dnode->data);
+
+        if(!is_ehci_controller(pci_device)) return DRIVER_PARSE_FAIL;
+
+        // already set up by init
+        for(size_t i = 0; i < self.pci_devices.size(); i++)
+        {
+            if(self.pci_devices[i] == dnode) return DRIVER_SUCCESS;
+        }
+
+        if(!setup_ehci_controller(driver, dnode)) return 0x3;
+
+        return DRIVER_SUCCESS;
+    }
+
+    kernel_driver get_ehci_driver(vfs::vfs_t* gvfs)
+    {
+        return kernel_driver{
+            // driver name and desciption
+            .name = "dvr_ehci",
+            .desc = "USB 2.0 EHCI Driver",
+
+            // the filesystem
+            .gvfs = gvfs,
+            .data = nullptr,
+
+            // some driver functions
+            .get_error_desc = ehci_kdriver_error_desc,
+            .init = ehci_kdriver_init,
+            .process_event = ehci_kdriver_process_event,
+
+            // the class of the driver
+            .uid_class = UID_CLASS_PCI
+        };
+    }
+}
@@ -0,0 +1,223 @@
+#pragma once
+
+#include <includes.h>
+#include "../defs.hpp"
+#include "../../driver_defs.hpp"
+#include "../enumeration.hpp"
+#include "../stats.hpp"
+
+#include <std/std.hpp>
+#include <std/ds.hpp>
+#include <hw/pci/pci.hpp>
+
+namespace drivers::usb
+{
+    // queue element transfer descriptor, 64-bit capable layout
+    struct ehci_qtd
+    {
+        u32 nextQTD;
+        u32 altNextQTD;
+        u32 token;
+        u32 buffer[5];
+        u32 bufferHi[5];
+
+        // software fields, never touched by the controller
+        ehci_qtd* next;
+        // holds the setup packet of control transfers
+        u8  data[8];
+    }_packed;
+
+    struct ehci_queue_head
+    {
+        u32 horizontalLink;
+        u32 endpointChars;
+        u32 endpointCaps;
+        u32 currentQTD;
+
+        // transfer overlay
+        u32 nextQTD;
+        u32 altNextQTD;
+        u32 token;
+        u32 buffer[5];
+        u32 bufferHi[5];
+
+        // software fields, pads the QH to a multiple of 32 bytes
+        ehci_queue_head* next;
+        u32 resv[6];
+    }_packed;
+
+    // qTDs linked through both nextQTD and next
+    struct ehci_qtd_chain
+    {
+        ehci_qtd* head;
+        ehci_qtd* tail;
+        size_t count;
+    };
+
+    // physically contiguous pool of descriptors owned by one controller
+    class ehci_pool
+    {
+        private:
+            u8* base;
+            ptr_t basePhys;
+            size_t poolSize;
+            size_t poolHead;
+
+            ehci_qtd* freeQTDs;
+            size_t freeQTDCount;
+            size_t totalQTDCount;
+            ehci_queue_head* freeQHs;
+
+        public:
+            bool init(size_t pages);
+
+            // permanent allocations, only valid before build()
+            void* carve(size_t size, size_t align);
+            // split the rest of the pool into qhCount QHs and qTDs
+            void build(size_t qhCount);
+
+            ehci_qtd_chain alloc_qtds(size_t count);
+            void free_qtds(ehci_qtd_chain& chain);
+            size_t total_qtds() const { return totalQTDCount; }
+
+            ehci_queue_head* alloc_qh();
+            void free_qh(ehci_queue_head* qh);
+
+            // physical address of a pointer inside the pool
+            ptr_t physical(const void* ptr) const
+            {
+                return basePhys + (reinterpret_cast<const u8*>(ptr) - base);
+            }
+    };
+
+    struct ehci_endpoint;
+
+    // a qTD chain that is currently queued on an endpoint
+    struct ehci_transfer
+    {
+        ehci_qtd_chain chain;
+        ehci_endpoint* endpoint;
+        u32 size;
+
+        // becomes the endpoint's dummy once the chain is submitted
+        ehci_qtd* dummy;
+
+        // set by the IRQ handler once the chain retires
+        volatile u8 status;
+        volatile bool complete;
+
+        // next chain queued on the same endpoint
+        ehci_transfer* next;
+    };
+
+    // a device endpoint, its transfers are queued on one QH
+    // that stays in the asynchronous schedule
+    struct ehci_endpoint
+    {
+        u8 address;
+        u8 endpoint;
+        u8 packetType;
+        bool control;
+
+        ehci_queue_head* qh;
+        // inactive qTD the queue waits on, the next chain starts in it
+        ehci_qtd* dummy;
+
+        ehci_transfer* pendingHead;
+        ehci_transfer* pendingTail;
+    };
+
+#define EHCI_MAX_ENDPOINTS 32
+
+    class ehci_controller
+    {
+        private:
+            bus::pci::device* ehciController;
+
+            volatile u8* capRegs;
+            volatile u8* opRegs;
+
+            u8 portCount;
+            root_hub rootHub;
+
+            ehci_pool descriptorPool;
+            ehci_queue_head* asyncHead;
+
+            u8 irqLine;
+
+            ehci_endpoint endpoints[EHCI_MAX_ENDPOINTS];
+            u8 endpointCount;
+
+            u32 readReg(u32 reg);
+            void writeReg(u32 reg, u32 value);
+
+            // take the controller from the BIOS
+            void takeOwnership();
+
+            bool resetPort(u8 port);
+            // full and low speed devices are handled by the companion controller
+            void releasePort(u8 port);
+
+            void linkQH(ehci_queue_head* qh);
+            // waits till the controller no longer caches the QH
+            void unlinkQH(ehci_queue_head* qh);
+
+            ehci_endpoint* getEndpoint(u8 address, u8 endpoint, u8 packetType, u16 maxPacketSize);
+            // the device resets its toggles on SET_CONFIGURATION and CLEAR_FEATURE(HALT)
+            void resetToggles(u8 address, u8 endpointAddress, bool allEndpoints);
+
+            // reserves qtdCount qTDs, starting with the endpoint's dummy
+            // the endpoint only moves on to the new dummy in submitTransfer
+            ehci_transfer* allocTransfer(ehci_endpoint* endpoint, size_t qtdCount);
+            void fillQTD(ehci_qtd* qtd, u8 packetType, bool toggle, void* buffer, u32 length);
+            void submitTransfer(ehci_transfer* transfer);
+            // waits for the transfer and releases it, returns its status
+            u8 waitTransfer(ehci_transfer* transfer, endpoint_stats* stats);
+
+            // completes the transfers that have retired, in queue order
+            void retireEndpoint(ehci_endpoint* endpoint);
+            // fails every transfer queued on the endpoint
+            void cancelEndpoint(ehci_endpoint* endpoint);
+
+            bool controlTransfer(const usb_device& device, request_packet rpacket, void* buffer, u16 size, bool in);
+
+        public:
+            ehci_controller(bus::pci::device* device);
+
+            bool Init();
+            void Setup(vfs::vfs_t* gvfs, vfs::node_t* controller_node);
+
+            bool resetDevice(usb_device& device);
+
+            // root hub hooks, ports are enumerated by timer callbacks
+            void portReset(u16 port, bool reset);
+            u8 portEnable(u16 port);
+            void portDisable(u16 port);
+            // true till every port is either enumerating or released to the companions
+            bool portsResetting();
+
+            // called from the IRQ line shared by this controller
+            // returns true if the interrupt was raised by this controller
+            bool handleIRQ();
+
+            bool controlIn(const usb_device& device, request_packet rpacket, void* buffer, u16 size);
+            bool controlOut(const usb_device& device, request_packet rpacket, u16 size);
+
+            bool bulkIn(const usb_device& device, u8 endpoint, u16 maxPacketSize, void* buffer, u32 size);
+            bool bulkOut(const usb_device& device, u8 endpoint, u16 maxPacketSize, void* buffer, u32 size);
+
+            // a transfer takes one qTD per 16-20KiB out of the shared pool
+            u32 maxBulkTransfer(u16 maxPacketSize);
+            // queue a bulk transfer behind the ones pending on the endpoint,
+            // returns nullptr on failure
+            ehci_transfer* bulkQueue(const usb_device& device, u8 endpoint, u16 maxPacketSize, void* buffer, u32 size, u8 packetType);
+            // wait for a queued bulk transfer and release it
+            bool bulkWait(const usb_device& device, ehci_transfer* transfer);
+
+            // ehci_controller should be alive for
+            // as long as usb_controller is.
+            usb_controller as_generic_controller();
+    };
+
+    kernel_driver get_ehci_driver(vfs::vfs_t* gvfs);
+}
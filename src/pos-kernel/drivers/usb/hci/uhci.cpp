@@ -1,11 +1,18 @@
 #include "uhci.hpp"
+#include "../stats.hpp"
 
 #include <c/math.h>
 #include <io/io.h>
 #include <hw/pit/PIT.h>
 #include <arch/x86.h>
+#include <arch/IRQ/IRQ.h>
+#include <arch/IRQ/PIC.h>
 #include <std/std.hpp>
+#include <std/memory/object_cache.hpp>
 #include <cpu/paging.hpp>
+#include <cpu/memory.hpp>
+#include <cpu/dma.hpp>
+#include <cpu/exceptions.hpp>
 
 #define GLOBAL_RESET_COUNT 5
 
@@ -17,6 +24,34 @@
 #define UHCI_FRADDR  0x8
 #define UHCI_PCI_LEGACY  0xC0
 #define UHCI_PORT_BASE   0x10
+#define UHCI_PCI_IRQ_LINE 0x3C
+
+#define UHCI_STS_USBINT  (1 << 0)
+#define UHCI_STS_ERROR   (1 << 1)
+
+#define UHCI_PORT_CONNECT        (1 << 0)
+#define UHCI_PORT_CONNECT_CHANGE (1 << 1)
+#define UHCI_PORT_ENABLE         (1 << 2)
+#define UHCI_PORT_ENABLE_CHANGE  (1 << 3)
+#define UHCI_PORT_LOW_SPEED      (1 << 8)
+#define UHCI_PORT_RESET          (1 << 9)
+// write 1 to clear
+#define UHCI_PORT_RWC (UHCI_PORT_CONNECT_CHANGE | UHCI_PORT_ENABLE_CHANGE)
+
+#define UHCI_INTR_TIMEOUT_CRC (1 << 0)
+#define UHCI_INTR_IOC         (1 << 2)
+#define UHCI_INTR_SHORT       (1 << 3)
+
+#define UHCI_TD_ACTIVE   (1 << 23)
+#define UHCI_TD_IOC      (1 << 24)
+#define UHCI_TD_SPD      (1 << 29)
+// error counter, a packet fails after 3 bus errors
+#define UHCI_TD_CERR     (3 << 27)
+#define UHCI_TD_STALLED  (1 << 22)
+#define UHCI_TD_NAK      (1 << 19)
+#define UHCI_TD_CRC_TIMEOUT (1 << 18)
+// stalled, data buffer error, babble, CRC/timeout, bitstuff
+#define UHCI_TD_ERROR    (0x76 << 16)
 
 #define UHCI_TD 0b00
 #define UHCI_QH 0b10
@@ -27,30 +62,25 @@
 #define UHCI_QBulk        9
 #define UHCI_QUEUE_COUNT 10
 
+#define UHCI_DEPTH_FIRST  (1 << 2)
+#define UHCI_FRNUM_MASK   0x7FF
+#define UHCI_FSBR_DEFAULT true
+
 #define PORT_RESTART_TRIES 10
 
+#define UHCI_TRANSFER_TIMEOUT 1000
+#define UHCI_MAX_CONTROLLERS  8
+
+// 64 KiB: frame list, schedule, then transfer QHs and TDs
+#define UHCI_POOL_PAGES    16
+#define UHCI_POOL_QH_COUNT 64
+// bulk transfers are split into chains of at most this many packets
+#define UHCI_MAX_CHAIN_PACKETS 512
+
 namespace drivers::usb
 {
     using namespace bus;
 
-    struct device_desc
-    {
-        u8  length;
-        u8  descType;
-        u16 bcdUSB;
-        u8  deviceClass;
-        u8  subClass;
-        u8  protocolCode;
-        u8  maxPacketSize;
-        u16 vendorID;
-        u16 productID;
-        u16 bcdDevice;
-        u8  iManufacture;
-        u8  iProduct;
-        u8  iSerialNumber;
-        u8  configCount;
-    }_packed;
-
     void printWideString(char* string, u8 byteLength)
     {
         for(int i = 0; i < (byteLength / 2); i++)
@@ -70,6 +100,145 @@ namespace drivers::usb
         out[srcByteLength / 2] = 0;
     }
 
+    // controllers that have an IRQ handler registered
+    static uhci_controller* irqControllers[UHCI_MAX_CONTROLLERS];
+    static size_t irqControllerCount = 0;
+
+    void _no_stack_trace uhci_irq_handler(Registers* registers)
+    {
+        // IRQ lines can be shared between controllers,
+        // every controller checks its own status register
+        for(size_t i = 0; i < irqControllerCount; i++)
+        {
+            irqControllers[i]->handleIRQ();
+        }
+    }
+
+    static void uhci_port_reset(void* instance_data, u16 port, bool reset)
+    {
+        reinterpret_cast<uhci_controller*>(instance_data)->portReset(port, reset);
+    }
+    static u8 uhci_port_enable(void* instance_data, u16 port)
+    {
+        return reinterpret_cast<uhci_controller*>(instance_data)->portEnable(port);
+    }
+    static void uhci_port_disable(void* instance_data, u16 port)
+    {
+        reinterpret_cast<uhci_controller*>(instance_data)->portDisable(port);
+    }
+
+    bool uhci_pool::init(size_t pages)
+    {
+        // the frame list at the start of the pool must be page aligned
+        cpu::dma::dma_buffer memory = cpu::dma::alloc(pages * PAGE_SIZE, PAGE_SIZE);
+        if(memory.virt == nullptr) return false;
+
+        base = (u8*)memory.virt;
+        basePhys = memory.phys;
+        poolSize = pages * PAGE_SIZE;
+        poolHead = 0;
+
+        freeTDs = nullptr;
+        freeTDCount = 0;
+        totalTDCount = 0;
+        freeQHs = nullptr;
+
+        std::memset(base, 0, poolSize);
+
+        return true;
+    }
+    void* uhci_pool::carve(size_t size, size_t align)
+    {
+        // align is a power of 2
+        poolHead = (poolHead + align - 1) & ~(align - 1);
+        if(poolHead + size > poolSize) return nullptr;
+
+        void* ptr = base + poolHead;
+        poolHead += size;
+
+        return ptr;
+    }
+    void uhci_pool::build(size_t qhCount)
+    {
+        uhci_queue_head* qhs = (uhci_queue_head*)carve(qhCount * sizeof(uhci_queue_head), 16);
+        for(size_t i = 0; qhs != nullptr && i < qhCount; i++) free_qh(&qhs[i]);
+
+        poolHead = (poolHead + sizeof(uhci_td) - 1) & ~(sizeof(uhci_td) - 1);
+
+        // everything that is left are TDs
+        uhci_td* tds = (uhci_td*)(base + poolHead);
+        size_t tdCount = (poolSize - poolHead) / sizeof(uhci_td);
+        poolHead = poolSize;
+
+        // push in reverse, so chains come out in address order
+        for(size_t i = tdCount; i > 0; i--)
+        {
+            tds[i - 1].next = freeTDs;
+            freeTDs = &tds[i - 1];
+        }
+        freeTDCount = tdCount;
+        totalTDCount = tdCount;
+    }
+
+    uhci_td_chain uhci_pool::alloc_tds(size_t count)
+    {
+        uhci_td_chain chain = { nullptr, nullptr, 0 };
+        if(count == 0 || count > freeTDCount) return chain;
+
+        chain.head = freeTDs;
+        chain.count = count;
+
+        uhci_td* td = freeTDs;
+        for(size_t i = 0; i < count; i++)
+        {
+            uhci_td* next = td->next;
+
+            td->ctrlStatus = 0;
+            td->packetHeader = 0;
+            td->bufferPointer = 0;
+            td->linkPointer = (i == count - 1) ? UHCI_Invalid : physical(next);
+
+            chain.tail = td;
+            td = next;
+        }
+
+        freeTDs = td;
+        freeTDCount -= count;
+        chain.tail->next = nullptr;
+
+        return chain;
+    }
+    void uhci_pool::free_tds(uhci_td_chain& chain)
+    {
+        if(chain.head == nullptr) return;
+
+        chain.tail->next = freeTDs;
+        freeTDs = chain.head;
+        freeTDCount += chain.count;
+
+        chain = { nullptr, nullptr, 0 };
+    }
+
+    uhci_queue_head* uhci_pool::alloc_qh()
+    {
+        uhci_queue_head* qh = freeQHs;
+        if(qh == nullptr) return nullptr;
+
+        freeQHs = qh->next;
+
+        qh->ptrHorizontal = UHCI_Invalid;
+        qh->ptrVertical = UHCI_Invalid;
+        qh->next = nullptr;
+        qh->vert = nullptr;
+
+        return qh;
+    }
+    void uhci_pool::free_qh(uhci_queue_head* qh)
+    {
+        qh->next = freeQHs;
+        freeQHs = qh;
+    }
+
     void globalResetController(pci::device* device)
     {
         // reset controller
@@ -81,7 +250,8 @@ namespace drivers::usb
         }
     }
 
-    uhci_controller::uhci_controller(pci::device* device) : uhciController(device), device_count(0) { }
+    uhci_controller::uhci_controller(pci::device* device) : uhciController(device), portCount(0), irqLine(0xFF), activeTransfer(nullptr), endpointCount(0),
+                                                            fsbrEnabled(UHCI_FSBR_DEFAULT), bulkBytes(0), bulkFrames(0), bulkLastFrame(0) { }
 
     // returns if a USB port is present
     bool uhci_controller::isPortPresent(u16 portID)
@@ -130,7 +300,7 @@ namespace drivers::usb
             }
 
             // check the enable bit
-            if(uhciController->inw(UHCI_PORT_BASE) & (1 << 2))
+            if(uhciController->inw(UHCI_PORT_BASE + portID) & (1 << 2))
             {
                 // enabled
                 return true;
@@ -143,31 +313,46 @@ namespace drivers::usb
         return false;
     }
 
+    // link the last QH of a queue continues with
+    u32 uhci_controller::queueTailLink(u8 queueID)
+    {
+        // control transfers fall through to the bulk queue
+        if(queueID == UHCI_QControl) return descriptorPool.physical(&uhciQueueHeads[UHCI_QBulk]) | UHCI_QH;
+
+        // bandwidth reclamation: loop back to the bulk queue, so bulk
+        // transfers use all of the frame left after periodic work.
+        // the loop only exists while a bulk QH is queued, an empty
+        // bulk queue falls through to the terminating horizontal link
+        if(queueID == UHCI_QBulk && fsbrEnabled) return descriptorPool.physical(&uhciQueueHeads[UHCI_QBulk]) | UHCI_QH;
+
+        return UHCI_Invalid;
+    }
+
     // insert QH to queue indicated by queueID
     void uhci_controller::insertToQueue(uhci_queue_head* qh, u8 queueID)
     {
+        qh->next = nullptr;
+        qh->ptrHorizontal = queueTailLink(queueID);
+
         // first time
         if((uhciQueueHeads[queueID].ptrVertical & UHCI_Invalid) == UHCI_Invalid)
         {
-            uhciQueueHeads[queueID].ptrVertical = cpu::getPhysicalLocation(qh) | UHCI_QH;
-            uhciQueueHeads[queueID].vert = qh;
-            qh->next = nullptr;
             qh->vert = &uhciQueueHeads[queueID];
-            qh->ptrHorizontal = UHCI_Invalid;
+
+            uhciQueueHeads[queueID].vert = qh;
+            uhciQueueHeads[queueID].ptrVertical = descriptorPool.physical(qh) | UHCI_QH;
         }
         else
         {
             uhci_queue_head* lastQH = uhciQueueHeads[queueID].vert;
 
             // get the last queue head.
-            while(lastQH != nullptr) lastQH = lastQH->next;
+            while(lastQH->next != nullptr) lastQH = lastQH->next;
 
-            lastQH->next = qh;
-            lastQH->ptrHorizontal = cpu::getPhysicalLocation(qh) | UHCI_QH;
-
-            qh->next = nullptr;
             qh->vert = nullptr;
-            qh->ptrHorizontal = UHCI_Invalid;
+
+            lastQH->next = qh;
+            lastQH->ptrHorizontal = descriptorPool.physical(qh) | UHCI_QH;
         }
     }
 
@@ -177,11 +362,12 @@ namespace drivers::usb
         // if vert points to parent queue header, then change queue header pointer.
         if(qh->vert != nullptr)
         {
-            qh->vert->ptrVertical = qh->ptrHorizontal;
-            qh->vert->vert = qh->next;
+            // the tail link is not part of the queue
+            if(qh->next == nullptr) qh->vert->ptrVertical = UHCI_Invalid;
+            else qh->vert->ptrVertical = descriptorPool.physical(qh->next) | UHCI_QH;
 
-            qh->next = nullptr;
-            qh->vert = nullptr;
+            qh->vert->vert = qh->next;
+            if(qh->next != nullptr) qh->next->vert = qh->vert;
         }
         else
         {
@@ -192,17 +378,74 @@ namespace drivers::usb
 
             prevQH->next = qh->next;
             prevQH->ptrHorizontal = qh->ptrHorizontal;
+        }
 
-            qh->next = nullptr;
-            qh->vert = nullptr;
+        qh->next = nullptr;
+        qh->vert = nullptr;
+    }
+
+    // the frame number advances once every 1 ms frame
+    u16 uhci_controller::currentFrame()
+    {
+        return uhciController->inw(UHCI_FRNUM) & UHCI_FRNUM_MASK;
+    }
+
+    void uhci_controller::setBandwidthReclamation(bool enable)
+    {
+        x86_DisableInterrupts();
+
+        fsbrEnabled = enable;
+
+        // the loop link lives in the tail QH of the bulk queue, rewrite it
+        // so a queue that is already scheduled follows the new setting
+        uhci_queue_head* tailQH = uhciQueueHeads[UHCI_QBulk].vert;
+        if(tailQH != nullptr)
+        {
+            while(tailQH->next != nullptr) tailQH = tailQH->next;
+            tailQH->ptrHorizontal = queueTailLink(UHCI_QBulk);
         }
+
+        x86_EnableInterrupts();
+    }
+
+    std::string uhci_controller::bulkThroughput()
+    {
+        std::string fsbr = std::string("fsbr ") + (fsbrEnabled ? "1\n" : "0\n");
+        if(bulkFrames == 0) return fsbr + "no bulk transfers yet\n";
+
+        // a frame is 1 ms, so bytes per frame are KB/s
+        u32 bytesPerFrame = bulkBytes / bulkFrames;
+
+        return fsbr + "bytes " + std::utos((u32)bulkBytes) + " ms " + std::utos((u32)bulkFrames) +
+                " KB/s " + std::utos(bytesPerFrame) + " (wire rate 1500 KB/s)\n";
+    }
+
+    static i32 bulk_node_read(vfs::node_t* node, size_t offset, void* buffer, size_t len)
+    {
+        uhci_controller* controller = reinterpret_cast<uhci_controller*>(node->data);
+        std::string text = controller->bulkThroughput();
+
+        return vfs::read_text(text.c_str(), text.size(), offset, buffer, len);
+    }
+
+    // writing '0' or '1' turns bandwidth reclamation off or on
+    static i32 bulk_node_write(vfs::node_t* node, size_t offset, const void* buffer, size_t len)
+    {
+        uhci_controller* controller = reinterpret_cast<uhci_controller*>(node->data);
+        char value = len == 0 ? 0 : reinterpret_cast<const char*>(buffer)[0];
+
+        if(value != '0' && value != '1') return EINVARG;
+
+        controller->setBandwidthReclamation(value == '1');
+
+        return OP_SUCCESS;
     }
 
-    u8 uhci_controller::getTransferStatus(volatile uhci_td* td, size_t count)
+    u8 uhci_controller::getTransferStatus(volatile uhci_td* td)
     {
-        for(int i = 0; i < count; i++)
+        for(; td != nullptr; td = td->next)
         {
-            u8 status = (td[i].ctrlStatus >> 16) & 0xFF;
+            u8 status = (td->ctrlStatus >> 16) & 0xFF;
 
             if(status != 0)
             {
@@ -215,104 +458,134 @@ namespace drivers::usb
 
         return 0;
     }
-    u8 uhci_controller::waitTillTransferComplete(uhci_td* td, size_t count)
+    // a chain has retired once the last TD is inactive, or a TD
+    // stopped with an error and the rest of the chain will never run
+    bool uhci_controller::isTransferRetired(volatile uhci_td* td)
     {
-        u16 timeout = 1000;
-        u8 status = 3;
-        while(status == 3 && timeout > 0)
+        for(; td != nullptr; td = td->next)
         {
-            timeout -= 10;
-            PIT_sleep(10);
-            status = getTransferStatus(td, count);
+            u32 ctrlStatus = td->ctrlStatus;
+
+            if(ctrlStatus & UHCI_TD_ACTIVE) return false;
+            if(ctrlStatus & UHCI_TD_ERROR) return true;
         }
 
-        return status;
+        return true;
     }
-
-    void uhci_controller::setupDevice(vfs::vfs_t* gvfs, vfs::node_t* controller_node, u16 portID)
+    // packet level counters of a chain that is done
+    static void recordChainStats(endpoint_stats* stats, volatile uhci_td* td, bool timedOut)
     {
-        u16 portsc = uhciController->inw(UHCI_PORT_BASE + portID);
+        if(stats == nullptr) return;
+
+        if(timedOut) stats->timeouts++;
 
-        usb_device device;
-        device.isLowSpeedDevice = (portsc & (1 << 8)) ? 1 : 0;
-        device.address = 0;
+        for(; td != nullptr; td = td->next)
+        {
+            u32 ctrlStatus = td->ctrlStatus;
 
-        device_desc deviceDesc;
+            if(ctrlStatus & UHCI_TD_NAK) stats->naks++;
+            if(ctrlStatus & UHCI_TD_CRC_TIMEOUT) stats->timeouts++;
+            // running out of retries marks the packet stalled as well
+            else if(ctrlStatus & UHCI_TD_STALLED) stats->stalls++;
 
-        char mf[STR_MAX_SIZE];
-        char prod[STR_MAX_SIZE];
-        char srn[STR_MAX_SIZE];
+            // counts down once per bus error
+            stats->retries += 3 - ((ctrlStatus >> 27) & 0x3);
+        }
+    }
+    bool uhci_controller::handleIRQ()
+    {
+        u16 status = uhciController->inw(UHCI_STATUS);
 
-        device.portAddress = UHCI_PORT_BASE + portID;
+        // not raised by this controller
+        if((status & (UHCI_STS_USBINT | UHCI_STS_ERROR)) == 0) return false;
 
-        u8 requestType = USB_DEVICE_TO_HOST | USB_REQ_STRD | USB_REP_DEVICE;
+        // acknowledge the interrupt (R/WC)
+        uhciController->outw(UHCI_STATUS, status & (UHCI_STS_USBINT | UHCI_STS_ERROR));
 
-        if(controlIn(device, &deviceDesc, requestType, REQ_GET_DESC, (1 << 8) | 0, 0, 18, 8))
+        uhci_transfer* transfer = activeTransfer;
+        if(transfer != nullptr && isTransferRetired(transfer->chain.head))
         {
-            u16 LANGID = 0x0409; // English(US)
+            transfer->complete = true;
+        }
 
-            bool status = controlIn(device, mf, requestType, REQ_GET_DESC, (3 << 8) | deviceDesc.iManufacture, LANGID, STR_MAX_SIZE, deviceDesc.maxPacketSize);
-            status &= controlIn(device, prod, requestType, REQ_GET_DESC, (3 << 8) | deviceDesc.iProduct, LANGID, STR_MAX_SIZE, deviceDesc.maxPacketSize);
-            status &= controlIn(device, srn, requestType, REQ_GET_DESC, (3 << 8) | deviceDesc.iSerialNumber, LANGID, STR_MAX_SIZE, deviceDesc.maxPacketSize);
+        for(size_t i = 0; i < endpointCount; i++)
+        {
+            if(endpoints[i].pendingHead != nullptr) retireEndpoint(&endpoints[i]);
+        }
 
-            if(!status) log_warn("[UHCI][DeviceSetup] Failed to retrieve device info.\n");
-            else
-            {
-                device.manufactureName = std::string((u16*)(mf + 2), mf[0] - 1);
-                device.productName     = std::string((u16*)(prod + 2), prod[0] - 1);
-                device.serialNumber    = std::string((u16*)(srn + 2), srn[0] - 1);
-            }
+        return true;
+    }
+    u8 uhci_controller::waitTillTransferComplete(uhci_td_chain& chain)
+    {
+        // the last TD raises IOC, errors raise the USB error interrupt
+        chain.tail->ctrlStatus |= UHCI_TD_IOC;
 
-            device.bcdDevice = deviceDesc.bcdDevice;
-            device.configCount = deviceDesc.configCount;
-            device.productID = deviceDesc.productID;
-            device.protocolCode = deviceDesc.protocolCode;
-            device.maxPacketSize = deviceDesc.maxPacketSize;
-            device.subClass = deviceDesc.subClass;
-            device.vendorID = deviceDesc.vendorID;
+        uhci_transfer transfer;
+        transfer.chain = chain;
+        transfer.endpoint = nullptr;
+        transfer.complete = false;
 
-            // initialized by usb protocol layer
-            // device.controller = nullptr;
+        activeTransfer = &transfer;
 
-            device.address = 0;
+        // the chain might have retired before the transfer was published
+        if(isTransferRetired(chain.head)) transfer.complete = true;
 
-            u8 setAddrReqType = USB_HOST_TO_DEVICE | USB_REQ_STRD | USB_REP_DEVICE;
+        PIT_setTimeout(UHCI_TRANSFER_TIMEOUT);
 
-            // reset the device again.
-            resetPort(portID);
+        // sleep until the controller interrupts us or the transfer times out
+        while(!transfer.complete && !PIT_hasTimedOut())
+        {
+            // without an IRQ line the chain has to be polled
+            if(irqLine >= 16) transfer.complete = isTransferRetired(chain.head);
+            else cpu::halt();
+        }
 
-            std::string ctrl_path = "/dev/" + std::string(controller_node->name);
+        PIT_cancelTimeout();
 
-            if(controlOut(device, setAddrReqType, REQ_SET_ADDR, addressCount, 0, 0, device.maxPacketSize))
-            {
-                device.address = addressCount; addressCount++;
+        activeTransfer = nullptr;
 
-                std::string dev_name = "usb" + std::utos(device_count);
-                vfs::node_t node = vfs::make_node(dev_name.take(), false);
+        return getTransferStatus(chain.head);
+    }
 
-                node.flags |= vfs::NODE_DEVICE;
-                node.data = new usb_device(device);
-                node.size = device.maxPacketSize;
-                node.write = vfs::ignore_write;
-                node.read = vfs::ignore_read;
-                node.driver_uid = UID_CLASS_USB;
+    void uhci_controller::portReset(u16 portID, bool reset)
+    {
+        u16 portsc = uhciController->inw(UHCI_PORT_BASE + portID) & ~UHCI_PORT_RWC;
 
-                vfs::add_dnode(gvfs, ctrl_path.c_str(), node);
+        if(reset) portsc |= UHCI_PORT_RESET;
+        else portsc &= ~UHCI_PORT_RESET;
 
-                device_count++;
+        uhciController->outw(UHCI_PORT_BASE + portID, portsc);
+    }
+    u8 uhci_controller::portEnable(u16 portID)
+    {
+        u16 portsc = uhciController->inw(UHCI_PORT_BASE + portID);
 
-                //connectedDevices.push_back(device);
-            }
-            else
-            {
-                log_warn("[UHCI][DeviceSetup] Failed to set USB address.\n");
-            }
+        // no devices connected
+        if((portsc & UHCI_PORT_CONNECT) == 0) return USB_PORT_GONE;
+
+        // if connect/enable change
+        if(portsc & UHCI_PORT_RWC)
+        {
+            uhciController->outw(UHCI_PORT_BASE + portID, portsc);
+            return USB_PORT_RETRY;
         }
-        else
+
+        if(portsc & UHCI_PORT_ENABLE)
         {
-            log_warn("[UHCI][DeviceSetup] Failed to get USB descriptor.\n");
+            return USB_PORT_ENABLED | ((portsc & UHCI_PORT_LOW_SPEED) ? USB_PORT_LOW_SPEED : 0);
         }
+
+        // set enabled
+        uhciController->outw(UHCI_PORT_BASE + portID, portsc | UHCI_PORT_ENABLE);
+        return USB_PORT_RETRY;
     }
+    void uhci_controller::portDisable(u16 portID)
+    {
+        u16 portsc = uhciController->inw(UHCI_PORT_BASE + portID);
+
+        uhciController->outw(UHCI_PORT_BASE + portID, portsc & ~(UHCI_PORT_RWC | UHCI_PORT_ENABLE));
+    }
+
     /*
     std::vector<usb_device>& uhci_controller::getAllDevices()
     {
@@ -364,22 +637,28 @@ namespace drivers::usb
     // setup the controller
     void uhci_controller::Setup(vfs::vfs_t* gvfs, vfs::node_t* controller_node)
     {
-        // disable all interrupts
-        uhciController->outw(UHCI_INTR, 0b1111);
+        // disable all interrupts till the schedule is ready
+        uhciController->outw(UHCI_INTR, 0x0);
 
         // reset frame num register to 0
         uhciController->outw(UHCI_FRNUM, 0);
 
-        this->frameList = (u32*)std::malloc_aligned(1024 * sizeof(u32), 4096);
-        ptr_t frameListPhys = cpu::getPhysicalLocation(this->frameList);
+        // all DMA structures of this controller live in one pool
+        if(!descriptorPool.init(UHCI_POOL_PAGES))
+        {
+            log_error("[UHCI] Failed to allocate descriptor pool\n");
+            return;
+        }
 
-        std::memset(this->frameList, 0, 1024 * sizeof(u32));
+        this->frameList = (u32*)descriptorPool.carve(1024 * sizeof(u32), 4096);
+        ptr_t frameListPhys = descriptorPool.physical(this->frameList);
 
         // allocate Queue Heads
-        this->uhciQueueHeads = (uhci_queue_head*)std::malloc_aligned(UHCI_QUEUE_COUNT * sizeof(uhci_queue_head), 16);
-        ptr_t queueHeadPhy = cpu::getPhysicalLocation(this->uhciQueueHeads);
+        this->uhciQueueHeads = (uhci_queue_head*)descriptorPool.carve(UHCI_QUEUE_COUNT * sizeof(uhci_queue_head), 16);
+        ptr_t queueHeadPhy = descriptorPool.physical(this->uhciQueueHeads);
 
-        std::memset(this->uhciQueueHeads, 0, UHCI_QUEUE_COUNT * sizeof(uhci_queue_head));
+        // the rest is used by transfers
+        descriptorPool.build(UHCI_POOL_QH_COUNT);
 
         // No TDs, this driver does not implement isochronous transfers
 
@@ -418,6 +697,25 @@ namespace drivers::usb
 
         // clear status register
         uhciController->outw(UHCI_STATUS, 0xFFFF);
+
+        // route completion and error interrupts to our handler
+        irqLine = uhciController->config_read<u8>(UHCI_PCI_IRQ_LINE);
+        if(irqLine < 16 && irqControllerCount < UHCI_MAX_CONTROLLERS)
+        {
+            irqControllers[irqControllerCount] = this;
+            irqControllerCount++;
+
+            IRQ_registerHandler(irqLine, uhci_irq_handler);
+            PIC_irq_unmask(irqLine);
+
+            uhciController->outw(UHCI_INTR, UHCI_INTR_TIMEOUT_CRC | UHCI_INTR_IOC | UHCI_INTR_SHORT);
+        }
+        else
+        {
+            log_warn("[UHCI] No usable IRQ line (%u), falling back to polling\n", irqLine);
+            irqLine = 0xFF;
+        }
+
         // set the USB command register.
         uhciController->outw(UHCI_COMMAND, (1 << 7) | (1 << 6) | (1 << 0));
 
@@ -425,19 +723,31 @@ namespace drivers::usb
 
         u32 cmdReg = uhciController->inw(UHCI_COMMAND);
 
-        // address of 0 is reserved.
-        addressCount = 1;
+        // "/dev/<controller>/bulk" reports bulk throughput and toggles FSBR
+        vfs::node_t bulkNode = vfs::make_node(std::string("bulk").take(), false);
+        bulkNode.data = this;
+        bulkNode.read = bulk_node_read;
+        bulkNode.write = bulk_node_write;
+
+        std::string ctrl_path = "/dev/" + std::string(controller_node->name);
+        vfs::add_vnode(gvfs, ctrl_path.c_str(), bulkNode);
 
+        init_root_hub(rootHub, gvfs, controller_node);
+        rootHub.instance_data = this;
+        rootHub.port_reset = uhci_port_reset;
+        rootHub.port_enable = uhci_port_enable;
+        rootHub.port_disable = uhci_port_disable;
+        rootHub.resetTime = USB_TDRST;
+
+        // ports are reset together, devices are added from timer callbacks
         u16 port = 0;
         while(isPortPresent(port))
         {
             portCount++;
 
-            if(resetPort(port))
+            if(uhciController->inw(UHCI_PORT_BASE + port) & UHCI_PORT_CONNECT)
             {
-                //log_info("[UHCI] Found USB 1.0 Device at port %x\n", port);
-
-                setupDevice(gvfs, controller_node, port);
+                enumerate_port(rootHub, port);
             }
 
             // try next port
@@ -449,59 +759,106 @@ namespace drivers::usb
         return resetPort(device.portAddress);
     }
 
+    // points the TDs at consecutive packets of buffer, resolving the
+    // physical address once per page instead of assuming a contiguous buffer
+    // returns false if a packet straddles two discontiguous physical pages
+    bool uhci_controller::mapPackets(uhci_td* td, void* buffer, size_t size, u16 packetSize)
+    {
+        ptr_t pageVirt = ptr_cast(buffer) & 0xFFFFF000;
+        ptr_t pagePhys = cpu::getPhysicalLocation(reinterpret_cast<void*>(pageVirt));
+
+        for(size_t offset = 0; offset < size; offset += packetSize, td = td->next)
+        {
+            ptr_t vaddr = ptr_cast(buffer) + offset;
+            size_t length = (size - offset) < packetSize ? (size - offset) : packetSize;
+
+            // crossed into a new page
+            if((vaddr & 0xFFFFF000) != pageVirt)
+            {
+                pageVirt = vaddr & 0xFFFFF000;
+                pagePhys = cpu::getPhysicalLocation(reinterpret_cast<void*>(pageVirt));
+            }
+
+            // the packet ends in the next page, which must follow physically
+            ptr_t lastVirt = vaddr + length - 1;
+            if((lastVirt & 0xFFFFF000) != pageVirt)
+            {
+                if(cpu::getPhysicalLocation(reinterpret_cast<void*>(lastVirt & 0xFFFFF000)) != pagePhys + PAGE_SIZE) return false;
+            }
+
+            td->bufferPointer = pagePhys + (vaddr & 0xFFF);
+        }
+
+        return true;
+    }
+
     bool uhci_controller::controlIn(usb_device device, void* buffer, u8 requestType, u8 request, u16 value, u16 index, u16 length, u8 packetSize)
     {
-        request_packet* rpacket = (request_packet*)std::malloc_aligned(sizeof(request_packet), 16);
+        u16 td_count = DivRoundUp(length, packetSize) + 2;
+        uhci_td_chain chain = descriptorPool.alloc_tds(td_count);
+        uhci_queue_head* qh = descriptorPool.alloc_qh();
+
+        if(chain.head == nullptr || qh == nullptr)
+        {
+            log_warn("[UHCI][ControlIn] Out of transfer descriptors\n");
+
+            descriptorPool.free_tds(chain);
+            if(qh != nullptr) descriptorPool.free_qh(qh);
+            return false;
+        }
+
+        // return buffer, physically contiguous so every packet is an offset into it
+        cpu::dma::dma_buffer retBuffer = cpu::dma::alloc(length);
+        if(retBuffer.virt == nullptr)
+        {
+            descriptorPool.free_tds(chain);
+            descriptorPool.free_qh(qh);
+            return false;
+        }
+        std::memset(retBuffer.virt, 0, length);
+
+        qh->ptrVertical = descriptorPool.physical(chain.head);
+
+        // the first TD describes the control packet
+        uhci_td* td = chain.head;
+        request_packet* rpacket = reinterpret_cast<request_packet*>(td->data);
         rpacket->requestType = requestType;
         rpacket->request = request;
         rpacket->index = index;
         rpacket->value = value;
         rpacket->size = length;
 
-        // return buffer
-        u8* retBuffer = (u8*)std::malloc(length);
-        std::memset(retBuffer, 0, length);
-
-        u16 td_count = DivRoundUp(length, packetSize) + 2;
-        uhci_td* td_in = (uhci_td*)std::malloc_aligned(td_count * sizeof(uhci_td), 16);
-        std::memset(td_in, 0, td_count * sizeof(uhci_td));
-
-        uhci_queue_head* qh = (uhci_queue_head*)std::malloc_aligned(sizeof(qh), 16);
-        std::memset(qh, 0, sizeof(uhci_queue_head));
-        qh->ptrVertical = cpu::getPhysicalLocation(td_in);
-
-        // the first TD describes the control packet
-        td_in[0].linkPointer = cpu::getPhysicalLocation(&td_in[1]);
-        td_in[0].ctrlStatus = (device.isLowSpeedDevice ? (1 << 26) : 0) | (1 << 23);
-        td_in[0].packetHeader = ((sizeof(request_packet) - 1) << 21) | (CTRL_ENDPOINT << 15) | (device.address << 8) | PACKET_SETUP; // DATA0
-        td_in[0].bufferPointer = cpu::getPhysicalLocation(rpacket);
+        td->ctrlStatus = (device.isLowSpeedDevice ? (1 << 26) : 0) | UHCI_TD_CERR | (1 << 23);
+        td->packetHeader = ((sizeof(request_packet) - 1) << 21) | (CTRL_ENDPOINT << 15) | (device.address << 8) | PACKET_SETUP; // DATA0
+        td->bufferPointer = descriptorPool.physical(rpacket);
 
         u16 sz = length;
 
-        for(int i = 1; (i < td_count - 1); i++)
+        td = td->next;
+        for(int i = 1; (i < td_count - 1); i++, td = td->next)
         {
             u16 tokenSize = sz < packetSize ? sz : packetSize;
 
-            td_in[i].linkPointer = cpu::getPhysicalLocation(&td_in[i + 1]);
-            td_in[i].ctrlStatus = (device.isLowSpeedDevice ? (1 << 26) : 0) | (1 << 23);
-            td_in[i].packetHeader = ((tokenSize - 1) << 21) | (CTRL_ENDPOINT << 15) | ((i & 1) ? (1 << 19) : 0) | (device.address << 8) | PACKET_IN;
-            td_in[i].bufferPointer = cpu::getPhysicalLocation(retBuffer) + (i - 1) * packetSize;
+            td->ctrlStatus = (device.isLowSpeedDevice ? (1 << 26) : 0) | UHCI_TD_CERR | (1 << 23);
+            td->packetHeader = ((tokenSize - 1) << 21) | (CTRL_ENDPOINT << 15) | ((i & 1) ? (1 << 19) : 0) | (device.address << 8) | PACKET_IN;
+            td->bufferPointer = retBuffer.phys + (i - 1) * packetSize;
 
             sz -= tokenSize;
         }
 
-        td_in[td_count-1].linkPointer = UHCI_Invalid;
-        td_in[td_count-1].ctrlStatus = (device.isLowSpeedDevice ? (1 << 26) : 0) | (1 << 23);
-        td_in[td_count-1].packetHeader = (0x7FF << 21) | (1 << 19) | (CTRL_ENDPOINT << 15) | (device.address << 8) | PACKET_OUT; // DATA1
-        td_in[td_count-1].bufferPointer = nullptr;
+        td->ctrlStatus = (device.isLowSpeedDevice ? (1 << 26) : 0) | UHCI_TD_CERR | (1 << 23);
+        td->packetHeader = (0x7FF << 21) | (1 << 19) | (CTRL_ENDPOINT << 15) | (device.address << 8) | PACKET_OUT; // DATA1
+        td->bufferPointer = nullptr;
 
         insertToQueue(qh, UHCI_QControl);
 
-        u8 status = waitTillTransferComplete(td_in, td_count);
+        u8 status = waitTillTransferComplete(chain);
 
         removeFromQueue(qh, UHCI_QControl);
 
-        std::memcpy(retBuffer, buffer, length);
+        recordChainStats(get_endpoint_stats(device, CTRL_ENDPOINT, true), chain.head, status == 3);
+
+        std::memcpy(retBuffer.virt, buffer, length);
 
         if(status != 0)
         {
@@ -530,47 +887,55 @@ namespace drivers::usb
             log_warn("\tRequested Length: %x\n", length);
         }
 
-        std::free(retBuffer);
-        std::free(rpacket);
-        std::free(td_in);
-        std::free(qh);
+        cpu::dma::free(retBuffer);
+        descriptorPool.free_tds(chain);
+        descriptorPool.free_qh(qh);
 
         return status == 0;
     }
     bool uhci_controller::controlOut(usb_device device, u8 requestType, u8 request, u16 value, u16 index, u16 length, u8 packetSize)
     {
-        request_packet* rpacket = (request_packet*)std::malloc_aligned(sizeof(request_packet), 16);
+        uhci_td_chain chain = descriptorPool.alloc_tds(2);
+        uhci_queue_head* qh = descriptorPool.alloc_qh();
+
+        if(chain.head == nullptr || qh == nullptr)
+        {
+            log_warn("[UHCI][ControlOut] Out of transfer descriptors\n");
+
+            descriptorPool.free_tds(chain);
+            if(qh != nullptr) descriptorPool.free_qh(qh);
+            return false;
+        }
+
+        qh->ptrVertical = descriptorPool.physical(chain.head);
+
+        // the first TD describes the control packet
+        uhci_td* td = chain.head;
+        request_packet* rpacket = reinterpret_cast<request_packet*>(td->data);
         rpacket->requestType = requestType;
         rpacket->request = request;
         rpacket->index = index;
         rpacket->value = value;
         rpacket->size = length;
 
-        uhci_td* td_in = (uhci_td*)std::malloc_aligned(2 * sizeof(uhci_td), 16);
-        std::memset(td_in, 0, 2 * sizeof(uhci_td));
-
-        uhci_queue_head* qh = (uhci_queue_head*)std::malloc_aligned(sizeof(qh), 16);
-        std::memset(qh, 0, sizeof(uhci_queue_head));
-        qh->ptrVertical = cpu::getPhysicalLocation(td_in);
-
-        // the first TD describes the control packet
-        td_in[0].linkPointer = cpu::getPhysicalLocation(&td_in[1]);
-        td_in[0].ctrlStatus = (device.isLowSpeedDevice ? (1 << 26) : 0) | (1 << 23);
-        td_in[0].packetHeader = ((sizeof(request_packet) - 1) << 21) | (CTRL_ENDPOINT << 15) | (device.address << 8) | PACKET_SETUP; // DATA0
-        td_in[0].bufferPointer = cpu::getPhysicalLocation(rpacket);
+        td->ctrlStatus = (device.isLowSpeedDevice ? (1 << 26) : 0) | UHCI_TD_CERR | (1 << 23);
+        td->packetHeader = ((sizeof(request_packet) - 1) << 21) | (CTRL_ENDPOINT << 15) | (device.address << 8) | PACKET_SETUP; // DATA0
+        td->bufferPointer = descriptorPool.physical(rpacket);
 
         // last TD, status
-        td_in[1].linkPointer = UHCI_Invalid;
-        td_in[1].ctrlStatus = (device.isLowSpeedDevice ? (1 << 26) : 0) | (1 << 23);
-        td_in[1].packetHeader = (0x7FF << 21) | DATA1 | (CTRL_ENDPOINT << 15) | (device.address << 8) | PACKET_IN; // DATA1
-        td_in[1].bufferPointer = nullptr;
+        td = td->next;
+        td->ctrlStatus = (device.isLowSpeedDevice ? (1 << 26) : 0) | UHCI_TD_CERR | (1 << 23);
+        td->packetHeader = (0x7FF << 21) | DATA1 | (CTRL_ENDPOINT << 15) | (device.address << 8) | PACKET_IN; // DATA1
+        td->bufferPointer = nullptr;
 
         insertToQueue(qh, UHCI_QControl);
 
-        u8 status = waitTillTransferComplete(td_in, 2);
+        u8 status = waitTillTransferComplete(chain);
 
         removeFromQueue(qh, UHCI_QControl);
 
+        recordChainStats(get_endpoint_stats(device, CTRL_ENDPOINT, false), chain.head, status == 3);
+
         if(status != 0)
         {
             switch (status)
@@ -599,150 +964,507 @@ namespace drivers::usb
             log_warn("\tRequested Length: %x\n", length);
         }
 
-        std::free(rpacket);
-        std::free(td_in);
-        std::free(qh);
+        descriptorPool.free_tds(chain);
+        descriptorPool.free_qh(qh);
 
         return status == 0;
     }
 
-    bool uhci_controller::bulkIn(const usb_device& device, u8 endpoint, u16 maxPacketSize, void* buffer, u16 size)
+    uhci_endpoint* uhci_controller::getEndpoint(const usb_device& device, u8 endpoint, u8 packetType)
     {
-        void* returnBuffer = std::malloc(size);
+        for(size_t i = 0; i < endpointCount; i++)
+        {
+            uhci_endpoint& ep = endpoints[i];
+            if(ep.address == device.address && ep.endpoint == endpoint && ep.packetType == packetType) return &ep;
+        }
 
-        u16 td_count = DivRoundUp(size, maxPacketSize);
-        uhci_td* td_in = (uhci_td*)std::malloc_aligned(td_count * sizeof(uhci_td), 16);
-        std::memset(td_in, 0, td_count * sizeof(uhci_td));
+        if(endpointCount >= UHCI_MAX_ENDPOINTS)
+        {
+            log_warn("[UHCI][Bulk] Too many endpoints\n");
+            return nullptr;
+        }
 
-        uhci_queue_head* qh = (uhci_queue_head*)std::malloc_aligned(sizeof(qh), 16);
-        std::memset(qh, 0, sizeof(uhci_queue_head));
-        qh->ptrVertical = cpu::getPhysicalLocation(td_in);
-        qh->ptrHorizontal = UHCI_Invalid;
+        uhci_td_chain dummy = descriptorPool.alloc_tds(1);
+        uhci_queue_head* qh = descriptorPool.alloc_qh();
+
+        if(dummy.head == nullptr || qh == nullptr)
+        {
+            log_warn("[UHCI][Bulk] Out of transfer descriptors\n");
+
+            descriptorPool.free_tds(dummy);
+            if(qh != nullptr) descriptorPool.free_qh(qh);
+            return nullptr;
+        }
+
+        uhci_endpoint& ep = endpoints[endpointCount];
+        endpointCount++;
+
+        ep.address = device.address;
+        ep.endpoint = endpoint;
+        ep.packetType = packetType;
+        ep.toggle = 0;
 
-        u16 sz = size;
+        ep.scheduled = false;
+        ep.qh = qh;
+        ep.dummy = dummy.head;
+        ep.pendingHead = nullptr;
+        ep.pendingTail = nullptr;
+
+        // the queue parks on the inactive dummy
+        qh->ptrVertical = descriptorPool.physical(ep.dummy);
+
+        return &ep;
+    }
+    void uhci_controller::resetToggles(u8 address, u8 endpointAddress, bool allEndpoints)
+    {
+        u8 packetType = (endpointAddress & 0x80) ? PACKET_IN : PACKET_OUT;
 
-        for(int i = 0; i < td_count; i++)
+        for(size_t i = 0; i < endpointCount; i++)
         {
-            u16 tokenSize = sz < maxPacketSize ? sz : maxPacketSize;
+            uhci_endpoint& ep = endpoints[i];
+            if(ep.address != address) continue;
+            if(!allEndpoints && (ep.endpoint != (endpointAddress & 0xF) || ep.packetType != packetType)) continue;
 
-            td_in[i].linkPointer = cpu::getPhysicalLocation(&td_in[i + 1]);
-            if(i == td_count - 1) td_in[i].linkPointer = UHCI_Invalid;
+            ep.toggle = 0;
+        }
+    }
 
-            td_in[i].ctrlStatus = (device.isLowSpeedDevice ? (1 << 26) : 0) | (1 << 23);
-            td_in[i].packetHeader = ((tokenSize - 1) << 21) | (endpoint << 15) | ((i & 1) ? (1 << 19) : 0) | (device.address << 8) | PACKET_IN;
-            td_in[i].bufferPointer = cpu::getPhysicalLocation(returnBuffer) + i * maxPacketSize;
+    static std::object_cache<uhci_transfer> transfer_cache;
 
-            sz -= tokenSize;
+    // builds a chain in the endpoint's dummy TD and the TDs after it,
+    // the last new TD becomes the dummy the queue parks on afterwards
+    uhci_transfer* uhci_controller::queueBulkChain(const usb_device& device, uhci_endpoint* endpoint, u16 maxPacketSize, void* buffer, u32 size)
+    {
+        u32 td_count = DivRoundUp(size, maxPacketSize);
+        uhci_td_chain tds = descriptorPool.alloc_tds(td_count);
+
+        if(tds.head == nullptr)
+        {
+            log_warn("[UHCI][Bulk] Out of transfer descriptors\n");
+            return nullptr;
         }
 
-        insertToQueue(qh, UHCI_QControl);
-        u8 status = waitTillTransferComplete(td_in, td_count);
-        removeFromQueue(qh, UHCI_QControl);
+        uhci_transfer* transfer = transfer_cache.alloc();
+        if(transfer == nullptr)
+        {
+            descriptorPool.free_tds(tds);
+            return nullptr;
+        }
 
-        if(status != 0)
+        transfer->endpoint = endpoint;
+        transfer->buffer = buffer;
+        transfer->bounceBuffer = { nullptr, 0, 0 };
+        transfer->size = size;
+        transfer->status = 0;
+        transfer->complete = false;
+        transfer->next = nullptr;
+        transfer->nextChain = nullptr;
+
+        uhci_td* newDummy = tds.tail;
+
+        uhci_td_chain& chain = transfer->chain;
+        chain.head = endpoint->dummy;
+        chain.tail = endpoint->dummy;
+        chain.count = td_count;
+
+        chain.head->linkPointer = descriptorPool.physical(tds.head);
+        chain.head->next = nullptr;
+
+        if(td_count > 1)
         {
-            switch (status)
+            chain.head->next = tds.head;
+
+            chain.tail = tds.head;
+            while(chain.tail->next != newDummy) chain.tail = chain.tail->next;
+            chain.tail->next = nullptr;
+        }
+
+        // DMA straight to/from the caller's buffer when possible
+        if(!mapPackets(chain.head, buffer, size, maxPacketSize))
+        {
+            // the heap isn't physically contiguous either, bounce through the DMA zone
+            transfer->bounceBuffer = cpu::dma::alloc(size);
+            if(transfer->bounceBuffer.virt == nullptr)
             {
-            case 0x3:
-                log_warn("[UHCI][ControlIn] USB device timed out. Info: \n");
-                break;
-            case 0x2:
-                log_warn("[UHCI][ControlIn] USB device sent NAK. Info: \n");
-                break;
-            case 0x1:
-                log_warn("[UHCI][ControlIn] ERROR USB device. Info: \n");
-                break;
-            default:
-                break;
+                log_warn("[UHCI][Bulk] Out of DMA memory\n");
+
+                // the old dummy stays parked, the new TDs go back to the pool
+                if(td_count > 1) chain.tail->next = newDummy;
+                chain.head->linkPointer = UHCI_Invalid;
+                chain.head->next = nullptr;
+
+                descriptorPool.free_tds(tds);
+                transfer_cache.free(transfer);
+                return nullptr;
             }
-            log_warn("\tPort: %x\n", device.portAddress);
-            log_warn("\tAddress: %x\n", device.address);
-            log_warn("\tEndpoint: %x\n", endpoint);
-            log_warn("\tSpeed: %s\n", device.isLowSpeedDevice ? "Low Speed" : "Full Speed");
-            log_warn("\tMax Packet Size: %x\n", maxPacketSize);
-            log_warn("\tSent Length: %x\n", size);
+
+            if(endpoint->packetType == PACKET_OUT) std::memcpy(buffer, transfer->bounceBuffer.virt, size);
+
+            u32 offset = 0;
+            for(uhci_td* td = chain.head; td != nullptr; td = td->next, offset += maxPacketSize) td->bufferPointer = transfer->bounceBuffer.phys + offset;
         }
 
-        if(status == 0) std::memcpy(returnBuffer, buffer, size);
+        newDummy->ctrlStatus = 0;
+        newDummy->linkPointer = UHCI_Invalid;
+        newDummy->next = nullptr;
 
-        std::free(returnBuffer);
-        std::free(td_in);
-        std::free(qh);
+        u32 sz = size;
 
-        return status == 0;
+        // the chain stays inactive till it is fully built
+        for(uhci_td* td = chain.head; td != nullptr; td = td->next)
+        {
+            u16 tokenSize = sz < maxPacketSize ? sz : maxPacketSize;
+
+            // short IN packets halt the queue instead of running into the next chain
+            td->ctrlStatus = (device.isLowSpeedDevice ? (1 << 26) : 0) | UHCI_TD_CERR | (endpoint->packetType == PACKET_IN ? UHCI_TD_SPD : 0);
+            td->packetHeader = ((tokenSize - 1) << 21) | (endpoint->endpoint << 15) | DATA0 | (device.address << 8) | endpoint->packetType;
+            td->linkPointer |= UHCI_DEPTH_FIRST;
+
+            sz -= tokenSize;
+        }
+        chain.tail->ctrlStatus |= UHCI_TD_IOC;
+
+        for(uhci_td* td = chain.head->next; td != nullptr; td = td->next) td->ctrlStatus |= UHCI_TD_ACTIVE;
+
+        transfer->startFrame = currentFrame();
+
+        x86_DisableInterrupts();
+
+        // the IRQ handler may flip the toggle or restart the queue at the dummy,
+        // so both are only read and swapped once it can't run
+        for(uhci_td* td = chain.head; td != nullptr; td = td->next)
+        {
+            if(endpoint->toggle) td->packetHeader |= DATA1;
+            endpoint->toggle ^= 1;
+        }
+        endpoint->dummy = newDummy;
+
+        if(endpoint->pendingTail != nullptr) endpoint->pendingTail->next = transfer;
+        else endpoint->pendingHead = transfer;
+        endpoint->pendingTail = transfer;
+
+        // activating the old dummy hands the whole chain to the controller
+        __asm__ volatile("" ::: "memory");
+        chain.head->ctrlStatus |= UHCI_TD_ACTIVE;
+
+        if(!endpoint->scheduled)
+        {
+            insertToQueue(endpoint->qh, UHCI_QBulk);
+            endpoint->scheduled = true;
+        }
+
+        x86_EnableInterrupts();
+
+        return transfer;
     }
-    bool uhci_controller::bulkOut(const usb_device& device, u8 endpoint, u16 maxPacketSize, void* buffer, u16 size)
+
+    // called with interrupts disabled
+    void uhci_controller::retireEndpoint(uhci_endpoint* endpoint)
     {
-        u16 td_count = DivRoundUp(size, maxPacketSize);
-        uhci_td* td_in = (uhci_td*)std::malloc_aligned(td_count * sizeof(uhci_td), 16);
-        std::memset(td_in, 0, td_count * sizeof(uhci_td));
+        while(endpoint->pendingHead != nullptr)
+        {
+            uhci_transfer* transfer = endpoint->pendingHead;
 
-        uhci_queue_head* qh = (uhci_queue_head*)std::malloc_aligned(sizeof(qh), 16);
-        std::memset(qh, 0, sizeof(uhci_queue_head));
-        qh->ptrVertical = cpu::getPhysicalLocation(td_in);
-        qh->ptrHorizontal = UHCI_Invalid;
+            uhci_td* halted = nullptr;
+            bool active = false;
+            bool error = false;
+
+            for(uhci_td* td = transfer->chain.head; td != nullptr; td = td->next)
+            {
+                u32 ctrlStatus = td->ctrlStatus;
+
+                if(ctrlStatus & UHCI_TD_ACTIVE)
+                {
+                    active = true;
+                    break;
+                }
+                if(ctrlStatus & UHCI_TD_ERROR)
+                {
+                    halted = td;
+                    error = true;
+                    break;
+                }
+
+                // actual length and maximum length are both stored minus one
+                u32 actual = (ctrlStatus + 1) & 0x7FF;
+                u32 expected = ((td->packetHeader >> 21) + 1) & 0x7FF;
+                if(actual < expected)
+                {
+                    halted = td;
+                    break;
+                }
+            }
 
-        void* buffer_out = std::malloc_aligned(size, 16);
-        std::memcpy(buffer, buffer_out, size);
+            if(active) return;
 
-        u16 sz = size;
+            if(error)
+            {
+                // the endpoint stalled or stopped answering, nothing queued
+                // behind will run. the failed packet was never acknowledged
+                endpoint->toggle = (halted->packetHeader & DATA1) ? 1 : 0;
+
+                for(uhci_transfer* t = transfer; t != nullptr; t = t->next)
+                {
+                    for(uhci_td* td = t->chain.head; td != nullptr; td = td->next) td->ctrlStatus &= ~UHCI_TD_ACTIVE;
+
+                    t->status = (t == transfer) ? getTransferStatus(transfer->chain.head) : 1;
+                    t->complete = true;
+                }
+
+                endpoint->pendingHead = nullptr;
+                endpoint->pendingTail = nullptr;
+                endpoint->qh->ptrVertical = descriptorPool.physical(endpoint->dummy);
+
+                return;
+            }
 
-        for(int i = 0; i < td_count; i++)
+            endpoint->pendingHead = transfer->next;
+            if(endpoint->pendingHead == nullptr) endpoint->pendingTail = nullptr;
+
+            if(halted != nullptr)
+            {
+                // short packet, the rest of the chain is skipped
+                u32 skipped = 0;
+                for(uhci_td* td = halted->next; td != nullptr; td = td->next)
+                {
+                    td->ctrlStatus &= ~UHCI_TD_ACTIVE;
+                    skipped++;
+                }
+
+                // chains queued behind assumed the skipped packets were sent
+                if(skipped & 1)
+                {
+                    endpoint->toggle ^= 1;
+                    for(uhci_transfer* t = endpoint->pendingHead; t != nullptr; t = t->next)
+                    {
+                        for(uhci_td* td = t->chain.head; td != nullptr; td = td->next) td->packetHeader ^= DATA1;
+                    }
+                }
+
+                // restart the halted queue at the next chain, or the dummy
+                endpoint->qh->ptrVertical = transfer->chain.tail->linkPointer & ~0xF;
+            }
+
+            transfer->status = 0;
+            transfer->complete = true;
+        }
+    }
+    void uhci_controller::cancelEndpoint(uhci_endpoint* endpoint)
+    {
+        x86_DisableInterrupts();
+        if(endpoint->scheduled) removeFromQueue(endpoint->qh, UHCI_QBulk);
+        endpoint->scheduled = false;
+        x86_EnableInterrupts();
+
+        // let the controller finish the frame it might be working on the QH in
+        PIT_sleep(2);
+
+        x86_DisableInterrupts();
+
+        retireEndpoint(endpoint);
+
+        if(endpoint->pendingHead != nullptr)
         {
-            u16 tokenSize = sz < maxPacketSize ? sz : maxPacketSize;
+            // the first active packet was never acknowledged
+            for(uhci_td* td = endpoint->pendingHead->chain.head; td != nullptr; td = td->next)
+            {
+                if(td->ctrlStatus & UHCI_TD_ACTIVE)
+                {
+                    endpoint->toggle = (td->packetHeader & DATA1) ? 1 : 0;
+                    break;
+                }
+            }
+        }
 
-            td_in[i].linkPointer = cpu::getPhysicalLocation(&td_in[i + 1]);
-            if(i == td_count - 1) td_in[i].linkPointer = UHCI_Invalid;
+        for(uhci_transfer* t = endpoint->pendingHead; t != nullptr; t = t->next)
+        {
+            for(uhci_td* td = t->chain.head; td != nullptr; td = td->next) td->ctrlStatus &= ~UHCI_TD_ACTIVE;
 
-            td_in[i].ctrlStatus = (device.isLowSpeedDevice ? (1 << 26) : 0) | (1 << 23);
-            td_in[i].packetHeader = ((tokenSize - 1) << 21) | (endpoint << 15) | ((i & 1) ? (1 << 19) : 0) | (device.address << 8) | PACKET_OUT;
-            td_in[i].bufferPointer = cpu::getPhysicalLocation(buffer_out) + i * maxPacketSize;
+            t->status = 3;
+            t->complete = true;
+        }
 
-            sz -= tokenSize;
+        endpoint->pendingHead = nullptr;
+        endpoint->pendingTail = nullptr;
+        endpoint->qh->ptrVertical = descriptorPool.physical(endpoint->dummy);
+
+        x86_EnableInterrupts();
+    }
+
+    bool uhci_controller::waitBulkChain(const usb_device& device, uhci_transfer* transfer)
+    {
+        uhci_endpoint* endpoint = transfer->endpoint;
+
+        PIT_setTimeout(UHCI_TRANSFER_TIMEOUT);
+
+        // sleep until the controller interrupts us or the transfer times out
+        while(!transfer->complete && !PIT_hasTimedOut())
+        {
+            // without an IRQ line the queue has to be polled
+            if(irqLine >= 16)
+            {
+                x86_DisableInterrupts();
+                retireEndpoint(endpoint);
+                x86_EnableInterrupts();
+            }
+            else cpu::halt();
         }
 
-        insertToQueue(qh, UHCI_QControl);
-        u8 status = waitTillTransferComplete(td_in, td_count);
-        removeFromQueue(qh, UHCI_QControl);
+        PIT_cancelTimeout();
 
-        if(status != 0)
+        if(!transfer->complete) cancelEndpoint(endpoint);
+
+        x86_DisableInterrupts();
+        if(endpoint->pendingHead == nullptr && endpoint->scheduled)
+        {
+            removeFromQueue(endpoint->qh, UHCI_QBulk);
+            endpoint->scheduled = false;
+        }
+        x86_EnableInterrupts();
+
+        u8 status = transfer->status;
+
+        recordChainStats(get_endpoint_stats(device, endpoint->endpoint, endpoint->packetType == PACKET_IN), transfer->chain.head, status == 3);
+
+        if(status == 0)
         {
+            u16 frame = currentFrame();
+
+            // pipelined transfers overlap, only count frames once
+            u16 sinceStart = (frame - transfer->startFrame) & UHCI_FRNUM_MASK;
+            u16 sinceLast = (frame - bulkLastFrame) & UHCI_FRNUM_MASK;
+
+            bulkBytes += transfer->size;
+            bulkFrames += sinceStart < sinceLast ? sinceStart : sinceLast;
+            bulkLastFrame = frame;
+        }
+        else
+        {
+            const char* name = endpoint->packetType == PACKET_IN ? "BulkIn" : "BulkOut";
+
             switch (status)
             {
             case 0x3:
-                log_warn("[UHCI][ControlIn] USB device timed out. Info: \n");
+                log_warn("[UHCI][%s] USB device timed out. Info: \n", name);
                 break;
             case 0x2:
-                log_warn("[UHCI][ControlIn] USB device sent NAK. Info: \n");
+                log_warn("[UHCI][%s] USB device sent NAK. Info: \n", name);
                 break;
             case 0x1:
-                log_warn("[UHCI][ControlIn] ERROR USB device. Info: ");
+                log_warn("[UHCI][%s] ERROR USB device. Info: \n", name);
                 break;
             default:
                 break;
             }
             log_warn("\tPort: %x\n", device.portAddress);
             log_warn("\tAddress: %x\n", device.address);
-            log_warn("\tEndpoint: %x\n", endpoint);
+            log_warn("\tEndpoint: %x\n", endpoint->endpoint);
             log_warn("\tSpeed: %s\n", device.isLowSpeedDevice ? "Low Speed" : "Full Speed");
-            log_warn("\tMax Packet Size: %x\n", maxPacketSize);
-            log_warn("\tSent Length: %x\n", size);
+            log_warn("\tSent Length: %x\n", transfer->size);
         }
 
-        std::free(buffer_out);
-        std::free(qh);
-        std::free(td_in);
+        if(transfer->bounceBuffer.virt != nullptr)
+        {
+            if(status == 0 && endpoint->packetType == PACKET_IN) std::memcpy(transfer->bounceBuffer.virt, transfer->buffer, transfer->size);
+            cpu::dma::free(transfer->bounceBuffer);
+        }
+        descriptorPool.free_tds(transfer->chain);
+        transfer_cache.free(transfer);
 
         return status == 0;
     }
 
+    uhci_transfer* uhci_controller::bulkQueue(const usb_device& device, u8 endpoint, u16 maxPacketSize, void* buffer, u32 size, u8 packetType)
+    {
+        if(maxPacketSize == 0)
+        {
+            log_warn("[UHCI][Bulk] Endpoint %u of device %u has max packet size 0\n", endpoint, device.address);
+            return nullptr;
+        }
+
+        uhci_endpoint* ep = getEndpoint(device, endpoint, packetType);
+        if(ep == nullptr) return nullptr;
+
+        // large transfers are split into several chains on the same queue
+        u32 chainBytes = UHCI_MAX_CHAIN_PACKETS * maxPacketSize;
+
+        uhci_transfer* first = nullptr;
+        uhci_transfer* last = nullptr;
+
+        for(u32 offset = 0; offset < size; offset += chainBytes)
+        {
+            u32 length = (size - offset) < chainBytes ? (size - offset) : chainBytes;
+
+            uhci_transfer* transfer = queueBulkChain(device, ep, maxPacketSize, (u8*)buffer + offset, length);
+            if(transfer == nullptr)
+            {
+                // the chains queued so far still have to run
+                if(first != nullptr) bulkWait(device, first);
+                return nullptr;
+            }
+
+            if(last != nullptr) last->nextChain = transfer;
+            else first = transfer;
+            last = transfer;
+        }
+
+        return first;
+    }
+    bool uhci_controller::bulkWait(const usb_device& device, uhci_transfer* transfer)
+    {
+        bool status = true;
+
+        while(transfer != nullptr)
+        {
+            uhci_transfer* next = transfer->nextChain;
+            status &= waitBulkChain(device, transfer);
+            transfer = next;
+        }
+
+        return status;
+    }
+
+    u32 uhci_controller::maxBulkTransfer(u16 maxPacketSize)
+    {
+        // half the pool, the rest is left to the other endpoints
+        return (descriptorPool.total_tds() / 2) * maxPacketSize;
+    }
+
+    bool uhci_controller::bulkIn(const usb_device& device, u8 endpoint, u16 maxPacketSize, void* buffer, u32 size)
+    {
+        uhci_transfer* transfer = bulkQueue(device, endpoint, maxPacketSize, buffer, size, PACKET_IN);
+        if(transfer == nullptr) return false;
+
+        return bulkWait(device, transfer);
+    }
+    bool uhci_controller::bulkOut(const usb_device& device, u8 endpoint, u16 maxPacketSize, void* buffer, u32 size)
+    {
+        uhci_transfer* transfer = bulkQueue(device, endpoint, maxPacketSize, buffer, size, PACKET_OUT);
+        if(transfer == nullptr) return false;
+
+        return bulkWait(device, transfer);
+    }
+
     bool uhci_controller::controlIn(const usb_device& device, request_packet rpacket, void* buffer, u16 size)
     {
         return controlIn(device, buffer, rpacket.requestType, rpacket.request, rpacket.value, rpacket.index, size, device.maxPacketSize);
     }
     bool uhci_controller::controlOut(const usb_device& device, request_packet rpacket, u16 size)
     {
-        return controlOut(device, rpacket.requestType, rpacket.request, rpacket.value, rpacket.index, size, device.maxPacketSize);
+        bool status = controlOut(device, rpacket.requestType, rpacket.request, rpacket.value, rpacket.index, size, device.maxPacketSize);
+        if(!status) return false;
+
+        if(rpacket.request == USB_SET_CONFIG && (rpacket.requestType & 0b11) == USB_REP_DEVICE)
+        {
+            resetToggles(device.address, 0, true);
+        }
+        // ENDPOINT_HALT
+        if(rpacket.request == USB_CLEAR_FEATURE && (rpacket.requestType & 0b11) == USB_REP_ENDPOINT && rpacket.value == 0)
+        {
+            resetToggles(device.address, rpacket.index, false);
+        }
+
+        return true;
     }
 
     namespace uhci
@@ -761,14 +1483,27 @@ namespace drivers::usb
             return reinterpret_cast<uhci_controller*>(instance_data)->controlOut(device, rpacket, size);
         }
 
-        bool bulkIn(void* instance_data, const usb_device& device, u8 endpoint, u16 maxPacketSize, void* buffer, u16 size)
+        bool bulkIn(void* instance_data, const usb_device& device, u8 endpoint, u16 maxPacketSize, void* buffer, u32 size)
         {
             return reinterpret_cast<uhci_controller*>(instance_data)->bulkIn(device, endpoint, maxPacketSize, buffer, size);
         }
-        bool bulkOut(void* instance_data, const usb_device& device, u8 endpoint, u16 maxPacketSize, void* buffer, u16 size)
+        bool bulkOut(void* instance_data, const usb_device& device, u8 endpoint, u16 maxPacketSize, void* buffer, u32 size)
         {
             return reinterpret_cast<uhci_controller*>(instance_data)->bulkOut(device, endpoint, maxPacketSize, buffer, size);
         }
+
+        void* bulkQueue(void* instance_data, const usb_device& device, u8 endpoint, u16 maxPacketSize, void* buffer, u32 size, u8 packetType)
+        {
+            return reinterpret_cast<uhci_controller*>(instance_data)->bulkQueue(device, endpoint, maxPacketSize, buffer, size, packetType);
+        }
+        bool bulkWait(void* instance_data, const usb_device& device, void* transfer)
+        {
+            return reinterpret_cast<uhci_controller*>(instance_data)->bulkWait(device, reinterpret_cast<uhci_transfer*>(transfer));
+        }
+        u32 maxBulkTransfer(void* instance_data, u16 maxPacketSize)
+        {
+            return reinterpret_cast<uhci_controller*>(instance_data)->maxBulkTransfer(maxPacketSize);
+        }
     }
 
     usb_controller uhci_controller::as_generic_controller()
@@ -781,6 +1516,9 @@ namespace drivers::usb
         controller.controlOut = uhci::controlOut;
         controller.bulkIn = uhci::bulkIn;
         controller.bulkOut = uhci::bulkOut;
+        controller.bulkQueue = uhci::bulkQueue;
+        controller.bulkWait = uhci::bulkWait;
+        controller.maxBulkTransfer = uhci::maxBulkTransfer;
 
         return controller;
     }
@@ -877,7 +1615,7 @@ namespace drivers::usb
             .process_event = uhci_kdriver_process_event,
 
             // the class of the driver
-            .uid_class = UID_CLASS_USBCTRL
+            .uid_class = UID_CLASS_PCI
         };
     }
 }
@@ -3,10 +3,12 @@
 #include <includes.h>
 #include "../defs.hpp"
 #include "../../driver_defs.hpp"
+#include "../enumeration.hpp"
 
 #include <std/std.hpp>
 #include <std/ds.hpp>
 #include <hw/pci/pci.hpp>
+#include <cpu/dma.hpp>
 
 namespace drivers::usb
 {
@@ -16,7 +18,12 @@ namespace drivers::usb
         u32 ctrlStatus;
         u32 packetHeader;
         u32 bufferPointer;
-        u32 resv[4];
+
+        // software fields, never touched by the controller
+        uhci_td* next;
+        u32 resv;
+        // holds the setup packet of control transfers
+        u8  data[8];
     }_packed;
 
     struct uhci_queue_head
@@ -28,30 +35,148 @@ namespace drivers::usb
         uhci_queue_head* vert;
     }_packed;
 
+    // TDs linked through both linkPointer and next
+    struct uhci_td_chain
+    {
+        uhci_td* head;
+        uhci_td* tail;
+        size_t count;
+    };
+
+    // physically contiguous pool of descriptors owned by one controller
+    class uhci_pool
+    {
+        private:
+            u8* base;
+            ptr_t basePhys;
+            size_t poolSize;
+            size_t poolHead;
+
+            uhci_td* freeTDs;
+            size_t freeTDCount;
+            size_t totalTDCount;
+            uhci_queue_head* freeQHs;
+
+        public:
+            bool init(size_t pages);
+
+            // permanent allocations, only valid before build()
+            void* carve(size_t size, size_t align);
+            // split the rest of the pool into qhCount QHs and TDs
+            void build(size_t qhCount);
+
+            uhci_td_chain alloc_tds(size_t count);
+            void free_tds(uhci_td_chain& chain);
+            size_t total_tds() const { return totalTDCount; }
+
+            uhci_queue_head* alloc_qh();
+            void free_qh(uhci_queue_head* qh);
+
+            // physical address of a pointer inside the pool
+            ptr_t physical(const void* ptr) const
+            {
+                return basePhys + (reinterpret_cast<const u8*>(ptr) - base);
+            }
+    };
+
+    struct uhci_endpoint;
+
+    // a TD chain that is currently scheduled on the controller
+    struct uhci_transfer
+    {
+        uhci_td_chain chain;
+        // null for control transfers
+        uhci_endpoint* endpoint;
+
+        void* buffer;
+        // used when buffer can't be DMA'd to directly
+        cpu::dma::dma_buffer bounceBuffer;
+        u32 size;
+        u16 startFrame;
+
+        // set by the IRQ handler once the chain retires
+        volatile u8 status;
+        volatile bool complete;
+
+        // next chain queued on the same endpoint
+        uhci_transfer* next;
+        // next chain of the same bulk transfer
+        uhci_transfer* nextChain;
+    };
+
+    // a device endpoint, its transfers are queued on one QH
+    struct uhci_endpoint
+    {
+        u8 address;
+        u8 endpoint;
+        u8 packetType;
+        // DATA0/DATA1 of the next packet queued
+        u8 toggle;
+
+        // the QH is only in the schedule while transfers are pending
+        bool scheduled;
+        uhci_queue_head* qh;
+        // inactive TD the queue parks on, the next chain starts in it
+        uhci_td* dummy;
+
+        uhci_transfer* pendingHead;
+        uhci_transfer* pendingTail;
+    };
+
+#define UHCI_MAX_ENDPOINTS 32
+
     class uhci_controller
     {
         private:
             bus::pci::device* uhciController;
 
-            u32 device_count;
-
             u16 portCount;
-            u8  addressCount;
+            root_hub rootHub;
+
+            uhci_pool descriptorPool;
 
             u32* frameList;
             uhci_queue_head* uhciQueueHeads;
 
+            u8 irqLine;
+            uhci_transfer* volatile activeTransfer;
+
+            uhci_endpoint endpoints[UHCI_MAX_ENDPOINTS];
+            u8 endpointCount;
+
+            // full speed bandwidth reclamation for the bulk queue
+            bool fsbrEnabled;
+            u64 bulkBytes;
+            u64 bulkFrames;
+            u16 bulkLastFrame;
+
             //std::vector<usb_device> connectedDevices;
 
             bool isPortPresent(u16 portID);
             bool resetPort(u16 portID);
-            void setupDevice(vfs::vfs_t* gvfs, vfs::node_t* controller_node, u16 portID);
 
+            u32 queueTailLink(u8 queueID);
             void insertToQueue(uhci_queue_head* qh, u8 queueID);
             void removeFromQueue(uhci_queue_head* qh, u8 queueID);
 
-            u8 getTransferStatus(volatile uhci_td* td, size_t count);
-            u8 waitTillTransferComplete(uhci_td* td, size_t count);
+            u16 currentFrame();
+
+            u8 getTransferStatus(volatile uhci_td* td);
+            bool isTransferRetired(volatile uhci_td* td);
+            u8 waitTillTransferComplete(uhci_td_chain& chain);
+
+            bool mapPackets(uhci_td* td, void* buffer, size_t size, u16 packetSize);
+
+            uhci_endpoint* getEndpoint(const usb_device& device, u8 endpoint, u8 packetType);
+            // the device resets its toggles on SET_CONFIGURATION and CLEAR_FEATURE(HALT)
+            void resetToggles(u8 address, u8 endpointAddress, bool allEndpoints);
+
+            uhci_transfer* queueBulkChain(const usb_device& device, uhci_endpoint* endpoint, u16 maxPacketSize, void* buffer, u32 size);
+            bool waitBulkChain(const usb_device& device, uhci_transfer* transfer);
+            // completes the transfers that have retired, in queue order
+            void retireEndpoint(uhci_endpoint* endpoint);
+            // fails every transfer queued on the endpoint
+            void cancelEndpoint(uhci_endpoint* endpoint);
 
             bool controlIn(usb_device device, void* buffer, u8 requestType, u8 request, u16 value, u16 index, u16 length, u8 packetSize);
             bool controlOut(usb_device device, u8 requestType, u8 request, u16 value, u16 index, u16 length, u8 packetSize);
@@ -63,13 +188,35 @@ namespace drivers::usb
             void Setup(vfs::vfs_t* gvfs, vfs::node_t* controller_node);
 
             bool resetDevice(usb_device& device);
+
+            // root hub hooks, ports are enumerated by timer callbacks
+            void portReset(u16 portID, bool reset);
+            u8 portEnable(u16 portID);
+            void portDisable(u16 portID);
+
+            // relinks the bulk queue, so it applies to queued transfers too
+            void setBandwidthReclamation(bool enable);
+            // the FSBR setting and bulk throughput achieved so far as text
+            std::string bulkThroughput();
+
+            // called from the IRQ line shared by this controller
+            // returns true if the interrupt was raised by this controller
+            bool handleIRQ();
             //std::vector<usb_device>& getAllDevices();
 
             bool controlIn(const usb_device& device, request_packet rpacket, void* buffer, u16 size);
             bool controlOut(const usb_device& device, request_packet rpacket, u16 size);
 
-            bool bulkIn(const usb_device& device, u8 endpoint, u16 maxPacketSize, void* buffer, u16 size);
-            bool bulkOut(const usb_device& device, u8 endpoint, u16 maxPacketSize, void* buffer, u16 size);
+            bool bulkIn(const usb_device& device, u8 endpoint, u16 maxPacketSize, void* buffer, u32 size);
+            bool bulkOut(const usb_device& device, u8 endpoint, u16 maxPacketSize, void* buffer, u32 size);
+
+            // a transfer takes one TD per packet out of the shared pool
+            u32 maxBulkTransfer(u16 maxPacketSize);
+            // queue a bulk transfer behind the ones pending on the endpoint,
+            // returns nullptr on failure
+            uhci_transfer* bulkQueue(const usb_device& device, u8 endpoint, u16 maxPacketSize, void* buffer, u32 size, u8 packetType);
+            // wait for a queued bulk transfer and release it
+            bool bulkWait(const usb_device& device, uhci_transfer* transfer);
 
             // uhci_controller should be alive for
             // as long as usb_controller is.
@@ -0,0 +1,91 @@
+#include "stats.hpp"
+
+#include <io/io.h>
+#include <std/std.hpp>
+
+namespace drivers::usb
+{
+    endpoint_stats* get_endpoint_stats(const usb_device& device, u8 endpoint, bool in)
+    {
+        if(device.stats == nullptr) return nullptr;
+
+        size_t index = (endpoint & 0xF) * 2 + (in ? 1 : 0);
+        endpoint_stats*& stats = device.stats->endpoints[index];
+
+        if(stats == nullptr)
+        {
+            stats = new endpoint_stats();
+            if(stats == nullptr) return nullptr;
+
+            std::memset(stats, 0, sizeof(endpoint_stats));
+        }
+
+        return stats;
+    }
+
+    void record_transfer(endpoint_stats* stats, u32 bytes, u64 cycles, bool success)
+    {
+        if(stats == nullptr) return;
+
+        stats->transfers++;
+        if(success) stats->bytes += bytes;
+        else stats->failures++;
+
+        u32 bucket = 63 - __builtin_clzll(cycles | 1);
+        if(bucket >= USB_LATENCY_BUCKETS) bucket = USB_LATENCY_BUCKETS - 1;
+
+        stats->latency[bucket]++;
+    }
+
+    static std::string format_stats(const device_stats& device)
+    {
+        std::string text;
+
+        for(size_t i = 0; i < USB_STATS_ENDPOINTS; i++)
+        {
+            const endpoint_stats* stats = device.endpoints[i];
+            if(stats == nullptr) continue;
+
+            text += "endpoint " + std::utos(i / 2) + ((i & 1) ? " in\n" : " out\n");
+            text += "\ttransfers " + std::utos(stats->transfers) + " failures " + std::utos(stats->failures) + " bytes " + std::utos(stats->bytes) + "\n";
+            text += "\tnaks " + std::utos(stats->naks) + " stalls " + std::utos(stats->stalls) +
+                    " timeouts " + std::utos(stats->timeouts) + " retries " + std::utos(stats->retries) + "\n";
+
+            // bucket n counts transfers that took 2^n to 2^(n+1) cycles
+            text += "\tlatency";
+            for(size_t j = 0; j < USB_LATENCY_BUCKETS; j++)
+            {
+                if(stats->latency[j] == 0) continue;
+                text += " " + std::utos(j) + ":" + std::utos(stats->latency[j]);
+            }
+            text += "\n";
+        }
+
+        return text;
+    }
+
+    static i32 stats_node_read(vfs::node_t* node, size_t offset, void* buffer, size_t len)
+    {
+        const device_stats& stats = *reinterpret_cast<const device_stats*>(node->data);
+        std::string text = format_stats(stats);
+
+        return vfs::read_text(text.c_str(), text.size(), offset, buffer, len);
+    }
+
+    void add_stats_node(vfs::vfs_t* gvfs, const char* ctrl_path, const char* name, usb_device* device)
+    {
+        device->stats = new device_stats();
+        if(device->stats == nullptr) return;
+
+        std::memset(device->stats, 0, sizeof(device_stats));
+
+        std::string stats_name = std::string(name) + ".stats";
+        vfs::node_t node = vfs::make_node(stats_name.take(), false);
+
+        node.data = device->stats;
+        node.read = stats_node_read;
+        node.write = vfs::ignore_write;
+
+        vfs::add_vnode(gvfs, ctrl_path, node);
+    }
+}
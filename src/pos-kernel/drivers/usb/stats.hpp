@@ -0,0 +1,42 @@
+#pragma once
+
+#include <includes.h>
+#include "defs.hpp"
+
+// log2 of the cycles a transfer took
+#define USB_LATENCY_BUCKETS 32
+// every endpoint number in both directions
+#define USB_STATS_ENDPOINTS 32
+
+namespace drivers::usb
+{
+    struct endpoint_stats
+    {
+        u64 bytes;
+        u32 transfers;
+        u32 failures;
+
+        // counted by the host controller per packet
+        u32 naks;
+        u32 stalls;
+        u32 timeouts;
+        u32 retries;
+
+        u32 latency[USB_LATENCY_BUCKETS];
+    };
+
+    struct device_stats
+    {
+        // allocated on the first transfer
+        endpoint_stats* endpoints[USB_STATS_ENDPOINTS];
+    };
+
+    // nullptr if the device does not keep stats
+    endpoint_stats* get_endpoint_stats(const usb_device& device, u8 endpoint, bool in);
+
+    // called by the protocol layer once a transfer is done
+    void record_transfer(endpoint_stats* stats, u32 bytes, u64 cycles, bool success);
+
+    // adds "<name>.stats" next to the device node, reading it returns the stats as text
+    void add_stats_node(vfs::vfs_t* gvfs, const char* ctrl_path, const char* name, usb_device* device);
+}
@@ -1,9 +1,11 @@
 #include "usb.hpp"
+#include "stats.hpp"
 
 #include <io/io.h>
 
 #include <std/std.hpp>
 #include <std/ds.hpp>
+#include <std/memory/object_cache.hpp>
 
 #include <cpu/exceptions.hpp>
 
@@ -42,6 +44,17 @@ namespace drivers::usb
         u8  interval;
     }_packed;
 
+    // handle returned by bulk_queue
+    struct queued_transfer
+    {
+        void* transfer;
+        endpoint_stats* stats;
+        u64 start;
+        u32 size;
+    };
+
+    static std::object_cache<queued_transfer> transfer_cache;
+
     std::string get_string(const usb_device &device, usb_controller* controller, u8 stringIndex)
     {
         if(!stringIndex) return std::string();
@@ -85,6 +98,36 @@ namespace drivers::usb
         return value;
     }
 
+    static const std::string& load_string(vfs::node_t* dnode, std::string& value, u8& stringIndex)
+    {
+        // already loaded, or the device has none
+        if(stringIndex == 0) return value;
+
+        const usb_device& device = *reinterpret_cast<const usb_device*>(dnode->data);
+        usb_controller* controller = reinterpret_cast<usb_controller*>(dnode->parent->data);
+
+        value = get_string(device, controller, stringIndex);
+        stringIndex = 0;
+
+        return value;
+    }
+
+    const std::string& get_manufacture_name(vfs::node_t* dnode)
+    {
+        usb_device& device = *reinterpret_cast<usb_device*>(dnode->data);
+        return load_string(dnode, device.manufactureName, device.iManufacture);
+    }
+    const std::string& get_product_name(vfs::node_t* dnode)
+    {
+        usb_device& device = *reinterpret_cast<usb_device*>(dnode->data);
+        return load_string(dnode, device.productName, device.iProduct);
+    }
+    const std::string& get_serial_number(vfs::node_t* dnode)
+    {
+        usb_device& device = *reinterpret_cast<usb_device*>(dnode->data);
+        return load_string(dnode, device.serialNumber, device.iSerialNumber);
+    }
+
     config_desc get_config(vfs::node_t* dnode, u8 configID)
     {
         const usb_device& device = *reinterpret_cast<const usb_device*>(dnode->data);
@@ -155,7 +198,8 @@ namespace drivers::usb
                 endpoint_desc_ctrlin* endpoint = (endpoint_desc_ctrlin*)interfacePtr;
 
                 currentEndpoint->endpointAddress = endpoint->endpointAddress;
-                currentEndpoint->maxPacketSize = endpoint->maxPacketSize;
+                // bits 11-12 hold the high bandwidth multiplier, not the size
+                currentEndpoint->maxPacketSize = endpoint->maxPacketSize & 0x7FF;
                 currentEndpoint->attributes = endpoint->attributes;
                 currentEndpoint->interval = endpoint->interval;
 
@@ -291,7 +335,14 @@ namespace drivers::usb
             x86_raise(0);
         }
 
-        return controller->controlOut(controller->instance_data, device, rPacket, rPacket.size);
+        endpoint_stats* stats = get_endpoint_stats(device, CTRL_ENDPOINT, false);
+        u64 start = cpu::read_tsc();
+
+        bool status = controller->controlOut(controller->instance_data, device, rPacket, rPacket.size);
+
+        record_transfer(stats, rPacket.size, cpu::read_tsc() - start, status);
+
+        return status;
     }
     // get control packet to device
     bool control_packet_in(vfs::node_t* dnode, request_packet rPacket, void* buffer)
@@ -304,7 +355,14 @@ namespace drivers::usb
             x86_raise(0);
         }
 
-        return controller->controlIn(controller->instance_data, device, rPacket, buffer, rPacket.size);
+        endpoint_stats* stats = get_endpoint_stats(device, CTRL_ENDPOINT, true);
+        u64 start = cpu::read_tsc();
+
+        bool status = controller->controlIn(controller->instance_data, device, rPacket, buffer, rPacket.size);
+
+        record_transfer(stats, rPacket.size, cpu::read_tsc() - start, status);
+
+        return status;
     }
 
     // bulk out
@@ -318,7 +376,14 @@ namespace drivers::usb
             x86_raise(0);
         }
 
-        return controller->bulkOut(controller->instance_data, device, endpoint->endpointAddress & 0xF, endpoint->maxPacketSize, buffer, size);
+        endpoint_stats* stats = get_endpoint_stats(device, endpoint->endpointAddress, false);
+        u64 start = cpu::read_tsc();
+
+        bool status = controller->bulkOut(controller->instance_data, device, endpoint->endpointAddress & 0xF, endpoint->maxPacketSize, buffer, size);
+
+        record_transfer(stats, size, cpu::read_tsc() - start, status);
+
+        return status;
     }
     bool bulk_in(vfs::node_t* dnode, endpoint_desc* endpoint, void* buffer, size_t size)
     {
@@ -330,6 +395,78 @@ namespace drivers::usb
             x86_raise(0);
         }
 
-        return controller->bulkIn(controller->instance_data, device, endpoint->endpointAddress & 0xF, endpoint->maxPacketSize, buffer, size);
+        endpoint_stats* stats = get_endpoint_stats(device, endpoint->endpointAddress, true);
+        u64 start = cpu::read_tsc();
+
+        bool status = controller->bulkIn(controller->instance_data, device, endpoint->endpointAddress & 0xF, endpoint->maxPacketSize, buffer, size);
+
+        record_transfer(stats, size, cpu::read_tsc() - start, status);
+
+        return status;
+    }
+
+    void* bulk_queue(vfs::node_t* dnode, endpoint_desc* endpoint, void* buffer, size_t size)
+    {
+        const usb_device& device = *reinterpret_cast<const usb_device*>(dnode->data);
+        usb_controller* controller = reinterpret_cast<usb_controller*>(dnode->parent->data);
+        if(controller == nullptr)
+        {
+            log_error("[USB][Protocol Layer] device has null controller\n");
+            x86_raise(0);
+        }
+
+        u8 packetType = (endpoint->endpointAddress & 0x80) ? PACKET_IN : PACKET_OUT;
+
+        queued_transfer* queued = transfer_cache.alloc();
+        queued->stats = get_endpoint_stats(device, endpoint->endpointAddress, packetType == PACKET_IN);
+        queued->start = cpu::read_tsc();
+        queued->size = size;
+
+        queued->transfer = controller->bulkQueue(controller->instance_data, device, endpoint->endpointAddress & 0xF, endpoint->maxPacketSize, buffer, size, packetType);
+
+        if(queued->transfer == nullptr)
+        {
+            record_transfer(queued->stats, size, cpu::read_tsc() - queued->start, false);
+
+            transfer_cache.free(queued);
+            return nullptr;
+        }
+
+        return queued;
+    }
+    u32 max_bulk_transfer(vfs::node_t* dnode, endpoint_desc* endpoint)
+    {
+        usb_controller* controller = reinterpret_cast<usb_controller*>(dnode->parent->data);
+        if(controller == nullptr)
+        {
+            log_error("[USB][Protocol Layer] device has null controller\n");
+            x86_raise(0);
+        }
+
+        return controller->maxBulkTransfer(controller->instance_data, endpoint->maxPacketSize);
+    }
+    bool bulk_wait(vfs::node_t* dnode, void* transfer)
+    {
+        // queueing failed
+        if(transfer == nullptr) return false;
+
+        const usb_device& device = *reinterpret_cast<const usb_device*>(dnode->data);
+        usb_controller* controller = reinterpret_cast<usb_controller*>(dnode->parent->data);
+        if(controller == nullptr)
+        {
+            log_error("[USB][Protocol Layer] device has null controller\n");
+            x86_raise(0);
+        }
+
+        queued_transfer* queued = reinterpret_cast<queued_transfer*>(transfer);
+
+        bool status = controller->bulkWait(controller->instance_data, device, queued->transfer);
+
+        // latency includes the time spent queued behind other transfers
+        record_transfer(queued->stats, queued->size, cpu::read_tsc() - queued->start, status);
+
+        transfer_cache.free(queued);
+
+        return status;
     }
 }
@@ -9,7 +9,7 @@ namespace drivers::usb
     {
         u8  endpointAddress;
         u8  attributes;
-        u8  maxPacketSize;
+        u16 maxPacketSize;
         u8  interval;
     };
     struct interface_desc
@@ -37,6 +37,11 @@ namespace drivers::usb
 
     // allocates string
     std::string get_string(const usb_device& device, usb_controller* controller, u8 stringIndex);
+
+    // device strings are fetched on first access
+    const std::string& get_manufacture_name(vfs::node_t* dnode);
+    const std::string& get_product_name(vfs::node_t* dnode);
+    const std::string& get_serial_number(vfs::node_t* dnode);
     
     // allocates all needed memory
     config_desc get_config(vfs::node_t* dnode, u8 configID);
@@ -61,5 +66,13 @@ namespace drivers::usb
     bool bulk_out(vfs::node_t* dnode, endpoint_desc* endpoint, void* buffer, size_t size);
     // bulk in
     bool bulk_in(vfs::node_t* dnode, endpoint_desc* endpoint, void* buffer, size_t size);
+
+    // queue a bulk transfer behind the ones pending on the endpoint
+    // the direction is taken from the endpoint address
+    void* bulk_queue(vfs::node_t* dnode, endpoint_desc* endpoint, void* buffer, size_t size);
+    // wait for a queued bulk transfer to finish
+    bool bulk_wait(vfs::node_t* dnode, void* transfer);
+    // largest transfer bulk_queue takes on the endpoint
+    u32 max_bulk_transfer(vfs::node_t* dnode, endpoint_desc* endpoint);
 }
 
@@ -6,10 +6,13 @@
 #include <cpu/boot.hpp>
 #include <cpu/paging.hpp>
 #include <cpu/memory.hpp>
+#include <cpu/dma.hpp>
 #include <cpu/stack.hpp>
 
 #include <vfs/vfs.hpp>
 
+#include <std/memory/heap_stats.hpp>
+
 // all the drivers
 #include "vga/VGA.hpp"
 #include "dcom/DebugCOM.hpp"
@@ -19,6 +22,16 @@
 
 #include "pci/pci.hpp"
 
+// heap dumps go to the debug console, the monitor may be what broke
+static con::console debug_console;
+
+static i32 heap_node_read(vfs::node_t* node, size_t offset, void* buffer, size_t len)
+{
+    std::string text = std::format_heap_stats();
+
+    return vfs::read_text(text.c_str(), text.size(), offset, buffer, len);
+}
+
 // initialize the hardware
 vfs::vfs_t* initialize_hw(KernelInfo& kernel_info)
 {
@@ -40,11 +53,22 @@ vfs::vfs_t* initialize_hw(KernelInfo& kernel_info)
 	u32 flags_page_zero = cpu::getFlagsPage(0);
 	flags_page_zero &= ~cpu::PAGE_PRESENT;
 	cpu::setFlagsPage(0, flags_page_zero);
+	// the bootloader's tables behind large pages are free memory now
+	cpu::releasePageTables();
+	// MMIO BARs are reached through the identity map, the heap window must stay below them
+	cpu::limit_address_space(bus::pci::lowest_memory_bar());
 	// done
 	printf("Ok\n");
 
+	printf("initialising DMA Zone... ");
+	if(cpu::dma::initialize()) printf("Ok\n");
+	else printf("Failed\n");
+
 	printf("initialising Kernel Heap... ");
 	std::initialize_heap();
+
+	debug_console = DCOM::get_console();
+	std::set_heap_dump_console(&debug_console);
 	printf("Ok\n");
 
 	printf("initialising VFS... ");
@@ -52,6 +76,12 @@ vfs::vfs_t* initialize_hw(KernelInfo& kernel_info)
 	vfs::vfs_t* g_vfs = vfs::init();
 	vfs::add_vnode(g_vfs, "/", vfs::make_node("hw", true));
 	vfs::add_vnode(g_vfs, "/", vfs::make_node("dev", true));
+	vfs::add_vnode(g_vfs, "/", vfs::make_node("sys", true));
+
+	vfs::node_t heap_node = vfs::make_node("heap", false);
+	heap_node.read = heap_node_read;
+	heap_node.write = vfs::ignore_write;
+	vfs::add_vnode(g_vfs, "/sys/", heap_node);
 
 	printf("Ok\n");
 
@@ -109,6 +109,50 @@ namespace bus::pci
         config_write_u16(bus_no, device_no, function, register_offset, (curr_value & ~(UINT8_MAX)) | value);
     }
 
+    u32 lowest_memory_bar()
+    {
+        u32 lowest = UINT32_MAX;
+
+        for(u32 bus = 0; bus < 256; bus++)
+        {
+            for(u8 device_no = 0; device_no < 32; device_no++)
+            {
+                if(config_read_u16(bus, device_no, 0, 0x00) == 0xFFFF) continue;
+
+                u8 functionCount = (config_read_u8(bus, device_no, 0, 0x0E) & 0x80) ? 8 : 1;
+                for(u8 function = 0; function < functionCount; function++)
+                {
+                    if(config_read_u16(bus, device_no, function, 0x00) == 0xFFFF) continue;
+
+                    // bridges have 2 BARs, cardbus bridges 1
+                    u8 headerType = config_read_u8(bus, device_no, function, 0x0E) & (~0x80);
+                    u8 barCount = headerType == 0 ? 6 : (headerType == 1 ? 2 : 1);
+
+                    for(u8 i = 0; i < barCount; i++)
+                    {
+                        u32 BAR = config_read_u32(bus, device_no, function, 0x10 + i * 4);
+
+                        // IO space
+                        if(BAR & 0x01) continue;
+
+                        // 64-bit BARs mapped above 4GiB can't collide
+                        if((BAR & 0x6) == 0x4)
+                        {
+                            i++;
+                            if(i < barCount && config_read_u32(bus, device_no, function, 0x10 + i * 4) != 0) continue;
+                        }
+
+                        // 0 if the firmware did not assign it
+                        u32 base = BAR & ~((u32)0xF);
+                        if(base != 0 && base < lowest) lowest = base;
+                    }
+                }
+            }
+        }
+
+        return lowest;
+    }
+
     device getDeviceFunction(u8 bus, u8 device_no, u8 function)
     {
         device finfo;
@@ -185,7 +229,7 @@ namespace bus::pci
 
         vfs::node_t dnode = vfs::make_node(device_name.take(), false);
         dnode.flags |= vfs::NODE_DEVICE;
-        dnode.driver_uid = UID_CLASS_USBCTRL;
+        dnode.driver_uid = UID_CLASS_PCI;
         dnode.data = new device(_device);
 
         dnode.write = pci_dev_write;
@@ -104,6 +104,10 @@ namespace bus::pci
     };
 
     
+    // lowest address a memory BAR assigned by the firmware decodes, UINT32_MAX if there is none
+    // reads the config space directly, so it can be used before init
+    u32 lowest_memory_bar();
+
     void enumerate_bus(vfs::vfs_t* gvfs);
     
     void pretty_print_bus(vfs::vfs_t* gvfs);
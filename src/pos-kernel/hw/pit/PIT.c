@@ -9,8 +9,25 @@ static volatile u32 PIT_ticks_till_timeout = 0;
 static volatile bool PIT_timer_enabled = false;
 static volatile bool PIT_timedout = false;
 
+#define PIT_TICKS_PER_MS (PIT_TICKS_PER_SECOND / 1000)
+#define PIT_MAX_TIMERS   64
+
+struct PIT_timer
+{
+    u32 deadline;
+    PIT_callback callback;
+    void* data;
+};
+
+static volatile u32 PIT_ticks = 0;
+// unordered, only touched outside of the IRQ
+static PIT_timer PIT_timers[PIT_MAX_TIMERS];
+static u32 PIT_timer_count = 0;
+
 void _no_stack_trace PIT_timer_irq(Registers* registers)
 {
+    PIT_ticks++;
+
     if(!PIT_timer_enabled) return;
 
     // ran out of time
@@ -25,7 +42,7 @@ void _no_stack_trace PIT_timer_irq(Registers* registers)
 
 void PIT_setTimeout(u32 timeOut)
 {
-    PIT_ticks_till_timeout = timeOut * 18;
+    PIT_ticks_till_timeout = timeOut * PIT_TICKS_PER_MS;
     PIT_timer_enabled = true;
     PIT_timedout = false;
 }
@@ -47,6 +64,47 @@ bool PIT_hasTimedOut()
     return PIT_timedout;
 }
 
+u32 PIT_getTicks()
+{
+    return PIT_ticks;
+}
+
+bool PIT_addTimer(u32 time, PIT_callback callback, void* data)
+{
+    if(PIT_timer_count >= PIT_MAX_TIMERS) return false;
+
+    PIT_timers[PIT_timer_count].deadline = PIT_ticks + time * PIT_TICKS_PER_MS;
+    PIT_timers[PIT_timer_count].callback = callback;
+    PIT_timers[PIT_timer_count].data = data;
+    PIT_timer_count++;
+
+    return true;
+}
+
+u32 PIT_runTimers()
+{
+    u32 i = 0;
+    while(i < PIT_timer_count)
+    {
+        // wrap around safe
+        if((i32)(PIT_ticks - PIT_timers[i].deadline) < 0)
+        {
+            i++;
+            continue;
+        }
+
+        PIT_timer timer = PIT_timers[i];
+
+        // the callback may add timers of its own
+        PIT_timer_count--;
+        PIT_timers[i] = PIT_timers[PIT_timer_count];
+
+        timer.callback(timer.data);
+    }
+
+    return PIT_timer_count;
+}
+
 void PIT_init()
 {
     PIC_irq_unmask(0);
@@ -5,6 +5,7 @@
 #define PIT_IRQ 0
 #define PIT_FREQUENCY 100 // Hz
 #define PIT_MAX_FREQ 1193182 // Hz
+#define PIT_TICKS_PER_SECOND 18000
 
 // set time in seconds
 void PIT_setTimeout(u32 timeOut);
@@ -14,4 +15,15 @@ void PIT_sleep(u32 time);
 
 bool PIT_hasTimedOut();
 
+// ticks since PIT_init, PIT_TICKS_PER_SECOND of them make a second
+u32 PIT_getTicks();
+
+typedef void(*PIT_callback)(void* data);
+
+// calls callback once time ms have passed, independent of the timeout
+// callbacks are run by PIT_runTimers, never from the IRQ
+bool PIT_addTimer(u32 time, PIT_callback callback, void* data);
+// runs the callbacks of expired timers, returns the number still pending
+u32 PIT_runTimers();
+
 void PIT_init();
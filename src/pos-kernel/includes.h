@@ -47,7 +47,7 @@ typedef u32 pid_t;
 
 // Defines for UIDs
 #define UID_IS_DRIVER_HINT(x) (x < 0)
-#define UID_CLASS_USBCTRL ((uid_t)-2)
+#define UID_CLASS_PCI ((uid_t)-2)
 #define UID_CLASS_USB ((uid_t)-3)
 
 #ifdef _novscode
@@ -6,6 +6,7 @@
 #include <cpu/exceptions.hpp>
 #include <std/std.hpp>
 #include <hw/pci/pci.hpp>
+#include <hw/pit/PIT.h>
 
 #include <std/memory/heap.hpp>
 
@@ -52,6 +53,9 @@ _export void start(KernelInfo kernelInfo)
 
 	while (true)
 	{
+		// drives device enumeration
+		PIT_runTimers();
+
 		if(!vfs::poll(g_vfs)) continue;
 		vfs::event_t event = vfs::pop_event(g_vfs);
 		if(event.flags == vfs::EVENT_INVALID) continue;
@@ -2,33 +2,93 @@
 
 #include <c/math.h>
 
+#define BITMAP_WORD_BITS 32
+#define BITMAP_FULL_WORD 0xFFFFFFFF
+
 namespace std
 {
-    Bitmap::Bitmap(u8* _bitmap, size_t bitcount, bool defaultValue) : bitmap(_bitmap)
+    size_t Bitmap::storage_size(size_t bitcount)
+    {
+        size_t words = DivRoundUp(bitcount, BITMAP_WORD_BITS);
+        size_t summary_words = DivRoundUp(words, BITMAP_WORD_BITS);
+
+        return (words + summary_words) * sizeof(u32);
+    }
+
+    Bitmap::Bitmap(u8* _bitmap, size_t bitcount, bool defaultValue) : bitmap(reinterpret_cast<u32*>(_bitmap))
     {
-        bitmap_size = DivRoundUp(bitcount, 8);
         bitmap_count = bitcount;
-        for(size_t i = 0; i < bitmap_size; i++)
+        word_count = DivRoundUp(bitcount, BITMAP_WORD_BITS);
+
+        summary_count = DivRoundUp(word_count, BITMAP_WORD_BITS);
+        summary = bitmap + word_count;
+
+        for(size_t i = 0; i < word_count; i++)
+        {
+            bitmap[i] = defaultValue ? BITMAP_FULL_WORD : 0;
+        }
+
+        // the bits past the end are used, so no search runs into them
+        if(bitcount % BITMAP_WORD_BITS != 0)
         {
-            bitmap[i] = 0xFF * (u8)defaultValue;
+            bitmap[word_count - 1] |= BITMAP_FULL_WORD << (bitcount % BITMAP_WORD_BITS);
         }
+
+        for(size_t i = 0; i < summary_count; i++)
+        {
+            summary[i] = defaultValue ? BITMAP_FULL_WORD : 0;
+        }
+
+        if(word_count % BITMAP_WORD_BITS != 0)
+        {
+            summary[summary_count - 1] |= BITMAP_FULL_WORD << (word_count % BITMAP_WORD_BITS);
+        }
+
+        if(!defaultValue && bitcount % BITMAP_WORD_BITS != 0) update_summary(word_count - 1);
+
         isFalseBitCached = false;
     }
 
-    bool Bitmap::get(size_t bitIndex)
+    void Bitmap::update_summary(size_t wordIndex)
     {
-        size_t byteIndex = bitIndex / 8;
-        size_t byteOffset = bitIndex % 8;
+        u32 mask = 1u << (wordIndex % BITMAP_WORD_BITS);
 
-        return (bitmap[byteIndex] >> byteOffset) & 0x1;
+        if(bitmap[wordIndex] == BITMAP_FULL_WORD) summary[wordIndex / BITMAP_WORD_BITS] |= mask;
+        else summary[wordIndex / BITMAP_WORD_BITS] &= ~mask;
+    }
+
+    size_t Bitmap::next_free_word(size_t wordIndex)
+    {
+        size_t index = wordIndex / BITMAP_WORD_BITS;
+        if(index >= summary_count) return word_count;
+
+        // ignore the words before wordIndex in its summary word
+        u32 free = ~summary[index] & (BITMAP_FULL_WORD << (wordIndex % BITMAP_WORD_BITS));
+
+        while(free == 0)
+        {
+            index++;
+            if(index >= summary_count) return word_count;
+
+            free = ~summary[index];
+        }
+
+        return index * BITMAP_WORD_BITS + __builtin_ctz(free);
+    }
+
+    bool Bitmap::get(size_t bitIndex)
+    {
+        return (bitmap[bitIndex / BITMAP_WORD_BITS] >> (bitIndex % BITMAP_WORD_BITS)) & 0x1;
     }
     void Bitmap::set(size_t bitIndex, bool value)
     {
-        size_t byteIndex = bitIndex / 8;
-        size_t byteOffset = bitIndex % 8;
+        size_t wordIndex = bitIndex / BITMAP_WORD_BITS;
+        u32 mask = 1u << (bitIndex % BITMAP_WORD_BITS);
 
-        if(value) bitmap[byteIndex] |= (1 << byteOffset);
-        else bitmap[byteIndex] &= ~(1 << byteOffset);
+        if(value) bitmap[wordIndex] |= mask;
+        else bitmap[wordIndex] &= ~mask;
+
+        update_summary(wordIndex);
     }
 
     size_t Bitmap::find_false()
@@ -39,124 +99,147 @@ namespace std
             return cache_false_bit_pos;
         }
 
-        for(size_t i = 0; i < bitmap_size; i++)
-        {
-            u8 value = bitmap[i];
-
-            // if the byte is not equal to 0xFF
-            // impiles that this byte contains a false value
-            if(value != 0xFF)
-            {
-                for(u8 offset = 0; offset < 8; offset++)
-                {
-                    // if the value at that offset is false
-                    // the >> will givew a even number
-                    if((value >> offset) % 2 == 0)
-                    {
-                        // this is our value
-                        return i * 8 + offset;
-                    }
-                }
-            }
-        }
+        size_t wordIndex = next_free_word(0);
 
         // not found
-        return Bitmap::npos;
+        if(wordIndex >= word_count) return Bitmap::npos;
+
+        return wordIndex * BITMAP_WORD_BITS + __builtin_ctz(~bitmap[wordIndex]);
     }
 
-    size_t Bitmap::find_false_bits(size_t n, bool cache)
+    size_t Bitmap::find_false_bits(u32 n, bool cache)
     {
         isFalseBitCached = cache;
 
-        for(size_t i = 0; i < bitmap_size; i++)
+        // the false bits found so far, ended by the first true bit
+        size_t run_start = 0;
+        size_t run_length = 0;
+
+        size_t wordIndex = next_free_word(0);
+
+        if(cache)
         {
-            u8 value = bitmap[i];
+            cache_false_bit_pos = Bitmap::npos;
+            if(wordIndex < word_count) cache_false_bit_pos = wordIndex * BITMAP_WORD_BITS + __builtin_ctz(~bitmap[wordIndex]);
+        }
 
-            // if the byte is equal to 0xFF
-            // there is no false bits in this byte
-            if(value == 0xFF) continue;
+        if(n == 0) return Bitmap::npos;
 
-            for(u8 offset = 0; offset < 8; offset++)
+        while(wordIndex < word_count)
+        {
+            u32 value = bitmap[wordIndex];
+
+            // the whole word extends the run
+            if(value == 0)
             {
-                // if the value at that offset is false
-                // the >> will givew a even number
-                if((value >> offset) & 0x1) continue;
+                if(run_length == 0) run_start = wordIndex * BITMAP_WORD_BITS;
+                run_length += BITMAP_WORD_BITS;
 
-                if(cache)
-                {
-                    cache_false_bit_pos = i * 8 + offset;
-                    cache = false;
-                }
+                if(run_length >= n) return run_start;
 
-                size_t loc = i * 8 + offset;
+                wordIndex++;
+                continue;
+            }
 
-                for(size_t j = 0; j < n; j++)
+            // walk the word one run of equal bits at a time
+            u32 bit = 0;
+            while(bit < BITMAP_WORD_BITS)
+            {
+                // false bits from bit on, the shift brings in zeros past the word
+                u32 rest = value >> bit;
+                u32 count = rest == 0 ? BITMAP_WORD_BITS - bit : __builtin_ctz(rest);
+
+                if(count != 0)
                 {
-                    // not a false byte
-                    // skip
-                    if(get(loc + j))
-                    {
-                        goto nextByte;
-                    }
+                    if(run_length == 0) run_start = wordIndex * BITMAP_WORD_BITS + bit;
+                    run_length += count;
+
+                    if(run_length >= n) return run_start;
+
+                    bit += count;
+                    if(bit == BITMAP_WORD_BITS) break;
                 }
 
-                return loc;
+                // true bits end the run
+                rest = ~(value >> bit);
+                count = rest == 0 ? BITMAP_WORD_BITS - bit : __builtin_ctz(rest);
+
+                run_length = 0;
+                bit += count;
             }
 
-            nextByte:
-            ;
-        }
+            wordIndex++;
 
-        cache_false_bit_pos = Bitmap::npos;
+            // a run can't start in a full word
+            if(run_length == 0) wordIndex = next_free_word(wordIndex);
+        }
 
         return Bitmap::npos;
     }
 
-    void Bitmap::setBits(size_t first, size_t size, bool value)
+    size_t Bitmap::next_false(size_t bitIndex)
     {
-        if(size < 8)
+        if(bitIndex >= bitmap_count) return bitmap_count;
+
+        size_t wordIndex = bitIndex / BITMAP_WORD_BITS;
+        u32 free = ~bitmap[wordIndex] & (BITMAP_FULL_WORD << (bitIndex % BITMAP_WORD_BITS));
+
+        if(free == 0)
         {
-            for(size_t i = 0; i < size; i++)
-            {
-                set(first + i, value);
-            }
+            wordIndex = next_free_word(wordIndex + 1);
+            if(wordIndex >= word_count) return bitmap_count;
 
-            return;
+            free = ~bitmap[wordIndex];
         }
 
-        u8 byteValue = 0xFF * (u8)value;
-        size_t byteCount = size / 8;
-
-        size_t firstByte = first / 8;
-        size_t lastByte = (first + size) / 8;
+        // the bits past the end are true, so this is in range
+        return wordIndex * BITMAP_WORD_BITS + __builtin_ctz(free);
+    }
+    size_t Bitmap::next_true(size_t bitIndex)
+    {
+        if(bitIndex >= bitmap_count) return bitmap_count;
 
-        u8 beginOffset = first % 8;
-        u8 lastOffset = 8 - ((first + size) % 8);
+        size_t wordIndex = bitIndex / BITMAP_WORD_BITS;
+        u32 used = bitmap[wordIndex] & (BITMAP_FULL_WORD << (bitIndex % BITMAP_WORD_BITS));
 
-        // perfectly divisible then last byte is 1 before calculated value
-        if(lastOffset == 8)
+        while(used == 0)
         {
-            lastByte--;
-            lastOffset = 0;
-        }
+            wordIndex++;
+            if(wordIndex >= word_count) return bitmap_count;
 
-        bitmap[firstByte] = (bitmap[firstByte] & ~(0xFF << beginOffset)) | (byteValue << beginOffset);
+            used = bitmap[wordIndex];
+        }
 
-        //if(value) bitmap[firstByte] |= 0xFF << beginOffset;
-        //else bitmap[firstByte] &= 0xFF >> (8 - beginOffset);
+        size_t index = wordIndex * BITMAP_WORD_BITS + __builtin_ctz(used);
+        return index < bitmap_count ? index : bitmap_count;
+    }
 
-        //bitmap[firstByte] |= byteValue << beginOffset;
+    void Bitmap::setBits(size_t first, size_t size, bool value)
+    {
+        size_t end = first + size;
 
-        for(size_t i = firstByte + 1; i < lastByte; i++)
+        // a word at a time, the first and last may be partial
+        while(first < end)
         {
-            bitmap[i] = byteValue;
-        }
+            size_t wordIndex = first / BITMAP_WORD_BITS;
+            u32 offset = first % BITMAP_WORD_BITS;
+
+            size_t count = BITMAP_WORD_BITS - offset;
+            if(count > end - first) count = end - first;
 
-        bitmap[lastByte] = (bitmap[lastByte] & ~(0xFF >> lastOffset)) | (byteValue >> lastOffset);
+            u32 mask = count == BITMAP_WORD_BITS ? BITMAP_FULL_WORD : ((1u << count) - 1) << offset;
+
+            if(value) bitmap[wordIndex] |= mask;
+            else bitmap[wordIndex] &= ~mask;
+
+            update_summary(wordIndex);
+
+            first += count;
+        }
     }
 
     size_t Bitmap::size()
     {
         return bitmap_count;
     }
-}
\ No newline at end of file
+}
@@ -7,17 +7,31 @@ namespace std
     class Bitmap
     {
         private:
-            size_t bitmap_size = 0;   // size in bytes
+            size_t word_count = 0;
             size_t bitmap_count = 0;
-            u8* bitmap = nullptr;
+            u32* bitmap = nullptr;
+
+            // a bit per word of the bitmap, set when the word has no false bit
+            // so searches skip 1024 used bits at a time
+            size_t summary_count = 0;
+            u32* summary = nullptr;
 
             bool isFalseBitCached = false;
             size_t cache_false_bit_pos = false;
+
+            void update_summary(size_t wordIndex);
+
+            // first word at or after wordIndex with a false bit, word_count if none
+            size_t next_free_word(size_t wordIndex);
         
         public:
             static const size_t npos = 0;
 
+            // bytes needed for the bits and their summary, the buffer holds both
+            static size_t storage_size(size_t bitcount);
+
             Bitmap() = default;
+            // _bitmap must be 4 byte aligned and storage_size(bitcount) bytes long
             Bitmap(u8* _bitmap, size_t bitcount, bool defaultValue = true);
 
             bool get(size_t bitIndex);
@@ -31,6 +45,10 @@ namespace std
             // finds n consecutive bits which are false
             size_t find_false_bits(u32 n, bool cache = false);
 
+            // first false or true bit at or after bitIndex, size() if there is none
+            size_t next_false(size_t bitIndex);
+            size_t next_true(size_t bitIndex);
+
             size_t size();
 
             ~Bitmap() = default;
@@ -1,9 +1,11 @@
 #include "heap.hpp"
 #include "internals.hpp"
+#include "heap_stats.hpp"
 
 #include <c/math.h>
 #include <io/io.h>
 #include <cpu/memory.hpp>
+#include <cpu/paging.hpp>
 #include <cpu/exceptions.hpp>
 
 #define MIN_NODE_SIZE 0x10
@@ -14,7 +16,23 @@
 #define HEAP_POOL_SIZE 0x100000 // 1 MiB
 
 #define HEAP_FREE_NODE 0x1
-#define HEAP_HINT_RESIZEABLE 0x2
+// the node physically before this one is free, its size is in the footer right before this header
+#define HEAP_PREV_FREE 0x2
+
+// exact classes for every size up to 512 bytes, 16 bytes apart
+#define HEAP_SMALL_CLASSES 32
+#define HEAP_SMALL_LIMIT (HEAP_SMALL_CLASSES * 0x10)
+// power of two classes for the rest, class n holds [2^(n+9), 2^(n+10))
+#define HEAP_LARGE_CLASSES 23
+#define HEAP_CLASS_COUNT (HEAP_SMALL_CLASSES + HEAP_LARGE_CLASSES)
+
+// smallest free node worth splitting off
+#define HEAP_MIN_SPLIT (sizeof(heap_node) + MIN_NODE_SIZE)
+
+// address space the heap grows into once the linker heap is used up
+#define HEAP_WINDOW_PAGES 0x10000 // 256 MiB
+// smallest growth, and the free pages kept mapped above the bin head
+#define HEAP_GROW_PAGES 0x40 // 256 KiB
 
 _import char __heap_start[];
 _import char __heap_end[];
@@ -28,7 +46,14 @@ namespace std
     size_t heap_bin_size;
 
     std::internal::HeapBin alloc_bin;
-    std::internal::HeapBin free_bin;
+
+    // pages mapped so far at the heap window
+    u8* heap_window;
+    size_t heap_window_pages;
+
+    // one free list per size class, and a bit for each non-empty one
+    std::internal::HeapBin free_bins[HEAP_CLASS_COUNT];
+    u64 free_classes;
 
     u32 get_aligned_size(u32 req_size, u32 align=0x1)
     {
@@ -39,56 +64,240 @@ namespace std
         return req_size + padding;
     }
 
-    void initialize_heap()
+    // sizes are multiples of 0x10 and never 0
+    static inline u32 size_class(u32 size)
     {
-        heap_bin_top = (u8*)__heap_start;
-        heap_bin_head = 0;
-        heap_bin_size = (u8*)__heap_end - (u8*)__heap_start;
+        if(size <= HEAP_SMALL_LIMIT) return size / 0x10 - 1;
+
+        return HEAP_SMALL_CLASSES + (31 - __builtin_clz(size)) - 9;
     }
 
-    void* malloc_aligned(u32 req_size, u32 align)
+    static inline void free_push(heap_node* node)
     {
-        // to meet alignment requirements
-        // figure out the padding needed
-        
-        align = RoundUpTo2Power(align);
-        // if normal alignment
-        if(align <= 0x10) return malloc(req_size);
+        u32 index = size_class(node->size);
 
-        // otherwise, find out padding
-        u32 heap_head_addr = reinterpret_cast<u32>(heap_bin_top + heap_bin_head);
+        std::internal::bin_push(&free_bins[index], node);
+        free_classes |= (u64)1 << index;
+    }
+    static inline void free_remove(heap_node* node)
+    {
+        u32 index = size_class(node->size);
 
-        u32 data_addr_nopad = heap_head_addr + sizeof(heap_node);
+        std::internal::bin_remove(&free_bins[index], node);
+        if(free_bins[index].head == nullptr) free_classes &= ~((u64)1 << index);
+    }
 
-        u32 padding = ~(data_addr_nopad & (align - 1)) + 1;
-        // make sure padding is less than align, i.e padding = padding % align
-        padding &= align - 1;
+    // the node physically after node, nullptr if node ends at the heap bin
+    static inline heap_node* node_after(heap_node* node)
+    {
+        u8* end = (u8*)(node + 1) + node->size;
+        if(end >= heap_bin_top + heap_bin_head) return nullptr;
+
+        return (heap_node*)end;
+    }
+    // only valid if node has HEAP_PREV_FREE set
+    static inline heap_node* node_before(heap_node* node)
+    {
+        u32 prev_size = reinterpret_cast<u32*>(node)[-1];
+
+        return (heap_node*)((u8*)node - prev_size - sizeof(heap_node));
+    }
 
-        // if no padding present, do normal malloc
-        if(padding == 0) return malloc(req_size);
+    // boundary tags of a free node, the footer and the flag of the next node
+    static inline void set_free_tags(heap_node* node)
+    {
+        reinterpret_cast<u32*>((u8*)(node + 1) + node->size)[-1] = node->size;
 
-        // make sure there is enough space
-        if(heap_bin_size < padding + get_aligned_size(req_size))
+        heap_node* next = node_after(node);
+        if(next != nullptr) next->flags |= HEAP_PREV_FREE;
+    }
+    static inline void clear_free_tags(heap_node* node)
+    {
+        heap_node* next = node_after(node);
+        if(next != nullptr) next->flags &= ~HEAP_PREV_FREE;
+    }
+
+    // removes a free node with at least size bytes from its list
+    static heap_node* free_take(u32 size)
+    {
+        u32 index = size_class(size);
+
+        // a large class also holds nodes smaller than size, only its head is tried
+        if(size > HEAP_SMALL_LIMIT)
         {
-            x86_raise(NO_HEAP_MEMORY);
-            return nullptr;
+            heap_node* node = free_bins[index].head;
+            if(node != nullptr && node->size >= size)
+            {
+                free_remove(node);
+                return node;
+            }
+
+            index++;
         }
 
-        heap_node* padding_node = reinterpret_cast<heap_node*>(heap_bin_top + heap_bin_head);
-        *padding_node = std::internal::construct_heap_node(padding - sizeof(heap_node));
-        
-        // add the padding node to free bin
-        padding_node->flags |= HEAP_FREE_NODE;
-        std::internal::bin_push(&free_bin, padding_node);
+        // every node of a higher class is big enough
+        u64 classes = index < HEAP_CLASS_COUNT ? free_classes >> index : 0;
+        if(classes != 0)
+        {
+            heap_node* node = free_bins[index + __builtin_ctzll(classes)].head;
+            free_remove(node);
+
+            return node;
+        }
+
+        // last resort before running out, the rest of the class of size
+        if(size <= HEAP_SMALL_LIMIT) return nullptr;
 
-        heap_bin_head += padding;
-        heap_bin_size -= padding;
+        heap_node* node = std::internal::bin_find_node(free_bins[index - 1], size);
+        if(node != nullptr) free_remove(node);
 
-        // return normal malloc
-        return malloc(req_size);
+        return node;
     }
 
-    void* malloc(u32 req_size)
+    // hands out a node taken from the free lists, the tail goes back if it is big enough
+    static void* use_free_node(heap_node* node, u32 size)
+    {
+        if(node->size >= size + HEAP_MIN_SPLIT)
+        {
+            heap_node* split_node = (heap_node*)((u8*)(node + 1) + size);
+            *split_node = std::internal::construct_heap_node(node->size - size - sizeof(heap_node));
+
+            // reconstruct node, to get rid of flags
+            u32 prev_free = node->flags & HEAP_PREV_FREE;
+            *node = std::internal::construct_heap_node(size);
+            node->flags |= prev_free;
+
+            // the node after it is already tagged
+            split_node->flags |= HEAP_FREE_NODE;
+            set_free_tags(split_node);
+            free_push(split_node);
+        }
+        else
+        {
+            // set free bit to 0
+            node->flags &= ~HEAP_FREE_NODE;
+            clear_free_tags(node);
+        }
+
+        std::internal::bin_push(&alloc_bin, node);
+
+        // return the data region
+        return (void*)(node + 1);
+    }
+
+    // padding needed to align the data of a node at address,
+    // large enough to hold a free node of its own
+    static inline u32 get_node_padding(u32 address, u32 align)
+    {
+        u32 padding = get_aligned_size(address + sizeof(heap_node), align) - (address + sizeof(heap_node));
+
+        if(padding != 0 && padding < HEAP_MIN_SPLIT) padding += align;
+
+        return padding;
+    }
+
+    // maps enough pages after the heap bin for a node of size bytes
+    static bool heap_grow(u32 size)
+    {
+        if(heap_window == nullptr)
+        {
+            heap_window = (u8*)cpu::reserve_address_space(HEAP_WINDOW_PAGES);
+            if(heap_window == nullptr) return false;
+
+            heap_window_pages = 0;
+        }
+
+        bool in_window = heap_bin_top == heap_window;
+
+        u32 needed = sizeof(heap_node) + size - (in_window ? heap_bin_size : 0);
+        size_t pages = DivRoundUp(needed, PAGE_SIZE);
+        if(pages < HEAP_GROW_PAGES) pages = HEAP_GROW_PAGES;
+
+        if(heap_window_pages + pages > HEAP_WINDOW_PAGES) pages = HEAP_WINDOW_PAGES - heap_window_pages;
+        if(pages == 0) return false;
+
+        // the pages don't have to be contiguous, take the largest runs available
+        // every run is mapped before the TLB is invalidated once
+        cpu::page_batch batch;
+        size_t mapped = 0;
+        size_t run = pages;
+        while(mapped < pages && run > 0)
+        {
+            if(run > pages - mapped) run = pages - mapped;
+
+            void* run_pages = cpu::alloc_pages(run);
+            if(run_pages == nullptr)
+            {
+                run /= 2;
+                continue;
+            }
+
+            u32 vaddress = reinterpret_cast<u32>(heap_window) + (heap_window_pages + mapped) * PAGE_SIZE;
+            batch.map_pages(vaddress, reinterpret_cast<u32>(run_pages), run, cpu::PAGE_PRESENT | cpu::PAGE_RW);
+
+            mapped += run;
+        }
+
+        batch.commit();
+        if(mapped == 0) return false;
+
+        if(!in_window)
+        {
+            // fence off the rest of the linker heap, it was kept free for this header
+            heap_node* fence = (heap_node*)(heap_bin_top + heap_bin_head);
+            *fence = std::internal::construct_heap_node(heap_bin_size);
+
+            heap_bin_top = heap_window;
+            heap_bin_head = 0;
+            heap_bin_size = 0;
+        }
+
+        heap_window_pages += mapped;
+        heap_bin_size += mapped * PAGE_SIZE;
+
+        return heap_bin_size >= sizeof(heap_node) + size;
+    }
+
+    // gives whole free pages above the bin head back to the page allocator
+    static void heap_shrink()
+    {
+        if(heap_bin_top != heap_window) return;
+
+        size_t keep = DivRoundUp(heap_bin_head, PAGE_SIZE) + HEAP_GROW_PAGES;
+        if(heap_window_pages < keep + HEAP_GROW_PAGES) return;
+
+        u32 vaddress = reinterpret_cast<u32>(heap_window) + keep * PAGE_SIZE;
+        size_t count = heap_window_pages - keep;
+
+        for(size_t i = 0; i < count; i++)
+        {
+            cpu::free_page(reinterpret_cast<void*>(cpu::getPhysicalLocation(reinterpret_cast<void*>(vaddress + i * PAGE_SIZE))));
+        }
+
+        // back to the identity mapping
+        cpu::mapVirtualPages(vaddress, vaddress, count, cpu::PAGE_PRESENT | cpu::PAGE_RW);
+
+        heap_window_pages = keep;
+        heap_bin_size -= count * PAGE_SIZE;
+    }
+
+    void initialize_heap()
+    {
+        heap_bin_top = (u8*)__heap_start;
+        heap_bin_head = 0;
+        // room for the fence once the heap moves to its window
+        heap_bin_size = (u8*)__heap_end - (u8*)__heap_start - sizeof(heap_node);
+
+        heap_window = nullptr;
+        heap_window_pages = 0;
+
+        alloc_bin = std::internal::construct_heap_bin();
+
+        for(size_t i = 0; i < HEAP_CLASS_COUNT; i++) free_bins[i] = std::internal::construct_heap_bin();
+        free_classes = 0;
+    }
+
+    static void* heap_alloc(u32 req_size)
     {
         if(req_size == 0)
         {
@@ -117,158 +326,263 @@ namespace std
         }
 
         // heap bin is empty
-        // find the a free node with space
-        heap_node* node = std::internal::bin_find_node(free_bin, aligned_req_size + sizeof(heap_node) + MIN_NODE_SIZE);
+        // take a node from the smallest class that fits
+        heap_node* node = free_take(aligned_req_size);
 
-        // there was nothing big enough
         if (node == nullptr)
         {
-            node = std::internal::bin_find_node(free_bin, aligned_req_size);
+            // the heap bin has space after growing
+            if(heap_grow(aligned_req_size)) return heap_alloc(req_size);
+
             // out of memory
-            if(node == nullptr)
-            {
-                x86_raise(NO_HEAP_MEMORY);
-                return nullptr;
-            }
+            dump_heap_stats();
+            x86_raise(NO_HEAP_MEMORY);
+            return nullptr;
+        }
 
-            std::internal::bin_remove(&free_bin, node);
-            std::internal::bin_push(&alloc_bin, node);
+        return use_free_node(node, aligned_req_size);
+    }
 
-            // set free bit to 0
-            node->flags &= ~HEAP_FREE_NODE;
+    static void* heap_alloc_aligned(u32 req_size, u32 align)
+    {
+        // to meet alignment requirements
+        // figure out the padding needed
+        
+        align = RoundUpTo2Power(align);
+        // if normal alignment
+        if(align <= 0x10) return heap_alloc(req_size);
 
-            // return the data region
-            return (void*)(node + 1);
+        if(req_size == 0)
+        {
+            log_warn("[heap manager] 0 bytes requested from malloc_aligned!\n");
+            return nullptr;
         }
 
-        // remove the found node
-        std::internal::bin_remove(&free_bin, node);
+        u32 aligned_req_size = get_aligned_size(req_size, 0x10);
 
-        // split the node
-        heap_node* split_node = (heap_node*)((u8*)node + req_node_size);
-        *split_node = std::internal::construct_heap_node(node->size - aligned_req_size - sizeof(heap_node));
+        // otherwise, find out padding
+        u32 heap_head_addr = reinterpret_cast<u32>(heap_bin_top + heap_bin_head);
+        u32 padding = get_node_padding(heap_head_addr, align);
 
-        
-        // reconstruct node, to get rid of flags
-        *node = std::internal::construct_heap_node(aligned_req_size);
-        node->flags |= HEAP_HINT_RESIZEABLE;
-        
-        std::internal::bin_push(&alloc_bin, node);
+        // the heap bin still has space
+        if(heap_bin_size >= padding + sizeof(heap_node) + aligned_req_size)
+        {
+            // if no padding present, do normal malloc
+            if(padding == 0) return heap_alloc(req_size);
 
-        split_node->flags |= HEAP_FREE_NODE;
-        std::internal::bin_push(&free_bin, split_node);
+            heap_node* padding_node = reinterpret_cast<heap_node*>(heap_bin_top + heap_bin_head);
+            *padding_node = std::internal::construct_heap_node(padding - sizeof(heap_node));
 
-        // return the data region
-        return (void*)(node + 1);
+            heap_bin_head += padding;
+            heap_bin_size -= padding;
+
+            // return normal malloc
+            void* ptr = heap_alloc(req_size);
+
+            // add the padding node to free bin, now that a node follows it
+            padding_node->flags |= HEAP_FREE_NODE;
+            set_free_tags(padding_node);
+            free_push(padding_node);
+
+            return ptr;
+        }
+
+        // a free node that fits the request at any alignment
+        heap_node* node = free_take(aligned_req_size + align + HEAP_MIN_SPLIT);
+        if(node == nullptr)
+        {
+            // the heap bin has space after growing
+            if(heap_grow(aligned_req_size + align + HEAP_MIN_SPLIT)) return heap_alloc_aligned(req_size, align);
+
+            dump_heap_stats();
+            x86_raise(NO_HEAP_MEMORY);
+            return nullptr;
+        }
+
+        padding = get_node_padding(reinterpret_cast<u32>(node), align);
+        if(padding != 0)
+        {
+            // give the front of the node back
+            heap_node* aligned_node = reinterpret_cast<heap_node*>((u8*)node + padding);
+            *aligned_node = std::internal::construct_heap_node(node->size - padding);
+
+            *node = std::internal::construct_heap_node(padding - sizeof(heap_node));
+            node->flags |= HEAP_FREE_NODE;
+            set_free_tags(node);
+            free_push(node);
+
+            node = aligned_node;
+        }
+
+        return use_free_node(node, aligned_req_size);
     }
 
-    void* realloc(void *prev_ptr, u32 new_req_size)
+    // puts a valid, allocated node back
+    static void heap_free(heap_node* node)
     {
-        if(new_req_size == 0)
+        // mark as free
+        node->flags |= HEAP_FREE_NODE;
+
+        std::internal::bin_remove(&alloc_bin, node);
+
+        // merge with the free node after this one
+        heap_node* next_node = node_after(node);
+        if(next_node != nullptr && (next_node->flags & HEAP_FREE_NODE))
         {
-            log_warn("[heap manager] 0 bytes requested from realloc!\n");
-            return nullptr;
+            free_remove(next_node);
+            node->size += sizeof(heap_node) + next_node->size;
         }
 
-        heap_node* node = ((heap_node*)prev_ptr) - 1;
-        if(!std::internal::heap_node_valid(*node))
+        // and the free node before it, found through its footer
+        if(node->flags & HEAP_PREV_FREE)
         {
-            log_warn("[heap manager] invalid pointer passed to realloc\n");
-            return nullptr;
+            heap_node* prev_node = node_before(node);
+
+            free_remove(prev_node);
+            prev_node->size += sizeof(heap_node) + node->size;
+
+            node = prev_node;
         }
 
-        u32 aligned_req_size = get_aligned_size(new_req_size, 0x10);
-        if(node->size > aligned_req_size)
+        // wait let's see if the end of this heap
+        // is the position of the top of the heap
+        u32 node_end_pos = reinterpret_cast<u32>(node + 1) - reinterpret_cast<u32>(heap_bin_top) + node->size;
+        
+        if(node_end_pos != heap_bin_head)
         {
-            log_warn("[heap manager] reducing allocated memory size using realloc is not supported yet!\n");
-            return prev_ptr;
+            // more likely
+            set_free_tags(node);
+            free_push(node);
         }
-        // node size could be larger, because of alignment
-        else if(node->size > new_req_size) { return prev_ptr; }
+        else
+        {
+            // damn! then we will just merge it
+            heap_bin_head -= sizeof(heap_node) + node->size;
+            heap_bin_size += sizeof(heap_node) + node->size;
+            // no need to add to free bin
 
+            heap_shrink();
+        }
+    }
+
+    // grows an allocated node in place if possible, otherwise moves it
+    static void* heap_resize(heap_node* node, u32 aligned_req_size, u32 new_req_size)
+    {
         // check if this node is at the top of heap
-        u32 node_end_pos = reinterpret_cast<u32>(prev_ptr) - reinterpret_cast<u32>(heap_bin_top) + node->size;
+        u32 node_end_pos = reinterpret_cast<u32>(node + 1) - reinterpret_cast<u32>(heap_bin_top) + node->size;
         if(node_end_pos == heap_bin_head)
         {
+            if(heap_bin_size < aligned_req_size - node->size) goto free_and_alloc;
+
             heap_bin_head += aligned_req_size - node->size;
             heap_bin_size -= aligned_req_size - node->size;
             node->size = aligned_req_size;
 
-            return prev_ptr;
+            return node + 1;
         }
 
-        // check if it might be possible to "remerge"
-        if(node->flags & HEAP_HINT_RESIZEABLE)
+        // check if it is possible to merge with the next node
         {
-            heap_node* next_node = reinterpret_cast<heap_node*>(reinterpret_cast<u8*>(prev_ptr) + node->size);
+            heap_node* next_node = node_after(node);
+            u32 growth = aligned_req_size - node->size;
 
-            // check if the new node is valid, is free and has enough memory
+            // check if the next node is free and has enough memory
             // otherwise do the normal free followed by malloc + memcpy
-            if(!std::internal::heap_node_valid(*next_node)) goto free_and_alloc;
+            if(next_node == nullptr) goto free_and_alloc;
             if((next_node->flags & HEAP_FREE_NODE) == 0) goto free_and_alloc;
-            if((next_node->size + sizeof(heap_node)) < (aligned_req_size - node->size)) goto free_and_alloc;
+            if(next_node->size + sizeof(heap_node) < growth) goto free_and_alloc;
+
+            // remove next_node from free bin
+            free_remove(next_node);
 
             // check if the next node can be split
-            if(next_node->size + sizeof(heap_node) >= (aligned_req_size - node->size) + sizeof(heap_node) + MIN_NODE_SIZE)
+            if(next_node->size >= growth + MIN_NODE_SIZE)
             {
-                u32 split_offset = (aligned_req_size - node->size);
-                u32 split_size = (aligned_req_size - node->size) - sizeof(heap_node);
-
-                // remove next_node from free bin
-                std::internal::bin_remove(&free_bin, next_node);
-
                 // yes, so now split it
-                // split the node
-                heap_node* split_node = (heap_node*)((u8*)next_node + split_offset);
-                *split_node = std::internal::construct_heap_node(next_node->size - split_size);
+                heap_node* split_node = (heap_node*)((u8*)next_node + growth);
+                *split_node = std::internal::construct_heap_node(next_node->size - growth);
 
                 // set the current node's new size
                 node->size = aligned_req_size;
-                // we might be able to resize it again
-                node->flags |= HEAP_HINT_RESIZEABLE;
-                // but it isn't free
-                node->flags &= ~HEAP_FREE_NODE;
 
+                // the node after it is already tagged
                 split_node->flags |= HEAP_FREE_NODE;
+                set_free_tags(split_node);
 
                 // add the split node to free bin
-                std::internal::bin_push(&free_bin, split_node);
+                free_push(split_node);
 
-                return prev_ptr;
+                return node + 1;
             }
 
-            // it is not possible to split next node
-
-            // remove from free bin
-            std::internal::bin_remove(&free_bin, next_node);
-
-            // merge with current node
+            // it is not possible to split next node, merge with current node
             node->size += next_node->size + sizeof(heap_node);
-            // if the next node is resizable
-            node->flags = HEAP_NODE_IDFLAG | (next_node->flags & HEAP_HINT_RESIZEABLE);
+            clear_free_tags(node);
 
-            return prev_ptr;
+            return node + 1;
         }
 
         free_and_alloc:
 
         // nothing is possible :(
-        void* new_ptr = malloc(new_req_size);
-        memcpy(prev_ptr, new_ptr, new_req_size);
-        free(prev_ptr);
+        void* new_ptr = heap_alloc(new_req_size);
+        if(new_ptr == nullptr) return nullptr;
+
+        memcpy(node + 1, new_ptr, node->size);
+        heap_free(node);
 
         // return the new ptr
         return new_ptr;
     }
 
-    void log_heap_status()
+    void* malloc_aligned(u32 req_size, u32 align)
     {
-        log_debug("Heap: Bin(loc = 0x%x, pos = 0x%x, free = 0x%x)\n", heap_bin_top, heap_bin_head, heap_bin_size);
+        void* ptr = heap_alloc_aligned(req_size, align);
+        if(ptr != nullptr) std::internal::track_alloc(((heap_node*)ptr) - 1, __builtin_return_address(0));
 
-        log_debug("\tAllocated Bin:\n");
-        std::internal::bin_log(alloc_bin, "\t\t", 0);
-        log_debug("\tFree Bin:\n");
-        std::internal::bin_log(free_bin, "\t\t", 0);
+        return ptr;
+    }
+
+    void* malloc(u32 req_size)
+    {
+        void* ptr = heap_alloc(req_size);
+        if(ptr != nullptr) std::internal::track_alloc(((heap_node*)ptr) - 1, __builtin_return_address(0));
+
+        return ptr;
+    }
+
+    void* realloc(void *prev_ptr, u32 new_req_size)
+    {
+        if(new_req_size == 0)
+        {
+            log_warn("[heap manager] 0 bytes requested from realloc!\n");
+            return nullptr;
+        }
+
+        heap_node* node = ((heap_node*)prev_ptr) - 1;
+        if(!std::internal::heap_node_valid(*node))
+        {
+            log_warn("[heap manager] invalid pointer passed to realloc\n");
+            return nullptr;
+        }
+
+        u32 aligned_req_size = get_aligned_size(new_req_size, 0x10);
+        if(node->size > aligned_req_size)
+        {
+            log_warn("[heap manager] reducing allocated memory size using realloc is not supported yet!\n");
+            return prev_ptr;
+        }
+        // node size could be larger, because of alignment
+        else if(node->size > new_req_size) { return prev_ptr; }
+
+        // a realloc counts as a free and an allocation
+        std::internal::track_free(node);
+
+        void* ptr = heap_resize(node, aligned_req_size, new_req_size);
+        // the old node is still allocated if the resize failed
+        std::internal::track_alloc(ptr != nullptr ? ((heap_node*)ptr) - 1 : node, __builtin_return_address(0));
+
+        return ptr;
     }
 
     void free(void* ptr)
@@ -287,27 +601,85 @@ namespace std
             return;
         }
 
-        // mark as free
-        node->flags |= HEAP_FREE_NODE;
+        std::internal::track_free(node);
+        heap_free(node);
+    }
 
-        std::internal::bin_remove(&alloc_bin, node);
+    void internal::get_heap_layout(heap_stats& stats)
+    {
+        stats.free_nodes = 0;
+        stats.free_bytes = 0;
+        stats.largest_free = 0;
 
-        // wait let's see if the end of this heap
-        // is the position of the top of the heap
-        u32 node_end_pos = reinterpret_cast<u32>(ptr) - reinterpret_cast<u32>(heap_bin_top) + node->size;
-        
-        //if(true)
-        if(node_end_pos != heap_bin_head)
+        for(size_t i = 0; i < HEAP_CLASS_COUNT; i++)
         {
-            // more likely
-            std::internal::bin_push(&free_bin, node);
+            for(heap_node* node = free_bins[i].head; node != nullptr; node = node->next)
+            {
+                stats.free_nodes++;
+                stats.free_bytes += node->size;
+                if(node->size > stats.largest_free) stats.largest_free = node->size;
+            }
         }
-        else
+
+        stats.bin_free = heap_bin_size;
+        stats.heap_size = (u8*)__heap_end - (u8*)__heap_start + heap_window_pages * PAGE_SIZE;
+    }
+
+    void log_heap_status()
+    {
+        log_debug("Heap: Bin(loc = 0x%x, pos = 0x%x, free = 0x%x)\n", heap_bin_top, heap_bin_head, heap_bin_size);
+        if(heap_window != nullptr) log_debug("Heap: Window(loc = 0x%x, pages = 0x%x)\n", heap_window, heap_window_pages);
+
+        log_debug("\tAllocated Bin:\n");
+        std::internal::bin_log(alloc_bin, "\t\t", 0);
+        log_debug("\tFree Bins:\n");
+        for(size_t i = 0; i < HEAP_CLASS_COUNT; i++)
         {
-            // damn! then we will just merge it
-            heap_bin_head -= sizeof(heap_node) + node->size;
-            heap_bin_size += sizeof(heap_node) + node->size;
-            // no need to add to free bin
+            if((free_classes & ((u64)1 << i)) == 0) continue;
+
+            log_debug("\t\tClass %u:\n", i);
+            std::internal::bin_log(free_bins[i], "\t\t\t", 0);
         }
     }
+
+    void benchmark_heap(u32 rounds)
+    {
+        const u32 slot_count = 256;
+        void* slots[slot_count] = {};
+
+        u64 malloc_cycles = 0, free_cycles = 0;
+        u32 malloc_count = 0, free_count = 0;
+
+        // deterministic sizes from 16 bytes to 1 KiB
+        u32 seed = 0x2545F491;
+
+        for(u32 i = 0; i < rounds; i++)
+        {
+            seed = seed * 1103515245 + 12345;
+            u32 slot = (seed >> 8) % slot_count;
+
+            if(slots[slot] != nullptr)
+            {
+                u64 start = cpu::read_tsc();
+                free(slots[slot]);
+                free_cycles += cpu::read_tsc() - start;
+                free_count++;
+            }
+
+            u32 size = 0x10 + ((seed >> 4) & 0x3F0);
+
+            u64 start = cpu::read_tsc();
+            slots[slot] = malloc(size);
+            malloc_cycles += cpu::read_tsc() - start;
+            malloc_count++;
+        }
+
+        for(u32 i = 0; i < slot_count; i++)
+        {
+            if(slots[i] != nullptr) free(slots[i]);
+        }
+
+        log_info("[heap manager] churn: malloc %u cycles, free %u cycles (avg over %u rounds)\n",
+                    (u32)(malloc_cycles / (malloc_count ? malloc_count : 1)), (u32)(free_cycles / (free_count ? free_count : 1)), rounds);
+    }
 }
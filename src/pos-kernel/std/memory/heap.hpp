@@ -13,6 +13,9 @@ namespace std
 
     void log_heap_status();
 
+    // allocation churn, logs the average cycles of malloc and free
+    void benchmark_heap(u32 rounds);
+
     void free(void* ptr);
 }
 
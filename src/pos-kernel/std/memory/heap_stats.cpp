@@ -0,0 +1,182 @@
+#include "heap_stats.hpp"
+
+#include <io/io.h>
+#include <hw/pit/PIT.h>
+
+namespace std
+{
+    static heap_stats counters;
+
+    static con::console* dump_console = nullptr;
+
+    // allocations at the last read, for the rate
+    static u32 last_allocs = 0;
+    static u32 last_ticks = 0;
+
+#ifdef HEAP_TRACK_CALLERS
+    // open addressing on the caller, entry 0 collects the sites that did not fit
+    static heap_site sites[HEAP_SITE_COUNT];
+
+    static u32 find_site(ptr_t caller)
+    {
+        u32 index = ((caller >> 2) * 2654435761u) % (HEAP_SITE_COUNT - 1) + 1;
+
+        for(u32 i = 0; i < 16; i++)
+        {
+            heap_site& site = sites[index];
+
+            if(site.caller == caller) return index;
+            if(site.caller == 0)
+            {
+                site.caller = caller;
+                return index;
+            }
+
+            index = index + 1 < HEAP_SITE_COUNT ? index + 1 : 1;
+        }
+
+        return 0;
+    }
+#endif
+
+    // the stats are formatted without the heap, they are dumped when it is out of memory
+    static char text[HEAP_STATS_TEXT];
+    static size_t text_size;
+
+    static void put(const char* str)
+    {
+        while(*str != 0 && text_size < HEAP_STATS_TEXT) text[text_size++] = *str++;
+    }
+    static void put(u32 value, u32 base = 10)
+    {
+        const char digits[] = "0123456789ABCDEF";
+        char buffer[10];
+
+        size_t count = 0;
+        do
+        {
+            buffer[count++] = digits[value % base];
+            value /= base;
+        } while(value != 0);
+
+        while(count != 0 && text_size < HEAP_STATS_TEXT) text[text_size++] = buffer[--count];
+    }
+
+    static void format_text()
+    {
+        heap_stats stats = get_heap_stats();
+        text_size = 0;
+
+        put("live "); put(stats.live_bytes); put(" peak "); put(stats.peak_bytes);
+        put(" size "); put(stats.heap_size); put("\n");
+
+        // allocations per second since the last read
+        u32 ticks = PIT_getTicks();
+        u32 elapsed = ticks - last_ticks;
+        u32 rate = elapsed == 0 ? 0 : (u32)((u64)(stats.allocs - last_allocs) * PIT_TICKS_PER_SECOND / elapsed);
+
+        last_allocs = stats.allocs;
+        last_ticks = ticks;
+
+        put("allocs "); put(stats.allocs); put(" frees "); put(stats.frees);
+        put(" rate "); put(rate); put("/s\n");
+
+        // external fragmentation, the free memory a single allocation can't use
+        u32 total_free = stats.free_bytes + stats.bin_free;
+        u32 largest = stats.largest_free > stats.bin_free ? stats.largest_free : stats.bin_free;
+        u32 fragmentation = total_free == 0 ? 0 : 100 - (u32)((u64)largest * 100 / total_free);
+
+        put("free nodes "); put(stats.free_nodes); put(" bytes "); put(stats.free_bytes);
+        put(" largest "); put(stats.largest_free); put(" bin "); put(stats.bin_free);
+        put(" fragmentation "); put(fragmentation); put("%\n");
+
+#ifdef HEAP_TRACK_CALLERS
+        // the sites holding the most memory, picked one at a time
+        static bool listed[HEAP_SITE_COUNT];
+        for(size_t i = 0; i < HEAP_SITE_COUNT; i++) listed[i] = false;
+
+        for(size_t n = 0; n < HEAP_SITE_REPORT; n++)
+        {
+            size_t best = HEAP_SITE_COUNT;
+            for(size_t i = 0; i < HEAP_SITE_COUNT; i++)
+            {
+                if(listed[i] || sites[i].allocs == 0) continue;
+                if(best == HEAP_SITE_COUNT || sites[i].live_bytes > sites[best].live_bytes) best = i;
+            }
+
+            if(best == HEAP_SITE_COUNT) break;
+            listed[best] = true;
+
+            const heap_site& site = sites[best];
+            if(best == 0) put("other");
+            else { put("0x"); put(site.caller, 16); }
+
+            put(" live "); put(site.live_bytes); put(" in "); put(site.live_count);
+            put(" peak "); put(site.peak_bytes); put(" allocs "); put(site.allocs); put("\n");
+        }
+#endif
+    }
+
+    heap_stats get_heap_stats()
+    {
+        heap_stats stats = counters;
+        std::internal::get_heap_layout(stats);
+
+        return stats;
+    }
+
+    std::string format_heap_stats()
+    {
+        format_text();
+        return std::string(text, text_size);
+    }
+
+    void dump_heap_stats(con::console* console)
+    {
+        if(console == nullptr) console = dump_console;
+        if(console == nullptr) return;
+
+        format_text();
+        console->write(console, text, text_size);
+    }
+
+    void set_heap_dump_console(con::console* console)
+    {
+        dump_console = console;
+    }
+}
+
+namespace std::internal
+{
+    void track_alloc(heap_node* node, void* caller)
+    {
+        counters.allocs++;
+        counters.live_bytes += node->size;
+        if(counters.live_bytes > counters.peak_bytes) counters.peak_bytes = counters.live_bytes;
+
+#ifdef HEAP_TRACK_CALLERS
+        u32 index = find_site(ptr_cast(caller));
+        heap_site& site = sites[index];
+
+        site.allocs++;
+        site.live_count++;
+        site.live_bytes += node->size;
+        if(site.live_bytes > site.peak_bytes) site.peak_bytes = site.live_bytes;
+
+        node->flags = (node->flags & ~HEAP_SITE_MASK) | (index << HEAP_SITE_SHIFT);
+#endif
+    }
+
+    void track_free(heap_node* node)
+    {
+        counters.frees++;
+        counters.live_bytes -= node->size;
+
+#ifdef HEAP_TRACK_CALLERS
+        heap_site& site = sites[(node->flags & HEAP_SITE_MASK) >> HEAP_SITE_SHIFT];
+
+        site.live_count--;
+        site.live_bytes -= node->size;
+#endif
+    }
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <includes.h>
+#include <io/console.hpp>
+
+#include "internals.hpp"
+#include "../ds/string.hpp"
+
+// record the caller of every allocation, costs a hash lookup per malloc
+//#define HEAP_TRACK_CALLERS
+
+// call sites that can be told apart, the rest share the first entry
+#define HEAP_SITE_COUNT 1024
+// call sites listed by format_heap_stats
+#define HEAP_SITE_REPORT 16
+// longest text of format_heap_stats
+#define HEAP_STATS_TEXT 2048
+
+namespace std
+{
+    struct heap_stats
+    {
+        // bytes handed out, not counting node headers
+        u32 live_bytes;
+        u32 peak_bytes;
+
+        u32 allocs;
+        u32 frees;
+
+        // free list nodes and the untouched space of the heap bin
+        u32 free_nodes;
+        u32 free_bytes;
+        u32 largest_free;
+        u32 bin_free;
+
+        // linker heap and mapped window
+        u32 heap_size;
+    };
+
+    struct heap_site
+    {
+        ptr_t caller;
+
+        u32 allocs;
+        u32 live_count;
+        u32 live_bytes;
+        u32 peak_bytes;
+    };
+
+    heap_stats get_heap_stats();
+
+    // the stats as text, with the call sites holding the most memory if they are tracked
+    std::string format_heap_stats();
+
+    // writes format_heap_stats to console, the dump console if nullptr
+    void dump_heap_stats(con::console* console = nullptr);
+
+    // where the heap dumps its stats before running out of memory
+    void set_heap_dump_console(con::console* console);
+}
+
+namespace std::internal
+{
+    // called by the heap with the node handed out or given back
+    void track_alloc(heap_node* node, void* caller);
+    void track_free(heap_node* node);
+
+    // free list and bin layout, filled in by the heap
+    void get_heap_layout(heap_stats& stats);
+}
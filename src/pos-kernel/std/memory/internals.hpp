@@ -3,6 +3,9 @@
 #include <includes.h>
 
 #define HEAP_NODE_IDFLAG 0xDEAD0000
+// call site that allocated the node, 0 if it is not tracked
+#define HEAP_SITE_SHIFT 4
+#define HEAP_SITE_MASK 0xFFF0
 
 namespace std::internal
 {
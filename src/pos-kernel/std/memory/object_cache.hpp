@@ -0,0 +1,193 @@
+#pragma once
+
+#include <includes.h>
+
+#include "heap.hpp"
+
+// smallest slab, slabs are aligned to their size so an object finds its slab by masking
+#define OBJECT_CACHE_MIN_SLAB 0x1000
+// objects that fit in a slab at least
+#define OBJECT_CACHE_MIN_OBJECTS 8
+
+namespace std
+{
+    // fixed size objects of type T, carved out of slabs allocated from the heap
+    // allocation and free are O(1), and only a slab pays for a heap header
+    template<class T>
+    class object_cache
+    {
+        public:
+            // called after the object is constructed, and before it is destroyed
+            typedef void (*hook_t)(T* object);
+
+        private:
+            union slot
+            {
+                slot* next;
+                alignas(T) u8 storage[sizeof(T)];
+            };
+
+            struct slab
+            {
+                // slabs with free slots
+                slab* next;
+                slab* prev;
+
+                slot* free_list;
+                size_t used;
+            };
+
+            static constexpr size_t slots_offset = (sizeof(slab) + alignof(slot) - 1) & ~(alignof(slot) - 1);
+
+            static constexpr size_t get_slab_size()
+            {
+                size_t size = OBJECT_CACHE_MIN_SLAB;
+                while(size < slots_offset + OBJECT_CACHE_MIN_OBJECTS * sizeof(slot)) size *= 2;
+
+                return size;
+            }
+
+            static constexpr size_t slab_size = get_slab_size();
+            static constexpr size_t slab_capacity = (slab_size - slots_offset) / sizeof(slot);
+
+            slab* partial;
+
+            hook_t ctor;
+            hook_t dtor;
+
+            size_t slab_count;
+            size_t empty_count;
+            size_t object_count;
+
+            void link(slab* s)
+            {
+                s->prev = nullptr;
+                s->next = partial;
+
+                if(partial != nullptr) partial->prev = s;
+                partial = s;
+            }
+            void unlink(slab* s)
+            {
+                if(s->prev != nullptr) s->prev->next = s->next;
+                else partial = s->next;
+
+                if(s->next != nullptr) s->next->prev = s->prev;
+            }
+
+            slab* grow()
+            {
+                slab* s = reinterpret_cast<slab*>(std::malloc_aligned(slab_size, slab_size));
+                if(s == nullptr) return nullptr;
+
+                slot* slots = reinterpret_cast<slot*>(reinterpret_cast<u8*>(s) + slots_offset);
+                for(size_t i = 0; i < slab_capacity; i++)
+                {
+                    slots[i].next = i + 1 < slab_capacity ? &slots[i + 1] : nullptr;
+                }
+
+                s->free_list = slots;
+                s->used = 0;
+
+                link(s);
+
+                slab_count++;
+                empty_count++;
+
+                return s;
+            }
+
+            void* take()
+            {
+                slab* s = partial;
+                if(s == nullptr)
+                {
+                    s = grow();
+                    if(s == nullptr) return nullptr;
+                }
+
+                slot* object = s->free_list;
+                s->free_list = object->next;
+
+                if(s->used == 0) empty_count--;
+                s->used++;
+
+                // the slab is full, it is found again through the object once freed
+                if(s->free_list == nullptr) unlink(s);
+
+                object_count++;
+
+                return object;
+            }
+            void give(void* object)
+            {
+                slab* s = reinterpret_cast<slab*>(ptr_cast(object) & ~(slab_size - 1));
+                slot* freed = reinterpret_cast<slot*>(object);
+
+                if(s->free_list == nullptr) link(s);
+
+                freed->next = s->free_list;
+                s->free_list = freed;
+
+                s->used--;
+                object_count--;
+
+                if(s->used != 0) return;
+
+                // keep one empty slab around for the next burst
+                if(empty_count == 0)
+                {
+                    empty_count++;
+                    return;
+                }
+
+                unlink(s);
+                std::free(s);
+
+                slab_count--;
+            }
+
+        public:
+            constexpr object_cache(hook_t ctor = nullptr, hook_t dtor = nullptr) :
+                partial(nullptr), ctor(ctor), dtor(dtor), slab_count(0), empty_count(0), object_count(0) { ; }
+
+            // no copies, objects point back to their slabs
+            object_cache(const object_cache&) = delete;
+            object_cache& operator=(const object_cache&) = delete;
+
+            T* alloc()
+            {
+                void* memory = take();
+                if(memory == nullptr) return nullptr;
+
+                T* object = new (memory) T();
+                if(ctor != nullptr) ctor(object);
+
+                return object;
+            }
+            T* alloc(const T& value)
+            {
+                void* memory = take();
+                if(memory == nullptr) return nullptr;
+
+                T* object = new (memory) T(value);
+                if(ctor != nullptr) ctor(object);
+
+                return object;
+            }
+
+            void free(T* object)
+            {
+                if(object == nullptr) return;
+
+                if(dtor != nullptr) dtor(object);
+                object->~T();
+
+                give(object);
+            }
+
+            size_t objects() const { return object_count; }
+            size_t slabs() const { return slab_count; }
+            size_t capacity() const { return slab_count * slab_capacity; }
+    };
+}
@@ -6,20 +6,17 @@ namespace std
     {
         char buffer[21];
 
-        u64 built_val = 0;
-        char* ptr = buffer;
+        // digits are produced from the lowest one
+        char* ptr = buffer + sizeof(buffer);
         do
         {
-            u64 c = value % 10;
-            
-            *ptr = ('0' + c);
-            ptr++;
-            
-            built_val *= 10;
-            built_val += c;
-        } while(built_val != value);
+            ptr--;
+            *ptr = '0' + (value % 10);
 
-        return std::string(buffer, ptr - buffer);
+            value /= 10;
+        } while(value != 0);
+
+        return std::string(ptr, buffer + sizeof(buffer) - ptr);
     }
 }
 
@@ -2,13 +2,31 @@
 
 #include <c/string.h>
 #include <std/std.hpp>
+#include <std/memory/object_cache.hpp>
 #include <io/io.h>
 
 namespace vfs
 {
-    void ignore_read (node_t*, size_t offset, void* buffer, size_t len){}
+    i32  ignore_read (node_t*, size_t offset, void* buffer, size_t len){return OP_SUCCESS;}
     i32  ignore_write(node_t*, size_t offset, const void* buffer, size_t len){return OP_SUCCESS;}
 
+    i32 read_text(const char* text, size_t size, size_t offset, void* buffer, size_t len)
+    {
+        if(len == 0) return OP_SUCCESS;
+
+        size_t count = 0;
+
+        if(offset < size)
+        {
+            count = size - offset < len ? size - offset : len;
+            std::memcpy(text + offset, buffer, count);
+        }
+
+        if(count < len) reinterpret_cast<char*>(buffer)[count] = 0;
+
+        return OP_SUCCESS;
+    }
+
     struct event_link
     {
         event_t event;
@@ -27,6 +45,9 @@ namespace vfs
 
     static vfs_t g_vfs;
 
+    static std::object_cache<node_t> node_cache;
+    static std::object_cache<event_link> event_cache;
+
     vfs_t* init()
     {
         // setup root node
@@ -79,7 +100,7 @@ namespace vfs
     }
     void add_event(vfs_t* instance, event_t event)
     {
-        event_link* new_link = new event_link{};
+        event_link* new_link = event_cache.alloc();
         new_link->event = event;
         new_link->next = nullptr;
 
@@ -193,7 +214,7 @@ namespace vfs
         // the node is not a directory, return error
         if((dir_node->flags & NODE_DIRECTORY) == 0) return EINVPATH;
 
-        node_t* child = new node_t(dnode);
+        node_t* child = node_cache.alloc(dnode);
         init_child(instance, child);
         add_child(dir_node, child);
 
@@ -209,7 +230,7 @@ namespace vfs
         // the node is not a directory, return error
         if((dir_node->flags & NODE_DIRECTORY) == 0) return EINVPATH;
 
-        node_t* child = new node_t(dnode);
+        node_t* child = node_cache.alloc(dnode);
         init_child(instance, child);
         add_child(dir_node, child);
 
@@ -251,7 +272,7 @@ namespace vfs
         // the node is not a directory or a device, return error
         if((dir_node->flags & NODE_DIRECTORY) == 0) return EINVPATH;
 
-        node_t* child = new node_t(blk_node);
+        node_t* child = node_cache.alloc(blk_node);
         init_child(instance, child);
         add_child(dir_node, child);
 
@@ -324,7 +345,7 @@ namespace vfs
     {
         // TODO: maybe add a check to see if the node has freed all it's 
         // children
-        delete node;
+        node_cache.free(node);
     }
     
     bool poll(vfs_t *instance)
@@ -336,17 +357,18 @@ namespace vfs
         // remove a event from the queue
         if(instance->queue_head == nullptr) return event_t{.flags=EVENT_INVALID};
 
-        event_t poped_event = instance->queue_head->event;
-
-        delete instance->queue_head;
+        event_link* link = instance->queue_head;
+        event_t poped_event = link->event;
 
         // pop the event from queue
-        instance->queue_head = instance->queue_head->next;
+        instance->queue_head = link->next;
         if(instance->queue_head == nullptr)
         {
             instance->queue_tail = instance->queue_head;
         }
 
+        event_cache.free(link);
+
         return poped_event;
     }
 }
@@ -34,7 +34,7 @@ namespace vfs
         u32 size;
 
         void* data;
-        void (*read) (node_t*, size_t offset, void* buffer, size_t len) = 0;
+        i32  (*read) (node_t*, size_t offset, void* buffer, size_t len) = 0;
         i32  (*write)(node_t*, size_t offset, const void* buffer, size_t len) = 0;
 
         uid_t uid;
@@ -57,9 +57,13 @@ namespace vfs
 
     struct vfs_t;
 
-    void ignore_read (node_t*, size_t offset, void* buffer, size_t len);
+    i32  ignore_read (node_t*, size_t offset, void* buffer, size_t len);
     i32  ignore_write(node_t*, size_t offset, const void* buffer, size_t len);
 
+    // read handler body of text nodes: copies text at offset into buffer,
+    // short reads are null terminated
+    i32  read_text(const char* text, size_t size, size_t offset, void* buffer, size_t len);
+
     // initialize vfs
     vfs_t* init();
 